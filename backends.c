@@ -0,0 +1,596 @@
+/*-------------------------------------------------------------------------
+ * backends.c
+ *
+ * Copyright (c) 2008-2025, PostgreSQL Global Development Group
+ * Copyright (c) 2020-2025, Hironobu Suzuki @ interdb.jp
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include <signal.h>
+
+#include "catalog/pg_authid.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "storage/latch.h"
+#include "storage/proc.h"
+#include "storage/procarray.h"
+#include "utils/acl.h"
+#include "utils/timestamp.h"
+
+#include "shutdown_db.h"
+#include "backends.h"
+#include "hashtable.h"
+#include "stats.h"
+
+/*
+ * The interval at which sddb_wait_drained() counts the backend processes
+ * again, in milliseconds. The waiters are woken up whenever a backend
+ * process exits or the supervisor process finishes a draining, so this only
+ * bounds the wait for the processes which don't wake them up, such as
+ * autovacuum workers.
+ */
+#define SDDB_WAIT_RECHECK_MS	1000
+
+/*
+ * A backend process wakes up the waiters just before it leaves the backend
+ * status array, so they count again after this many milliseconds.
+ */
+#define SDDB_WAIT_EXIT_MS		10
+
+/*
+ * What the policy flags of an entry tell to do with a backend process; see
+ * backend_policy().
+ */
+#define POLICY_KILL			0	/* kill it, or wait for it if `idle` */
+#define POLICY_WAIT			1	/* don't kill it, but wait for it */
+#define POLICY_IGNORE		2	/* neither kill it nor wait for it */
+
+/*
+ * The autovacuum worker sets this into its activity while it's vacuuming a
+ * table to prevent the wraparound; see autovac_report_activity().
+ */
+#define SDDB_WRAPAROUND_ACTIVITY	"(to prevent wraparound)"
+
+/*
+ * Function declarations
+ */
+static bool signal_backend(const int pid, const int sig);
+static int	backend_policy(const PgBackendStatus *beentry, const int flags);
+
+
+/*
+ * Send the signal `sig` to the backend process whose pid is pid, with the
+ * same privilege checks as pg_cancel_backend() and pg_terminate_backend().
+ *
+ * If the process has already gone, do nothing. Returns true if the signal
+ * has been sent.
+ */
+static bool
+signal_backend(const int pid, const int sig)
+{
+	PGPROC	   *proc = BackendPidGetProc(pid);
+
+	if (proc == NULL)
+		return false;
+
+	/* Only allow superusers to signal superuser-owned backends. */
+	if ((!OidIsValid(proc->roleId) || superuser_arg(proc->roleId)) && !superuser())
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("must be a superuser to terminate superuser process")));
+
+	/* Users can signal backends they have role membership in. */
+	if (!has_privs_of_role(GetUserId(), proc->roleId) &&
+#if PG_VERSION_NUM >= 140000
+		!has_privs_of_role(GetUserId(), ROLE_PG_SIGNAL_BACKEND)
+#else
+		!has_privs_of_role(GetUserId(), DEFAULT_ROLE_SIGNAL_BACKENDID)
+#endif
+		)
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("must be a member of the role whose process is being terminated or member of pg_signal_backend")));
+
+	if (kill(pid, sig))
+	{
+		ereport(WARNING,
+				(errmsg("could not send signal to process %d: %m", pid)));
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Tell what to do with the backend process beentry, by the policy flags of
+ * the entry of its database, i.e. SDDB_FLAG_AUTOVAC_* and
+ * SDDB_FLAG_KEEP_WALSENDERS. Without them, every backend process is
+ * killed, as pg_stat_activity shows them all.
+ */
+static int
+backend_policy(const PgBackendStatus *beentry, const int flags)
+{
+#if PG_VERSION_NUM >= 100000
+	if (beentry->st_backendType == B_AUTOVAC_WORKER)
+	{
+		if (flags & SDDB_FLAG_AUTOVAC_SKIP)
+			return POLICY_IGNORE;
+		if (flags & SDDB_FLAG_AUTOVAC_FINISH)
+			return POLICY_WAIT;
+	}
+	else if (beentry->st_backendType == B_WAL_SENDER)
+	{
+		/* A walsender which has a database is a logical one */
+		if (flags & SDDB_FLAG_KEEP_WALSENDERS)
+			return POLICY_IGNORE;
+	}
+#endif
+	return POLICY_KILL;
+}
+
+/*
+ * qsort/bsearch comparator for Oids
+ */
+int
+sddb_oid_cmp(const void *p1, const void *p2)
+{
+	Oid			v1 = *((const Oid *) p1);
+	Oid			v2 = *((const Oid *) p2);
+
+	if (v1 < v2)
+		return -1;
+	if (v1 > v2)
+		return 1;
+	return 0;
+}
+
+/*
+ * Kill the backend processes which are accessing the database whose id is
+ * dbid, by sending SIGINT (cancel) and then SIGTERM (terminate) to them.
+ * SIGINT is sent only to the ones which have a transaction open, which
+ * shutdown_db.plan() reports as `cancel`; the others are just terminated.
+ *
+ * If `idle` is true, only the backend processes whose state is idle are
+ * killed, i.e., the backends that are in the transaction block are not
+ * killed. Otherwise, all backends that are accessing the database are
+ * killed.
+ *
+ * After processing, if `idle` is true, this function returns the number of
+ * the remaining backend processes that are still running because of in the
+ * transaction block; if `idle` is false, this function always returns 0
+ * because all corresponding backend processes are killed.
+ *
+ * The autovacuum workers and the logical walsenders are handled as the
+ * policy flags tell; see backend_policy(). The ones to be waited for are
+ * counted as remaining, whatever `idle` is.
+ */
+int
+sddb_kill_backends(const Oid dbid, const bool idle, const int flags)
+{
+	int			num_running;
+
+	sddb_kill_backends_multi(&dbid, 1, idle, &flags, &num_running);
+
+	return num_running;
+}
+
+/*
+ * Same as sddb_kill_backends(), but for all the databases in dbids[],
+ * which must be sorted in ascending order, with the policy flags flags[i]
+ * of dbids[i]; every backend process is killed if flags is NULL. The
+ * number of the remaining backend processes of dbids[i] is stored into
+ * num_running[i].
+ *
+ * This is done in one pass over the backend status array, which is what
+ * pg_stat_activity shows, whatever the number of the databases is.
+ */
+void
+sddb_kill_backends_multi(const Oid *dbids, const int ndbids,
+						 const bool idle, const int *flags, int *num_running)
+{
+	int			num_backends;
+	int		   *cancels;
+	int		   *terminates;
+	int			i;
+
+	memset(num_running, 0, sizeof(int) * ndbids);
+
+	if (ndbids == 0)
+		return;
+
+	cancels = (int *) palloc0(sizeof(int) * ndbids);
+	terminates = (int *) palloc0(sizeof(int) * ndbids);
+
+	/* Discard the snapshot taken in this transaction, if any */
+	pgstat_clear_snapshot();
+
+	num_backends = pgstat_fetch_stat_numbackends();
+
+	for (i = 1; i <= num_backends; i++)
+	{
+		LocalPgBackendStatus *local;
+		PgBackendStatus *beentry;
+		const Oid  *dbid;
+		int			policy;
+
+#if PG_VERSION_NUM >= 160000
+		local = pgstat_get_local_beentry_by_index(i);
+#else
+		local = pgstat_fetch_stat_local_beentry(i);
+#endif
+		if (local == NULL)
+			continue;
+
+		beentry = &local->backendStatus;
+		if (!OidIsValid(beentry->st_databaseid) || beentry->st_procpid == MyProcPid)
+			continue;
+
+		dbid = (const Oid *) bsearch(&beentry->st_databaseid, dbids, ndbids,
+									 sizeof(Oid), sddb_oid_cmp);
+		if (dbid == NULL)
+			continue;
+
+		policy = flags ? backend_policy(beentry, flags[dbid - dbids]) : POLICY_KILL;
+		if (policy == POLICY_IGNORE)
+			continue;
+
+		if (policy == POLICY_WAIT ||
+			(idle && beentry->st_state != STATE_IDLE))
+		{
+			num_running[dbid - dbids]++;
+			continue;
+		}
+
+		/* See sddb_plan_backends() */
+		if (beentry->st_xact_start_timestamp != 0 &&
+			signal_backend(beentry->st_procpid, SIGINT))
+			cancels[dbid - dbids]++;
+		if (signal_backend(beentry->st_procpid, SIGTERM))
+			terminates[dbid - dbids]++;
+	}
+
+	sddb_stats_count_signals(dbids, ndbids, cancels, terminates);
+
+	pfree(cancels);
+	pfree(terminates);
+}
+
+/*
+ * Same as sddb_kill_backends(), but only for the backend processes of the
+ * role roleid, i.e. those whose session user is roleid, in the database
+ * dbid.
+ */
+int
+sddb_kill_role_backends(const Oid dbid, const Oid roleid, const bool idle)
+{
+	int			num_backends;
+	int			num_running = 0;
+	int			cancels = 0;
+	int			terminates = 0;
+	int			i;
+
+	/* Discard the snapshot taken in this transaction, if any */
+	pgstat_clear_snapshot();
+
+	num_backends = pgstat_fetch_stat_numbackends();
+
+	for (i = 1; i <= num_backends; i++)
+	{
+		LocalPgBackendStatus *local;
+		PgBackendStatus *beentry;
+
+#if PG_VERSION_NUM >= 160000
+		local = pgstat_get_local_beentry_by_index(i);
+#else
+		local = pgstat_fetch_stat_local_beentry(i);
+#endif
+		if (local == NULL)
+			continue;
+
+		beentry = &local->backendStatus;
+		if (beentry->st_databaseid != dbid || beentry->st_userid != roleid ||
+			beentry->st_procpid == MyProcPid)
+			continue;
+
+		if (idle && beentry->st_state != STATE_IDLE)
+		{
+			num_running++;
+			continue;
+		}
+
+		if (beentry->st_xact_start_timestamp != 0 &&
+			signal_backend(beentry->st_procpid, SIGINT))
+			cancels++;
+		if (signal_backend(beentry->st_procpid, SIGTERM))
+			terminates++;
+	}
+
+	sddb_stats_count_signals(&dbid, 1, &cancels, &terminates);
+
+	return num_running;
+}
+
+/*
+ * Count the backend processes which are accessing each database in dbids[],
+ * which must be sorted in ascending order, into counts[i], in one pass over
+ * the backend status array. If flags is not NULL, the backend processes
+ * which the policy flags flags[i] of dbids[i] tell to ignore are not
+ * counted; see backend_policy().
+ *
+ * Unlike sddb_kill_backends_multi(), the calling process itself is counted,
+ * as pg_stat_activity shows it.
+ */
+void
+sddb_count_backends_multi(const Oid *dbids, const int ndbids,
+						  const int *flags, int *counts)
+{
+	int			num_backends;
+	int			i;
+
+	memset(counts, 0, sizeof(int) * ndbids);
+
+	if (ndbids == 0)
+		return;
+
+	/* Discard the snapshot taken in this transaction, if any */
+	pgstat_clear_snapshot();
+
+	num_backends = pgstat_fetch_stat_numbackends();
+
+	for (i = 1; i <= num_backends; i++)
+	{
+		LocalPgBackendStatus *local;
+		const Oid  *dbid;
+
+#if PG_VERSION_NUM >= 160000
+		local = pgstat_get_local_beentry_by_index(i);
+#else
+		local = pgstat_fetch_stat_local_beentry(i);
+#endif
+		if (local == NULL || !OidIsValid(local->backendStatus.st_databaseid))
+			continue;
+
+		dbid = (const Oid *) bsearch(&local->backendStatus.st_databaseid,
+									 dbids, ndbids, sizeof(Oid), sddb_oid_cmp);
+		if (dbid == NULL)
+			continue;
+
+		if (flags &&
+			backend_policy(&local->backendStatus, flags[dbid - dbids]) == POLICY_IGNORE)
+			continue;
+
+		counts[dbid - dbids]++;
+	}
+}
+
+/*
+ * Tell what a shutdown of the database dbid in `mode` with the policy flags
+ * `flags` would do with each of its backend processes, without signalling
+ * any of them, as sddb_kill_backends_multi() would decide. The backend
+ * processes are stored into *items, and their number is returned.
+ *
+ * The calling process itself is skipped, as it's never killed.
+ */
+int
+sddb_plan_backends(const Oid dbid, const int mode, const int flags,
+				   sddbPlanItem * *items)
+{
+	int			num_backends;
+	int			n = 0;
+	int			i;
+
+	/* Discard the snapshot taken in this transaction, if any */
+	pgstat_clear_snapshot();
+
+	num_backends = pgstat_fetch_stat_numbackends();
+	*items = (sddbPlanItem *) palloc0(sizeof(sddbPlanItem) * Max(num_backends, 1));
+
+	for (i = 1; i <= num_backends; i++)
+	{
+		LocalPgBackendStatus *local;
+		PgBackendStatus *beentry;
+		sddbPlanItem *item;
+		int			policy;
+
+#if PG_VERSION_NUM >= 160000
+		local = pgstat_get_local_beentry_by_index(i);
+#else
+		local = pgstat_fetch_stat_local_beentry(i);
+#endif
+		if (local == NULL)
+			continue;
+
+		beentry = &local->backendStatus;
+		if (beentry->st_databaseid != dbid || beentry->st_procpid == MyProcPid)
+			continue;
+
+		item = &(*items)[n++];
+		item->pid = beentry->st_procpid;
+#if PG_VERSION_NUM >= 100000
+		item->backend_type = (int) beentry->st_backendType;
+#else
+		item->backend_type = -1;
+#endif
+		item->roleid = beentry->st_userid;
+		item->state = (int) beentry->st_state;
+		item->xact_start = beentry->st_xact_start_timestamp;
+		item->xid = local->backend_xid;
+#if PG_VERSION_NUM >= 160000
+		item->subxacts = local->backend_subxact_count;
+#else
+		item->subxacts = -1;
+#endif
+
+		policy = backend_policy(beentry, flags);
+		if (policy == POLICY_IGNORE)
+			item->action = PLAN_IGNORE;
+		else if (policy == POLICY_WAIT)
+			item->action = PLAN_WAIT;
+		else if (mode == NORMAL)
+			item->action = PLAN_NONE;
+		else if (mode == TRANSACTIONAL)
+			item->action = (beentry->st_state != STATE_IDLE) ? PLAN_WAIT : PLAN_TERMINATE;
+		else					/* signalled as sddb_kill_backends_multi() does */
+			item->action = (item->xact_start != 0) ? PLAN_CANCEL : PLAN_TERMINATE;
+	}
+
+	return n;
+}
+
+/*
+ * Terminate the autovacuum workers which have been launched in each
+ * database in dbids[], which must be sorted in ascending order, after
+ * since[i], i.e. after the shutdown of dbids[i]. The ones vacuuming a
+ * table to prevent the wraparound are left alone, since only they can
+ * save the cluster from the shutdown for the wraparound.
+ *
+ * Returns the number of the terminated ones.
+ */
+int
+sddb_kill_new_autovacuum(const Oid *dbids, const TimestampTz *since,
+						 const int ndbids)
+{
+	int			num_backends;
+	int			num_killed = 0;
+	int			i;
+
+	if (ndbids == 0)
+		return 0;
+
+	/* Discard the snapshot taken in this transaction, if any */
+	pgstat_clear_snapshot();
+
+	num_backends = pgstat_fetch_stat_numbackends();
+
+	for (i = 1; i <= num_backends; i++)
+	{
+#if PG_VERSION_NUM >= 100000
+		LocalPgBackendStatus *local;
+		PgBackendStatus *beentry;
+		const Oid  *dbid;
+		const char *activity;
+
+#if PG_VERSION_NUM >= 160000
+		local = pgstat_get_local_beentry_by_index(i);
+#else
+		local = pgstat_fetch_stat_local_beentry(i);
+#endif
+		if (local == NULL)
+			continue;
+
+		beentry = &local->backendStatus;
+		if (beentry->st_backendType != B_AUTOVAC_WORKER ||
+			!OidIsValid(beentry->st_databaseid))
+			continue;
+
+		dbid = (const Oid *) bsearch(&beentry->st_databaseid, dbids, ndbids,
+									 sizeof(Oid), sddb_oid_cmp);
+		if (dbid == NULL || beentry->st_proc_start_timestamp <= since[dbid - dbids])
+			continue;
+
+#if PG_VERSION_NUM >= 110000
+		activity = beentry->st_activity_raw;
+#else
+		activity = beentry->st_activity;
+#endif
+		if (activity && strstr(activity, SDDB_WRAPAROUND_ACTIVITY) != NULL)
+			continue;
+
+		if (signal_backend(beentry->st_procpid, SIGTERM))
+		{
+			int			zero = 0;
+			int			one = 1;
+
+			sddb_stats_count_signals(dbid, 1, &zero, &one);
+			num_killed++;
+		}
+#endif
+	}
+
+	return num_killed;
+}
+
+/*
+ * Wait until the shutdown database dbid is drained, i.e. no backend process
+ * is accessing it and, in TRANSACTIONAL mode, the supervisor process has
+ * finished serving it, or until timeout_ms milliseconds have passed if
+ * timeout_ms is not negative.
+ *
+ * Returns true and sets the time when the draining has finished into
+ * *drained_at if it's drained; returns false on timeout. It's an error if
+ * the database is not shut down, or is started up while waiting.
+ */
+bool
+sddb_wait_drained(const Oid dbid, const long timeout_ms, TimestampTz *drained_at)
+{
+	ConditionVariable *cv = SDDB_WAIT_CV(dbid);
+	TimestampTz start = GetCurrentTimestamp();
+	bool		drained = false;
+	bool		sleeping = false;
+	bool		woken = false;
+
+	for (;;)
+	{
+		sddbEntry	entry;
+		long		timeout = woken ? SDDB_WAIT_EXIT_MS : SDDB_WAIT_RECHECK_MS;
+		int			count;
+
+		if (!sddb_get_entry(dbid, &entry) || !SDDB_IS_SHUTDOWN(entry.mode))
+			ereport(ERROR,
+					(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+					 errmsg("database %u is not shut down", dbid)));
+
+		if (!entry.is_running)
+		{
+			sddb_count_backends_multi(&dbid, 1, &entry.flags, &count);
+			if (count == 0)
+			{
+				/* The supervisor process knows when it has finished */
+				*drained_at = (entry.mode == TRANSACTIONAL) ?
+					entry.state_change : GetCurrentTimestamp();
+				drained = true;
+				break;
+			}
+		}
+
+		if (timeout_ms >= 0)
+		{
+			long		elapsed = (long) ((GetCurrentTimestamp() - start) / 1000);
+
+			if (elapsed >= timeout_ms)
+				break;
+			timeout = Min(timeout, timeout_ms - elapsed);
+		}
+
+		sleeping = true;
+#if PG_VERSION_NUM >= 130000
+		woken = !ConditionVariableTimedSleep(cv, timeout,
+											 sddb_wait_event(WAIT_DRAIN));
+#else
+		ConditionVariablePrepareToSleep(cv);
+		woken = (WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT |
+						   WL_EXIT_ON_PM_DEATH, timeout,
+						   sddb_wait_event(WAIT_DRAIN)) & WL_LATCH_SET) != 0;
+		ResetLatch(MyLatch);
+		CHECK_FOR_INTERRUPTS();
+#endif
+	}
+	if (sleeping)
+		ConditionVariableCancelSleep();
+
+	return drained;
+}
+
+/*
+ * on_shmem_exit callback of the backend processes, which wakes up the
+ * processes waiting in sddb_wait_drained() for the database this process
+ * has been accessing. This runs just before the backend status of this
+ * process is cleared, which is why the waiters count again shortly.
+ */
+void
+sddb_backend_exit(int code, Datum arg)
+{
+	if (sddb && OidIsValid(MyDatabaseId))
+		ConditionVariableBroadcast(SDDB_WAIT_CV(MyDatabaseId));
+}
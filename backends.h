@@ -0,0 +1,60 @@
+/*-------------------------------------------------------------------------
+ * backends.h
+ *
+ * Copyright (c) 2008-2025, PostgreSQL Global Development Group
+ * Copyright (c) 2020-2025, hironobu suzuki@interdb.jp
+ *-------------------------------------------------------------------------
+ */
+#ifndef __BACKENDS_H__
+#define __BACKENDS_H__
+
+/*
+ * What a shutdown would do with a backend process, shown by
+ * shutdown_db.plan()
+ */
+enum plan_action
+{
+	PLAN_NONE = 0,				/* left running, in NORMAL mode */
+	PLAN_TERMINATE,				/* terminated; it has no open transaction */
+	PLAN_CANCEL,				/* terminated; its transaction is rolled back */
+	PLAN_WAIT,					/* waited for until it ends its transaction */
+	PLAN_IGNORE					/* neither killed nor waited for */
+};
+
+/*
+ * A backend process seen by sddb_plan_backends()
+ */
+typedef struct sddbPlanItem
+{
+	int			pid;
+	int			backend_type;	/* BackendType; -1 if unknown */
+	Oid			roleid;
+	int			state;			/* BackendState */
+	TimestampTz xact_start;		/* 0 if no transaction is open */
+	TransactionId xid;			/* InvalidTransactionId if not assigned */
+	int			subxacts;		/* number of the subtransaction xids; -1 if
+								 * unknown */
+	int			action;			/* enum plan_action */
+}			sddbPlanItem;
+
+/*
+ * Function declarations
+ */
+int			sddb_oid_cmp(const void *p1, const void *p2);
+int			sddb_kill_backends(const Oid dbid, const bool idle, const int flags);
+void		sddb_kill_backends_multi(const Oid *dbids, const int ndbids,
+									 const bool idle, const int *flags,
+									 int *num_running);
+int			sddb_kill_role_backends(const Oid dbid, const Oid roleid,
+									const bool idle);
+void		sddb_count_backends_multi(const Oid *dbids, const int ndbids,
+									  const int *flags, int *counts);
+int			sddb_kill_new_autovacuum(const Oid *dbids, const TimestampTz *since,
+									 const int ndbids);
+int			sddb_plan_backends(const Oid dbid, const int mode, const int flags,
+							   sddbPlanItem * *items);
+bool		sddb_wait_drained(const Oid dbid, const long timeout_ms,
+							  TimestampTz *drained_at);
+void		sddb_backend_exit(int code, Datum arg);
+
+#endif
@@ -0,0 +1,3 @@
+-- An idle session: a short statement, then idle during the sleep
+SELECT 1;
+\sleep 500 ms
@@ -0,0 +1,5 @@
+-- An idle-in-transaction session
+BEGIN;
+SELECT 1;
+\sleep 500 ms
+END;
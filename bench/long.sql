@@ -0,0 +1,2 @@
+-- A long-running statement of :long seconds
+SELECT pg_sleep(:long);
@@ -0,0 +1,148 @@
+#!/bin/sh
+#
+# run_bench.sh
+#
+# Measure the overhead of shutdown_db on the hot path. Each workload is run
+# by pgbench in four setups:
+#
+#   none   shutdown_db is not loaded
+#   empty  shutdown_db is loaded and no database is shut down
+#   10     shutdown_db is loaded and 10 databases are shut down
+#   10k    shutdown_db is loaded and 10000 databases are shut down
+#
+# The shutdown databases are restored from a state file written by this
+# script, so they don't have to exist; they are rejected by the hook gate.
+#
+# The results are written to $BENCH_OUTPUT as CSV, one line per setup and
+# workload, with the deltas against the `none` setup.
+#
+# Usage: make bench [PG_CONFIG=...] [BENCH_DURATION=...] ...
+#
+# shutdown_db must have been installed into the installation of PG_CONFIG.
+
+set -e
+
+PG_CONFIG=${PG_CONFIG:-pg_config}
+BINDIR=`$PG_CONFIG --bindir`
+BENCH_DIR=`cd \`dirname "$0"\` && pwd`
+
+BENCH_PORT=${BENCH_PORT:-54329}
+BENCH_DURATION=${BENCH_DURATION:-30}
+BENCH_CLIENTS=${BENCH_CLIENTS:-8}
+BENCH_SCALE=${BENCH_SCALE:-10}
+BENCH_WORKLOADS=${BENCH_WORKLOADS:-"select1 utility tpcb"}
+BENCH_SETUPS=${BENCH_SETUPS:-"none empty 10 10k"}
+BENCH_DATA=${BENCH_DATA:-"$BENCH_DIR/tmp_data"}
+BENCH_OUTPUT=${BENCH_OUTPUT:-"$BENCH_DIR/results.csv"}
+
+PGPORT=$BENCH_PORT
+PGHOST=$BENCH_DATA
+export PGPORT PGHOST
+
+# Write a state file of $1 databases shut down in Immediate mode, in the
+# format of statefile.c.
+write_state_file()
+{
+	perl -e '
+		my ($num, $path) = @ARGV;
+		open(my $fh, ">", $path) or die "could not open $path: $!";
+		binmode($fh);
+		print $fh pack("L L l", 0x53444442, 1, $num);
+		for (my $i = 0; $i < $num; $i++)
+		{
+			# shutdown_time, dbid, mode (IMMEDIATE), flags, datname
+			print $fh pack("q L l l a64 x4", 0, 1000000 + $i, 3, 0,
+						   "sddb_bench_$i");
+		}
+		close($fh);
+	' "$1" "$BENCH_DATA/pg_stat/shutdown_db.state"
+}
+
+start_server()
+{
+	setup=$1
+
+	rm -f "$BENCH_DATA/pg_stat/shutdown_db.state"
+
+	case $setup in
+		none)
+			preload=""
+			;;
+		empty)
+			preload="shutdown_db"
+			;;
+		10)
+			preload="shutdown_db"
+			write_state_file 10
+			;;
+		10k)
+			preload="shutdown_db"
+			write_state_file 10000
+			;;
+		*)
+			echo "unknown setup: $setup" >&2
+			exit 1
+			;;
+	esac
+
+	"$BINDIR/pg_ctl" -D "$BENCH_DATA" -l "$BENCH_DIR/server.log" -w \
+		-o "-p $BENCH_PORT -k $BENCH_DATA -c listen_addresses='' \
+			-c shared_preload_libraries='$preload' \
+			-c shutdown_db.connection_gate=hook" start >/dev/null
+}
+
+stop_server()
+{
+	"$BINDIR/pg_ctl" -D "$BENCH_DATA" -m fast -w stop >/dev/null
+}
+
+# Run workload $1, and print "tps,latency" in ms.
+run_pgbench()
+{
+	"$BINDIR/pgbench" -n -M prepared -c "$BENCH_CLIENTS" -j "$BENCH_CLIENTS" \
+		-T "$BENCH_DURATION" -D scale="$BENCH_SCALE" \
+		-f "$BENCH_DIR/$1.sql" postgres 2>/dev/null |
+	awk '/^latency average/ { lat = $4 }
+		 /^tps/ && tps == "" { tps = $3 }
+		 END { printf "%s,%s\n", tps, lat }'
+}
+
+rm -rf "$BENCH_DATA"
+"$BINDIR/initdb" -D "$BENCH_DATA" -A trust >/dev/null
+
+start_server none
+"$BINDIR/pgbench" -i -q -s "$BENCH_SCALE" postgres >/dev/null 2>&1
+stop_server
+
+results=`mktemp`
+trap 'rm -f "$results"; "$BINDIR/pg_ctl" -D "$BENCH_DATA" -m immediate stop >/dev/null 2>&1 || true' EXIT
+
+for setup in $BENCH_SETUPS
+do
+	start_server $setup
+	for workload in $BENCH_WORKLOADS
+	do
+		echo "running $workload in setup $setup ..." >&2
+		echo "$setup,$workload,`run_pgbench $workload`" >> "$results"
+	done
+	stop_server
+done
+
+# Append the deltas against the `none` setup, in percent
+echo "setup,workload,tps,latency_ms,tps_delta_pct,latency_delta_pct" > "$BENCH_OUTPUT"
+awk -F, '
+	{ setup[NR] = $1; workload[NR] = $2; tps[NR] = $3; lat[NR] = $4 }
+	$1 == "none" { base_tps[$2] = $3; base_lat[$2] = $4 }
+	END {
+		for (i = 1; i <= NR; i++)
+		{
+			dt = ""; dl = "";
+			if (base_tps[workload[i]] > 0)
+				dt = sprintf("%.2f", (tps[i] - base_tps[workload[i]]) * 100.0 / base_tps[workload[i]]);
+			if (base_lat[workload[i]] > 0)
+				dl = sprintf("%.2f", (lat[i] - base_lat[workload[i]]) * 100.0 / base_lat[workload[i]]);
+			printf "%s,%s,%s,%s,%s,%s\n", setup[i], workload[i], tps[i], lat[i], dt, dl
+		}
+	}' "$results" >> "$BENCH_OUTPUT"
+
+cat "$BENCH_OUTPUT"
@@ -0,0 +1,300 @@
+#!/bin/sh
+#
+# run_drain.sh
+#
+# Measure the drains of shutdown_db under many concurrent sessions. For
+# each mode, $DRAIN_DBS databases are filled with $DRAIN_CLIENTS sessions
+# each, a third of them idle, a third idle in transaction and the rest
+# running long statements, by pgbench; then they are all shut down at
+# once, while:
+#
+#   - a pgbench of the TPC-B-like workload keeps running on the postgres
+#     database, which stays up, and
+#   - a loop per database keeps reconnecting to it.
+#
+# The mode `none` shuts nothing down, and is the baseline of the TPS.
+#
+# The results are written to $DRAIN_OUTPUT as CSV, one line per mode:
+# the drain times from the shutdown to zero backends measured by
+# shutdown_db.wait(), the reconnections rejected, the signals sent, and
+# the TPS of the postgres database with its delta against `none`.
+#
+# Finally, $DRAIN_RACERS sessions shut down and start up the same database
+# at random $DRAIN_RACE_ITERATIONS times each, while it's reconnected to;
+# the database must be left started up, and no error nor crash must have
+# happened. The script exits with 1 otherwise.
+#
+# Usage: make bench-drain [PG_CONFIG=...] [DRAIN_DBS=...] ...
+#
+# shutdown_db must have been installed into the installation of PG_CONFIG.
+
+set -e
+
+PG_CONFIG=${PG_CONFIG:-pg_config}
+BINDIR=`$PG_CONFIG --bindir`
+BENCH_DIR=`cd \`dirname "$0"\` && pwd`
+
+BENCH_PORT=${BENCH_PORT:-54329}
+BENCH_CLIENTS=${BENCH_CLIENTS:-8}
+BENCH_SCALE=${BENCH_SCALE:-10}
+BENCH_DATA=${BENCH_DATA:-"$BENCH_DIR/tmp_data"}
+DRAIN_DBS=${DRAIN_DBS:-8}
+DRAIN_CLIENTS=${DRAIN_CLIENTS:-30}
+DRAIN_MODES=${DRAIN_MODES:-"none transactional immediate abort normal"}
+DRAIN_SESSION_SECS=${DRAIN_SESSION_SECS:-30}
+DRAIN_LONG_SECS=${DRAIN_LONG_SECS:-5}
+DRAIN_WINDOW=${DRAIN_WINDOW:-10}
+DRAIN_TIMEOUT=${DRAIN_TIMEOUT:-120}
+DRAIN_RACERS=${DRAIN_RACERS:-4}
+DRAIN_RACE_ITERATIONS=${DRAIN_RACE_ITERATIONS:-200}
+DRAIN_OUTPUT=${DRAIN_OUTPUT:-"$BENCH_DIR/results_drain.csv"}
+
+PGPORT=$BENCH_PORT
+PGHOST=$BENCH_DATA
+export PGPORT PGHOST
+
+WORK=`mktemp -d`
+trap 'rm -rf "$WORK"; "$BINDIR/pg_ctl" -D "$BENCH_DATA" -m immediate stop >/dev/null 2>&1 || true' EXIT
+
+psql_at()
+{
+	"$BINDIR/psql" -X -q -At -v ON_ERROR_STOP=1 "$@"
+}
+
+# The array of the names of the target databases, as a SQL literal
+db_array()
+{
+	awk -v n="$DRAIN_DBS" 'BEGIN {
+		printf "ARRAY[";
+		for (i = 0; i < n; i++)
+			printf "%s'\''drain_%d'\''", (i > 0) ? "," : "", i;
+		printf "]";
+	}'
+}
+
+# Print the total of column $1 of shutdown_db.stats
+stats_total()
+{
+	psql_at -d postgres -c "SELECT $1 FROM shutdown_db.stats WHERE dbid IS NULL"
+}
+
+# Run pgbench script $2 with $3 clients against database $1 in the
+# background, for $DRAIN_SESSION_SECS seconds. The clients killed by the
+# shutdown just end.
+start_sessions()
+{
+	threads=`expr \( $3 + 255 \) / 256`
+	"$BINDIR/pgbench" -n -c "$3" -j "$threads" -T "$DRAIN_SESSION_SECS" \
+		-D long="$DRAIN_LONG_SECS" -f "$BENCH_DIR/$2.sql" "$1" \
+		>/dev/null 2>&1 &
+	echo $! >> "$WORK/session_pids"
+}
+
+# Keep connecting to database $1 until $WORK/stop exists
+reconnect_loop()
+{
+	while [ ! -f "$WORK/stop" ]
+	do
+		"$BINDIR/psql" -X -q -d "$1" -c "SELECT 1" >/dev/null 2>&1 || true
+	done
+}
+
+# Wait until $1 sessions are connected to the target databases
+wait_connected()
+{
+	i=0
+	while [ $i -lt 600 ]
+	do
+		n=`psql_at -d postgres -c "SELECT count(*) FROM pg_stat_activity WHERE datname LIKE 'drain\\_%'"`
+		[ "$n" -ge "$1" ] && return 0
+		sleep 0.1
+		i=`expr $i + 1`
+	done
+	echo "only $n of $1 sessions have connected" >&2
+}
+
+# Run mode $1, and print the line of the results
+run_mode()
+{
+	mode=$1
+	idle=`expr $DRAIN_CLIENTS / 3`
+	in_xact=`expr $DRAIN_CLIENTS / 3`
+	long=`expr $DRAIN_CLIENTS - $idle - $in_xact`
+
+	rm -f "$WORK/session_pids" "$WORK/stop" "$WORK/drains"
+
+	i=0
+	while [ $i -lt $DRAIN_DBS ]
+	do
+		[ $idle -gt 0 ] && start_sessions drain_$i idle $idle
+		[ $in_xact -gt 0 ] && start_sessions drain_$i idle_in_xact $in_xact
+		[ $long -gt 0 ] && start_sessions drain_$i long $long
+		i=`expr $i + 1`
+	done
+	wait_connected `expr $DRAIN_DBS \* $DRAIN_CLIENTS`
+
+	rejections=`stats_total rejections`
+	cancels=`stats_total cancels`
+	terminates=`stats_total terminates`
+
+	# The database which stays up
+	"$BINDIR/pgbench" -n -M prepared -c "$BENCH_CLIENTS" -j "$BENCH_CLIENTS" \
+		-T "$DRAIN_WINDOW" -D scale="$BENCH_SCALE" \
+		-f "$BENCH_DIR/tpcb.sql" postgres > "$WORK/bystander" 2>/dev/null &
+	bystander=$!
+
+	if [ "$mode" != none ]
+	then
+		psql_at -d postgres -c "SELECT count(*) FROM shutdown_db.shutdown_$mode(`db_array`)" >/dev/null
+
+		i=0
+		while [ $i -lt $DRAIN_DBS ]
+		do
+			reconnect_loop drain_$i &
+			i=`expr $i + 1`
+		done
+
+		# The drain time of each database, or an empty line on timeout
+		psql_at -d postgres -c "SELECT extract(epoch FROM shutdown_db.wait(d, interval '$DRAIN_TIMEOUT s')) * 1000 FROM unnest(`db_array`) d" > "$WORK/drains"
+		touch "$WORK/stop"
+	fi
+
+	wait $bystander || true
+	for pid in `cat "$WORK/session_pids"`
+	do
+		wait $pid || true
+	done
+	wait
+
+	if [ "$mode" != none ]
+	then
+		psql_at -d postgres -c "SELECT count(*) FROM shutdown_db.startup(`db_array`)" >/dev/null
+	fi
+
+	tps=`awk '/^tps/ && tps == "" { tps = $3 } END { print tps }' "$WORK/bystander"`
+	rejections=`expr \`stats_total rejections\` - $rejections`
+	cancels=`expr \`stats_total cancels\` - $cancels`
+	terminates=`expr \`stats_total terminates\` - $terminates`
+
+	touch "$WORK/drains"
+	awk -v mode="$mode" -v dbs="$DRAIN_DBS" -v clients="$DRAIN_CLIENTS" \
+		-v rejections="$rejections" -v cancels="$cancels" \
+		-v terminates="$terminates" -v tps="$tps" '
+		$0 == "" { timeouts++; next }
+		{ n++; sum += $1; if ($1 > max) max = $1 }
+		END {
+			if (mode == "none")
+				printf "%s,%d,%d,,,,", mode, dbs, clients;
+			else
+				printf "%s,%d,%d,%.1f,%.1f,%d,", mode, dbs, clients,
+					max, (n > 0) ? sum / n : 0, timeouts;
+			printf "%s,%s,%s,%s\n", rejections, cancels, terminates, tps;
+		}' "$WORK/drains"
+}
+
+# Shut down and start up drain_0 at random from $DRAIN_RACERS sessions at
+# once, and check that it's left consistent.
+run_race()
+{
+	rm -f "$WORK/stop"
+	failed=0
+
+	reconnect_loop drain_0 &
+	reconnector=$!
+
+	racers=""
+	i=0
+	while [ $i -lt $DRAIN_RACERS ]
+	do
+		awk -v n="$DRAIN_RACE_ITERATIONS" -v seed=$i 'BEGIN {
+			srand(seed);
+			split("shutdown_immediate shutdown_transactional shutdown_normal shutdown_abort startup startup", ops, " ");
+			for (i = 0; i < n; i++)
+				printf "SELECT shutdown_db.%s('\''drain_0'\'');\n", ops[int(rand() * 6) + 1];
+		}' > "$WORK/race_$i.sql"
+		"$BINDIR/psql" -X -q -d postgres -f "$WORK/race_$i.sql" \
+			>/dev/null 2> "$WORK/race_$i.err" &
+		racers="$racers $!"
+		i=`expr $i + 1`
+	done
+	for pid in $racers
+	do
+		wait $pid || true
+	done
+
+	touch "$WORK/stop"
+	wait $reconnector || true
+
+	psql_at -d postgres -c "SELECT shutdown_db.startup('drain_0')" >/dev/null 2>&1 || true
+
+	if cat "$WORK"/race_*.err | grep 'ERROR' >&2
+	then
+		echo "race: the shutdowns and startups have failed" >&2
+		failed=1
+	fi
+	if [ "`psql_at -d postgres -c "SELECT count(*) FROM shutdown_db.show_db_list WHERE datname = 'drain_0'"`" != 0 ]
+	then
+		echo "race: drain_0 is still shut down" >&2
+		failed=1
+	fi
+	if ! psql_at -d drain_0 -c "SELECT 1" >/dev/null
+	then
+		echo "race: drain_0 can't be connected to" >&2
+		failed=1
+	fi
+	if grep -E 'TRAP|PANIC|terminated by signal' "$BENCH_DIR/server.log" >&2
+	then
+		echo "race: the server has crashed" >&2
+		failed=1
+	fi
+
+	[ $failed -eq 0 ] && echo "race: ok" >&2
+	return $failed
+}
+
+rm -rf "$BENCH_DATA"
+"$BINDIR/initdb" -D "$BENCH_DATA" -A trust >/dev/null
+
+max_connections=`expr $DRAIN_DBS \* \( $DRAIN_CLIENTS + 1 \) + $BENCH_CLIENTS + $DRAIN_RACERS + 20`
+"$BINDIR/pg_ctl" -D "$BENCH_DATA" -l "$BENCH_DIR/server.log" -w \
+	-o "-p $BENCH_PORT -k $BENCH_DATA -c listen_addresses='' \
+		-c max_connections=$max_connections \
+		-c shared_preload_libraries='shutdown_db' \
+		-c shutdown_db.connection_gate=hook" start >/dev/null
+
+psql_at -d postgres -c "CREATE EXTENSION shutdown_db" >/dev/null
+
+"$BINDIR/pgbench" -i -q -s "$BENCH_SCALE" postgres >/dev/null 2>&1
+i=0
+while [ $i -lt $DRAIN_DBS ]
+do
+	psql_at -d postgres -c "CREATE DATABASE drain_$i" >/dev/null
+	i=`expr $i + 1`
+done
+
+results="$WORK/results"
+for mode in $DRAIN_MODES
+do
+	echo "running $mode mode with $DRAIN_DBS databases of $DRAIN_CLIENTS sessions ..." >&2
+	run_mode $mode >> "$results"
+done
+
+# Append the TPS deltas against the `none` mode, in percent
+echo "mode,databases,clients,max_drain_ms,avg_drain_ms,timeouts,rejected,cancels,terminates,tps,tps_delta_pct" > "$DRAIN_OUTPUT"
+awk -F, '
+	{ line[NR] = $0; mode[NR] = $1; tps[NR] = $10 }
+	$1 == "none" { base = $10 }
+	END {
+		for (i = 1; i <= NR; i++)
+		{
+			d = "";
+			if (base > 0)
+				d = sprintf("%.2f", (tps[i] - base) * 100.0 / base);
+			printf "%s,%s\n", line[i], d
+		}
+	}' "$results" >> "$DRAIN_OUTPUT"
+
+cat "$DRAIN_OUTPUT"
+
+echo "running $DRAIN_RACERS racers of $DRAIN_RACE_ITERATIONS shutdowns and startups ..." >&2
+run_race
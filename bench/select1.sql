@@ -0,0 +1,2 @@
+-- Goes through sddb_ExecutorStart()
+SELECT 1;
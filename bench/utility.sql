@@ -0,0 +1,2 @@
+-- Goes through sddb_ProcessUtility()
+SHOW work_mem;
@@ -17,65 +17,93 @@
 #include "executor/spi.h"
 #include "pgstat.h"
 #include "utils/builtins.h"
+#include "utils/guc.h"
 #include "utils/snapmgr.h"
+#include "utils/timestamp.h"
+#include "tcop/tcopprot.h"
 #include "tcop/utility.h"
 
 #include "shutdown_db.h"
+#include "backends.h"
+#include "bgworker.h"
+#include "buffers.h"
 #include "hashtable.h"
+#include "scheduler.h"
+#include "statefile.h"
+#include "stats.h"
+#include "wal.h"
 
 /*
  * extern variables
  */
 extern sddbSharedState * sddb;
 extern HTAB *sddb_hash;
+extern int	sddb_killer_naptime;
 
 /*
- * local variable
+ * After the supervisor process is woken up by a transaction end, the backend
+ * might not be idle yet, so it checks again shortly, up to
+ * SDDB_SUPERVISOR_RETRIES times, before going back to sddb_killer_naptime.
  */
-static int	sddb_killer_naptime = 15;
+#define SDDB_SUPERVISOR_RETRY_MS 10
+#define SDDB_SUPERVISOR_RETRIES	 10
 
 /*
  * Function declarations
  */
 #if PG_VERSION_NUM >= 160000
-PGDLLEXPORT void		shutdown_db_init(Datum main_arg);
+PGDLLEXPORT void		sddb_supervisor_main(Datum main_arg);
 #else
-void		shutdown_db_init(Datum main_arg);
+void		sddb_supervisor_main(Datum main_arg);
 #endif
 
-void		shutdown_db_init(Datum) pg_attribute_noreturn();
+void		sddb_supervisor_main(Datum) pg_attribute_noreturn();
+
+#if PG_VERSION_NUM >= 160000
+PGDLLEXPORT void		sddb_prewarm_main(Datum main_arg);
+#else
+void		sddb_prewarm_main(Datum main_arg);
+#endif
+
+void		sddb_prewarm_main(Datum) pg_attribute_noreturn();
+
+#if PG_VERSION_NUM >= 160000
+PGDLLEXPORT void		sddb_flush_main(Datum main_arg);
+#else
+void		sddb_flush_main(Datum main_arg);
+#endif
+
+void		sddb_flush_main(Datum) pg_attribute_noreturn();
 
 PG_FUNCTION_INFO_V1(sddb_killer_launch);
-void		sddb_killer_main(Datum) pg_attribute_noreturn();
 
 static void start_tx(void);
 static void commit_tx(void);
+static void sddb_supervisor_detach(int code, Datum arg);
+static void sddb_flush_detach(int code, Datum arg);
+static void count_drains(void);
+static void release_buffers(void);
+static void drain_roles(void);
+static void block_autovacuum(void);
+
+/*
+ * The job served by this flush worker
+ */
+static int64 flush_job_id = 0;
 
 /*
  * flags set by signal handlers
  */
 static volatile sig_atomic_t got_sighup = false;
 static volatile sig_atomic_t got_sigterm = false;
-static void shutdown_db_sigterm(SIGNAL_ARGS);
-static void shutdown_db_sighup(SIGNAL_ARGS);
-static void sddb_killer_sigterm(SIGNAL_ARGS);
-static void sddb_killer_sighup(SIGNAL_ARGS);
+static void sddb_supervisor_sigterm(SIGNAL_ARGS);
+static void sddb_supervisor_sighup(SIGNAL_ARGS);
 
 /*
  * Signal handler for SIGTERM
  */
 static void
-shutdown_db_sigterm(SIGNAL_ARGS)
-{
-	int			save_errno = errno;
-
-	got_sigterm = true;
-	/* do nothing */
-	errno = save_errno;
-}
-
-static void
-sddb_killer_sigterm(SIGNAL_ARGS)
+sddb_supervisor_sigterm(SIGNAL_ARGS)
 {
 	int			save_errno = errno;
 
@@ -88,17 +116,7 @@ sddb_killer_sigterm(SIGNAL_ARGS)
  * Signal handler for SIGHUP
  */
 static void
-shutdown_db_sighup(SIGNAL_ARGS)
-{
-	int			save_errno = errno;
-
-	got_sighup = true;
-	/* do nothing */
-	errno = save_errno;
-}
-
-static void
-sddb_killer_sighup(SIGNAL_ARGS)
+sddb_supervisor_sighup(SIGNAL_ARGS)
 {
 	int			save_errno = errno;
 
@@ -129,293 +147,325 @@ commit_tx(void)
 }
 
 /*
- * Initialize shutdown_db. This function is only executed when PostgreSQL starts.
+ * Count the drains of the shutdown databases which no backend process
+ * accesses any longer, in every mode, measured from their shutdown times.
+ * The backend processes which the policy flags of the database tell to
+ * ignore, e.g. the logical walsenders kept, are not waited for.
  */
-void
-shutdown_db_init(Datum main_arg)
+static void
+count_drains(void)
 {
-	int			ret;
-	int			ntup;
-	bool		isnull;
-	StringInfoData buf;
+	Oid		   *dbids;
+	TimestampTz *shutdown_times;
+	int		   *flags;
+	int		   *counts;
+	int			ndbids;
+	int			i;
+
+	if ((ndbids = sddb_collect_undrained(&dbids, &shutdown_times, &flags)) == 0)
+		return;
+
+	counts = (int *) palloc(sizeof(int) * ndbids);
+	sddb_count_backends_multi(dbids, ndbids, flags, counts);
+
+	for (i = 0; i < ndbids; i++)
+		if (counts[i] == 0 && sddb_set_drained(dbids[i]))
+			sddb_stats_count_drain(dbids[i], shutdown_times[i]);
+}
 
-	/* Establish signal handlers before unblocking signals */
-	pqsignal(SIGHUP, shutdown_db_sighup);
-	pqsignal(SIGTERM, shutdown_db_sigterm);
+/*
+ * Dump the block lists of and release the buffers of the shutdown databases
+ * which have requested them, once no backend process accesses them. This is
+ * done by the supervisor process, so that shutdown functions don't have to
+ * wait for the killed backends to exit.
+ *
+ * The block list is dumped first, since releasing the buffers loses it.
+ */
+static void
+release_buffers(void)
+{
+	Oid		   *dbids;
+	Oid		   *idle;
+	Oid		   *releasing;
+	int		   *counts;
+	int		   *released;
+	int			ndbids;
+	int			nidle = 0;
+	int			nreleasing = 0;
+	int			i,
+				j;
+
+	if ((ndbids = sddb_collect_releasing(&dbids)) == 0)
+		return;
+
+	counts = (int *) palloc(sizeof(int) * ndbids);
+	sddb_count_backends_multi(dbids, ndbids, NULL, counts);
+
+	/* dbids[] is sorted, so is idle[] */
+	idle = (Oid *) palloc(sizeof(Oid) * ndbids);
+	for (i = 0; i < ndbids; i++)
+		if (counts[i] == 0)
+			idle[nidle++] = dbids[i];
+
+	if (nidle == 0)
+		return;
+
+	/* idle[] is sorted, so is releasing[] */
+	releasing = (Oid *) palloc(sizeof(Oid) * nidle);
+	for (i = 0; i < nidle; i++)
+	{
+		sddbEntry	entry;
+		int			num;
 
-	/* We're now ready to receive signals */
-	BackgroundWorkerUnblockSignals();
+		if (!sddb_get_entry(idle[i], &entry))
+			continue;
 
-	/* Connect to postgres database */
-	BackgroundWorkerInitializeConnection("postgres", NULL, 0);
+		sddb_set_progress(idle[i], PHASE_RELEASING, -1, -1);
 
-	start_tx();
+		if (entry.flags & SDDB_FLAG_DUMP_BLOCKS)
+		{
+			if ((num = sddb_dump_blocks(idle[i])) >= 0)
+				elog(LOG, "%s: %d blocks of database %u have been dumped",
+					 __func__, num, idle[i]);
+		}
 
-	/* Could we use CREATE SCHEMA IF NOT EXISTS? */
-	initStringInfo(&buf);
-	appendStringInfo(&buf, "SELECT count(*) FROM pg_namespace WHERE nspname = %s;",
-					 quote_literal_cstr(SCHEMA));
+		if (entry.flags & SDDB_FLAG_RELEASE_BUFFERS)
+			releasing[nreleasing++] = idle[i];
+		else
+			sddb_set_released(idle[i], 0);
+	}
 
-	pgstat_report_activity(STATE_RUNNING, "initializing shutdown_db schema");
-	SetCurrentStatementStartTimestamp();
-	ret = SPI_execute(buf.data, true, 0);
+	released = (int *) palloc(sizeof(int) * Max(nreleasing, 1));
+	if (nreleasing > 0)
+		sddb_release_buffers(releasing, nreleasing, released);
 
-	if (ret != SPI_OK_SELECT)
-		elog(FATAL, "SPI_execute failed: error code %d", ret);
+	for (j = 0; j < nreleasing; j++)
+	{
+		sddb_set_released(releasing[j], released[j]);
+		if (released[j] >= 0)
+			elog(LOG, "%s: %d buffers of database %u have been released",
+				 __func__, released[j], releasing[j]);
+		else
+			elog(LOG, "%s: the buffers of database %u have been written out",
+				 __func__, releasing[j]);
+	}
 
-	if (SPI_processed != 1)
-		elog(FATAL, "not a singleton result");
+	/* Record that they have been released */
+	sddb_save_state();
+}
 
-	ntup = DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[0],
-									   SPI_tuptable->tupdesc,
-									   1, &isnull));
+/*
+ * Terminate the sessions of the roles which are being shut down in their
+ * databases; see shutdown_db.shutdown_role(). In Transactional mode, only
+ * the idle sessions are terminated, as for a whole database; in Immediate
+ * mode, the sessions which have appeared since the shutdown, e.g. the ones
+ * which had passed the authentication then, are terminated. An entry stops
+ * being served once its role has no session left in the database.
+ */
+static void
+drain_roles(void)
+{
+	Oid		   *dbids;
+	Oid		   *roleids;
+	int			n;
+	int			i;
 
-	if (isnull)
-		elog(FATAL, "null result");
+	if ((n = sddb_collect_running_roles(&dbids, &roleids)) == 0)
+		return;
 
-	/* Create schema and functions/views */
-	if (ntup == 0)
+	for (i = 0; i < n; i++)
 	{
-		resetStringInfo(&buf);
-		appendStringInfo(&buf,
-						 "CREATE SCHEMA %s;"
-						 "CREATE FUNCTION %s.sddb_show_db("
-						 "   OUT dbid oid,"
-						 "   OUT mode int,"
-						 "   OUT is_running bool)"
-						 "   RETURNS SETOF record"
-						 "   AS 'shutdown_db'"
-						 "   LANGUAGE C;"
-
-						 "CREATE VIEW %s.show_db_list"
-						 "  AS"
-						 "  WITH db_list AS ("
-						 "      SELECT s.dbid, d.datname, s.mode, s.is_running FROM %s.sddb_show_db() AS s, pg_database AS d WHERE s.dbid = d.oid"
-						 "  )"
-						 "  SELECT l.dbid, l.datname,"
-						 "      CASE WHEN l.mode = 0 THEN 'INIT'"
-						 "           WHEN l.mode = 1 THEN 'NORMAL'"
-						 "           WHEN l.mode = 2 THEN 'ABORT'"
-						 "           WHEN l.mode = 3 THEN 'IMMEDIATE'"
-						 "           ELSE 'TRANSACTIONAL'"
-						 "      END AS mode,"
-						 "      count(a.datid) AS num_users,"
-						 "      l.is_running AS killer_process_running"
-						 "         FROM db_list AS l LEFT JOIN pg_stat_activity AS a  ON l.dbid = a.datid"
-						 "               GROUP BY  l.dbid, l.datname, l.mode, l.is_running ORDER BY l.dbid;",
-						 SCHEMA,
-						 SCHEMA,
-						 SCHEMA,
-						 SCHEMA
-			);
-
-		pgstat_report_activity(STATE_RUNNING, "creating shutdown_db schema, functions and views.");
-		SetCurrentStatementStartTimestamp();
-		ret = SPI_execute(buf.data, false, 0);
-
-		if (ret != SPI_OK_UTILITY)
-			elog(FATAL, "failed to create shutdown_db schema, functions and views");
-
-		resetStringInfo(&buf);
-		appendStringInfo(&buf,
-						 "CREATE FUNCTION %s.shutdown_normal(TEXT) RETURNS void"
-						 "  AS 'shutdown_db'"
-						 "  LANGUAGE C;"
-						 "CREATE FUNCTION %s.shutdown_abort(TEXT) RETURNS void"
-						 "  AS 'shutdown_db'"
-						 "  LANGUAGE C;"
-						 "CREATE FUNCTION %s.shutdown_immediate(TEXT) RETURNS void"
-						 "  AS 'shutdown_db'"
-						 "  LANGUAGE C;"
-						 "CREATE FUNCTION %s.shutdown_transactional(TEXT) RETURNS void"
-						 "  AS 'shutdown_db'"
-						 "  LANGUAGE C;"
-						 "CREATE FUNCTION %s.startup(TEXT) RETURNS void"
-						 "  AS 'shutdown_db'"
-						 "  LANGUAGE C;",
-						 SCHEMA,
-						 SCHEMA,
-						 SCHEMA,
-						 SCHEMA,
-						 SCHEMA
-			);
-
-		pgstat_report_activity(STATE_RUNNING, "creating shutdown_db functions.");
-		SetCurrentStatementStartTimestamp();
-		ret = SPI_execute(buf.data, false, 0);
-
-		if (ret != SPI_OK_UTILITY)
-			elog(FATAL, "failed to create shutdown_db schema, functions and views");
-
-		resetStringInfo(&buf);
-		appendStringInfo(&buf,
-
-		/*
-		 * This function kills the backend processes which is accessing the
-		 * database whose id is dbid.
-		 *
-		 * If the argument `idle` is true, this function only kills the
-		 * backend process whose state is idle, i.e., the backends that are in
-		 * the transaction block are not killed. Otherwise, `idle` is false,
-		 * all backends that are accessing the database whose id is dbid are
-		 * killed.
-		 *
-		 * After processing, if `idle` is true, this function returns the
-		 * number of the remaining backend processes that are still running
-		 * because of in the transaction block; if `idle` is false, this
-		 * function always returns 0 because all corresponding backend
-		 * processes are killed.
-		 */
-						 "CREATE FUNCTION %s.sddb_kill_processes(dbid OID, idle BOOL) RETURNS integer"
-						 " AS $$"
-						 "DECLARE"
-						 "	pid Oid;"
-						 "	query text;"
-						 "	num_running int;"
-						 "	activity pg_stat_activity\%%ROWTYPE;"
-						 "BEGIN"
-						 "	num_running := 0;"
-						 "   	FOR activity IN SELECT * FROM pg_stat_activity WHERE datid = dbid LOOP"
-						 "		pid := activity.pid;"
-						 "		query := \'SELECT pg_cancel_backend(\' || pid || \'); SELECT pg_terminate_backend(\' || pid || \');\';"
-						 "		num_running := num_running + 1;"
-						 "		IF idle IS TRUE THEN"
-						 "			IF activity.state = \'idle\' THEN"
-						 "				EXECUTE query;"
-						 "				num_running := num_running - 1;"
-						 "			END IF;"
-						 "		ELSE"
-						 "			EXECUTE query;"
-						 "			num_running := num_running - 1;"
-						 "		END IF;"
-						 "	END LOOP;"
-						 "	RETURN num_running;"
-						 "END;"
-						 "$$ LANGUAGE plpgsql;"
-
-						 "CREATE FUNCTION %s.sddb_killer_launch(INTEGER) RETURNS pg_catalog.int4 STRICT"
-						 "  AS 'shutdown_db'"
-						 "  LANGUAGE C;",
-						 SCHEMA,
-						 SCHEMA
-			);
-
-		pgstat_report_activity(STATE_RUNNING, "creating shutdown_db functions.");
-		SetCurrentStatementStartTimestamp();
-		ret = SPI_execute(buf.data, false, 0);
-
-		if (ret != SPI_OK_UTILITY)
-			elog(FATAL, "failed to create shutdown_db schema, functions and views.");
-
-		resetStringInfo(&buf);
-		appendStringInfo(&buf,
-						 "REVOKE ALL ON FUNCTION %s.sddb_killer_launch(INT) FROM PUBLIC;"
-						 "REVOKE ALL ON FUNCTION %s.sddb_kill_processes(dbid OID, idle BOOL) FROM PUBLIC;"
-						 "REVOKE ALL ON FUNCTION %s.shutdown_normal(TEXT) FROM PUBLIC;"
-						 "REVOKE ALL ON FUNCTION %s.shutdown_abort(TEXT) FROM PUBLIC;"
-						 "REVOKE ALL ON FUNCTION %s.shutdown_immediate(TEXT) FROM PUBLIC;"
-						 "REVOKE ALL ON FUNCTION %s.shutdown_transactional(TEXT) FROM PUBLIC;"
-						 "REVOKE ALL ON FUNCTION %s.startup(TEXT) FROM PUBLIC;"
-						 "REVOKE ALL ON FUNCTION %s.sddb_show_db(OUT dbid oid, OUT is_running bool) FROM PUBLIC;",
-						 SCHEMA, SCHEMA, SCHEMA, SCHEMA,
-						 SCHEMA, SCHEMA, SCHEMA, SCHEMA
-			);
-
-		pgstat_report_activity(STATE_RUNNING, "revoke all functions from public.");
-		SetCurrentStatementStartTimestamp();
-		ret = SPI_execute(buf.data, false, 0);
-
-		if (ret != SPI_OK_UTILITY)
-			elog(FATAL, "failed to revoke shutdown_db functions.");
+		sddbEntry	entry;
+
+		if (!sddb_get_role_entry(dbids[i], roleids[i], &entry))
+			continue;
+
+		if (sddb_kill_role_backends(dbids[i], roleids[i],
+									(entry.mode == TRANSACTIONAL)) > 0)
+			continue;
+
+		sddb_set_role_entry(dbids[i], roleids[i], false);
+		elog(LOG, "%s: role %u in database %u is going down.....",
+			 __func__, roleids[i], dbids[i]);
 	}
 
-	/*
-	 * Initialize the hash table
-	 */
-	initStringInfo(&buf);
-	appendStringInfo(&buf,
-					 "SELECT oid FROM pg_database"
-					 " WHERE datallowconn = false AND datname"
-					 " NOT IN ('template0', 'template1', 'postgres');"
-		);
+	pfree(dbids);
+	pfree(roleids);
+}
+
+/*
+ * Terminate the autovacuum workers which have been launched in the
+ * databases shut down with shutdown_db.block_autovacuum since their
+ * shutdowns, so that the maintenance I/O is not spent on them; it would be
+ * spent again when they start up. This is polled every
+ * shutdown_db.killer_naptime, since the launcher can't be told to skip
+ * them.
+ */
+static void
+block_autovacuum(void)
+{
+	Oid		   *dbids;
+	TimestampTz *since;
+	int			n;
+	int			num;
 
-	pgstat_report_activity(STATE_RUNNING, buf.data);
-	SetCurrentStatementStartTimestamp();
-	ret = SPI_execute(buf.data, true, 0);
+	if ((n = sddb_collect_blocking(&dbids, &since)) == 0)
+		return;
 
-	if (ret != SPI_OK_SELECT)
-		ereport(ERROR, (errmsg("SPI_execute failed: error code %d", ret)));
+	if ((num = sddb_kill_new_autovacuum(dbids, since, n)) > 0)
+		elog(LOG, "%s: %d autovacuum workers have been terminated", __func__, num);
 
-	if (SPI_processed > 0)
-	{
-		int			i;
-		int64		dbid;
+	pfree(dbids);
+	pfree(since);
+}
 
-		for (i = 0; i < SPI_processed; i++)
-		{
-			dbid = DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[i],
-											   SPI_tuptable->tupdesc,
-											   1, &isnull));
-			sddb_store_entry(dbid, INIT, false);
-		}
-	}
+/*
+ * Register the supervisor process. This is called from _PG_init().
+ */
+void
+sddb_supervisor_register(void)
+{
+	BackgroundWorker worker;
 
-	commit_tx();
+	memset(&worker, 0, sizeof(worker));
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS |
+		BGWORKER_BACKEND_DATABASE_CONNECTION;
+	/* Start on the hot standbys too, to drain the replayed shutdowns */
+	worker.bgw_start_time = BgWorkerStart_ConsistentState;
+	worker.bgw_restart_time = SDDB_SUPERVISOR_RESTART_TIME;
 
-	proc_exit(0);
+	sprintf(worker.bgw_library_name, "shutdown_db");
+	sprintf(worker.bgw_function_name, "sddb_supervisor_main");
+	worker.bgw_notify_pid = 0;
+	snprintf(worker.bgw_name, BGW_MAXLEN, "shutdown_db supervisor");
+	snprintf(worker.bgw_type, BGW_MAXLEN, "shutdown_db");
+	worker.bgw_main_arg = (Datum) 0;
+	RegisterBackgroundWorker(&worker);
+}
+
+/*
+ * Wake up the supervisor process, if it's running.
+ */
+void
+sddb_supervisor_wakeup(void)
+{
+	Latch	   *latch;
+
+	/* Safety check... */
+	if (!sddb)
+		return;
+
+	SpinLockAcquire(&sddb->mutex);
+	latch = sddb->supervisor_latch;
+	SpinLockRelease(&sddb->mutex);
+
+	if (latch != NULL)
+		SetLatch(latch);
+}
+
+/*
+ * Return the pid of the supervisor process if it's running; otherwise
+ * InvalidPid.
+ */
+pid_t
+sddb_supervisor_pid(void)
+{
+	pid_t		pid;
+
+	/* Safety check... */
+	if (!sddb)
+		return InvalidPid;
+
+	SpinLockAcquire(&sddb->mutex);
+	pid = sddb->supervisor_pid;
+	SpinLockRelease(&sddb->mutex);
+
+	return pid;
 }
 
 /*
- * This function is executed when shutdown_db.shutdown_transactional() runs.
+ * Clear the supervisor process's pid and latch from the shared state when
+ * it exits.
+ */
+static void
+sddb_supervisor_detach(int code, Datum arg)
+{
+	SpinLockAcquire(&sddb->mutex);
+	sddb->supervisor_pid = InvalidPid;
+	sddb->supervisor_latch = NULL;
+	SpinLockRelease(&sddb->mutex);
+
+	Assert(pg_atomic_read_u32(&sddb->num_bgw) > 0);
+	pg_atomic_fetch_sub_u32(&sddb->num_bgw, 1);
+}
+
+/*
+ * The supervisor process serves all the databases which are shut down in
+ * Transactional mode.
+ *
+ * The draining databases are the entries whose `is_running` is true in the
+ * hash table. For all of them, this function checks the number of users who
+ * run the transactions in one pass over the backend status array, and if the
+ * number of users of a database is 0, which means that there is no running
+ * transaction in it, sets its `is_running` to false; otherwise, the database
+ * continues to be checked.
  *
- * This function periodically checks the number of users who run the transactions
- * in the database whose id is dbid, and if the number of users is 0, which means
- * that there is no running transaction in the target database, this function ends;
- * otherwise, this function continues to check.
+ * The check is done whenever shutdown_transactional() is executed or a
+ * transaction ends in a draining database, because they set our latch, and
+ * at least every sddb_killer_naptime seconds while any database is draining.
  */
 void
-sddb_killer_main(Datum main_arg)
+sddb_supervisor_main(Datum main_arg)
 {
-	int			dbid = DatumGetInt32(main_arg);
-	StringInfoData buf;
-	bool		isnull;
+	long		timeout = 0;
+	int			retries = 0;
 
 	/* Establish signal handlers before unblocking signals. */
-	pqsignal(SIGHUP, sddb_killer_sighup);
-	pqsignal(SIGTERM, sddb_killer_sigterm);
+	pqsignal(SIGHUP, sddb_supervisor_sighup);
+	pqsignal(SIGTERM, sddb_supervisor_sigterm);
 
 	/* We're now ready to receive signals */
 	BackgroundWorkerUnblockSignals();
 
-	/* Connect to our database */
+	/* Connect to postgres database */
 	BackgroundWorkerInitializeConnection("postgres", NULL, 0);
 
-	initStringInfo(&buf);
-	appendStringInfo(&buf,
-					 "SELECT %s.sddb_kill_processes(%d, TRUE)",
-					 SCHEMA, dbid);
+	/* Advertise ourselves */
+	pg_atomic_fetch_add_u32(&sddb->num_bgw, 1);
+	before_shmem_exit(sddb_supervisor_detach, (Datum) 0);
 
-	/* Set pid to the hashtale's entry */
-	sddb_set_pid2entry(dbid, MyProcPid);
-
-	/* Increment sddb->num_hbgw */
-	SpinLockAcquire(&sddb->elock);
-	sddb->num_bgw++;
-	SpinLockRelease(&sddb->elock);
+	SpinLockAcquire(&sddb->mutex);
+	sddb->supervisor_pid = MyProcPid;
+	sddb->supervisor_latch = MyLatch;
+	SpinLockRelease(&sddb->mutex);
 
 	/*
 	 * Main loop
 	 */
 	while (!got_sigterm)
 	{
-		int			ret,
-					rc,
-					running_processes;
+		int			rc;
+		int			ndbids;
+		int			nexpired = 0;
+		int			ndraining = 0;
+		int			i;
+		Oid		   *dbids;
+		TimestampTz *deadlines;
+		int		   *flags;
+		Oid		   *expired;
+		Oid		   *draining;
+		int		   *expired_flags;
+		int		   *draining_flags;
+		int		   *running_processes;
+		TimestampTz now;
+		TimestampTz next_deadline = 0;
+		long		job_timeout;
 
 		rc = WaitLatch(MyLatch,
-					   WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
-					   sddb_killer_naptime * 1000L,
-					   PG_WAIT_EXTENSION);
+					   WL_LATCH_SET | WL_EXIT_ON_PM_DEATH |
+					   ((timeout >= 0) ? WL_TIMEOUT : 0),
+					   timeout,
+					   sddb_wait_event(WAIT_SUPERVISOR_MAIN));
 		ResetLatch(MyLatch);
 
 		/* emergency bailout if postmaster has died. */
@@ -424,65 +474,161 @@ sddb_killer_main(Datum main_arg)
 
 		CHECK_FOR_INTERRUPTS();
 
-		/* In case of a SIGHUP, do nothing. */
+		/* In case of a SIGHUP, reload the configuration file. */
 		if (got_sighup)
+		{
 			got_sighup = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
 
-		/* In case of a SIGTERM, reduce num_bgw and halt. */
+		/* In case of a SIGTERM, halt; the postmaster restarts us. */
 		if (got_sigterm)
-		{
-			got_sigterm = false;
+			break;
 
-			SpinLockAcquire(&sddb->elock);
-			Assert(sddb->num_hbgw > 0);
-			sddb->num_bgw--;
-			SpinLockRelease(&sddb->elock);
+		/* A transaction has ended or a new database is being drained */
+		if (rc & WL_LATCH_SET)
+			retries = SDDB_SUPERVISOR_RETRIES;
 
-			proc_exit(0);
+		/* Run the queued jobs the budgets allow; see scheduler.c */
+		job_timeout = sddb_scheduler_run();
+
+		/* Nothing to do; sleep until our latch is set, or for the jobs. */
+		if (pg_atomic_read_u32(&sddb->num_running) == 0 &&
+			pg_atomic_read_u32(&sddb->num_releasing) == 0 &&
+			pg_atomic_read_u32(&sddb->num_blocking) == 0 &&
+			pg_atomic_read_u32(&sddb->num_undrained) == 0)
+		{
+			timeout = job_timeout;
+			continue;
 		}
 
+		sddb_stats_count_loop();
+
 		start_tx();
 
-		ret = SPI_execute(buf.data, true, 0);
-		if (ret != SPI_OK_SELECT)
+		ndbids = sddb_collect_running(&dbids, &deadlines, &flags, MyProcPid);
+		if (ndbids > 0)
 		{
-			commit_tx();
-			elog(FATAL, "SPI_execute failed: error code %d", ret);
-			break;
+			/*
+			 * Split the databases into the ones whose deadline has passed, or
+			 * all of whose sessions are terminated, and the others; both stay
+			 * sorted.
+			 */
+			now = GetCurrentTimestamp();
+			expired = (Oid *) palloc(sizeof(Oid) * ndbids);
+			draining = (Oid *) palloc(sizeof(Oid) * ndbids);
+			expired_flags = (int *) palloc(sizeof(int) * ndbids);
+			draining_flags = (int *) palloc(sizeof(int) * ndbids);
+			for (i = 0; i < ndbids; i++)
+			{
+				if ((flags[i] & SDDB_FLAG_TERMINATE_ALL) ||
+					(deadlines[i] != 0 && deadlines[i] <= now))
+				{
+					expired_flags[nexpired] = flags[i];
+					expired[nexpired++] = dbids[i];
+				}
+				else
+				{
+					draining_flags[ndraining] = flags[i];
+					draining[ndraining++] = dbids[i];
+					if (deadlines[i] != 0 &&
+						(next_deadline == 0 || deadlines[i] < next_deadline))
+						next_deadline = deadlines[i];
+				}
+			}
+
+			/*
+			 * Cancel and terminate all the remaining sessions of the expired
+			 * databases, as shutdown_immediate() does.
+			 */
+			running_processes = (int *) palloc(sizeof(int) * ndbids);
+			if (nexpired > 0)
+			{
+				int			nescalated = 0;
+
+				sddb_kill_backends_multi(expired, nexpired, false, expired_flags,
+										 running_processes);
+
+				for (i = 0; i < nexpired; i++)
+				{
+					sddb_set_progress(expired[i], PHASE_CANCELLING, -1, -1);
+
+					/* Replayed from WAL; served until the sessions are gone */
+					if (expired_flags[i] & SDDB_FLAG_TERMINATE_ALL)
+					{
+						if (running_processes[i] == 0)
+						{
+							sddb_set_entry(expired[i], false);
+							elog(LOG, "%s: database %u is going down.....", __func__, expired[i]);
+						}
+						continue;
+					}
+
+					sddb_set_mode(expired[i], IMMEDIATE);
+					elog(LOG, "%s: the deadline of database %u has passed; escalated to Immediate mode",
+						 __func__, expired[i]);
+					expired[nescalated++] = expired[i];
+				}
+
+				if (nescalated > 0)
+				{
+					sddb_save_state();
+					sddb_wal_log_entries(expired, nescalated);
+				}
+			}
+
+			sddb_kill_backends_multi(draining, ndraining, true, draining_flags,
+									 running_processes);
+
+			for (i = 0; i < ndraining; i++)
+			{
+				/* The sessions killed above are waited for to exit */
+				sddb_set_progress(draining[i],
+								  (running_processes[i] > 0) ? PHASE_WAITING : PHASE_TERMINATING,
+								  -1, -1);
+
+				if (running_processes[i] == 0)
+				{
+					/* Set entry(dbid).is_running = false */
+					sddb_set_entry(draining[i], false);
+					elog(LOG, "%s: database %u is going down.....", __func__, draining[i]);
+				}
+			}
 		}
 
-		if (SPI_processed != 1)
-		{
-			commit_tx();
-			elog(FATAL, "%s returned invalid value", __func__);
-			break;
-		}
+		/* Terminate the sessions of the shutdown roles */
+		drain_roles();
+
+		/* Terminate the autovacuum workers launched in the shutdown databases */
+		block_autovacuum();
+
+		/* Count the drains of the databases all of whose backends are gone */
+		count_drains();
 
-		running_processes = DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[0],
-														SPI_tuptable->tupdesc,
-														1, &isnull));
+		/* Release the buffers of the databases all of whose backends are gone */
+		release_buffers();
 
 		commit_tx();
 
-		if (isnull)
+		if (retries > 0)
 		{
-			elog(FATAL, "null result");
-			break;
+			retries--;
+			timeout = SDDB_SUPERVISOR_RETRY_MS;
 		}
+		else
+			timeout = sddb_killer_naptime * 1000L;
 
-		if (running_processes == 0)
-		{
-			/* Set entry(dbid).is_running = false */
-			sddb_set_entry(dbid, false);
-			elog(LOG, "%s is going down.....", __func__);
+		if (job_timeout >= 0)
+			timeout = Min(timeout, job_timeout);
 
-			/* reduce num_bgw */
-			SpinLockAcquire(&sddb->elock);
-			Assert(sddb->num_hbgw > 0);
-			sddb->num_bgw--;
-			SpinLockRelease(&sddb->elock);
+		/* Don't sleep past the nearest deadline */
+		if (next_deadline != 0)
+		{
+			long		secs;
+			int			usecs;
 
-			proc_exit(0);
+			TimestampDifference(GetCurrentTimestamp(), next_deadline, &secs, &usecs);
+			timeout = Min(timeout, secs * 1000L + usecs / 1000 + 1);
 		}
 	}
 
@@ -490,53 +636,167 @@ sddb_killer_main(Datum main_arg)
 }
 
 /*
- * Dynamically launch an SPI worker by the shutdown_transactional() command.
+ * Launch the process which prewarms the buffers of the database whose id
+ * is dbid from its block list. This is called when the database starts up
+ * again; the process isn't waited for.
  */
-Datum
-sddb_killer_launch(PG_FUNCTION_ARGS)
+void
+sddb_prewarm_launch(const Oid dbid)
 {
-	int32		dbid = PG_GETARG_INT32(0);
 	BackgroundWorker worker;
 	BackgroundWorkerHandle *handle;
-	BgwHandleStatus status;
-	pid_t		pid;
 
 	memset(&worker, 0, sizeof(worker));
 	worker.bgw_flags = BGWORKER_SHMEM_ACCESS |
 		BGWORKER_BACKEND_DATABASE_CONNECTION;
 	worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
 	worker.bgw_restart_time = BGW_NEVER_RESTART;
-
 	sprintf(worker.bgw_library_name, "shutdown_db");
-	sprintf(worker.bgw_function_name, "sddb_killer_main");
-	snprintf(worker.bgw_name, BGW_MAXLEN, "sddb_killer dbid=%d", dbid);
-	snprintf(worker.bgw_type, BGW_MAXLEN, "sddb_killer");
-	worker.bgw_main_arg = Int32GetDatum(dbid);
-
-	/* Set bgw_notify_pid so that we can use WaitForBackgroundWorkerStartup */
-	worker.bgw_notify_pid = MyProcPid;
+	sprintf(worker.bgw_function_name, "sddb_prewarm_main");
+	worker.bgw_notify_pid = 0;
+	snprintf(worker.bgw_name, BGW_MAXLEN, "shutdown_db prewarm for database %u", dbid);
+	snprintf(worker.bgw_type, BGW_MAXLEN, "shutdown_db prewarm");
+	worker.bgw_main_arg = ObjectIdGetDatum(dbid);
 
 	if (!RegisterDynamicBackgroundWorker(&worker, &handle))
+		ereport(WARNING,
+				(errcode(ERRCODE_CONFIGURATION_LIMIT_EXCEEDED),
+				 errmsg("could not register background process to prewarm database %u", dbid),
+				 errhint("You may need to increase max_worker_processes.")));
+}
+
+/*
+ * Main routine of the prewarm process. main_arg is the dbid.
+ */
+void
+sddb_prewarm_main(Datum main_arg)
+{
+	Oid			dbid = DatumGetObjectId(main_arg);
+	int			num;
+
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+
+	/* Connect even if the gate is still closed by datallowconn */
+	BackgroundWorkerInitializeConnectionByOid(dbid, InvalidOid,
+											  BGWORKER_BYPASS_ALLOWCONN);
+
+	num = sddb_prewarm_blocks();
+
+	elog(LOG, "%s: %d blocks of database %u have been prewarmed",
+		 __func__, num, dbid);
+
+	proc_exit(0);
+}
+
+/*
+ * Launch the process which writes out the buffers of the database whose id
+ * is dbid for the ABORT job whose job id is job_id; see scheduler.c. Its
+ * handle, allocated in the current memory context, is set into *handle.
+ * Returns false if it can't be registered.
+ */
+bool
+sddb_flush_launch(const Oid dbid, const int64 job_id,
+				  BackgroundWorkerHandle **handle)
+{
+	BackgroundWorker worker;
+
+	memset(&worker, 0, sizeof(worker));
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS |
+		BGWORKER_BACKEND_DATABASE_CONNECTION;
+	worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+	worker.bgw_restart_time = BGW_NEVER_RESTART;
+	sprintf(worker.bgw_library_name, "shutdown_db");
+	sprintf(worker.bgw_function_name, "sddb_flush_main");
+	worker.bgw_notify_pid = 0;
+	snprintf(worker.bgw_name, BGW_MAXLEN, "shutdown_db flush for database %u", dbid);
+	snprintf(worker.bgw_type, BGW_MAXLEN, "shutdown_db flush");
+	worker.bgw_main_arg = ObjectIdGetDatum(dbid);
+	memcpy(worker.bgw_extra, &job_id, sizeof(int64));
+
+	if (!RegisterDynamicBackgroundWorker(&worker, handle))
 	{
-		elog(ERROR, "This function could not be executed because of the background worker failure.");
-		PG_RETURN_NULL();
+		ereport(WARNING,
+				(errcode(ERRCODE_CONFIGURATION_LIMIT_EXCEEDED),
+				 errmsg("could not register background process to flush database %u", dbid),
+				 errhint("You may need to increase max_worker_processes.")));
+		return false;
 	}
 
-	status = WaitForBackgroundWorkerStartup(handle, &pid);
+	return true;
+}
+
+/*
+ * Tell the scheduler that the flush of the job has ended when the flush
+ * worker exits, even by an error, and wake up the supervisor process to go
+ * on with the jobs.
+ */
+static void
+sddb_flush_detach(int code, Datum arg)
+{
+	sddb_job_flush_done(flush_job_id);
+	sddb_supervisor_wakeup();
+}
+
+/*
+ * Main routine of the flush process. main_arg is the dbid, and bgw_extra
+ * holds the job id.
+ *
+ * It connects to the postgres database rather than to the one being shut
+ * down, so that it isn't counted as a backend process of the latter.
+ */
+void
+sddb_flush_main(Datum main_arg)
+{
+	Oid			dbid = DatumGetObjectId(main_arg);
+	int			num;
+
+	memcpy(&flush_job_id, MyBgworkerEntry->bgw_extra, sizeof(int64));
+
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+
+	/*
+	 * Registered before the connection, so that this runs after the
+	 * transaction has been aborted and its locks released.
+	 */
+	before_shmem_exit(sddb_flush_detach, (Datum) 0);
+	sddb_job_flush_started(flush_job_id);
+
+	BackgroundWorkerInitializeConnection("postgres", NULL, 0);
+
+	StartTransactionCommand();
+	num = sddb_flush_buffers(&dbid, 1);
+	sddb_set_progress(dbid, PHASE_TERMINATING, -1, -1);
+	CommitTransactionCommand();
+
+	if (num >= 0)
+		elog(LOG, "%s: %d buffers of database %u have been written out",
+			 __func__, num, dbid);
 
-	if (status == BGWH_STOPPED)
+	proc_exit(0);
+}
+
+/*
+ * Wake up the supervisor process to serve the database by the
+ * shutdown_transactional() command, and return its pid.
+ *
+ * This function is kept for the compatibility; the supervisor process is
+ * started at the server start and serves all the databases, so this never
+ * launches a new worker.
+ */
+Datum
+sddb_killer_launch(PG_FUNCTION_ARGS)
+{
+	pid_t		pid;
+
+	if ((pid = sddb_supervisor_pid()) == InvalidPid)
 		ereport(ERROR,
-				(errcode(ERRCODE_INSUFFICIENT_RESOURCES),
-				 errmsg("could not start background process"),
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("shutdown_db supervisor process is not running"),
 				 errhint("More details may be available in the server log.")));
-	if (status == BGWH_POSTMASTER_DIED)
-		ereport(ERROR,
-				(errcode(ERRCODE_INSUFFICIENT_RESOURCES),
-				 errmsg("cannot start background processes without postmaster"),
-				 errhint("Kill all remaining database processes and restart the database.")));
-	Assert(status == BGWH_STARTED);
 
-	pfree(handle);
+	sddb_supervisor_wakeup();
 
 	PG_RETURN_INT32(pid);
 }
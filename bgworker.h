@@ -0,0 +1,28 @@
+/*-------------------------------------------------------------------------
+ * bgworker.h
+ *
+ * Copyright (c) 2008-2025, PostgreSQL Global Development Group
+ * Copyright (c) 2020-2025, hironobu suzuki@interdb.jp
+ *-------------------------------------------------------------------------
+ */
+#ifndef __SDDB_BGWORKER_H__
+#define __SDDB_BGWORKER_H__
+
+#include "postmaster/bgworker.h"
+
+/*
+ * Define constants
+ */
+#define SDDB_SUPERVISOR_RESTART_TIME	10	/* in seconds */
+
+/*
+ * Function declarations
+ */
+void		sddb_supervisor_register(void);
+void		sddb_supervisor_wakeup(void);
+pid_t		sddb_supervisor_pid(void);
+void		sddb_prewarm_launch(const Oid dbid);
+bool		sddb_flush_launch(const Oid dbid, const int64 job_id,
+							  BackgroundWorkerHandle **handle);
+
+#endif
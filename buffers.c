@@ -0,0 +1,657 @@
+/*-------------------------------------------------------------------------
+ * buffers.c
+ *
+ * Copyright (c) 2008-2025, PostgreSQL Global Development Group
+ * Copyright (c) 2020-2025, Hironobu Suzuki @ interdb.jp
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "access/xact.h"
+#if PG_VERSION_NUM >= 120000
+#include "access/relation.h"
+#else
+#include "access/heapam.h"
+#endif
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "storage/buf_internals.h"
+#include "storage/bufmgr.h"
+#include "storage/fd.h"
+#include "storage/latch.h"
+#include "storage/smgr.h"
+#if PG_VERSION_NUM >= 160000
+#include "utils/relfilenumbermap.h"
+#else
+#include "utils/relfilenodemap.h"
+#endif
+#include "utils/rel.h"
+#include "utils/timestamp.h"
+
+#include "shutdown_db.h"
+#include "backends.h"
+#include "buffers.h"
+#include "hashtable.h"
+#include "stats.h"
+
+/*
+ * Number of the buffers written between checks of the rate limit
+ */
+#define SDDB_FLUSH_BATCH_SIZE	 32
+
+/*
+ * The block list of a shutdown database, dumped into
+ * SDDB_BLOCK_FILE_FORMAT. The file consists of the header, the version,
+ * the number of records, and the records in the order to be prewarmed.
+ */
+#define SDDB_BLOCK_FILE_FORMAT	PGSTAT_STAT_PERMANENT_DIRECTORY "/shutdown_db.%u.blocks"
+
+static const uint32 SDDB_BLOCK_FILE_HEADER = 0x5344424b;
+static const uint32 SDDB_BLOCK_FILE_VERSION = 1;
+
+typedef struct sddbBlockRecord
+{
+	Oid			tablespace;
+	Oid			filenumber;
+	int32		forknum;
+	uint32		blocknum;
+	int32		usage_count;	/* higher ones are prewarmed first */
+}			sddbBlockRecord;
+
+/*
+ * extern variables
+ */
+extern int	sddb_flush_rate_limit;
+extern int	sddb_prewarm_rate_limit;
+
+/*
+ * Function declarations
+ */
+#if PG_VERSION_NUM >= 140000
+static bool flush_buffer(const int buf_id);
+static void report_flushed(const Oid *dbids, const int *flushed,
+						   const int ndbids);
+#endif
+static void throttle(const TimestampTz start, const int n, const int rate_limit);
+static int	block_record_cmp(const void *p1, const void *p2);
+static bool prewarm_run(const sddbBlockRecord * records, const int n,
+						TimestampTz start, int *nread);
+
+
+#if PG_VERSION_NUM >= 140000
+/*
+ * Write out the buffer whose id is buf_id if it's still valid and dirty.
+ * Returns true if it has been written.
+ *
+ * The tag is read without the buffer header lock; ReadRecentBuffer() pins
+ * the buffer only if it still holds the same page, so a torn or stale tag
+ * does no harm.
+ */
+static bool
+flush_buffer(const int buf_id)
+{
+	BufferDesc *bufHdr = GetBufferDescriptor(buf_id);
+	BufferTag	tag = bufHdr->tag;
+	Buffer		buffer = BufferDescriptorGetBuffer(bufHdr);
+
+#if PG_VERSION_NUM >= 160000
+	if (!ReadRecentBuffer(BufTagGetRelFileLocator(&tag), BufTagGetForkNum(&tag),
+						  tag.blockNum, buffer))
+		return false;
+#else
+	if (!ReadRecentBuffer(tag.rnode, tag.forkNum, tag.blockNum, buffer))
+		return false;
+#endif
+
+	/* FlushOneBuffer() writes it only if it's dirty */
+	LockBuffer(buffer, BUFFER_LOCK_SHARE);
+	FlushOneBuffer(buffer);
+	LockBuffer(buffer, BUFFER_LOCK_UNLOCK);
+	ReleaseBuffer(buffer);
+
+	return true;
+}
+
+/*
+ * Report the numbers of the buffers of dbids[] written out so far,
+ * flushed[], into their progress.
+ */
+static void
+report_flushed(const Oid *dbids, const int *flushed, const int ndbids)
+{
+	int			i;
+
+	for (i = 0; i < ndbids; i++)
+		sddb_set_progress(dbids[i], PHASE_FLUSHING, -1, flushed[i]);
+}
+
+#endif
+
+/*
+ * Sleep so that the n buffers processed since `start` don't exceed
+ * rate_limit per second. 0 means no limit.
+ */
+static void
+throttle(const TimestampTz start, const int n, const int rate_limit)
+{
+	TimestampTz wakeup;
+	long		secs;
+	int			usecs;
+
+	if (rate_limit <= 0)
+		return;
+
+	wakeup = start + (TimestampTz) ((double) n * USECS_PER_SEC / rate_limit);
+	TimestampDifference(GetCurrentTimestamp(), wakeup, &secs, &usecs);
+
+	if (secs > 0 || usecs > 0)
+	{
+		(void) WaitLatch(MyLatch,
+						 WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+						 secs * 1000L + usecs / 1000 + 1,
+						 sddb_wait_event(WAIT_THROTTLE));
+		ResetLatch(MyLatch);
+	}
+
+	CHECK_FOR_INTERRUPTS();
+}
+
+/*
+ * Write out the dirty buffers of the databases in dbids[], instead of a
+ * cluster-wide CHECKPOINT, in one pass over the buffer pool. Returns the
+ * number of the buffers written, or -1 if unknown.
+ *
+ * The writes are throttled by shutdown_db.flush_rate_limit, pages per
+ * second, so that the other databases don't suffer an I/O spike.
+ * ReadRecentBuffer() is needed for this; before PostgreSQL 14,
+ * FlushDatabaseBuffers() is used without throttling.
+ */
+int
+sddb_flush_buffers(const Oid *dbids, const int ndbids)
+{
+#if PG_VERSION_NUM >= 140000
+	Oid		   *sorted;
+	int		   *flushed;
+	TimestampTz start;
+	int			nwritten = 0;
+	int			i;
+
+	if (ndbids == 0)
+		return 0;
+
+	sorted = (Oid *) palloc(sizeof(Oid) * ndbids);
+	memcpy(sorted, dbids, sizeof(Oid) * ndbids);
+	qsort(sorted, ndbids, sizeof(Oid), sddb_oid_cmp);
+	flushed = (int *) palloc0(sizeof(int) * ndbids);
+
+	start = GetCurrentTimestamp();
+
+	for (i = 0; i < NBuffers; i++)
+	{
+		BufferDesc *bufHdr = GetBufferDescriptor(i);
+		uint32		buf_state;
+		Oid			dbid;
+		Oid		   *found;
+
+		/* Unlocked precheck, as FlushDatabaseBuffers() does */
+		buf_state = pg_atomic_read_u32(&bufHdr->state);
+		if ((buf_state & (BM_VALID | BM_DIRTY)) != (BM_VALID | BM_DIRTY))
+			continue;
+
+#if PG_VERSION_NUM >= 160000
+		dbid = bufHdr->tag.dbOid;
+#else
+		dbid = bufHdr->tag.rnode.dbNode;
+#endif
+		found = (Oid *) bsearch(&dbid, sorted, ndbids, sizeof(Oid), sddb_oid_cmp);
+		if (found == NULL)
+			continue;
+
+		if (!flush_buffer(i))
+			continue;
+
+		flushed[found - sorted]++;
+		if (++nwritten % SDDB_FLUSH_BATCH_SIZE == 0)
+		{
+			report_flushed(sorted, flushed, ndbids);
+			throttle(start, nwritten, sddb_flush_rate_limit);
+		}
+	}
+
+	report_flushed(sorted, flushed, ndbids);
+
+	pfree(sorted);
+	pfree(flushed);
+
+	return nwritten;
+#else
+	int			i;
+
+	for (i = 0; i < ndbids; i++)
+		FlushDatabaseBuffers(dbids[i]);
+
+	return -1;
+#endif
+}
+
+/*
+ * Return the percentage of the dirty buffers in the buffer pool, which tells
+ * the scheduler how busy the checkpointer and the bgwriter will be. The
+ * buffer headers are read without locking, so this is only an estimate.
+ */
+int
+sddb_dirty_buffers_percent(void)
+{
+	int			ndirty = 0;
+	int			i;
+
+	for (i = 0; i < NBuffers; i++)
+	{
+		BufferDesc *bufHdr = GetBufferDescriptor(i);
+
+		if (pg_atomic_read_u32(&bufHdr->state) & BM_DIRTY)
+			ndirty++;
+	}
+
+	return (int) ((int64) ndirty * 100 / NBuffers);
+}
+
+/*
+ * Return the number of the dirty buffers of the database dbid, i.e. the
+ * buffers which sddb_flush_buffers() would write out. The buffer headers
+ * are read without locking, so this is only an estimate.
+ */
+int
+sddb_count_dirty_buffers(const Oid dbid)
+{
+	int			ndirty = 0;
+	int			i;
+
+	for (i = 0; i < NBuffers; i++)
+	{
+		BufferDesc *bufHdr = GetBufferDescriptor(i);
+		uint32		buf_state;
+
+		buf_state = pg_atomic_read_u32(&bufHdr->state);
+		if ((buf_state & (BM_VALID | BM_DIRTY)) != (BM_VALID | BM_DIRTY))
+			continue;
+
+#if PG_VERSION_NUM >= 160000
+		if (bufHdr->tag.dbOid == dbid)
+#else
+		if (bufHdr->tag.rnode.dbNode == dbid)
+#endif
+			ndirty++;
+	}
+
+	return ndirty;
+}
+
+/*
+ * Release the buffers of the databases in dbids[], which must be sorted in
+ * ascending order, in one pass over the buffer pool: each of them is
+ * written out if dirty and invalidated, so that it can be reused by the
+ * other databases at once. The number of the buffers released for dbids[i]
+ * is stored into released[i].
+ *
+ * This must be called only after all the backends of the databases have
+ * gone. The pinned buffers are skipped. EvictUnpinnedBuffer() is needed
+ * for this; before PostgreSQL 17 the buffers are only written out, as
+ * DropDatabaseBuffers() would discard the pages dirtied meanwhile by e.g.
+ * autovacuum, and released[i] is set to -1.
+ */
+void
+sddb_release_buffers(const Oid *dbids, const int ndbids, int *released)
+{
+#if PG_VERSION_NUM >= 170000
+	TimestampTz start;
+	int			nwritten = 0;
+	int			i;
+
+	memset(released, 0, sizeof(int) * ndbids);
+
+	if (ndbids == 0)
+		return;
+
+	start = GetCurrentTimestamp();
+
+	for (i = 0; i < NBuffers; i++)
+	{
+		BufferDesc *bufHdr = GetBufferDescriptor(i);
+		uint32		buf_state;
+		bool		flushed = false;
+		const Oid  *dbid;
+
+		/* Unlocked precheck; EvictUnpinnedBuffer() checks it again */
+		buf_state = pg_atomic_read_u32(&bufHdr->state);
+		if (!(buf_state & BM_VALID))
+			continue;
+
+		dbid = (const Oid *) bsearch(&bufHdr->tag.dbOid, dbids, ndbids,
+									 sizeof(Oid), sddb_oid_cmp);
+		if (dbid == NULL)
+			continue;
+
+#if PG_VERSION_NUM >= 180000
+		if (!EvictUnpinnedBuffer(BufferDescriptorGetBuffer(bufHdr), &flushed))
+			continue;
+#else
+		flushed = (buf_state & BM_DIRTY) != 0;
+		if (!EvictUnpinnedBuffer(BufferDescriptorGetBuffer(bufHdr)))
+			continue;
+#endif
+		released[dbid - dbids]++;
+
+		/* The same throttling as sddb_flush_buffers() */
+		if (flushed && ++nwritten % SDDB_FLUSH_BATCH_SIZE == 0)
+			throttle(start, nwritten, sddb_flush_rate_limit);
+	}
+#else
+	int			i;
+
+	(void) sddb_flush_buffers(dbids, ndbids);
+
+	for (i = 0; i < ndbids; i++)
+		released[i] = -1;
+#endif
+}
+
+/*
+ * Order the block records by usage count in descending order, so that the
+ * hot pages are prewarmed first, and then by file, fork and block, so that
+ * they are read sequentially.
+ */
+static int
+block_record_cmp(const void *p1, const void *p2)
+{
+	const sddbBlockRecord *a = (const sddbBlockRecord *) p1;
+	const sddbBlockRecord *b = (const sddbBlockRecord *) p2;
+
+#define cmp_member_elem(m, desc) \
+	do { \
+		if (a->m < b->m) \
+			return (desc) ? 1 : -1; \
+		else if (a->m > b->m) \
+			return (desc) ? -1 : 1; \
+	} while (0)
+
+	cmp_member_elem(usage_count, true);
+	cmp_member_elem(tablespace, false);
+	cmp_member_elem(filenumber, false);
+	cmp_member_elem(forknum, false);
+	cmp_member_elem(blocknum, false);
+
+#undef cmp_member_elem
+
+	return 0;
+}
+
+/*
+ * Dump the block list of the buffers of the database whose id is dbid, in
+ * the same spirit as the autoprewarm dump of pg_prewarm. This is called by
+ * the supervisor process after all the backends of the database have gone,
+ * and before its buffers are released.
+ *
+ * Returns the number of the blocks dumped, or -1 on failure.
+ */
+int
+sddb_dump_blocks(const Oid dbid)
+{
+	char		path[MAXPGPATH];
+	char		tmppath[MAXPGPATH];
+	sddbBlockRecord *records;
+	FILE	   *file;
+	int32		num = 0;
+	int			i;
+
+	snprintf(path, sizeof(path), SDDB_BLOCK_FILE_FORMAT, dbid);
+	snprintf(tmppath, sizeof(tmppath), "%s.tmp", path);
+
+	records = (sddbBlockRecord *)
+		palloc_extended((Size) NBuffers * sizeof(sddbBlockRecord), MCXT_ALLOC_HUGE);
+
+	for (i = 0; i < NBuffers; i++)
+	{
+		BufferDesc *bufHdr = GetBufferDescriptor(i);
+		uint32		buf_state;
+
+		CHECK_FOR_INTERRUPTS();
+
+		buf_state = LockBufHdr(bufHdr);
+
+#if PG_VERSION_NUM >= 160000
+		if ((buf_state & BM_TAG_VALID) && (buf_state & BM_VALID) &&
+			bufHdr->tag.dbOid == dbid)
+		{
+			records[num].tablespace = bufHdr->tag.spcOid;
+			records[num].filenumber = BufTagGetRelNumber(&bufHdr->tag);
+			records[num].forknum = BufTagGetForkNum(&bufHdr->tag);
+#else
+		if ((buf_state & BM_TAG_VALID) && (buf_state & BM_VALID) &&
+			bufHdr->tag.rnode.dbNode == dbid)
+		{
+			records[num].tablespace = bufHdr->tag.rnode.spcNode;
+			records[num].filenumber = bufHdr->tag.rnode.relNode;
+			records[num].forknum = bufHdr->tag.forkNum;
+#endif
+			records[num].blocknum = bufHdr->tag.blockNum;
+			records[num].usage_count = BUF_STATE_GET_USAGECOUNT(buf_state);
+			num++;
+		}
+
+		UnlockBufHdr(bufHdr, buf_state);
+	}
+
+	qsort(records, num, sizeof(sddbBlockRecord), block_record_cmp);
+
+	file = AllocateFile(tmppath, PG_BINARY_W);
+	if (file == NULL)
+		goto error;
+
+	if (fwrite(&SDDB_BLOCK_FILE_HEADER, sizeof(uint32), 1, file) != 1 ||
+		fwrite(&SDDB_BLOCK_FILE_VERSION, sizeof(uint32), 1, file) != 1 ||
+		fwrite(&num, sizeof(int32), 1, file) != 1)
+		goto error;
+
+	if (num > 0 && fwrite(records, sizeof(sddbBlockRecord), num, file) != num)
+		goto error;
+
+	if (FreeFile(file))
+	{
+		file = NULL;
+		goto error;
+	}
+
+	(void) durable_rename(tmppath, path, WARNING);
+
+	pfree(records);
+
+	return num;
+
+error:
+	ereport(WARNING,
+			(errcode_for_file_access(),
+			 errmsg("could not write file \"%s\": %m", tmppath)));
+	if (file)
+		FreeFile(file);
+	unlink(tmppath);
+	pfree(records);
+
+	return -1;
+}
+
+/*
+ * Whether the block list of the database whose id is dbid has been dumped.
+ */
+bool
+sddb_has_block_dump(const Oid dbid)
+{
+	char		path[MAXPGPATH];
+	struct stat st;
+
+	snprintf(path, sizeof(path), SDDB_BLOCK_FILE_FORMAT, dbid);
+
+	return (stat(path, &st) == 0);
+}
+
+/*
+ * Read the blocks of records[0 .. n-1], which belong to the same relation
+ * file, into the buffers, in a transaction. Returns false if the prewarm
+ * should be stopped, i.e. the database has been shut down again.
+ */
+static bool
+prewarm_run(const sddbBlockRecord * records, const int n,
+			TimestampTz start, int *nread)
+{
+	Relation	rel;
+	Oid			reloid;
+	int32		forknum = InvalidForkNumber;
+	BlockNumber nblocks = 0;
+	int			i;
+
+	/* The database has been shut down again; leave it */
+	if (sddb_find_entry(MyDatabaseId, false))
+		return false;
+
+	StartTransactionCommand();
+
+#if PG_VERSION_NUM >= 160000
+	reloid = RelidByRelfilenumber(records[0].tablespace, records[0].filenumber);
+#else
+	reloid = RelidByRelfilenode(records[0].tablespace, records[0].filenumber);
+#endif
+	if (!OidIsValid(reloid) ||
+		(rel = try_relation_open(reloid, AccessShareLock)) == NULL)
+	{
+		/* The relation has been dropped or rewritten */
+		CommitTransactionCommand();
+		return true;
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		Buffer		buf;
+
+		CHECK_FOR_INTERRUPTS();
+
+		if (records[i].forknum != forknum)
+		{
+			forknum = records[i].forknum;
+			nblocks = 0;
+			if (forknum > InvalidForkNumber && forknum <= MAX_FORKNUM)
+			{
+#if PG_VERSION_NUM >= 150000
+				SMgrRelation reln = RelationGetSmgr(rel);
+#else
+				SMgrRelation reln;
+
+				RelationOpenSmgr(rel);
+				reln = rel->rd_smgr;
+#endif
+				if (smgrexists(reln, forknum))
+					nblocks = RelationGetNumberOfBlocksInFork(rel, forknum);
+			}
+		}
+
+		/* The relation may have been truncated */
+		if (records[i].blocknum >= nblocks)
+			continue;
+
+		buf = ReadBufferExtended(rel, forknum, records[i].blocknum,
+								 RBM_NORMAL, NULL);
+		ReleaseBuffer(buf);
+
+		if (++(*nread) % SDDB_FLUSH_BATCH_SIZE == 0)
+			throttle(start, *nread, sddb_prewarm_rate_limit);
+	}
+
+	relation_close(rel, AccessShareLock);
+	CommitTransactionCommand();
+
+	return true;
+}
+
+/*
+ * Prewarm the buffers of the database this process is connected to, from
+ * the block list dumped by sddb_dump_blocks(), in the order of the list.
+ * The reads are throttled by shutdown_db.prewarm_rate_limit, pages per
+ * second, so that the other databases don't suffer from the I/O.
+ *
+ * The dump is removed afterwards. Returns the number of the blocks read.
+ */
+int
+sddb_prewarm_blocks(void)
+{
+	char		path[MAXPGPATH];
+	sddbBlockRecord *records;
+	FILE	   *file;
+	uint32		header;
+	uint32		version;
+	int32		num;
+	TimestampTz start;
+	int			nread = 0;
+	int			i,
+				j;
+
+	snprintf(path, sizeof(path), SDDB_BLOCK_FILE_FORMAT, MyDatabaseId);
+
+	file = AllocateFile(path, PG_BINARY_R);
+	if (file == NULL)
+	{
+		if (errno != ENOENT)
+			ereport(LOG,
+					(errcode_for_file_access(),
+					 errmsg("could not read file \"%s\": %m", path)));
+		return 0;
+	}
+
+	if (fread(&header, sizeof(uint32), 1, file) != 1 ||
+		fread(&version, sizeof(uint32), 1, file) != 1 ||
+		fread(&num, sizeof(int32), 1, file) != 1 ||
+		header != SDDB_BLOCK_FILE_HEADER ||
+		version != SDDB_BLOCK_FILE_VERSION ||
+		num < 0 || num > NBuffers)
+	{
+		ereport(LOG,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("ignoring invalid data in file \"%s\"", path)));
+		FreeFile(file);
+		unlink(path);
+		return 0;
+	}
+
+	records = (sddbBlockRecord *)
+		palloc_extended((Size) Max(num, 1) * sizeof(sddbBlockRecord), MCXT_ALLOC_HUGE);
+	if (num > 0 && fread(records, sizeof(sddbBlockRecord), num, file) != num)
+	{
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not read file \"%s\": %m", path)));
+		num = 0;
+	}
+	FreeFile(file);
+
+	/* The list is consumed even if the prewarm is stopped */
+	unlink(path);
+
+	start = GetCurrentTimestamp();
+
+	for (i = 0; i < num; i = j)
+	{
+		/* Find the run of the records of the same relation file */
+		for (j = i + 1; j < num; j++)
+			if (records[j].tablespace != records[i].tablespace ||
+				records[j].filenumber != records[i].filenumber)
+				break;
+
+		if (!prewarm_run(&records[i], j - i, start, &nread))
+			break;
+	}
+
+	pfree(records);
+
+	return nread;
+}
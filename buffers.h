@@ -0,0 +1,23 @@
+/*-------------------------------------------------------------------------
+ * buffers.h
+ *
+ * Copyright (c) 2008-2025, PostgreSQL Global Development Group
+ * Copyright (c) 2020-2025, hironobu suzuki@interdb.jp
+ *-------------------------------------------------------------------------
+ */
+#ifndef __BUFFERS_H__
+#define __BUFFERS_H__
+
+/*
+ * Function declarations
+ */
+int			sddb_flush_buffers(const Oid *dbids, const int ndbids);
+int			sddb_dirty_buffers_percent(void);
+int			sddb_count_dirty_buffers(const Oid dbid);
+void		sddb_release_buffers(const Oid *dbids, const int ndbids,
+								 int *released);
+int			sddb_dump_blocks(const Oid dbid);
+bool		sddb_has_block_dump(const Oid dbid);
+int			sddb_prewarm_blocks(void);
+
+#endif
@@ -7,22 +7,78 @@
  */
 #include "postgres.h"
 
+#include "access/xact.h"
+#include "access/xlog.h"
 #include "catalog/pg_authid.h"
+#include "catalog/pg_type.h"
+#include "commands/dbcommands.h"
+#include "executor/spi.h"
 #include "funcapi.h"
 #include "miscadmin.h"
-#include "executor/spi.h"
+#include "nodes/makefuncs.h"
+#include "postmaster/bgwriter.h"
 #include "utils/acl.h"
+#include "utils/array.h"
 #include "utils/builtins.h"
+#include "utils/timestamp.h"
 #include "pgstat.h"
 
 #include "shutdown_db.h"
+#include "backends.h"
+#include "bgworker.h"
+#include "buffers.h"
+#include "functions.h"
 #include "hashtable.h"
+#include "scheduler.h"
+#include "statefile.h"
+#include "stats.h"
+#include "wal.h"
+
+/*
+ * Define constants
+ */
+#define SHUTDOWN_DB_RESULT_COLS	 3
+#define SHUTDOWN_DB_STATS_COLS	 21
+#define SHUTDOWN_DB_JOBS_COLS	 10
+#define SHUTDOWN_DB_ROLES_COLS	 8
+#define SHUTDOWN_DB_PLAN_COLS	 9
+#define SHUTDOWN_DB_PLAN_SUMMARY_COLS	 14
+#define SHUTDOWN_DB_PROGRESS_COLS	 11
+
+/*
+ * Results of the shutdown and startup commands for each database
+ */
+enum result
+{
+	RESULT_DONE = 0,			/* shutdown or started up */
+	RESULT_NOT_ALLOWED,			/* postgres, template0 or template1 */
+	RESULT_NOT_FOUND,			/* no such database */
+	RESULT_ALREADY,				/* already shutdown or already started */
+	RESULT_FULL					/* hash table is full */
+};
+
+/*
+ * A database to be shut down or started up
+ */
+typedef struct sddbTarget
+{
+	char	   *dbname;
+	Oid			dbid;
+	int			result;			/* enum result */
+}			sddbTarget;
 
 /*
  * extern variables
  */
 extern sddbSharedState * sddb;
-extern HTAB *sddb_hash;
+extern int	sddb_connection_gate;
+extern int	sddb_abort_flush;
+extern bool sddb_buffer_release;
+extern bool sddb_prewarm;
+extern int	sddb_autovacuum_policy;
+extern bool sddb_block_autovacuum;
+extern bool sddb_keep_walsenders;
+extern int	sddb_flush_rate_limit;
 
 /*
  * Function declarations
@@ -32,24 +88,120 @@ Datum		shutdown_transactional(PG_FUNCTION_ARGS);
 Datum		shutdown_immediate(PG_FUNCTION_ARGS);
 Datum		shutdown_abort(PG_FUNCTION_ARGS);
 Datum		shutdown_normal(PG_FUNCTION_ARGS);
+Datum		startup_array(PG_FUNCTION_ARGS);
+Datum		shutdown_transactional_array(PG_FUNCTION_ARGS);
+Datum		shutdown_immediate_array(PG_FUNCTION_ARGS);
+Datum		shutdown_abort_array(PG_FUNCTION_ARGS);
+Datum		shutdown_normal_array(PG_FUNCTION_ARGS);
+Datum		throttle_db(PG_FUNCTION_ARGS);
+Datum		suspend_db(PG_FUNCTION_ARGS);
 Datum		sddb_show_db(PG_FUNCTION_ARGS);
+Datum		sddb_kill_processes(PG_FUNCTION_ARGS);
+Datum		sddb_stats(PG_FUNCTION_ARGS);
+Datum		sddb_stats_reset_all(PG_FUNCTION_ARGS);
+Datum		shutdown_transactional_wait(PG_FUNCTION_ARGS);
+Datum		shutdown_immediate_wait(PG_FUNCTION_ARGS);
+Datum		shutdown_abort_wait(PG_FUNCTION_ARGS);
+Datum		shutdown_normal_wait(PG_FUNCTION_ARGS);
+Datum		sddb_wait(PG_FUNCTION_ARGS);
+Datum		sddb_schedule(PG_FUNCTION_ARGS);
+Datum		sddb_jobs(PG_FUNCTION_ARGS);
+Datum		sddb_cancel_jobs(PG_FUNCTION_ARGS);
+Datum		shutdown_role(PG_FUNCTION_ARGS);
+Datum		startup_role(PG_FUNCTION_ARGS);
+Datum		sddb_show_roles(PG_FUNCTION_ARGS);
+Datum		sddb_plan(PG_FUNCTION_ARGS);
+Datum		sddb_plan_summary(PG_FUNCTION_ARGS);
+Datum		sddb_progress(PG_FUNCTION_ARGS);
+Datum		sddb_import_catalog(PG_FUNCTION_ARGS);
 
 PG_FUNCTION_INFO_V1(startup);
 PG_FUNCTION_INFO_V1(shutdown_transactional);
 PG_FUNCTION_INFO_V1(shutdown_immediate);
 PG_FUNCTION_INFO_V1(shutdown_abort);
 PG_FUNCTION_INFO_V1(shutdown_normal);
+PG_FUNCTION_INFO_V1(startup_array);
+PG_FUNCTION_INFO_V1(shutdown_transactional_array);
+PG_FUNCTION_INFO_V1(shutdown_immediate_array);
+PG_FUNCTION_INFO_V1(shutdown_abort_array);
+PG_FUNCTION_INFO_V1(shutdown_normal_array);
+PG_FUNCTION_INFO_V1(throttle_db);
+PG_FUNCTION_INFO_V1(suspend_db);
 PG_FUNCTION_INFO_V1(sddb_show_db);
+PG_FUNCTION_INFO_V1(sddb_kill_processes);
+PG_FUNCTION_INFO_V1(sddb_stats);
+PG_FUNCTION_INFO_V1(sddb_stats_reset_all);
+PG_FUNCTION_INFO_V1(shutdown_transactional_wait);
+PG_FUNCTION_INFO_V1(shutdown_immediate_wait);
+PG_FUNCTION_INFO_V1(shutdown_abort_wait);
+PG_FUNCTION_INFO_V1(shutdown_normal_wait);
+PG_FUNCTION_INFO_V1(sddb_wait);
+PG_FUNCTION_INFO_V1(sddb_schedule);
+PG_FUNCTION_INFO_V1(sddb_jobs);
+PG_FUNCTION_INFO_V1(sddb_cancel_jobs);
+PG_FUNCTION_INFO_V1(shutdown_role);
+PG_FUNCTION_INFO_V1(startup_role);
+PG_FUNCTION_INFO_V1(sddb_show_roles);
+PG_FUNCTION_INFO_V1(sddb_plan);
+PG_FUNCTION_INFO_V1(sddb_plan_summary);
+PG_FUNCTION_INFO_V1(sddb_progress);
+PG_FUNCTION_INFO_V1(sddb_import_catalog);
 
 static bool is_allowed_role(void);
 static void check_workenv(void);
-static bool check_dbname(char *dbname);
-static Oid	get_dbid(char *dbname, StringInfoData *buf);
-static bool do_alter_database(char *dbname, const bool set, StringInfoData *buf);
-static bool kill_pids(const Oid dbid, const bool idle, StringInfoData *buf);
-static bool do_checkpoint(StringInfoData *buf);
-static bool run_sddb_killer(const Oid dbid, StringInfoData *buf);
-static bool kill_bgworker(const pid_t pid, StringInfoData *buf);
+static bool check_dbname(const char *dbname);
+static void get_dbids(sddbTarget * targets, const int n);
+static bool do_alter_database(const char *dbname, const bool set);
+static int	policy_flags(void);
+static bool kill_pids(const Oid *dbids, const int ndbids, const bool idle,
+					  const int flags);
+static void start_progress(const Oid *dbids, const int ndbids, const int mode,
+						   const int flags);
+static void set_progress(const Oid *dbids, const int ndbids, const int phase);
+static bool do_checkpoint(void);
+static bool run_sddb_killer(void);
+static sddbTarget * get_target(FunctionCallInfo fcinfo);
+static sddbTarget * get_targets(FunctionCallInfo fcinfo, int *n);
+static TimestampTz get_deadline(FunctionCallInfo fcinfo);
+static void do_shutdown(sddbTarget * targets, const int n, const int mode,
+						const TimestampTz deadline, const int abort_flush);
+static void do_startup(sddbTarget * targets, const int n);
+static void do_shutdown_role(sddbTarget * target, const char *rolname,
+							 const int mode);
+static void do_startup_role(sddbTarget * target, const char *rolname);
+static void do_restrict(sddbTarget * target, const int mode,
+						const int max_active);
+static void report_shutdown(const sddbTarget * target, const int mode);
+static void report_startup(const sddbTarget * target);
+static Datum return_results(FunctionCallInfo fcinfo, const sddbTarget * targets,
+							const int n, const bool is_startup);
+static Tuplestorestate *begin_srf(FunctionCallInfo fcinfo, TupleDesc *tupdesc);
+static Datum shutdown_one(FunctionCallInfo fcinfo, const int mode);
+static Datum shutdown_many(FunctionCallInfo fcinfo, const int mode);
+static Datum shutdown_one_wait(FunctionCallInfo fcinfo, const int mode,
+							   const TimestampTz deadline, const bool wait);
+static Datum wait_drained(FunctionCallInfo fcinfo, const sddbTarget * target,
+						  const long timeout_ms);
+static const char *mode_name(const int mode);
+static const char *mode_label(const int mode);
+static int	parse_mode(const char *name);
+static const char *result_label(const int result, const bool is_startup);
+static const char *job_state_label(const int state);
+static const char *plan_action_label(const int action);
+static const char *phase_label(const int phase);
+static const char *backend_state_label(const int state);
+static const char *backend_type_label(const int backend_type);
+static char *entry_datname(const sddbEntry * entry);
+static char *entry_rolname(const sddbEntry * entry);
+static int	get_plan(FunctionCallInfo fcinfo, sddbTarget * *target, int *mode,
+					 sddbPlanItem * *items);
+static Datum interval_datum(const int64 usecs);
+static int	entry_cmp(const void *p1, const void *p2);
+static int	remove_role_entries(sddbEntry * entries, const int num,
+								const bool keep_roles);
+static int	stats_entry_cmp(const void *p1, const void *p2);
+static void put_counters(const sddbStatsCounters * counters, Datum *values,
+						 bool *nulls, int *j);
 
 /*
  * Check privilege
@@ -78,491 +230,1049 @@ static void
 check_workenv(void)
 {
 	/* hash table must exist already */
-	if (!sddb || !sddb_hash)
+	if (!sddb_attach_table())
 		ereport(ERROR,
 				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
 				 errmsg("shutdown_db must be loaded via shared_preload_libraries")));
 }
 
 /*
- * Check dbname NOT IN (postgres, template1, template0) and EXISTS
+ * Check dbname NOT IN (postgres, template1, template0)
  */
 static bool
-check_dbname(char *dbname)
+check_dbname(const char *dbname)
 {
 	if (pg_strcasecmp(dbname, "postgres") == 0
 		|| pg_strcasecmp(dbname, "template0") == 0
 		|| pg_strcasecmp(dbname, "template1") == 0)
-	{
-		pfree(dbname);
 		return false;
-	}
 	return true;
 }
 
-#define terminate_procedure(dbname) \
-	do {						  \
-	pfree(dbname);				  \
-	SPI_finish();}				  \
-	while (0)
-
 /*
- * Get dbid by database name
+ * Get the dbids of targets[0 .. n-1] by database name, via the syscache.
+ * If a database is not found, its result is set to RESULT_NOT_FOUND.
  */
-static Oid
-get_dbid(char *dbname, StringInfoData *buf)
+static void
+get_dbids(sddbTarget * targets, const int n)
 {
-	int			ret;
-	Oid			dbid;
-	bool		isnull;
-
-	appendStringInfo(buf, "SELECT oid FROM pg_database WHERE datname = %s;",
-					 quote_literal_cstr(dbname));
+	int			i;
 
-	ret = SPI_execute(buf->data, true, 0);
-	if (ret != SPI_OK_SELECT)
-	{
-		terminate_procedure(dbname);
-		elog(FATAL, "SPI_execute failed: error code %d", ret);
-	}
-	if (SPI_processed == 0)
-	{
-		terminate_procedure(dbname);
-		elog(ERROR, "Database %s not found.", dbname);
-	}
-	else if (SPI_processed != 1)
+	for (i = 0; i < n; i++)
 	{
-		terminate_procedure(dbname);
-		elog(ERROR, "%s is not valid name.", dbname);
-	}
+		targets[i].dbid = get_database_oid(targets[i].dbname, true);
 
-	dbid = DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[0],
-									   SPI_tuptable->tupdesc,
-									   1, &isnull));
-
-	if (isnull)
-	{
-		terminate_procedure(dbname);
-		elog(FATAL, "null result");
+		if (targets[i].result == RESULT_DONE && !OidIsValid(targets[i].dbid))
+			targets[i].result = RESULT_NOT_FOUND;
 	}
-	return dbid;
 }
 
 /*
  * Excute ALTER DATABASE ALLOW_CONNECTIONS command
  */
 static bool
-do_alter_database(char *dbname, const bool set, StringInfoData *buf)
+do_alter_database(const char *dbname, const bool set)
 {
-	int			ret;
+	AlterDatabaseStmt *stmt = makeNode(AlterDatabaseStmt);
+	DefElem    *option;
+
+#if PG_VERSION_NUM >= 100000
+	option = makeDefElem("allow_connections", (Node *) makeInteger(set ? 1 : 0), -1);
+#else
+	option = makeDefElem("allow_connections", (Node *) makeInteger(set ? 1 : 0));
+#endif
 
-	appendStringInfo(buf, "ALTER DATABASE %s ALLOW_CONNECTIONS %s;",
-					 dbname,
-					 (set) ? "true" : "false");
-	ret = SPI_execute(buf->data, false, 0);
+	stmt->dbname = pstrdup(dbname);
+	stmt->options = list_make1(option);
 
-	if (ret != SPI_OK_UTILITY)
-	{
-		terminate_procedure(dbname);
-		elog(FATAL, "failed to alter database");
-	}
+	AlterDatabase(NULL, stmt, false);
+
+	/* Make the change visible to the following commands */
+	CommandCounterIncrement();
 
 	return true;
 }
 
 
 /*
- * Execute the sddb_kill_processes function defined in the bgworker.c
+ * Return the policy flags for the autovacuum workers and the logical
+ * walsenders, SDDB_FLAG_AUTOVAC_*, SDDB_FLAG_BLOCK_AUTOVAC and
+ * SDDB_FLAG_KEEP_WALSENDERS, set by the parameters of this session.
+ */
+static int
+policy_flags(void)
+{
+	int			flags = 0;
+
+	if (sddb_autovacuum_policy == AUTOVAC_FINISH)
+		flags |= SDDB_FLAG_AUTOVAC_FINISH;
+	else if (sddb_autovacuum_policy == AUTOVAC_SKIP)
+		flags |= SDDB_FLAG_AUTOVAC_SKIP;
+	if (sddb_block_autovacuum)
+		flags |= SDDB_FLAG_BLOCK_AUTOVAC;
+	if (sddb_keep_walsenders)
+		flags |= SDDB_FLAG_KEEP_WALSENDERS;
+
+	return flags;
+}
+
+/*
+ * Kill the backend processes corresponding to dbids[0 .. ndbids-1] in one
+ * pass, with the policy flags `flags`; see sddb_kill_backends_multi().
  */
 static bool
-kill_pids(const Oid dbid, const bool idle, StringInfoData *buf)
+kill_pids(const Oid *dbids, const int ndbids, const bool idle, const int flags)
 {
-	int			ret;
+	Oid		   *sorted;
+	int		   *num_running;
+	int		   *sorted_flags;
+	int			i;
 
-	appendStringInfo(buf, "SELECT %s.sddb_kill_processes(%d, %s);",
-					 SCHEMA, dbid, (idle == true) ? "true" : "false");
+	if (ndbids == 0)
+		return true;
 
-	ret = SPI_execute(buf->data, true, 0);
-	if (ret != SPI_OK_SELECT)
-	{
-		SPI_finish();
-		elog(FATAL, "SPI_execute failed: error code %d", ret);
-	}
+	sorted = (Oid *) palloc(sizeof(Oid) * ndbids);
+	memcpy(sorted, dbids, sizeof(Oid) * ndbids);
+	qsort(sorted, ndbids, sizeof(Oid), sddb_oid_cmp);
+
+	/* All of them have the same flags */
+	sorted_flags = (int *) palloc(sizeof(int) * ndbids);
+	for (i = 0; i < ndbids; i++)
+		sorted_flags[i] = flags;
+
+	num_running = (int *) palloc(sizeof(int) * ndbids);
+	sddb_kill_backends_multi(sorted, ndbids, idle, sorted_flags, num_running);
+
+	pfree(sorted);
+	pfree(sorted_flags);
+	pfree(num_running);
 
 	return true;
 }
 
 /*
- * Execute CHECKPOINT command
+ * Start reporting the progress of the drains of dbids[0 .. ndbids-1] just
+ * shut down in `mode` with the policy flags `flags`: count their backend
+ * processes in one pass, and set the first phase after the gating.
  */
-static bool
-do_checkpoint(StringInfoData *buf)
+static void
+start_progress(const Oid *dbids, const int ndbids, const int mode,
+			   const int flags)
 {
-	int			ret;
+	Oid		   *sorted;
+	int		   *sorted_flags;
+	int		   *counts;
+	int			phase;
+	int			i;
+
+	if (ndbids == 0)
+		return;
+
+	sorted = (Oid *) palloc(sizeof(Oid) * ndbids);
+	memcpy(sorted, dbids, sizeof(Oid) * ndbids);
+	qsort(sorted, ndbids, sizeof(Oid), sddb_oid_cmp);
+
+	/* All of them have the same flags */
+	sorted_flags = (int *) palloc(sizeof(int) * ndbids);
+	for (i = 0; i < ndbids; i++)
+		sorted_flags[i] = flags;
 
-	appendStringInfo(buf, "CHECKPOINT;");
-	ret = SPI_execute(buf->data, false, 0);
+	counts = (int *) palloc(sizeof(int) * ndbids);
+	sddb_count_backends_multi(sorted, ndbids, sorted_flags, counts);
 
-	if (ret != SPI_OK_UTILITY)
+	switch (mode)
 	{
-		SPI_finish();
-		elog(FATAL, "failed to checkpoint");
+		case NORMAL:
+			phase = PHASE_WAITING_SESSIONS;
+			break;
+		case TRANSACTIONAL:
+			phase = PHASE_WAITING;
+			break;
+		default:
+			phase = PHASE_TERMINATING;
+			break;
 	}
 
+	for (i = 0; i < ndbids; i++)
+		sddb_set_progress(sorted[i], phase, counts[i], -1);
+
+	pfree(sorted);
+	pfree(sorted_flags);
+	pfree(counts);
+}
+
+/*
+ * Set the phase of the drains of dbids[0 .. ndbids-1].
+ */
+static void
+set_progress(const Oid *dbids, const int ndbids, const int phase)
+{
+	int			i;
+
+	for (i = 0; i < ndbids; i++)
+		sddb_set_progress(dbids[i], phase, -1, -1);
+}
+
+/*
+ * Execute CHECKPOINT command, with the same privilege check.
+ */
+static bool
+do_checkpoint(void)
+{
+#if PG_VERSION_NUM >= 150000
+	if (!has_privs_of_role(GetUserId(), ROLE_PG_CHECKPOINT))
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("must be superuser or have privileges of pg_checkpoint to do CHECKPOINT")));
+#else
+	if (!superuser())
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("must be superuser to do CHECKPOINT")));
+#endif
+
+	RequestCheckpoint(CHECKPOINT_IMMEDIATE | CHECKPOINT_WAIT |
+					  (RecoveryInProgress() ? 0 : CHECKPOINT_FORCE));
+
 	return true;
 }
 
 /*
- * Run the killer process (bgworker).
+ * Ask the supervisor process (bgworker) to serve the stored entries.
  */
 static bool
-run_sddb_killer(const Oid dbid, StringInfoData *buf)
+run_sddb_killer(void)
 {
-	int			ret;
+	if (sddb_supervisor_pid() == InvalidPid)
+		ereport(WARNING,
+				(errmsg("shutdown_db supervisor process is not running"),
+				 errdetail("The database will be served after the supervisor process is restarted.")));
 
-	appendStringInfo(buf,
-					 "SELECT %s.sddb_killer_launch(%d);",
-					 SCHEMA,
-					 dbid);
+	sddb_supervisor_wakeup();
 
-	ret = SPI_execute(buf->data, true, 0);
-	if (ret != SPI_OK_SELECT)
+	return true;
+}
+
+/*
+ * Return the name of the mode for logging.
+ */
+static const char *
+mode_name(const int mode)
+{
+	switch (mode)
 	{
-		SPI_finish();
-		elog(FATAL, "SPI_execute failed: error code %d", ret);
-		return false;
+		case NORMAL:
+			return "Normal";
+		case ABORT:
+			return "Abort";
+		case IMMEDIATE:
+			return "Immediate";
+		case TRANSACTIONAL:
+			return "Transactional";
+		case THROTTLED:
+			return "Throttled";
+		case SUSPENDED:
+			return "Suspended";
+		default:
+			return "Init";
 	}
-	return true;
 }
 
 /*
- * Kill the process(pid).
+ * Return the mode given by its name, e.g. 'transactional', to
+ * shutdown_db.schedule() and shutdown_db.shutdown_role(); -1 if unknown.
  */
-static bool
-kill_bgworker(const pid_t pid, StringInfoData *buf)
+static int
+parse_mode(const char *name)
 {
-	int			ret;
+	if (pg_strcasecmp(name, "normal") == 0)
+		return NORMAL;
+	if (pg_strcasecmp(name, "abort") == 0)
+		return ABORT;
+	if (pg_strcasecmp(name, "immediate") == 0)
+		return IMMEDIATE;
+	if (pg_strcasecmp(name, "transactional") == 0)
+		return TRANSACTIONAL;
+	return -1;
+}
 
-	appendStringInfo(buf, "SELECT pg_terminate_backend(%d);", pid);
+/*
+ * Return the result of a shutdown or a startup shown by the functions
+ * taking an array of database names and by shutdown_db.jobs.
+ */
+static const char *
+result_label(const int result, const bool is_startup)
+{
+	switch (result)
+	{
+		case RESULT_DONE:
+			return (is_startup) ? "started" : "shutdown";
+		case RESULT_NOT_ALLOWED:
+			return "not allowed";
+		case RESULT_NOT_FOUND:
+			return "not found";
+		case RESULT_ALREADY:
+			return (is_startup) ? "already started" : "already shutdown";
+		default:
+			return "hash table is full";
+	}
+}
 
-	ret = SPI_execute(buf->data, true, 0);
-	if (ret != SPI_OK_SELECT)
-		elog(FATAL, "SPI_execute failed: error code %d", ret);
+/*
+ * Return the state of a job shown in shutdown_db.jobs.
+ */
+static const char *
+job_state_label(const int state)
+{
+	switch (state)
+	{
+		case JOB_QUEUED:
+			return "queued";
+		case JOB_RUNNING:
+			return "running";
+		case JOB_DONE:
+			return "done";
+		case JOB_SKIPPED:
+			return "skipped";
+		case JOB_FAILED:
+			return "failed";
+		default:
+			return "canceled";
+	}
+}
 
-	return true;
+/*
+ * Return what a shutdown would do with a backend process, shown by
+ * shutdown_db.plan().
+ */
+static const char *
+plan_action_label(const int action)
+{
+	switch (action)
+	{
+		case PLAN_NONE:
+			return "none";
+		case PLAN_TERMINATE:
+			return "terminate";
+		case PLAN_CANCEL:
+			return "cancel";
+		case PLAN_WAIT:
+			return "wait";
+		default:
+			return "ignore";
+	}
 }
 
 /*
- * SHUTDOWN and STARTUP commands
+ * Return the phase of a drain shown in shutdown_db.progress.
  */
-Datum
-shutdown_normal(PG_FUNCTION_ARGS)
+static const char *
+phase_label(const int phase)
 {
-	Oid			dbid;
-	char	   *dbname;
-	StringInfoData buf;
+	switch (phase)
+	{
+		case PHASE_GATING:
+			return "gating";
+		case PHASE_CANCELLING:
+			return "cancelling";
+		case PHASE_WAITING:
+			return "waiting for transactions";
+		case PHASE_WAITING_SESSIONS:
+			return "waiting for sessions";
+		case PHASE_TERMINATING:
+			return "terminating";
+		case PHASE_FLUSHING:
+			return "flushing";
+		case PHASE_RELEASING:
+			return "releasing buffers";
+		default:
+			return "done";
+	}
+}
 
-	check_workenv();
+/*
+ * Return the state of a backend process, as pg_stat_activity shows it.
+ */
+static const char *
+backend_state_label(const int state)
+{
+	switch (state)
+	{
+		case STATE_IDLE:
+			return "idle";
+		case STATE_RUNNING:
+			return "active";
+		case STATE_IDLEINTRANSACTION:
+			return "idle in transaction";
+		case STATE_FASTPATH:
+			return "fastpath function call";
+		case STATE_IDLEINTRANSACTION_ABORTED:
+			return "idle in transaction (aborted)";
+		case STATE_DISABLED:
+			return "disabled";
+		default:
+			return NULL;
+	}
+}
 
-	if (!is_allowed_role())
-		elog(ERROR, "You cannot execute this function because of no-privilege.");
+/*
+ * Return the type of a backend process, as pg_stat_activity shows it, or
+ * NULL if unknown.
+ */
+static const char *
+backend_type_label(const int backend_type)
+{
+	if (backend_type < 0)
+		return NULL;
+#if PG_VERSION_NUM >= 130000
+	return GetBackendTypeDesc((BackendType) backend_type);
+#elif PG_VERSION_NUM >= 100000
+	return pgstat_get_backend_desc((BackendType) backend_type);
+#else
+	return NULL;
+#endif
+}
 
-	/* Get database name */
-	dbname = text_to_cstring(PG_GETARG_TEXT_PP(0));
+/*
+ * Return the current name of the database of the entry, looked up by its
+ * dbid, so that a rename is shown even where the stored name is stale,
+ * e.g. on a hot standby; the stored name if the database has gone.
+ */
+static char *
+entry_datname(const sddbEntry * entry)
+{
+	char	   *datname = get_database_name(entry->dbid);
 
-	if (!check_dbname(dbname))
-		elog(ERROR, "%s cannot be shutdown.", dbname);
+	return datname ? datname : pstrdup(NameStr(entry->datname));
+}
 
-	/* Connect SPI */
-	SPI_connect();
+/*
+ * Same as entry_datname(), but for the role of the entry of a role.
+ */
+static char *
+entry_rolname(const sddbEntry * entry)
+{
+	char	   *rolname = GetUserNameFromId(entry->key.roleid, true);
 
-	initStringInfo(&buf);
-	/* Get dbid */
-	dbid = get_dbid(dbname, &buf);
+	return rolname ? rolname : pstrdup(NameStr(entry->rolname));
+}
 
-	/* Check whether dbid is in the hash table */
-	if (sddb_find_entry(dbid, false))
+/*
+ * Return the name of the mode shown in shutdown_db.show_db_list.
+ */
+static const char *
+mode_label(const int mode)
+{
+	switch (mode)
 	{
-		elog(WARNING, "%s is already shutdown.", dbname);
-		terminate_procedure(dbname);
-		return (Datum) 0;
+		case NORMAL:
+			return "NORMAL";
+		case ABORT:
+			return "ABORT";
+		case IMMEDIATE:
+			return "IMMEDIATE";
+		case TRANSACTIONAL:
+			return "TRANSACTIONAL";
+		case THROTTLED:
+			return "THROTTLED";
+		case SUSPENDED:
+			return "SUSPENDED";
+		default:
+			return "INIT";
 	}
+}
 
-	/* ALTER DATABASE */
-	resetStringInfo(&buf);
-	do_alter_database(dbname, false, &buf);
+/*
+ * Make an interval of usecs microseconds.
+ */
+static Datum
+interval_datum(const int64 usecs)
+{
+	Interval   *result = (Interval *) palloc0(sizeof(Interval));
 
-	/* Logging */
-	elog(LOG, "%s has been shutdown in Normal mode", dbname);
+	result->time = usecs;
 
-	pfree(dbname);
+	return IntervalPGetDatum(result);
+}
 
-	/* Add dbid into hash table */
-	sddb_store_entry(dbid, NORMAL, false);
+/*
+ * Build the target from the database name given as the first argument.
+ */
+static sddbTarget *
+get_target(FunctionCallInfo fcinfo)
+{
+	sddbTarget *target = (sddbTarget *) palloc0(sizeof(sddbTarget));
 
-	SPI_finish();
+	target->dbname = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	target->dbid = InvalidOid;
+	target->result = RESULT_DONE;
 
-	return (Datum) 0;
+	return target;
 }
 
-Datum
-shutdown_abort(PG_FUNCTION_ARGS)
+/*
+ * Build the targets from the array of database names given as the first
+ * argument. NULL elements are ignored.
+ */
+static sddbTarget *
+get_targets(FunctionCallInfo fcinfo, int *n)
 {
-	Oid			dbid;
-	char	   *dbname;
-	StringInfoData buf;
+	ArrayType  *array = PG_GETARG_ARRAYTYPE_P(0);
+	Datum	   *elems;
+	bool	   *nulls;
+	int			nelems;
+	int			i;
+	sddbTarget *targets;
 
-	check_workenv();
+	deconstruct_array(array, TEXTOID, -1, false, 'i',
+					  &elems, &nulls, &nelems);
 
-	if (!is_allowed_role())
-		elog(ERROR, "You cannot execute this function because of no-privilege.");
+	targets = (sddbTarget *) palloc0(sizeof(sddbTarget) * Max(nelems, 1));
 
-	/* Get database name */
-	dbname = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	*n = 0;
+	for (i = 0; i < nelems; i++)
+	{
+		if (nulls[i])
+			continue;
+		targets[*n].dbname = TextDatumGetCString(elems[i]);
+		targets[*n].dbid = InvalidOid;
+		targets[*n].result = RESULT_DONE;
+		(*n)++;
+	}
 
-	if (!check_dbname(dbname))
-		elog(ERROR, "%s cannot be shutdown.", dbname);
+	return targets;
+}
 
-	/* Connect SPI */
-	SPI_connect();
+/*
+ * Get the deadline of the draining from the timeout given as the second
+ * argument of shutdown_transactional(). Returns 0 if it's not given.
+ */
+static TimestampTz
+get_deadline(FunctionCallInfo fcinfo)
+{
+	TimestampTz now;
+	TimestampTz deadline;
 
-	initStringInfo(&buf);
-	/* Get dbid */
-	dbid = get_dbid(dbname, &buf);
+	if (PG_NARGS() < 2 || PG_ARGISNULL(1))
+		return 0;
+
+	now = GetCurrentTimestamp();
+	deadline = DatumGetTimestampTz(DirectFunctionCall2(timestamptz_pl_interval,
+													   TimestampTzGetDatum(now),
+													   PG_GETARG_DATUM(1)));
+	if (deadline < now)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("timeout must not be negative")));
+
+	/* Escalate at once if the timeout is zero */
+	return Max(deadline, 1);
+}
 
-	/* Check whether dbid is in the hash table */
-	if (sddb_find_entry(dbid, false))
+/*
+ * Shut down targets[0 .. n-1] in the mode `mode`. If `deadline` is not 0,
+ * the databases which are still being drained at that time are escalated to
+ * IMMEDIATE mode by the supervisor process.
+ * The dirty buffers are written out in ABORT mode as `abort_flush` tells.
+ *
+ * The dbids are resolved via the syscache, the entries are stored in one
+ * call, and the backend processes are killed in one pass over the backend
+ * status array. The result of each target is set into
+ * targets[i].result.
+ */
+static void
+do_shutdown(sddbTarget * targets, const int n, const int mode,
+			const TimestampTz deadline, const int abort_flush)
+{
+	Oid		   *dbids;
+	const char **datnames;
+	int		   *results;
+	sddbEntry	entry;
+	int			ndbids = 0;
+	int			flags = 0;
+	int			i,
+				k;
+
+	for (i = 0; i < n; i++)
+		if (!check_dbname(targets[i].dbname))
+			targets[i].result = RESULT_NOT_ALLOWED;
+
+	/* Get dbids */
+	get_dbids(targets, n);
+
+	/*
+	 * Check whether dbid is in the hash table, and ALTER DATABASE unless
+	 * connections are rejected by our ClientAuthentication_hook.
+	 */
+	if (sddb_connection_gate == GATE_CATALOG)
+		flags |= SDDB_FLAG_CATALOG_GATE;
+	if (sddb_buffer_release)
+		flags |= SDDB_FLAG_RELEASE_BUFFERS;
+	if (sddb_prewarm)
+		flags |= SDDB_FLAG_DUMP_BLOCKS;
+	flags |= policy_flags();
+
+	dbids = (Oid *) palloc(sizeof(Oid) * Max(n, 1));
+	datnames = (const char **) palloc(sizeof(char *) * Max(n, 1));
+	for (i = 0; i < n; i++)
 	{
-		elog(WARNING, "%s is already shutdown.", dbname);
-		terminate_procedure(dbname);
-		return (Datum) 0;
+		if (targets[i].result != RESULT_DONE)
+			continue;
+
+		if (sddb_get_entry(targets[i].dbid, &entry))
+		{
+			if (SDDB_IS_SHUTDOWN(entry.mode))
+			{
+				targets[i].result = RESULT_ALREADY;
+				continue;
+			}
+
+			/* A THROTTLED or SUSPENDED database is not shut down; replace it */
+			sddb_delete_entry(targets[i].dbid);
+		}
+
+		if (flags & SDDB_FLAG_CATALOG_GATE)
+			do_alter_database(targets[i].dbname, false);
+		datnames[ndbids] = targets[i].dbname;
+		dbids[ndbids++] = targets[i].dbid;
 	}
 
-	/* ALTER DATABASE */
-	resetStringInfo(&buf);
-	do_alter_database(dbname, false, &buf);
+	/* Add dbids into hash table */
+	results = (int *) palloc(sizeof(int) * Max(ndbids, 1));
+	sddb_store_entries(dbids, datnames, ndbids, mode, (mode == TRANSACTIONAL),
+					   flags, deadline, results);
+
+	/*
+	 * Leave only the stored dbids in dbids[]. This is done in place, since
+	 * the stored ones never outnumber the ones already read.
+	 */
+	k = 0;
+	ndbids = 0;
+	for (i = 0; i < n; i++)
+	{
+		if (targets[i].result != RESULT_DONE)
+			continue;
 
-	/* Logging */
-	elog(LOG, "%s has been shutdown in Abort mode", dbname);
+		switch (results[k++])
+		{
+			case SDDB_STORED:
+				datnames[ndbids] = targets[i].dbname;
+				dbids[ndbids++] = targets[i].dbid;
+				/* Logging */
+				elog(LOG, "%s has been shutdown in %s mode", targets[i].dbname,
+					 mode_name(mode));
+				break;
+			case SDDB_EXISTS:
+				/* The same database is given twice */
+				targets[i].result = RESULT_ALREADY;
+				break;
+			default:
+				targets[i].result = RESULT_FULL;
+				break;
+		}
+	}
 
-	pfree(dbname);
+	/* Make the shutdown survive a restart of the server */
+	if (ndbids > 0)
+		sddb_save_state();
 
-	/* Add dbid into hash table */
-	sddb_store_entry(dbid, ABORT, false);
+	/* Propagate it to the standbys */
+	sddb_wal_log_entries(dbids, ndbids);
 
-	/* Kill processes corresponding to dbname */
-	resetStringInfo(&buf);
-	kill_pids(dbid, false, &buf);
+	sddb_stats_count_shutdowns(dbids, datnames, ndbids, mode);
 
-	/* Do checkpoint */
-	resetStringInfo(&buf);
-	do_checkpoint(&buf);
+	/* Report the progress of the drains; see shutdown_db.progress */
+	start_progress(dbids, ndbids, mode, flags);
 
-	SPI_finish();
+	switch (mode)
+	{
+		case ABORT:
+			/* Kill processes corresponding to dbids */
+			kill_pids(dbids, ndbids, false, flags);
+
+			/*
+			 * Do checkpoint, or write out the buffers of dbids only; a job of
+			 * the scheduler leaves them to a flush worker.
+			 */
+			if (ndbids > 0)
+			{
+				set_progress(dbids, ndbids, PHASE_FLUSHING);
+				if (abort_flush == FLUSH_DATABASE)
+					sddb_flush_buffers(dbids, ndbids);
+				else if (abort_flush == FLUSH_CHECKPOINT)
+					do_checkpoint();
+				if (abort_flush != FLUSH_DEFERRED)
+					set_progress(dbids, ndbids, PHASE_TERMINATING);
+			}
+			break;
+		case IMMEDIATE:
+			/* Kill processes corresponding to dbids */
+			kill_pids(dbids, ndbids, false, flags);
+			break;
+		case TRANSACTIONAL:
+			if (ndbids > 0)
+				run_sddb_killer();
+			break;
+		default:
+			break;
+	}
 
-	return (Datum) 0;
+	/*
+	 * The supervisor process counts the drains, and dumps the block lists and
+	 * releases the buffers, after the backends exit
+	 */
+	if (mode != TRANSACTIONAL && ndbids > 0)
+	{
+		if (SDDB_BUFFERS_PENDING(flags))
+			run_sddb_killer();
+		else
+			sddb_supervisor_wakeup();
+	}
 }
 
-Datum
-shutdown_immediate(PG_FUNCTION_ARGS)
+/*
+ * Shut down the database `dbname` for a job of the scheduler, in the
+ * supervisor process. In ABORT mode, the buffers are not written out here:
+ * the scheduler launches a flush worker, which writes out only the buffers
+ * of the database, with shutdown_db.flush_rate_limit, rather than
+ * CHECKPOINT, whatever shutdown_db.abort_flush is.
+ *
+ * Sets the dbid, or InvalidOid if not found, into *dbid and the result
+ * into *result. Returns true if the database has been shut down.
+ */
+bool
+sddb_shutdown_job(const char *dbname, const int mode, Oid *dbid,
+				  const char **result)
 {
-	Oid			dbid;
-	char	   *dbname;
-	StringInfoData buf;
-
-	check_workenv();
-
-	if (!is_allowed_role())
-		elog(ERROR, "You cannot execute this function because of no-privilege.");
+	sddbTarget	target;
 
-	/* Get database name */
-	dbname = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	target.dbname = pstrdup(dbname);
+	target.dbid = InvalidOid;
+	target.result = RESULT_DONE;
 
-	if (!check_dbname(dbname))
-		elog(ERROR, "%s cannot be shutdown.", dbname);
+	do_shutdown(&target, 1, mode, 0, FLUSH_DEFERRED);
 
-	/* Connect SPI */
-	SPI_connect();
+	*dbid = OidIsValid(target.dbid) ? target.dbid : InvalidOid;
+	*result = result_label(target.result, false);
 
-	initStringInfo(&buf);
-	/* Get dbid */
-	dbid = get_dbid(dbname, &buf);
+	return (target.result == RESULT_DONE);
+}
 
-	/* Check whether dbid is in the hash table */
-	if (sddb_find_entry(dbid, false))
+/*
+ * Start up targets[0 .. n-1]. The entries are deleted in one call. The
+ * result of each target is set into targets[i].result.
+ */
+static void
+do_startup(sddbTarget * targets, const int n)
+{
+	sddbEntry	entry;
+	Oid		   *dbids;
+	const char **datnames;
+	int			ndbids = 0;
+	int			i;
+
+	for (i = 0; i < n; i++)
+		if (!check_dbname(targets[i].dbname))
+			targets[i].result = RESULT_NOT_ALLOWED;
+
+	/* Get dbids */
+	get_dbids(targets, n);
+
+	/* Check whether dbid is in the hash table, and ALTER DATABASE */
+	dbids = (Oid *) palloc(sizeof(Oid) * Max(n, 1));
+	datnames = (const char **) palloc(sizeof(char *) * Max(n, 1));
+	for (i = 0; i < n; i++)
 	{
-		elog(WARNING, "%s is already shutdown.", dbname);
-		terminate_procedure(dbname);
-		return (Datum) 0;
-	}
+		if (targets[i].result != RESULT_DONE)
+			continue;
+
+		if (!sddb_get_entry(targets[i].dbid, &entry))
+		{
+			targets[i].result = RESULT_ALREADY;
+			continue;
+		}
 
-	/* ALTER DATABASE */
-	resetStringInfo(&buf);
-	do_alter_database(dbname, false, &buf);
+		if (entry.flags & SDDB_FLAG_CATALOG_GATE)
+			do_alter_database(targets[i].dbname, true);
+		datnames[ndbids] = targets[i].dbname;
+		dbids[ndbids++] = targets[i].dbid;
 
-	/* Logging */
-	elog(LOG, "%s has been shutdown in Immediate mode", dbname);
+		/* Logging */
+		elog(LOG, "%s starts again.", targets[i].dbname);
+	}
 
-	pfree(dbname);
+	/*
+	 * Delete dbids into hash table; the supervisor process stops serving
+	 * them.
+	 */
+	sddb_delete_entries(dbids, ndbids);
 
-	/* Add dbid into hash table */
-	sddb_store_entry(dbid, IMMEDIATE, false);
+	if (ndbids > 0)
+		sddb_save_state();
 
-	/* Kill processes corresponding to dbname */
-	resetStringInfo(&buf);
-	kill_pids(dbid, false, &buf);
+	sddb_wal_log_deletes(dbids, ndbids);
 
-	SPI_finish();
+	sddb_stats_count_startups(dbids, datnames, ndbids);
 
-	return (Datum) 0;
+	/* Read the blocks dumped at shutdown back into the buffers */
+	for (i = 0; i < ndbids; i++)
+		if (sddb_has_block_dump(dbids[i]))
+			sddb_prewarm_launch(dbids[i]);
 }
 
-Datum
-shutdown_transactional(PG_FUNCTION_ARGS)
+/*
+ * Shut down only the role `rolname` in the target, in NORMAL, IMMEDIATE
+ * or TRANSACTIONAL mode: its new connections to the database are rejected,
+ * and its sessions in the database are terminated at once (IMMEDIATE) or
+ * once they are idle (TRANSACTIONAL) by the supervisor process. The other
+ * roles keep using the database. The result is set into target->result.
+ */
+static void
+do_shutdown_role(sddbTarget * target, const char *rolname, const int mode)
 {
-	Oid			dbid;
-	char	   *dbname;
-	StringInfoData buf;
+	Oid			roleid;
+	int			result;
 
-	check_workenv();
+	if (!check_dbname(target->dbname))
+		target->result = RESULT_NOT_ALLOWED;
 
-	if (!is_allowed_role())
-		elog(ERROR, "You cannot execute this function because of no-privilege.");
+	/* Get dbid and roleid */
+	get_dbids(target, 1);
+	roleid = get_role_oid(rolname, false);
 
-	/* Get database name */
-	dbname = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	if (target->result != RESULT_DONE)
+		return;
 
-	if (!check_dbname(dbname))
-		elog(ERROR, "%s cannot be shutdown.", dbname);
+	result = sddb_store_role_entry(target->dbid, target->dbname, roleid,
+								   rolname, mode, (mode != NORMAL));
+	if (result != SDDB_STORED)
+	{
+		target->result = (result == SDDB_EXISTS) ? RESULT_ALREADY : RESULT_FULL;
+		return;
+	}
 
-	SPI_connect();
+	/* Logging */
+	elog(LOG, "role %s in %s has been shutdown in %s mode", rolname,
+		 target->dbname, mode_name(mode));
 
-	/* Get dbid */
-	initStringInfo(&buf);
-	dbid = get_dbid(dbname, &buf);
+	/* Make it survive a restart of the server */
+	sddb_save_state();
+
+	sddb_wal_log_role_entry(target->dbid, roleid);
 
-	/* Check whether dbid is in the hash table */
-	if (sddb_find_entry(dbid, false))
+	switch (mode)
 	{
-		elog(WARNING, "%s is already shutdown.", dbname);
-		terminate_procedure(dbname);
-		return (Datum) 0;
+		case IMMEDIATE:
+			sddb_kill_role_backends(target->dbid, roleid, false);
+
+			/*
+			 * The supervisor process terminates the sessions which have
+			 * passed the authentication before the entry was stored.
+			 */
+			run_sddb_killer();
+			break;
+		case TRANSACTIONAL:
+			run_sddb_killer();
+			break;
+		default:
+			break;
 	}
+}
 
-	/* ALTER DATABASE */
-	resetStringInfo(&buf);
-	do_alter_database(dbname, false, &buf);
+/*
+ * Start up the role `rolname` in the target again. The result is set into
+ * target->result.
+ */
+static void
+do_startup_role(sddbTarget * target, const char *rolname)
+{
+	Oid			roleid;
 
-	/* Logging */
-	elog(LOG, "%s has been shutdown in Transactional mode", dbname);
-	pfree(dbname);
+	/* Get dbid and roleid */
+	get_dbids(target, 1);
+	roleid = get_role_oid(rolname, false);
+
+	if (target->result != RESULT_DONE)
+		return;
 
-	/* Add dbid into hash table */
-	if (sddb_store_entry(dbid, TRANSACTIONAL, true))
+	if (!sddb_delete_role_entry(target->dbid, roleid))
 	{
-		resetStringInfo(&buf);
-		run_sddb_killer(dbid, &buf);
-	}
-	else
-	{
-		SPI_finish();
-		elog(ERROR, "killer process (%d) could not be executed.", dbid);
+		target->result = RESULT_ALREADY;
+		return;
 	}
 
-	SPI_finish();
+	/* Logging */
+	elog(LOG, "role %s in %s starts again.", rolname, target->dbname);
 
-	return (Datum) 0;
+	sddb_save_state();
+
+	sddb_wal_log_role_delete(target->dbid, roleid);
 }
 
-Datum
-startup(PG_FUNCTION_ARGS)
+/*
+ * Throttle or suspend the target, i.e. make it THROTTLED with the limit of
+ * max_active concurrently executing statements, or SUSPENDED. A THROTTLED
+ * database gets the new limit, and a THROTTLED or SUSPENDED one can be
+ * switched to the other mode. The connections and the sessions are left
+ * alone. The result is set into target->result.
+ */
+static void
+do_restrict(sddbTarget * target, const int mode, const int max_active)
 {
-	Oid			dbid;
-	char	   *dbname;
-	StringInfoData buf;
-	pid_t		pid;
+	sddbEntry	entry;
+	const char *datname = target->dbname;
+	int			result;
 
-	check_workenv();
+	if (!check_dbname(target->dbname))
+		target->result = RESULT_NOT_ALLOWED;
 
-	if (!is_allowed_role())
-		elog(ERROR, "You cannot execute this function because of no-privilege.");
+	/* Get dbid */
+	get_dbids(target, 1);
 
-	/* Get database name */
-	dbname = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	if (target->result != RESULT_DONE)
+		return;
 
-	if (!check_dbname(dbname))
-		elog(ERROR, "%s cannot be started up.", dbname);
+	if (sddb_get_entry(target->dbid, &entry))
+	{
+		if (SDDB_IS_SHUTDOWN(entry.mode) ||
+			(entry.mode == SUSPENDED && mode == SUSPENDED))
+		{
+			target->result = RESULT_ALREADY;
+			return;
+		}
 
-	SPI_connect();
+		if (entry.mode != mode)
+		{
+			sddb_set_mode(target->dbid, mode);
+			sddb_stats_count_shutdowns(&target->dbid, &datname, 1, mode);
+		}
+	}
+	else
+	{
+		sddb_store_entries(&target->dbid, &datname, 1, mode, false, 0, 0,
+						   &result);
+		if (result != SDDB_STORED)
+		{
+			target->result = (result == SDDB_EXISTS) ? RESULT_ALREADY : RESULT_FULL;
+			return;
+		}
 
-	/* Get dbid */
-	initStringInfo(&buf);
-	dbid = get_dbid(dbname, &buf);
+		sddb_stats_count_shutdowns(&target->dbid, &datname, 1, mode);
+	}
 
-	/* Check whether dbid is in the hash table */
-	if (!sddb_find_entry(dbid, false))
+	/* Logging */
+	if (mode == THROTTLED)
 	{
-		elog(WARNING, "%s is already started.", dbname);
-		terminate_procedure(dbname);
-		return (Datum) 0;
+		sddb_set_throttle(target->dbid, max_active);
+		elog(LOG, "%s has been throttled to %d statements", target->dbname,
+			 max_active);
 	}
+	else
+		elog(LOG, "%s has been suspended", target->dbname);
 
-	/* ALTER DATABASE */
-	resetStringInfo(&buf);
-	do_alter_database(dbname, true, &buf);
+	/* Make it survive a restart of the server */
+	sddb_save_state();
 
-	/* Logging */
-	elog(LOG, "%s starts again.", dbname);
-	pfree(dbname);
+	sddb_wal_log_entries(&target->dbid, 1);
+}
 
-	/* Kill the killer process if running */
-	if ((pid = sddb_get_pid(dbid, true)) != InvalidPid)
+/*
+ * Report the result of shutting down one database in the way the single
+ * database variants have always done.
+ */
+static void
+report_shutdown(const sddbTarget * target, const int mode)
+{
+	switch (target->result)
 	{
-		resetStringInfo(&buf);
-		kill_bgworker(pid, &buf);
+		case RESULT_NOT_ALLOWED:
+			elog(ERROR, "%s cannot be shutdown.", target->dbname);
+			break;
+		case RESULT_NOT_FOUND:
+			elog(ERROR, "Database %s not found.", target->dbname);
+			break;
+		case RESULT_ALREADY:
+			elog(WARNING, "%s is already shutdown.", target->dbname);
+			break;
+		case RESULT_FULL:
+			if (mode == TRANSACTIONAL)
+				elog(ERROR, "killer process (%d) could not be executed.", target->dbid);
+			elog(WARNING, "New entry was not created since hash table is full.");
+			break;
+		default:
+			break;
 	}
-	SPI_finish();
+}
+
+static void
+report_startup(const sddbTarget * target)
+{
+	switch (target->result)
+	{
+		case RESULT_NOT_ALLOWED:
+			elog(ERROR, "%s cannot be started up.", target->dbname);
+			break;
+		case RESULT_NOT_FOUND:
+			elog(ERROR, "Database %s not found.", target->dbname);
+			break;
+		case RESULT_ALREADY:
+			elog(WARNING, "%s is already started.", target->dbname);
+			break;
+		default:
+			break;
+	}
+}
+
+/*
+ * Return the results of the array variants as a set of
+ * (datname, dbid, result).
+ */
+static Datum
+return_results(FunctionCallInfo fcinfo, const sddbTarget * targets,
+			   const int n, const bool is_startup)
+{
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	int			i;
+
+	tupstore = begin_srf(fcinfo, &tupdesc);
+
+	for (i = 0; i < n; i++)
+	{
+		Datum		values[SHUTDOWN_DB_RESULT_COLS];
+		bool		nulls[SHUTDOWN_DB_RESULT_COLS];
+		const char *result;
+		int			j = 0;
 
-	/* Delete dbid into hash table */
-	sddb_delete_entry(dbid);
+		memset(values, 0, sizeof(values));
+		memset(nulls, 0, sizeof(nulls));
+
+		result = result_label(targets[i].result, is_startup);
+
+		values[j++] = CStringGetTextDatum(targets[i].dbname);
+		if (OidIsValid(targets[i].dbid))
+			values[j++] = ObjectIdGetDatum(targets[i].dbid);
+		else
+			nulls[j++] = true;
+		values[j++] = CStringGetTextDatum(result);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
 
 	return (Datum) 0;
 }
 
 /*
- * Retrieve stored dbs in the hash table.
+ * Set up a materialize-mode set-returning function, and return the
+ * tuplestore to put the result rows into.
  */
-Datum
-sddb_show_db(PG_FUNCTION_ARGS)
+static Tuplestorestate *
+begin_srf(FunctionCallInfo fcinfo, TupleDesc *tupdesc)
 {
 	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
-	TupleDesc	tupdesc;
 	Tuplestorestate *tupstore;
 	MemoryContext per_query_ctx;
 	MemoryContext oldcontext;
-	Oid			userid = GetUserId();
-	bool		is_allowed_role = false;
-	HASH_SEQ_STATUS hash_seq;
-	sddbEntry  *entry;
-
-	/* Superusers or members of pg_read_all_stats members are allowed */
-#if PG_VERSION_NUM >= 100000
-	is_allowed_role = is_member_of_role(userid,
-#if PG_VERSION_NUM >= 140000
-										ROLE_PG_READ_ALL_STATS
-#else
-										DEFAULT_ROLE_READ_ALL_STATS
-#endif
-		);
-#else
-	is_allowed_role = superuser();
-#endif
-
-	/* hash table must exist already */
-	if (!sddb || !sddb_hash)
-		ereport(ERROR,
-				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
-				 errmsg("shutdown_db must be loaded via shared_preload_libraries")));
 
 	/* check to see if caller supports us returning a tuplestore */
 	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
@@ -580,41 +1290,1242 @@ sddb_show_db(PG_FUNCTION_ARGS)
 	oldcontext = MemoryContextSwitchTo(per_query_ctx);
 
 	/* Build a tuple descriptor for our result type */
-	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+	if (get_call_result_type(fcinfo, NULL, tupdesc) != TYPEFUNC_COMPOSITE)
 		elog(ERROR, "return type must be a row type");
 
 	tupstore = tuplestore_begin_heap(true, false, work_mem);
 	rsinfo->returnMode = SFRM_Materialize;
 	rsinfo->setResult = tupstore;
-	rsinfo->setDesc = tupdesc;
+	rsinfo->setDesc = *tupdesc;
 
 	MemoryContextSwitchTo(oldcontext);
 
-	if (is_allowed_role)
-	{
-		/* Get shared lock, and iterate over the hash table entries */
-		LWLockAcquire(sddb->lock, LW_SHARED);
+	return tupstore;
+}
 
-		hash_seq_init(&hash_seq, sddb_hash);
-		while ((entry = hash_seq_search(&hash_seq)) != NULL)
-		{
-			Datum		values[SHUTDOWN_DB_COLS];
-			bool		nulls[SHUTDOWN_DB_COLS];
-			int			i = 0;
+/*
+ * Common part of the SHUTDOWN commands for one database and for an array
+ * of databases.
+ */
+static Datum
+shutdown_one(FunctionCallInfo fcinfo, const int mode)
+{
+	sddbTarget *target;
 
-			/* Set values */
-			memset(values, 0, sizeof(values));
-			memset(nulls, 0, sizeof(nulls));
+	check_workenv();
 
-			values[i++] = ObjectIdGetDatum(entry->key.dbid);
-			values[i++] = ObjectIdGetDatum(entry->mode);
-			values[i++] = ObjectIdGetDatum(entry->is_running);
+	if (!is_allowed_role())
+		elog(ERROR, "You cannot execute this function because of no-privilege.");
 
-			tuplestore_putvalues(tupstore, tupdesc, values, nulls);
-		}
+	/* Get database name */
+	target = get_target(fcinfo);
+
+	do_shutdown(target, 1, mode, get_deadline(fcinfo), sddb_abort_flush);
+	report_shutdown(target, mode);
+
+	PG_RETURN_VOID();
+}
+
+static Datum
+shutdown_many(FunctionCallInfo fcinfo, const int mode)
+{
+	sddbTarget *targets;
+	int			n;
+
+	check_workenv();
+
+	if (!is_allowed_role())
+		elog(ERROR, "You cannot execute this function because of no-privilege.");
+
+	/* Get database names */
+	targets = get_targets(fcinfo, &n);
+
+	do_shutdown(targets, n, mode, get_deadline(fcinfo), sddb_abort_flush);
+
+	return return_results(fcinfo, targets, n, false);
+}
+
+/*
+ * Same as shutdown_one(), but if `wait` is true, wait until the database is
+ * drained, and return the drain time; see wait_drained(). Returns NULL if
+ * `wait` is false.
+ */
+static Datum
+shutdown_one_wait(FunctionCallInfo fcinfo, const int mode,
+				  const TimestampTz deadline, const bool wait)
+{
+	sddbTarget *target;
+
+	check_workenv();
+
+	if (!is_allowed_role())
+		elog(ERROR, "You cannot execute this function because of no-privilege.");
+
+	/* Get database name */
+	target = get_target(fcinfo);
+
+	do_shutdown(target, 1, mode, deadline, sddb_abort_flush);
+	report_shutdown(target, mode);
+
+	if (!wait || (target->result != RESULT_DONE && target->result != RESULT_ALREADY))
+		PG_RETURN_NULL();
+
+	return wait_drained(fcinfo, target, -1);
+}
+
+/*
+ * Wait until the target, which must be shut down, is drained, i.e. no
+ * backend process is accessing it and the supervisor process has finished
+ * serving it, or until timeout_ms milliseconds have passed unless it's
+ * negative. Returns the interval from the shutdown to the end of the
+ * draining, or NULL on timeout.
+ *
+ * This sleeps on the condition variable of the database, which is signaled
+ * by the exiting backend processes and by the supervisor process, so the
+ * callers don't have to poll show_db_list.
+ */
+static Datum
+wait_drained(FunctionCallInfo fcinfo, const sddbTarget * target,
+			 const long timeout_ms)
+{
+	sddbEntry	entry;
+	TimestampTz drained_at;
+
+	if (!sddb_get_entry(target->dbid, &entry) || !SDDB_IS_SHUTDOWN(entry.mode))
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("%s is not shutdown", target->dbname)));
+
+	if (!sddb_wait_drained(target->dbid, timeout_ms, &drained_at))
+		PG_RETURN_NULL();
+
+	return DirectFunctionCall2(timestamp_mi,
+							   TimestampTzGetDatum(Max(drained_at, entry.shutdown_time)),
+							   TimestampTzGetDatum(entry.shutdown_time));
+}
 
-		LWLockRelease(sddb->lock);
+/*
+ * Limit the number of the concurrently executing statements of the
+ * database, without disconnecting anyone; startup() lifts the limit.
+ */
+Datum
+throttle_db(PG_FUNCTION_ARGS)
+{
+	sddbTarget *target;
+	int			max_active = PG_GETARG_INT32(1);
+
+	check_workenv();
+
+	if (!is_allowed_role())
+		elog(ERROR, "You cannot execute this function because of no-privilege.");
+
+	if (max_active <= 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("max_active must be positive")));
+
+	/* Get database name */
+	target = get_target(fcinfo);
+
+	do_restrict(target, THROTTLED, max_active);
+	report_shutdown(target, THROTTLED);
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * Park the sessions of the database at their next statement boundaries,
+ * without disconnecting anyone; startup() wakes them up at once.
+ */
+Datum
+suspend_db(PG_FUNCTION_ARGS)
+{
+	sddbTarget *target;
+
+	check_workenv();
+
+	if (!is_allowed_role())
+		elog(ERROR, "You cannot execute this function because of no-privilege.");
+
+	/* Get database name */
+	target = get_target(fcinfo);
+
+	do_restrict(target, SUSPENDED, 0);
+	report_shutdown(target, SUSPENDED);
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * SHUTDOWN and STARTUP commands
+ */
+Datum
+shutdown_normal(PG_FUNCTION_ARGS)
+{
+	return shutdown_one(fcinfo, NORMAL);
+}
+
+Datum
+shutdown_abort(PG_FUNCTION_ARGS)
+{
+	return shutdown_one(fcinfo, ABORT);
+}
+
+Datum
+shutdown_immediate(PG_FUNCTION_ARGS)
+{
+	return shutdown_one(fcinfo, IMMEDIATE);
+}
+
+Datum
+shutdown_transactional(PG_FUNCTION_ARGS)
+{
+	return shutdown_one(fcinfo, TRANSACTIONAL);
+}
+
+Datum
+shutdown_normal_wait(PG_FUNCTION_ARGS)
+{
+	return shutdown_one_wait(fcinfo, NORMAL, 0, PG_GETARG_BOOL(1));
+}
+
+Datum
+shutdown_abort_wait(PG_FUNCTION_ARGS)
+{
+	return shutdown_one_wait(fcinfo, ABORT, 0, PG_GETARG_BOOL(1));
+}
+
+Datum
+shutdown_immediate_wait(PG_FUNCTION_ARGS)
+{
+	return shutdown_one_wait(fcinfo, IMMEDIATE, 0, PG_GETARG_BOOL(1));
+}
+
+/*
+ * This serves both shutdown_transactional(TEXT, wait BOOL) and
+ * shutdown_transactional(TEXT, timeout INTERVAL, wait BOOL).
+ */
+Datum
+shutdown_transactional_wait(PG_FUNCTION_ARGS)
+{
+	if (PG_NARGS() < 3)
+		return shutdown_one_wait(fcinfo, TRANSACTIONAL, 0, PG_GETARG_BOOL(1));
+
+	if (PG_ARGISNULL(0) || PG_ARGISNULL(2))
+		PG_RETURN_NULL();
+
+	return shutdown_one_wait(fcinfo, TRANSACTIONAL, get_deadline(fcinfo),
+							 PG_GETARG_BOOL(2));
+}
+
+Datum
+shutdown_normal_array(PG_FUNCTION_ARGS)
+{
+	return shutdown_many(fcinfo, NORMAL);
+}
+
+Datum
+shutdown_abort_array(PG_FUNCTION_ARGS)
+{
+	return shutdown_many(fcinfo, ABORT);
+}
+
+Datum
+shutdown_immediate_array(PG_FUNCTION_ARGS)
+{
+	return shutdown_many(fcinfo, IMMEDIATE);
+}
+
+Datum
+shutdown_transactional_array(PG_FUNCTION_ARGS)
+{
+	return shutdown_many(fcinfo, TRANSACTIONAL);
+}
+
+Datum
+startup(PG_FUNCTION_ARGS)
+{
+	sddbTarget *target;
+
+	check_workenv();
 
+	if (!is_allowed_role())
+		elog(ERROR, "You cannot execute this function because of no-privilege.");
+
+	target = get_target(fcinfo);
+	do_startup(target, 1);
+	report_startup(target);
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * Wait until the shutdown database is drained, for at most `timeout` if
+ * it's not NULL; see wait_drained().
+ */
+Datum
+sddb_wait(PG_FUNCTION_ARGS)
+{
+	sddbTarget *target;
+	long		timeout_ms = -1;
+
+	check_workenv();
+
+	if (!is_allowed_role())
+		elog(ERROR, "You cannot execute this function because of no-privilege.");
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	if (!PG_ARGISNULL(1))
+	{
+		TimestampTz deadline = get_deadline(fcinfo);
+
+		timeout_ms = (long) Max((deadline - GetCurrentTimestamp()) / 1000, 0);
 	}
-	return (Datum) 0;
+
+	/* Get database name and dbid */
+	target = get_target(fcinfo);
+	get_dbids(target, 1);
+	if (target->result == RESULT_NOT_FOUND)
+		elog(ERROR, "Database %s not found.", target->dbname);
+
+	return wait_drained(fcinfo, target, timeout_ms);
+}
+
+/*
+ * Shut down only the role in the database; see do_shutdown_role().
+ */
+Datum
+shutdown_role(PG_FUNCTION_ARGS)
+{
+	sddbTarget *target;
+	char	   *rolname = text_to_cstring(PG_GETARG_TEXT_PP(1));
+	char	   *modename = text_to_cstring(PG_GETARG_TEXT_PP(2));
+	int			mode;
+
+	check_workenv();
+
+	if (!is_allowed_role())
+		elog(ERROR, "You cannot execute this function because of no-privilege.");
+
+	/* ABORT mode writes out the buffers of the whole database */
+	mode = parse_mode(modename);
+	if (mode != NORMAL && mode != IMMEDIATE && mode != TRANSACTIONAL)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("invalid shutdown mode for a role: \"%s\"", modename),
+				 errhint("Valid modes are \"normal\", \"immediate\" and \"transactional\".")));
+
+	/* Get database name */
+	target = get_target(fcinfo);
+
+	do_shutdown_role(target, rolname, mode);
+
+	switch (target->result)
+	{
+		case RESULT_NOT_ALLOWED:
+			elog(ERROR, "%s cannot be shutdown.", target->dbname);
+			break;
+		case RESULT_NOT_FOUND:
+			elog(ERROR, "Database %s not found.", target->dbname);
+			break;
+		case RESULT_ALREADY:
+			elog(WARNING, "role %s in %s is already shutdown.", rolname,
+				 target->dbname);
+			break;
+		case RESULT_FULL:
+			elog(WARNING, "New entry was not created since hash table is full.");
+			break;
+		default:
+			break;
+	}
+
+	PG_RETURN_VOID();
+}
+
+Datum
+startup_role(PG_FUNCTION_ARGS)
+{
+	sddbTarget *target;
+	char	   *rolname = text_to_cstring(PG_GETARG_TEXT_PP(1));
+
+	check_workenv();
+
+	if (!is_allowed_role())
+		elog(ERROR, "You cannot execute this function because of no-privilege.");
+
+	target = get_target(fcinfo);
+	do_startup_role(target, rolname);
+
+	if (target->result == RESULT_NOT_FOUND)
+		elog(ERROR, "Database %s not found.", target->dbname);
+	else if (target->result == RESULT_ALREADY)
+		elog(WARNING, "role %s in %s is already started.", rolname,
+			 target->dbname);
+
+	PG_RETURN_VOID();
+}
+
+Datum
+startup_array(PG_FUNCTION_ARGS)
+{
+	sddbTarget *targets;
+	int			n;
+
+	check_workenv();
+
+	if (!is_allowed_role())
+		elog(ERROR, "You cannot execute this function because of no-privilege.");
+
+	targets = get_targets(fcinfo, &n);
+	do_startup(targets, n);
+
+	return return_results(fcinfo, targets, n, true);
+}
+
+/*
+ * Kill the backend processes which are accessing the database whose id is
+ * dbid, and return the number of the remaining backend processes;
+ * see sddb_kill_backends(). The autovacuum workers and the logical
+ * walsenders are handled as the parameters of this session tell.
+ */
+Datum
+sddb_kill_processes(PG_FUNCTION_ARGS)
+{
+	Oid			dbid = PG_GETARG_OID(0);
+	bool		idle = PG_GETARG_BOOL(1);
+
+	check_workenv();
+
+	PG_RETURN_INT32(sddb_kill_backends(dbid, idle, policy_flags()));
+}
+
+/*
+ * Compare the entries by dbid, for qsort.
+ */
+static int
+entry_cmp(const void *p1, const void *p2)
+{
+	return sddb_oid_cmp(&((const sddbEntry *) p1)->dbid,
+						&((const sddbEntry *) p2)->dbid);
+}
+
+/*
+ * Remove the entries of roles from entries[0 .. num-1] in place, or the
+ * other entries if keep_roles is true, and return the number of the
+ * remaining ones.
+ */
+static int
+remove_role_entries(sddbEntry * entries, const int num, const bool keep_roles)
+{
+	int			i;
+	int			n = 0;
+
+	for (i = 0; i < num; i++)
+	{
+		if (OidIsValid(entries[i].key.roleid) != keep_roles)
+			continue;
+		if (n != i)
+			memcpy(&entries[n], &entries[i], sizeof(sddbEntry));
+		n++;
+	}
+
+	return n;
+}
+
+/*
+ * Retrieve stored dbs in the hash table, in ascending order of dbid.
+ *
+ * The number of the backend processes accessing each database is counted
+ * in one pass over the backend status array, so this costs the same
+ * whatever the numbers of the sessions and of the stored dbs are.
+ *
+ * A function created by an older version has SHUTDOWN_DB_COLS_V1_0
+ * columns, which is still served.
+ */
+Datum
+sddb_show_db(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	sddbEntry  *entries;
+	Oid		   *dbids;
+	int		   *counts;
+	int			num;
+	int			i;
+
+	/* hash table must exist already */
+	check_workenv();
+
+	tupstore = begin_srf(fcinfo, &tupdesc);
+
+	if (tupdesc->natts != SHUTDOWN_DB_COLS &&
+		tupdesc->natts != SHUTDOWN_DB_COLS_V1_0)
+		elog(ERROR, "incorrect number of output arguments");
+
+	/* Superusers or members of pg_read_all_stats members are allowed */
+	if (!is_allowed_role())
+		return (Datum) 0;
+
+	/* Copy the entries, so that no lock is held while counting backends */
+	if ((num = sddb_copy_entries(&entries)) == 0)
+		return (Datum) 0;
+
+	/* The entries of roles are shown by sddb_show_roles() */
+	num = remove_role_entries(entries, num, false);
+
+	qsort(entries, num, sizeof(sddbEntry), entry_cmp);
+
+	dbids = (Oid *) palloc(sizeof(Oid) * num);
+	for (i = 0; i < num; i++)
+		dbids[i] = entries[i].dbid;
+
+	counts = (int *) palloc(sizeof(int) * num);
+	if (tupdesc->natts == SHUTDOWN_DB_COLS)
+		sddb_count_backends_multi(dbids, num, NULL, counts);
+
+	for (i = 0; i < num; i++)
+	{
+		sddbEntry  *entry = &entries[i];
+		Datum		values[SHUTDOWN_DB_COLS];
+		bool		nulls[SHUTDOWN_DB_COLS];
+		int			j = 0;
+
+		/* Set values */
+		memset(values, 0, sizeof(values));
+		memset(nulls, 0, sizeof(nulls));
+
+		if (tupdesc->natts == SHUTDOWN_DB_COLS_V1_0)
+		{
+			values[j++] = ObjectIdGetDatum(entry->dbid);
+			values[j++] = Int32GetDatum(entry->mode);
+			values[j++] = BoolGetDatum(entry->is_running);
+		}
+		else
+		{
+			values[j++] = ObjectIdGetDatum(entry->dbid);
+			values[j++] = CStringGetTextDatum(entry_datname(entry));
+			values[j++] = CStringGetTextDatum(mode_label(entry->mode));
+			values[j++] = Int32GetDatum(counts[i]);
+			values[j++] = BoolGetDatum(entry->is_running);
+			if (entry->is_running && entry->pid != InvalidPid)
+				values[j++] = Int32GetDatum(entry->pid);
+			else
+				nulls[j++] = true;
+			values[j++] = TimestampTzGetDatum(entry->shutdown_time);
+			values[j++] = TimestampTzGetDatum(entry->state_change);
+			if ((entry->flags & SDDB_FLAG_RELEASE_BUFFERS) &&
+				(entry->flags & SDDB_FLAG_BUFFERS_DONE) &&
+				entry->released_buffers >= 0)
+				values[j++] = Int64GetDatum((int64) entry->released_buffers * BLCKSZ);
+			else
+				nulls[j++] = true;
+		}
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	return (Datum) 0;
+}
+
+/*
+ * Retrieve the roles shut down by shutdown_role(), in ascending order of
+ * dbid.
+ */
+Datum
+sddb_show_roles(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	sddbEntry  *entries;
+	int			num;
+	int			i;
+
+	/* hash table must exist already */
+	check_workenv();
+
+	tupstore = begin_srf(fcinfo, &tupdesc);
+
+	if (tupdesc->natts != SHUTDOWN_DB_ROLES_COLS)
+		elog(ERROR, "incorrect number of output arguments");
+
+	/* Superusers or members of pg_read_all_stats members are allowed */
+	if (!is_allowed_role())
+		return (Datum) 0;
+
+	if ((num = sddb_copy_entries(&entries)) == 0)
+		return (Datum) 0;
+
+	num = remove_role_entries(entries, num, true);
+
+	qsort(entries, num, sizeof(sddbEntry), entry_cmp);
+
+	for (i = 0; i < num; i++)
+	{
+		sddbEntry  *entry = &entries[i];
+		Datum		values[SHUTDOWN_DB_ROLES_COLS];
+		bool		nulls[SHUTDOWN_DB_ROLES_COLS];
+		int			j = 0;
+
+		/* Set values */
+		memset(values, 0, sizeof(values));
+		memset(nulls, 0, sizeof(nulls));
+
+		values[j++] = ObjectIdGetDatum(entry->dbid);
+		values[j++] = CStringGetTextDatum(entry_datname(entry));
+		values[j++] = ObjectIdGetDatum(entry->key.roleid);
+		values[j++] = CStringGetTextDatum(entry_rolname(entry));
+		values[j++] = CStringGetTextDatum(mode_label(entry->mode));
+		values[j++] = BoolGetDatum(entry->is_running);
+		values[j++] = TimestampTzGetDatum(entry->shutdown_time);
+		values[j++] = TimestampTzGetDatum(entry->state_change);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	return (Datum) 0;
+}
+
+/*
+ * Retrieve the progress of the drains of the shutdown databases, in
+ * ascending order of dbid. The databases which have been drained are not
+ * shown.
+ *
+ * The phases are reported by the processes doing the work, i.e. the
+ * process which has shut down the database and the supervisor process,
+ * while the remaining backend processes are counted here, in one pass over
+ * the backend status array. A drain waiting for the terminated backend
+ * processes to exit is over once none of them remains.
+ */
+Datum
+sddb_progress(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	sddbEntry  *entries;
+	Oid		   *dbids;
+	int		   *flags;
+	int		   *counts;
+	TimestampTz now;
+	int			num;
+	int			i;
+
+	/* hash table must exist already */
+	check_workenv();
+
+	tupstore = begin_srf(fcinfo, &tupdesc);
+
+	if (tupdesc->natts != SHUTDOWN_DB_PROGRESS_COLS)
+		elog(ERROR, "incorrect number of output arguments");
+
+	/* Superusers or members of pg_read_all_stats members are allowed */
+	if (!is_allowed_role())
+		return (Datum) 0;
+
+	/* Copy the entries, so that no lock is held while counting backends */
+	if ((num = sddb_copy_entries(&entries)) == 0)
+		return (Datum) 0;
+
+	/* The drains of roles are not reported */
+	num = remove_role_entries(entries, num, false);
+
+	qsort(entries, num, sizeof(sddbEntry), entry_cmp);
+
+	dbids = (Oid *) palloc(sizeof(Oid) * Max(num, 1));
+	flags = (int *) palloc(sizeof(int) * Max(num, 1));
+	for (i = 0; i < num; i++)
+	{
+		dbids[i] = entries[i].dbid;
+		flags[i] = entries[i].flags;
+	}
+
+	counts = (int *) palloc(sizeof(int) * Max(num, 1));
+	sddb_count_backends_multi(dbids, num, flags, counts);
+
+	now = GetCurrentTimestamp();
+
+	for (i = 0; i < num; i++)
+	{
+		sddbEntry  *entry = &entries[i];
+		Datum		values[SHUTDOWN_DB_PROGRESS_COLS];
+		bool		nulls[SHUTDOWN_DB_PROGRESS_COLS];
+		int			phase = entry->phase;
+		int			j = 0;
+
+		if (!SDDB_IS_SHUTDOWN(entry->mode))
+			continue;
+
+		if (phase != PHASE_FLUSHING && phase != PHASE_RELEASING &&
+			!entry->is_running && counts[i] == 0)
+			phase = SDDB_BUFFERS_PENDING(entry->flags) ? PHASE_RELEASING : PHASE_DONE;
+
+		if (phase == PHASE_DONE)
+			continue;
+
+		/* Set values */
+		memset(values, 0, sizeof(values));
+		memset(nulls, 0, sizeof(nulls));
+
+		values[j++] = ObjectIdGetDatum(entry->dbid);
+		values[j++] = CStringGetTextDatum(entry_datname(entry));
+		values[j++] = CStringGetTextDatum(mode_label(entry->mode));
+		values[j++] = CStringGetTextDatum(phase_label(phase));
+		if (entry->progress_pid != InvalidPid)
+			values[j++] = Int32GetDatum(entry->progress_pid);
+		else
+			nulls[j++] = true;
+		if (entry->backends_start >= 0)
+			values[j++] = Int32GetDatum(entry->backends_start);
+		else
+			nulls[j++] = true;
+		values[j++] = Int32GetDatum(counts[i]);
+		values[j++] = interval_datum(Max(now - entry->shutdown_time, 0));
+		if (entry->deadline != 0)
+			values[j++] = TimestampTzGetDatum(entry->deadline);
+		else
+			nulls[j++] = true;
+		if (entry->phase_change != 0)
+			values[j++] = TimestampTzGetDatum(entry->phase_change);
+		else
+			nulls[j++] = true;
+		if (entry->buffers_flushed >= 0)
+			values[j++] = Int64GetDatum((int64) entry->buffers_flushed);
+		else
+			nulls[j++] = true;
+
+		Assert(j == SHUTDOWN_DB_PROGRESS_COLS);
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	return (Datum) 0;
+}
+
+/*
+ * Common part of shutdown_db.plan() and shutdown_db.plan_summary(): read
+ * the database name and the mode from the first two arguments, and tell
+ * what the shutdown would do with each backend process of the database
+ * under the parameters of this session. Nothing is changed. Returns the
+ * number of the backend processes stored into *items.
+ */
+static int
+get_plan(FunctionCallInfo fcinfo, sddbTarget * *target, int *mode,
+		 sddbPlanItem * *items)
+{
+	char	   *mode_str;
+
+	check_workenv();
+
+	if (!is_allowed_role())
+		elog(ERROR, "You cannot execute this function because of no-privilege.");
+
+	mode_str = text_to_cstring(PG_GETARG_TEXT_PP(1));
+	if ((*mode = parse_mode(mode_str)) < 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("invalid shutdown mode: \"%s\"", mode_str),
+				 errhint("Valid modes are \"normal\", \"abort\", \"immediate\" and \"transactional\".")));
+
+	/* Get database name and dbid */
+	*target = get_target(fcinfo);
+	get_dbids(*target, 1);
+	if ((*target)->result == RESULT_NOT_FOUND)
+		elog(ERROR, "Database %s not found.", (*target)->dbname);
+
+	return sddb_plan_backends((*target)->dbid, *mode, policy_flags(), items);
+}
+
+/*
+ * Dry run of a shutdown: return what the shutdown of the database in the
+ * mode would do with each of its backend processes, one row per process.
+ */
+Datum
+sddb_plan(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	sddbTarget *target;
+	sddbPlanItem *items;
+	TimestampTz now;
+	int			mode;
+	int			num;
+	int			i;
+
+	num = get_plan(fcinfo, &target, &mode, &items);
+
+	tupstore = begin_srf(fcinfo, &tupdesc);
+
+	if (tupdesc->natts != SHUTDOWN_DB_PLAN_COLS)
+		elog(ERROR, "incorrect number of output arguments");
+
+	now = GetCurrentTimestamp();
+
+	for (i = 0; i < num; i++)
+	{
+		sddbPlanItem *item = &items[i];
+		Datum		values[SHUTDOWN_DB_PLAN_COLS];
+		bool		nulls[SHUTDOWN_DB_PLAN_COLS];
+		const char *label;
+		char	   *rolname = NULL;
+		int			j = 0;
+
+		memset(values, 0, sizeof(values));
+		memset(nulls, 0, sizeof(nulls));
+
+		if (OidIsValid(item->roleid))
+			rolname = GetUserNameFromId(item->roleid, true);
+
+		values[j++] = Int32GetDatum(item->pid);
+		if ((label = backend_type_label(item->backend_type)) != NULL)
+			values[j++] = CStringGetTextDatum(label);
+		else
+			nulls[j++] = true;
+		if (rolname != NULL)
+			values[j++] = CStringGetTextDatum(rolname);
+		else
+			nulls[j++] = true;
+		if ((label = backend_state_label(item->state)) != NULL)
+			values[j++] = CStringGetTextDatum(label);
+		else
+			nulls[j++] = true;
+		if (item->xact_start != 0)
+		{
+			values[j++] = TimestampTzGetDatum(item->xact_start);
+			values[j++] = interval_datum(Max(now - item->xact_start, 0));
+		}
+		else
+		{
+			nulls[j++] = true;
+			nulls[j++] = true;
+		}
+		values[j++] = CStringGetTextDatum(plan_action_label(item->action));
+		if (TransactionIdIsValid(item->xid))
+			values[j++] = TransactionIdGetDatum(item->xid);
+		else
+			nulls[j++] = true;
+		if (item->subxacts >= 0)
+			values[j++] = Int32GetDatum(item->subxacts);
+		else
+			nulls[j++] = true;
+
+		Assert(j == SHUTDOWN_DB_PLAN_COLS);
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	return (Datum) 0;
+}
+
+/*
+ * Dry run of a shutdown: summarize shutdown_db.plan() of the database in
+ * the mode, with the predicted drain time and the dirty buffers, so that
+ * the drains of many databases can be ordered to minimize the downtime.
+ *
+ * The drain time is predicted from the transactions to be waited for, each
+ * of which is expected to run as long again as it has run; it's bounded by
+ * `timeout` in TRANSACTIONAL mode, after which the rest are cancelled. In
+ * ABORT mode, the time to write out the dirty buffers at
+ * shutdown_db.flush_rate_limit is added if shutdown_db.abort_flush is
+ * database. It's NULL in NORMAL mode if any session is left running,
+ * since they are never drained until they disconnect by themselves.
+ */
+Datum
+sddb_plan_summary(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	sddbTarget *target;
+	sddbPlanItem *items;
+	sddbStatsCounters counters;
+	Datum		values[SHUTDOWN_DB_PLAN_SUMMARY_COLS];
+	bool		nulls[SHUTDOWN_DB_PLAN_SUMMARY_COLS];
+	int			actions[PLAN_IGNORE + 1];
+	TimestampTz now;
+	TimestampTz oldest = 0;
+	int64		lost = 0;
+	int64		predicted = 0;
+	int			rolled_back = 0;
+	int			ndirty;
+	int			mode;
+	int			num;
+	int			i;
+	int			j = 0;
+
+	num = get_plan(fcinfo, &target, &mode, &items);
+
+	tupstore = begin_srf(fcinfo, &tupdesc);
+
+	if (tupdesc->natts != SHUTDOWN_DB_PLAN_SUMMARY_COLS)
+		elog(ERROR, "incorrect number of output arguments");
+
+	now = GetCurrentTimestamp();
+	memset(actions, 0, sizeof(actions));
+
+	for (i = 0; i < num; i++)
+	{
+		sddbPlanItem *item = &items[i];
+		int64		age = (item->xact_start != 0) ? Max(now - item->xact_start, 0) : 0;
+
+		actions[item->action]++;
+
+		if (item->xact_start != 0 && (oldest == 0 || item->xact_start < oldest))
+			oldest = item->xact_start;
+
+		if (item->action == PLAN_CANCEL)
+		{
+			lost += age;
+			if (TransactionIdIsValid(item->xid))
+				rolled_back++;
+		}
+		else if (item->action == PLAN_WAIT)
+			predicted = Max(predicted, age);
+	}
+
+	if (mode == TRANSACTIONAL && !PG_ARGISNULL(2))
+	{
+		TimestampTz deadline;
+
+		deadline = DatumGetTimestampTz(DirectFunctionCall2(timestamptz_pl_interval,
+														   TimestampTzGetDatum(now),
+														   PG_GETARG_DATUM(2)));
+		predicted = Min(predicted, Max(deadline - now, 0));
+	}
+
+	ndirty = sddb_count_dirty_buffers(target->dbid);
+
+#if PG_VERSION_NUM >= 140000
+	if (mode == ABORT && sddb_abort_flush == FLUSH_DATABASE &&
+		sddb_flush_rate_limit > 0)
+		predicted += (int64) ((double) ndirty * USECS_PER_SEC / sddb_flush_rate_limit);
+#endif
+
+	memset(values, 0, sizeof(values));
+	memset(nulls, 0, sizeof(nulls));
+
+	values[j++] = CStringGetTextDatum(target->dbname);
+	values[j++] = CStringGetTextDatum(mode_label(mode));
+	values[j++] = Int32GetDatum(num);
+	values[j++] = Int32GetDatum(actions[PLAN_TERMINATE]);
+	values[j++] = Int32GetDatum(actions[PLAN_CANCEL]);
+	values[j++] = Int32GetDatum(actions[PLAN_WAIT]);
+	values[j++] = Int32GetDatum(actions[PLAN_IGNORE]);
+	values[j++] = Int32GetDatum(rolled_back);
+	if (oldest != 0)
+		values[j++] = TimestampTzGetDatum(oldest);
+	else
+		nulls[j++] = true;
+	values[j++] = interval_datum(lost);
+	if (mode == NORMAL && actions[PLAN_NONE] > 0)
+		nulls[j++] = true;
+	else
+		values[j++] = interval_datum(predicted);
+	if (sddb_stats_get(target->dbid, &counters) && counters.drains > 0)
+		values[j++] = interval_datum((int64) (counters.drain_time * 1000.0 / counters.drains));
+	else
+		nulls[j++] = true;
+	values[j++] = Int64GetDatum((int64) ndirty);
+	values[j++] = Int64GetDatum((int64) ndirty * BLCKSZ);
+
+	Assert(j == SHUTDOWN_DB_PLAN_SUMMARY_COLS);
+	tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+
+	return (Datum) 0;
+}
+
+/*
+ * Compare the stats entries by dbid, for qsort.
+ */
+static int
+stats_entry_cmp(const void *p1, const void *p2)
+{
+	return sddb_oid_cmp(&((const sddbStatsEntry *) p1)->dbid,
+						&((const sddbStatsEntry *) p2)->dbid);
+}
+
+/*
+ * Set the counters into values[*j ..], the columns from shutdowns_normal
+ * to rejections.
+ */
+static void
+put_counters(const sddbStatsCounters * counters, Datum *values, bool *nulls,
+			 int *j)
+{
+	int			mode;
+
+	for (mode = NORMAL; mode < SDDB_NUM_MODES; mode++)
+		values[(*j)++] = Int64GetDatum(counters->shutdowns[mode]);
+	values[(*j)++] = Int64GetDatum(counters->startups);
+	values[(*j)++] = Int64GetDatum(counters->drains);
+	values[(*j)++] = Float8GetDatum(counters->drain_time);
+	values[(*j)++] = Float8GetDatum(counters->max_drain_time);
+	values[(*j)++] = Int64GetDatum(counters->cancels);
+	values[(*j)++] = Int64GetDatum(counters->terminates);
+	values[(*j)++] = Int64GetDatum(counters->rejections);
+}
+
+/*
+ * Retrieve the statistics: one row per database, in ascending order of
+ * dbid, followed by the row of the totals, whose dbid is NULL. The counters
+ * of the supervisor process and the hooks are only in the latter.
+ */
+Datum
+sddb_stats(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	sddbStatsEntry *entries;
+	sddbStatsCounters total;
+	sddbStatsGlobal global;
+	Datum		values[SHUTDOWN_DB_STATS_COLS];
+	bool		nulls[SHUTDOWN_DB_STATS_COLS];
+	int			num;
+	int			i,
+				j,
+				k;
+
+	tupstore = begin_srf(fcinfo, &tupdesc);
+
+	if (tupdesc->natts != SHUTDOWN_DB_STATS_COLS)
+		elog(ERROR, "incorrect number of output arguments");
+
+	/* Superusers or members of pg_read_all_stats members are allowed */
+	if (!is_allowed_role())
+		return (Datum) 0;
+
+	num = sddb_stats_copy(&entries, &total, &global);
+	qsort(entries, num, sizeof(sddbStatsEntry), stats_entry_cmp);
+
+	for (i = 0; i < num; i++)
+	{
+		j = 0;
+		memset(values, 0, sizeof(values));
+		memset(nulls, 0, sizeof(nulls));
+
+		values[j++] = ObjectIdGetDatum(entries[i].dbid);
+		if (NameStr(entries[i].datname)[0] != '\0')
+			values[j++] = CStringGetTextDatum(NameStr(entries[i].datname));
+		else
+			nulls[j++] = true;
+		put_counters(&entries[i].counters, values, nulls, &j);
+
+		/* supervisor_loops, the hook calls and stats_reset */
+		while (j < SHUTDOWN_DB_STATS_COLS)
+			nulls[j++] = true;
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	j = 0;
+	memset(values, 0, sizeof(values));
+	memset(nulls, 0, sizeof(nulls));
+
+	nulls[j++] = true;
+	nulls[j++] = true;
+	put_counters(&total, values, nulls, &j);
+	values[j++] = Int64GetDatum(global.supervisor_loops);
+	for (k = 0; k < SDDB_NUM_HOOKS; k++)
+		values[j++] = Int64GetDatum(global.hook_calls[k]);
+	values[j++] = TimestampTzGetDatum(global.stats_reset);
+
+	Assert(j == SHUTDOWN_DB_STATS_COLS);
+	tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+
+	return (Datum) 0;
+}
+
+/*
+ * Reset the statistics.
+ */
+Datum
+sddb_stats_reset_all(PG_FUNCTION_ARGS)
+{
+	sddb_stats_reset();
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * Queue the shutdowns of the given databases in the given mode, which the
+ * supervisor process runs within the budgets of shutdown_db.job_*. Returns
+ * the job id of each database name; see shutdown_db.jobs for the progress.
+ */
+Datum
+sddb_schedule(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	sddbTarget *targets;
+	char	   *mode_str;
+	int			mode;
+	int			n;
+	int			i;
+
+	check_workenv();
+
+	if (!is_allowed_role())
+		elog(ERROR, "You cannot execute this function because of no-privilege.");
+
+	mode_str = text_to_cstring(PG_GETARG_TEXT_PP(1));
+	if ((mode = parse_mode(mode_str)) < 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("invalid shutdown mode: \"%s\"", mode_str),
+				 errhint("Valid modes are \"normal\", \"abort\", \"immediate\" and \"transactional\".")));
+
+	/* Get database names */
+	targets = get_targets(fcinfo, &n);
+
+	tupstore = begin_srf(fcinfo, &tupdesc);
+
+	for (i = 0; i < n; i++)
+	{
+		Datum		values[2];
+		bool		nulls[2];
+
+		memset(nulls, 0, sizeof(nulls));
+		values[0] = Int64GetDatum(sddb_job_enqueue(targets[i].dbname, mode));
+		values[1] = CStringGetTextDatum(targets[i].dbname);
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	run_sddb_killer();
+
+	return (Datum) 0;
+}
+
+/*
+ * Return the jobs of the scheduler, in the order of the job id.
+ */
+Datum
+sddb_jobs(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	sddbJob    *jobs;
+	int			num;
+	int			i;
+
+	tupstore = begin_srf(fcinfo, &tupdesc);
+
+	if (tupdesc->natts != SHUTDOWN_DB_JOBS_COLS)
+		elog(ERROR, "incorrect number of output arguments");
+
+	/* Superusers or members of pg_read_all_stats members are allowed */
+	if (!is_allowed_role())
+		return (Datum) 0;
+
+	num = sddb_jobs_copy(&jobs);
+
+	for (i = 0; i < num; i++)
+	{
+		Datum		values[SHUTDOWN_DB_JOBS_COLS];
+		bool		nulls[SHUTDOWN_DB_JOBS_COLS];
+		int			j = 0;
+
+		memset(values, 0, sizeof(values));
+		memset(nulls, 0, sizeof(nulls));
+
+		values[j++] = Int64GetDatum(jobs[i].job_id);
+		values[j++] = CStringGetTextDatum(NameStr(jobs[i].datname));
+		if (OidIsValid(jobs[i].dbid))
+			values[j++] = ObjectIdGetDatum(jobs[i].dbid);
+		else
+			nulls[j++] = true;
+		values[j++] = CStringGetTextDatum(mode_label(jobs[i].mode));
+		values[j++] = CStringGetTextDatum(job_state_label(jobs[i].state));
+		if (jobs[i].started_at != 0)
+			values[j++] = Int32GetDatum(jobs[i].backends);
+		else
+			nulls[j++] = true;
+		values[j++] = TimestampTzGetDatum(jobs[i].queued_at);
+		if (jobs[i].started_at != 0)
+			values[j++] = TimestampTzGetDatum(jobs[i].started_at);
+		else
+			nulls[j++] = true;
+		if (jobs[i].finished_at != 0)
+			values[j++] = TimestampTzGetDatum(jobs[i].finished_at);
+		else
+			nulls[j++] = true;
+		if (jobs[i].result[0] != '\0')
+			values[j++] = CStringGetTextDatum(jobs[i].result);
+		else
+			nulls[j++] = true;
+
+		Assert(j == SHUTDOWN_DB_JOBS_COLS);
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	return (Datum) 0;
+}
+
+/*
+ * Cancel all the queued jobs. The running ones are not affected. Returns
+ * the number of the jobs canceled.
+ */
+Datum
+sddb_cancel_jobs(PG_FUNCTION_ARGS)
+{
+	check_workenv();
+
+	if (!is_allowed_role())
+		elog(ERROR, "You cannot execute this function because of no-privilege.");
+
+	PG_RETURN_INT32(sddb_jobs_cancel());
+}
+
+/*
+ * Store the databases whose connections are rejected by pg_database, but
+ * which are unknown to the hash table, as INIT mode. This is only needed
+ * for the databases which have been shut down before the state file was
+ * introduced, and it can't tell their modes; so nothing is done if the hash
+ * table has been restored from the state file. This is called once by
+ * CREATE EXTENSION, not at every server start. Returns the number of the
+ * stored databases.
+ */
+Datum
+sddb_import_catalog(PG_FUNCTION_ARGS)
+{
+	int			ret;
+	int			n = 0;
+	uint64		i;
+
+	check_workenv();
+
+	if (!superuser())
+		elog(ERROR, "You cannot execute this function because of no-privilege.");
+
+	if (sddb->state_loaded)
+		PG_RETURN_INT32(0);
+
+	SPI_connect();
+
+	ret = SPI_execute("SELECT oid, datname FROM pg_database"
+					  " WHERE datallowconn = false AND datname"
+					  " NOT IN ('template0', 'template1', 'postgres');",
+					  true, 0);
+
+	if (ret != SPI_OK_SELECT)
+		ereport(ERROR, (errmsg("SPI_execute failed: error code %d", ret)));
+
+	for (i = 0; i < SPI_processed; i++)
+	{
+		bool		isnull;
+		Oid			dbid;
+		char	   *datname;
+
+		dbid = DatumGetObjectId(SPI_getbinval(SPI_tuptable->vals[i],
+											  SPI_tuptable->tupdesc,
+											  1, &isnull));
+		datname = SPI_getvalue(SPI_tuptable->vals[i],
+							   SPI_tuptable->tupdesc, 2);
+		if (sddb_store_entry(dbid, datname, INIT, false, SDDB_FLAG_CATALOG_GATE))
+			n++;
+	}
+
+	SPI_finish();
+
+	/* From now on, the state file keeps the hash table. */
+	sddb->state_loaded = true;
+	sddb_save_state();
+
+	PG_RETURN_INT32(n);
 }
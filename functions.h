@@ -0,0 +1,17 @@
+/*-------------------------------------------------------------------------
+ * functions.h
+ *
+ * Copyright (c) 2008-2025, PostgreSQL Global Development Group
+ * Copyright (c) 2020-2025, hironobu suzuki@interdb.jp
+ *-------------------------------------------------------------------------
+ */
+#ifndef __FUNCTIONS_H__
+#define __FUNCTIONS_H__
+
+/*
+ * Function declarations
+ */
+bool		sddb_shutdown_job(const char *dbname, const int mode, Oid *dbid,
+							  const char **result);
+
+#endif
@@ -10,256 +10,1686 @@
 #include "funcapi.h"
 #include "miscadmin.h"
 #include "pgstat.h"
+#if PG_VERSION_NUM >= 150000
+#include "common/hashfn.h"
+#include "lib/dshash.h"
+#include "utils/dsa.h"
+#endif
+#include "utils/builtins.h"
+#include "utils/memutils.h"
+#include "utils/timestamp.h"
 
 #include "shutdown_db.h"
+#include "backends.h"
 #include "hashtable.h"
+#include "statefile.h"
 
 /*
  * extern variables
  */
 extern sddbSharedState * sddb;
 extern HTAB *sddb_hash;
+extern HTAB *sddb_name_hash;
+extern int	sddb_hash_storage;
+
+#if PG_VERSION_NUM >= 150000
+/*
+ * The table of STORAGE_DYNAMIC, which this process has attached to
+ */
+static dsa_area *sddb_dsa = NULL;
+static dshash_table *sddb_dshash = NULL;
+#endif
+
+/*
+ * Sequential scan over the table, which is either a HTAB (STORAGE_FIXED)
+ * or a dshash table (STORAGE_DYNAMIC).
+ */
+typedef struct sddbTableScan
+{
+	HASH_SEQ_STATUS hash_seq;
+#if PG_VERSION_NUM >= 150000
+	dshash_seq_status dshash_seq;
+#endif
+	bool		done;			/* whether the scan has been run to the end */
+}			sddbTableScan;
+
+/*
+ * An entry collected by sddb_collect_running(), sddb_collect_blocking() and
+ * sddb_collect_undrained()
+ */
+typedef struct sddbRunningItem
+{
+	Oid			dbid;			/* MUST BE FIRST, for sddb_oid_cmp() */
+	TimestampTz deadline;
+	TimestampTz shutdown_time;
+	int			flags;
+}			sddbRunningItem;
 
 /*
  * Function declarations
  */
-static sddbEntry * alloc_entry(sddbHashKey * key);
+#if PG_VERSION_NUM >= 150000
+static void attach_dynamic(void);
+#endif
+static LWLock *partition_lock(const sddbHashKey * key);
+static LWLock *name_lock(const sddbNameKey * key);
+static void set_name_key(sddbNameKey * key, const char *datname,
+						 const char *rolname);
+static void index_entry(const sddbHashKey * key, const char *datname,
+						const char *rolname);
+static void unindex_entry(const sddbHashKey * key, const char *datname,
+						  const char *rolname);
+static bool scan_by_name(const char *datname, const char *rolname, Oid *dbid);
+static void lock_all_partitions(const LWLockMode mode);
+static void unlock_all_partitions(void);
+static sddbEntry * table_find(const sddbHashKey * key);
+static sddbEntry * table_enter(const sddbHashKey * key, bool *found);
+static void table_remove(const sddbHashKey * key);
+static void table_scan_begin(sddbTableScan * scan);
+static sddbEntry * table_scan_next(sddbTableScan * scan);
+static void table_scan_end(sddbTableScan * scan);
+static sddbEntry * alloc_entry(sddbHashKey * key, bool *found);
+static void count_running(const Oid dbid, const bool is_running);
+static void bump_generation(void);
+static void set_phase(sddbEntry * entry, const int phase, const TimestampTz now);
+static int	store_entries(const Oid *dbids, const char *const *datnames,
+						  const Oid roleid, const char *rolname,
+						  const int n, const int mode,
+						  const bool is_running, const int flags,
+						  const bool count_drain,
+						  const TimestampTz shutdown_time,
+						  const TimestampTz deadline, int *results);
+static bool get_entry(const sddbHashKey * key, sddbEntry * copy);
+static bool set_running(const sddbHashKey * key, const bool is_running);
+static bool delete_entry(const sddbHashKey * key);
+
+
+/*
+ * Make sure the table can be used in this process. Returns false if the
+ * shared memory has not been set up, i.e., shutdown_db is not loaded via
+ * shared_preload_libraries.
+ *
+ * This is cheap except for the first call in each process under
+ * STORAGE_DYNAMIC, which attaches to the table, or creates it, under the
+ * file lock. So the functions called for every connection or statement
+ * check the counters in sddb first, which are always in the main shared
+ * memory, and only attach if they can't tell the answer from them.
+ */
+bool
+sddb_attach_table(void)
+{
+	if (!sddb)
+		return false;
+
+	if (sddb_hash_storage == STORAGE_FIXED)
+		return (sddb_hash != NULL);
+
+#if PG_VERSION_NUM >= 150000
+	if (sddb_dshash == NULL)
+		attach_dynamic();
+	return true;
+#else
+	return false;
+#endif
+}
+
+#if PG_VERSION_NUM >= 150000
+/*
+ * Attach to the table of STORAGE_DYNAMIC.
+ *
+ * The table is created by the first process that uses it, rather than by
+ * the postmaster, because the postmaster can't create DSM segments. The
+ * creator also restores the entries from the state file, which would have
+ * been done by sddb_shmem_startup() under STORAGE_FIXED. Both are done
+ * under sddb->file_lock, so no process sees the table before it is filled.
+ */
+static void
+attach_dynamic(void)
+{
+	MemoryContext oldcontext;
+	dshash_parameters params;
+
+	/* The area and the table must live as long as this process */
+	oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+
+	LWLockAcquire(sddb->file_lock, LW_EXCLUSIVE);
+
+	if (!sddb->dynamic_created)
+		sddb->tranche_id = LWLockNewTrancheId();
+	LWLockRegisterTranche(sddb->tranche_id, "shutdown_db_hash");
+
+	memset(&params, 0, sizeof(params));
+	params.key_size = sizeof(sddbHashKey);
+	params.entry_size = sizeof(sddbEntry);
+	params.compare_function = dshash_memcmp;
+	params.hash_function = dshash_memhash;
+#if PG_VERSION_NUM >= 170000
+	params.copy_function = dshash_memcpy;
+#endif
+	params.tranche_id = sddb->tranche_id;
+
+	if (!sddb->dynamic_created)
+	{
+		/* First time through ... */
+		sddb_dsa = dsa_create(sddb->tranche_id);
+		dsa_pin(sddb_dsa);
+		dsa_pin_mapping(sddb_dsa);
+		sddb_dshash = dshash_create(sddb_dsa, &params, NULL);
+
+		sddb->dsa_handle = dsa_get_handle(sddb_dsa);
+		sddb->dshash_handle = dshash_get_hash_table_handle(sddb_dshash);
+		sddb->dynamic_created = true;
+
+		/* Restore the shutdown databases from the state file. */
+		sddb_load_state();
+	}
+	else
+	{
+		sddb_dsa = dsa_attach(sddb->dsa_handle);
+		dsa_pin_mapping(sddb_dsa);
+		sddb_dshash = dshash_attach(sddb_dsa, &params, sddb->dshash_handle, NULL);
+	}
+
+	LWLockRelease(sddb->file_lock);
+
+	MemoryContextSwitchTo(oldcontext);
+}
+#endif
+
+/*
+ * Return the lock of the partition the entry whose key is key belongs to.
+ *
+ * Under STORAGE_FIXED, the partition is computed from the hash code of the
+ * HTAB, as the buffer mapping table does, so that the entries in the same
+ * bucket always belong to the same partition.
+ */
+static LWLock *
+partition_lock(const sddbHashKey * key)
+{
+	uint32		hashcode;
+
+#if PG_VERSION_NUM >= 150000
+	if (sddb_hash_storage == STORAGE_DYNAMIC)
+		hashcode = tag_hash(key, sizeof(sddbHashKey));
+	else
+#endif
+		hashcode = get_hash_value(sddb_hash, key);
+
+	return sddb->partition_locks[hashcode % SDDB_NUM_PARTITIONS];
+}
+
+/*
+ * Return the lock of the partition of the name index the item whose key is
+ * key belongs to.
+ *
+ * A partition lock of the table may be held while taking it, but never the
+ * other way around.
+ */
+static LWLock *
+name_lock(const sddbNameKey * key)
+{
+	uint32		hashcode;
+
+	hashcode = get_hash_value(sddb_name_hash, key);
+
+	return sddb->name_locks[hashcode % SDDB_NUM_PARTITIONS];
+}
+
+/*
+ * Set the key of the name index. rolname is NULL for the entry of the
+ * whole database. The key is zero-padded, since it's hashed as a blob.
+ */
+static void
+set_name_key(sddbNameKey * key, const char *datname, const char *rolname)
+{
+	MemSet(key, 0, sizeof(sddbNameKey));
+	strlcpy(NameStr(key->datname), datname, NAMEDATALEN);
+	if (rolname)
+		strlcpy(NameStr(key->rolname), rolname, NAMEDATALEN);
+}
+
+/*
+ * Add the entry whose key is key to the name index. If the index is full,
+ * or the name is already taken by another entry, e.g. the entry of a
+ * dropped database which has been restored from the state file, the entry
+ * is counted in sddb->num_unindexed instead, and sddb_find_entry_by_name()
+ * falls back to scanning the table until it's deleted.
+ * Caller must hold an exclusive lock on the partition of key.
+ */
+static void
+index_entry(const sddbHashKey * key, const char *datname, const char *rolname)
+{
+	sddbNameKey name_key;
+	sddbNameEntry *item;
+	LWLock	   *lock;
+	bool		found;
+
+	set_name_key(&name_key, datname, rolname);
+
+	lock = name_lock(&name_key);
+	LWLockAcquire(lock, LW_EXCLUSIVE);
+
+	item = (sddbNameEntry *) hash_search(sddb_name_hash, &name_key,
+										 HASH_ENTER_NULL, &found);
+	if (item != NULL && !found)
+		item->entry_key = *key;
+	else
+		pg_atomic_fetch_add_u32(&sddb->num_unindexed, 1);
+
+	LWLockRelease(lock);
+}
+
+/*
+ * Remove the entry whose key is key from the name index, or uncount it
+ * from sddb->num_unindexed if it has not been indexed.
+ * Caller must hold an exclusive lock on the partition of key.
+ */
+static void
+unindex_entry(const sddbHashKey * key, const char *datname,
+			  const char *rolname)
+{
+	sddbNameKey name_key;
+	sddbNameEntry *item;
+	LWLock	   *lock;
+
+	set_name_key(&name_key, datname, rolname);
+
+	lock = name_lock(&name_key);
+	LWLockAcquire(lock, LW_EXCLUSIVE);
+
+	item = (sddbNameEntry *) hash_search(sddb_name_hash, &name_key,
+										 HASH_FIND, NULL);
+	if (item != NULL &&
+		item->entry_key.dbid == key->dbid &&
+		item->entry_key.roleid == key->roleid)
+		hash_search(sddb_name_hash, &name_key, HASH_REMOVE, NULL);
+	else
+	{
+		Assert(pg_atomic_read_u32(&sddb->num_unindexed) > 0);
+		pg_atomic_fetch_sub_u32(&sddb->num_unindexed, 1);
+	}
+
+	LWLockRelease(lock);
+}
+
+/*
+ * Lock all the partitions in `mode`, for a sequential scan over the table.
+ * They are always locked in the same order, so that two scans can't
+ * deadlock.
+ */
+static void
+lock_all_partitions(const LWLockMode mode)
+{
+	int			i;
+
+	for (i = 0; i < SDDB_NUM_PARTITIONS; i++)
+		LWLockAcquire(sddb->partition_locks[i], mode);
+}
+
+static void
+unlock_all_partitions(void)
+{
+	int			i;
+
+	for (i = SDDB_NUM_PARTITIONS - 1; i >= 0; i--)
+		LWLockRelease(sddb->partition_locks[i]);
+}
+
+/*
+ * Find the entry whose key is key in the table, and return it; NULL if
+ * not found.
+ * Caller must hold the lock of the partition of key; the entry stays valid
+ * until it is released.
+ */
+static sddbEntry *
+table_find(const sddbHashKey * key)
+{
+#if PG_VERSION_NUM >= 150000
+	if (sddb_hash_storage == STORAGE_DYNAMIC)
+	{
+		sddbEntry  *entry;
+
+		/*
+		 * Entries are deleted only under an exclusive lock on our partition
+		 * lock, so the lock of the dshash partition is not needed after the
+		 * lookup.
+		 */
+		if ((entry = (sddbEntry *) dshash_find(sddb_dshash, key, false)) != NULL)
+			dshash_release_lock(sddb_dshash, entry);
+		return entry;
+	}
+#endif
+	return (sddbEntry *) hash_search(sddb_hash, key, HASH_FIND, NULL);
+}
+
+/*
+ * Find or create the entry whose key is key in the table. If the entry
+ * already exists, *found is set to true. Return NULL if the table is full,
+ * which never happens under STORAGE_DYNAMIC.
+ * Caller must hold an exclusive lock on the partition of key.
+ */
+static sddbEntry *
+table_enter(const sddbHashKey * key, bool *found)
+{
+#if PG_VERSION_NUM >= 150000
+	if (sddb_hash_storage == STORAGE_DYNAMIC)
+	{
+		sddbEntry  *entry;
+
+		entry = (sddbEntry *) dshash_find_or_insert(sddb_dshash, key, found);
+		dshash_release_lock(sddb_dshash, entry);
+		return entry;
+	}
+#endif
+	return (sddbEntry *) hash_search(sddb_hash, key, HASH_ENTER_NULL, found);
+}
+
+/*
+ * Remove the entry whose key is key from the table.
+ * Caller must hold an exclusive lock on the partition of key.
+ */
+static void
+table_remove(const sddbHashKey * key)
+{
+#if PG_VERSION_NUM >= 150000
+	if (sddb_hash_storage == STORAGE_DYNAMIC)
+	{
+		dshash_delete_key(sddb_dshash, key);
+		return;
+	}
+#endif
+	hash_search(sddb_hash, key, HASH_REMOVE, NULL);
+}
+
+/*
+ * Begin, continue and end a sequential scan over the table. The scan must
+ * always be ended by table_scan_end(), even if it has been run to the end.
+ * Caller must hold the locks of all the partitions during the scan.
+ */
+static void
+table_scan_begin(sddbTableScan * scan)
+{
+	scan->done = false;
+#if PG_VERSION_NUM >= 150000
+	if (sddb_hash_storage == STORAGE_DYNAMIC)
+	{
+		dshash_seq_init(&scan->dshash_seq, sddb_dshash, false);
+		return;
+	}
+#endif
+	hash_seq_init(&scan->hash_seq, sddb_hash);
+}
+
+static sddbEntry *
+table_scan_next(sddbTableScan * scan)
+{
+	sddbEntry  *entry;
+
+	if (scan->done)
+		return NULL;
+
+#if PG_VERSION_NUM >= 150000
+	if (sddb_hash_storage == STORAGE_DYNAMIC)
+		entry = (sddbEntry *) dshash_seq_next(&scan->dshash_seq);
+	else
+#endif
+		entry = (sddbEntry *) hash_seq_search(&scan->hash_seq);
+
+	if (entry == NULL)
+		scan->done = true;
+
+	return entry;
+}
+
+static void
+table_scan_end(sddbTableScan * scan)
+{
+#if PG_VERSION_NUM >= 150000
+	if (sddb_hash_storage == STORAGE_DYNAMIC)
+	{
+		dshash_seq_term(&scan->dshash_seq);
+		return;
+	}
+#endif
+	/* hash_seq_search() has already ended the scan which ran to the end */
+	if (!scan->done)
+		hash_seq_term(&scan->hash_seq);
+}
 
 
 /*
- * Allocate a new hash table entry.
- * Caller must hold an exclusive lock on sddb->lock
+ * Allocate a new hash table entry. If the entry already exists, *found is
+ * set to true and the existing entry is returned.
+ * Caller must hold an exclusive lock on the partition of key.
  */
 static sddbEntry *
-alloc_entry(sddbHashKey * key)
+alloc_entry(sddbHashKey * key, bool *found)
+{
+	sddbEntry  *entry;
+
+	/*
+	 * Find or create an entry with desired hash code. If hash table is full,
+	 * return NULL.
+	 */
+	if ((entry = table_enter(key, found)) == NULL)
+		return entry;
+
+	if (!*found)
+	{
+		/* New entry, initialize it */
+		SpinLockInit(&entry->mutex);
+		entry->dbid = InvalidOid;
+		MemSet(&entry->datname, 0, sizeof(NameData));
+		MemSet(&entry->rolname, 0, sizeof(NameData));
+		entry->mode = INIT;
+		entry->flags = 0;
+		entry->is_running = false;
+		entry->deadline = 0;
+		entry->released_buffers = -1;
+		entry->pid = InvalidPid;
+		entry->phase = PHASE_DONE;
+		entry->phase_change = 0;
+		entry->progress_pid = InvalidPid;
+		entry->backends_start = -1;
+		entry->buffers_flushed = -1;
+		entry->drain_pending = false;
+	}
+
+	return entry;
+}
+
+
+/*
+ * Maintain sddb->num_running and the counting filter when the `is_running`
+ * value of the entry whose key is dbid turns into is_running.
+ * Caller must hold the entry's mutex so that transitions are not lost.
+ */
+static void
+count_running(const Oid dbid, const bool is_running)
+{
+	if (is_running)
+	{
+		pg_atomic_fetch_add_u32(&sddb->filter[SDDB_FILTER_SLOT(dbid)], 1);
+		pg_atomic_fetch_add_u32(&sddb->num_running, 1);
+	}
+	else
+	{
+		Assert(pg_atomic_read_u32(&sddb->filter[SDDB_FILTER_SLOT(dbid)]) > 0);
+		pg_atomic_fetch_sub_u32(&sddb->filter[SDDB_FILTER_SLOT(dbid)], 1);
+		pg_atomic_fetch_sub_u32(&sddb->num_running, 1);
+	}
+}
+
+
+/*
+ * Tell all backends that the hash table has been changed, so that they
+ * refresh the state of their database cached in sddb_check_ht().
+ * Must be called after the change is done; pg_atomic_fetch_add_u64()
+ * is a full memory barrier.
+ */
+static void
+bump_generation(void)
+{
+	pg_atomic_fetch_add_u64(&sddb->generation, 1);
+}
+
+/*
+ * Set the phase of the drain of the entry, whose mutex the caller holds,
+ * as reported by this process at `now`.
+ */
+static void
+set_phase(sddbEntry * entry, const int phase, const TimestampTz now)
+{
+	if (entry->phase != phase)
+	{
+		entry->phase = phase;
+		entry->phase_change = now;
+	}
+	entry->progress_pid = MyProcPid;
+}
+
+
+/*
+ * Store the entry whose key is dbid to the hash table.
+ */
+bool
+sddb_store_entry(const Oid dbid, const char *datname, const int mode,
+				 const bool is_running, const int flags)
+{
+	int			result;
+
+	if (sddb_store_entries(&dbid, &datname, 1, mode, is_running, flags, 0,
+						   &result) == 1)
+		return true;
+
+	if (result == SDDB_EXISTS)
+		elog(WARNING, "database %u is already stored.", dbid);
+	else if (result == SDDB_FULL)
+		elog(WARNING, "New entry was not created since hash table is full.");
+	return false;
+}
+
+/*
+ * Store the entries whose keys are dbids[0 .. n-1], and whose database
+ * names are datnames[0 .. n-1], to the hash table. Each entry is stored
+ * under the exclusive lock of its own partition only, so that storing
+ * entries doesn't block the lookups of other databases.
+ *
+ * `deadline` is the time when the supervisor process gives up draining
+ * the databases and escalates them to IMMEDIATE mode, or 0 if none.
+ *
+ * The result of dbids[i], SDDB_STORED, SDDB_EXISTS or SDDB_FULL, is set
+ * into results[i]. Returns the number of the stored entries.
+ */
+int
+sddb_store_entries(const Oid *dbids, const char *const *datnames,
+				   const int n, const int mode,
+				   const bool is_running, const int flags,
+				   const TimestampTz deadline, int *results)
+{
+	return store_entries(dbids, datnames, InvalidOid, NULL, n, mode,
+						 is_running, flags, true, GetCurrentTimestamp(),
+						 deadline, results);
+}
+
+/*
+ * Store the entry of the role roleid, whose name is rolname, in the
+ * database dbid. Only the sessions of the role in the database are
+ * rejected and terminated; see shutdown_db.shutdown_role(). The result is
+ * returned as sddb_store_entries() sets it.
+ */
+int
+sddb_store_role_entry(const Oid dbid, const char *datname,
+					  const Oid roleid, const char *rolname,
+					  const int mode, const bool is_running)
+{
+	int			result;
+
+	Assert(OidIsValid(roleid));
+
+	(void) store_entries(&dbid, &datname, roleid, rolname, 1, mode,
+						 is_running, 0, false, GetCurrentTimestamp(), 0,
+						 &result);
+	return result;
+}
+
+/*
+ * Store the entry which has been saved in the state file, keeping its
+ * shutdown time. The killer process is never running for a restored entry.
+ * roleid is InvalidOid unless the entry is of a role.
+ */
+bool
+sddb_restore_entry(const Oid dbid, const char *datname,
+				   const Oid roleid, const char *rolname, const int mode,
+				   const int flags, const TimestampTz shutdown_time)
+{
+	int			result;
+
+	return (store_entries(&dbid, &datname, roleid, rolname, 1, mode, false,
+						  flags, false, shutdown_time, 0, &result) == 1);
+}
+
+/*
+ * Workhorse of sddb_store_entries(), sddb_store_role_entry() and
+ * sddb_restore_entry(). All the entries are of the role roleid, unless it
+ * is InvalidOid. If count_drain is true, the drains of the entries of the
+ * shutdown modes are counted by the supervisor process when their backends
+ * are gone.
+ */
+static int
+store_entries(const Oid *dbids, const char *const *datnames,
+			  const Oid roleid, const char *rolname,
+			  const int n, const int mode,
+			  const bool is_running, const int flags,
+			  const bool count_drain,
+			  const TimestampTz shutdown_time, const TimestampTz deadline,
+			  int *results)
 {
+	sddbHashKey key;
 	sddbEntry  *entry;
+	sddbEntry  *e;
+	LWLock	   *lock;
 	bool		found;
+	int			i;
+	int			num_stored = 0;
+
+	/* Safety check... */
+	if (!sddb_attach_table())
+	{
+		for (i = 0; i < n; i++)
+			results[i] = SDDB_FULL;
+		return 0;
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		/* Set key */
+		key.dbid = dbids[i];
+		key.roleid = roleid;
+
+		lock = partition_lock(&key);
+		LWLockAcquire(lock, LW_EXCLUSIVE);
+
+		/* Create new entry */
+		if ((entry = alloc_entry(&key, &found)) == NULL)
+		{
+			/* New entry was not created since hash table is full. */
+			LWLockRelease(lock);
+			results[i] = SDDB_FULL;
+			continue;
+		}
+
+		if (found)
+		{
+			LWLockRelease(lock);
+			results[i] = SDDB_EXISTS;
+			continue;
+		}
+
+		/* Store data into the entry. */
+		e = (sddbEntry *) entry;
+
+		SpinLockAcquire(&e->mutex);
+		e->dbid = dbids[i];
+		namestrcpy(&e->datname, datnames[i]);
+		if (OidIsValid(roleid))
+			namestrcpy(&e->rolname, rolname);
+		e->mode = mode;
+		e->flags = flags;
+		e->shutdown_time = shutdown_time;
+		e->state_change = shutdown_time;
+		e->deadline = deadline;
+		e->released_buffers = -1;
+		e->max_active = 0;
+		e->active = 0;
+		e->is_running = is_running;
+		e->pid = InvalidPid;
+		e->phase = PHASE_GATING;
+		e->phase_change = shutdown_time;
+		e->progress_pid = MyProcPid;
+		e->backends_start = -1;
+		e->buffers_flushed = -1;
+		e->drain_pending = (count_drain && SDDB_IS_SHUTDOWN(mode) &&
+							mode != INIT);
+		if (e->drain_pending)
+			pg_atomic_fetch_add_u32(&sddb->num_undrained, 1);
+		if (is_running)
+			count_running(dbids[i], true);
+		SpinLockRelease(&e->mutex);
+
+		index_entry(&key, datnames[i], OidIsValid(roleid) ? rolname : NULL);
+
+		pg_atomic_fetch_add_u32(&sddb->num_ht, 1);
+		if (OidIsValid(roleid))
+			pg_atomic_fetch_add_u32(&sddb->num_roles, 1);
+		if (SDDB_BUFFERS_PENDING(flags))
+			pg_atomic_fetch_add_u32(&sddb->num_releasing, 1);
+		if (flags & SDDB_FLAG_BLOCK_AUTOVAC)
+			pg_atomic_fetch_add_u32(&sddb->num_blocking, 1);
+
+		LWLockRelease(lock);
+
+		results[i] = SDDB_STORED;
+		num_stored++;
+	}
+
+	if (num_stored > 0)
+		bump_generation();
+
+	return num_stored;
+}
+
+
+/*
+ * Find the entry whose key is dbid in the hash table.
+ */
+bool
+sddb_find_entry(const Oid dbid, const bool is_running)
+{
+	sddbHashKey key;
+	sddbEntry  *entry;
+	LWLock	   *lock;
+	bool		result;
+
+	/* Safety check... */
+	if (!sddb)
+		return false;
+
+	/* quick check */
+	if (pg_atomic_read_u32(&sddb->num_ht) == 0)
+		return false;
+
+	if (!sddb_attach_table())
+		return false;
+
+	/* Set key */
+	key.dbid = dbid;
+	key.roleid = InvalidOid;
+
+	/* Look up the hash table entry with shared lock. */
+	lock = partition_lock(&key);
+	LWLockAcquire(lock, LW_SHARED);
+
+	if ((entry = table_find(&key)) == NULL)
+		result = false;
+	else if (is_running)
+	{
+		SpinLockAcquire(&entry->mutex);
+		result = entry->is_running;
+		SpinLockRelease(&entry->mutex);
+	}
+	else
+		result = true;
+
+	LWLockRelease(lock);
+
+	return result;
+}
+
+/*
+ * Find the entry whose database name is datname in the hash table. The
+ * THROTTLED and SUSPENDED entries are skipped, since they accept
+ * connections.
+ *
+ * This is used to reject connections before the database is looked up,
+ * so the entry is looked up in the name index, under the lock of a single
+ * partition of the index and then of the table. If found, its dbid is
+ * stored into *dbid unless dbid is NULL.
+ *
+ * If rolname is not NULL, the entry of the role whose name is rolname in
+ * the database is looked for instead of the entry of the whole database.
+ */
+bool
+sddb_find_entry_by_name(const char *datname, const char *rolname, Oid *dbid)
+{
+	sddbNameKey name_key;
+	sddbNameEntry *item;
+	sddbHashKey key;
+	sddbEntry	copy;
+	LWLock	   *lock;
+
+	/* Safety check... */
+	if (!sddb)
+		return false;
+
+	/* quick check */
+	if (pg_atomic_read_u32(&sddb->num_ht) == 0)
+		return false;
+	if (rolname && pg_atomic_read_u32(&sddb->num_roles) == 0)
+		return false;
+
+	if (!sddb_attach_table())
+		return false;
+
+	/* Some entries can only be found by scanning; see index_entry(). */
+	if (pg_atomic_read_u32(&sddb->num_unindexed) > 0)
+		return scan_by_name(datname, rolname, dbid);
+
+	set_name_key(&name_key, datname, rolname);
+
+	lock = name_lock(&name_key);
+	LWLockAcquire(lock, LW_SHARED);
+	item = (sddbNameEntry *) hash_search(sddb_name_hash, &name_key,
+										 HASH_FIND, NULL);
+	if (item != NULL)
+		key = item->entry_key;
+	LWLockRelease(lock);
+
+	if (item == NULL)
+		return false;
+
+	/* The entry may have been deleted since; then it's not found. */
+	if (!get_entry(&key, &copy) || !SDDB_IS_SHUTDOWN(copy.mode))
+		return false;
+
+	if (dbid)
+		*dbid = copy.dbid;
+	return true;
+}
+
+/*
+ * Same as sddb_find_entry_by_name(), but by scanning the table.
+ */
+static bool
+scan_by_name(const char *datname, const char *rolname, Oid *dbid)
+{
+	sddbTableScan scan;
+	sddbEntry  *entry;
+	bool		found = false;
+
+	lock_all_partitions(LW_SHARED);
+
+	table_scan_begin(&scan);
+	while ((entry = table_scan_next(&scan)) != NULL)
+	{
+		/* The names are changed only under the exclusive partition locks */
+		if (OidIsValid(entry->key.roleid) != (rolname != NULL))
+			continue;
+		if (rolname && strcmp(NameStr(entry->rolname), rolname) != 0)
+			continue;
+		if (SDDB_IS_SHUTDOWN(entry->mode) &&
+			strcmp(NameStr(entry->datname), datname) == 0)
+		{
+			if (dbid)
+				*dbid = entry->dbid;
+			found = true;
+			break;
+		}
+	}
+
+	table_scan_end(&scan);
+
+	unlock_all_partitions();
+
+	return found;
+}
+
+/*
+ * Copy the entry whose key is dbid into *copy. Returns false if not found.
+ */
+bool
+sddb_get_entry(const Oid dbid, sddbEntry * copy)
+{
+	sddbHashKey key;
+
+	/* Set key */
+	key.dbid = dbid;
+	key.roleid = InvalidOid;
+
+	return get_entry(&key, copy);
+}
+
+/*
+ * Same as sddb_get_entry(), but for the entry of the role roleid in the
+ * database dbid.
+ */
+bool
+sddb_get_role_entry(const Oid dbid, const Oid roleid, sddbEntry * copy)
+{
+	sddbHashKey key;
+
+	key.dbid = dbid;
+	key.roleid = roleid;
+
+	return get_entry(&key, copy);
+}
+
+/*
+ * Workhorse of sddb_get_entry() and sddb_get_role_entry().
+ */
+static bool
+get_entry(const sddbHashKey * key, sddbEntry * copy)
+{
+	sddbEntry  *entry;
+	LWLock	   *lock;
+
+	/* Safety check... */
+	if (!sddb_attach_table())
+		return false;
+
+	/* Look up the hash table entry with shared lock. */
+	lock = partition_lock(key);
+	LWLockAcquire(lock, LW_SHARED);
+	entry = table_find(key);
+
+	if (entry != NULL)
+	{
+		SpinLockAcquire(&entry->mutex);
+		memcpy(copy, entry, sizeof(sddbEntry));
+		SpinLockRelease(&entry->mutex);
+	}
+
+	LWLockRelease(lock);
+
+	return (entry != NULL);
+}
+
+/*
+ * Check whether the killer process is running for the database whose id is
+ * dbid, i.e. whether the entry exists and its `is_running` is true.
+ *
+ * This is called for every statement, so the common answer "no" is given
+ * without taking any lock: if no entry is running, or none of the running
+ * entries shares dbid's filter slot, only relaxed atomic reads are done.
+ * Otherwise, it falls back to sddb_find_entry().
+ */
+bool
+sddb_is_running(const Oid dbid)
+{
+	/* Safety check... */
+	if (!sddb)
+		return false;
+
+	if (pg_atomic_read_u32(&sddb->num_running) == 0)
+		return false;
+
+	if (pg_atomic_read_u32(&sddb->filter[SDDB_FILTER_SLOT(dbid)]) == 0)
+		return false;
+
+	if (!sddb_attach_table())
+		return false;
+
+	return sddb_find_entry(dbid, true);
+}
+
+/*
+ * Check whether the role roleid is being shut down in the database dbid,
+ * i.e. whether its entry exists and its `is_running` is true. As
+ * sddb_is_running(), this is quick unless some entry of dbid's filter slot
+ * is running.
+ */
+bool
+sddb_role_is_running(const Oid dbid, const Oid roleid)
+{
+	sddbEntry	entry;
+
+	/* Safety check... */
+	if (!sddb)
+		return false;
+
+	if (pg_atomic_read_u32(&sddb->num_roles) == 0 ||
+		pg_atomic_read_u32(&sddb->filter[SDDB_FILTER_SLOT(dbid)]) == 0)
+		return false;
+
+	if (!sddb_attach_table())
+		return false;
+
+	return (sddb_get_role_entry(dbid, roleid, &entry) && entry.is_running);
+}
+
+/* Return the pid of the supervisor process which is polling the
+ * transactions in the database whose id is dbid.
+ *
+ * If is_active is true, it only returns the pid while the database is being
+ * served; if `is_active` is true and the database has been already drained,
+ * returns InvalidPid. If `is_active` is false, it returns the pid even if
+ * the database has been already drained.
+ */
+pid_t
+sddb_get_pid(const Oid dbid, const bool is_active)
+{
+	sddbHashKey key;
+	sddbEntry  *entry;
+	LWLock	   *lock;
+	sddbEntry  *e;
+	bool		is_running;
+	pid_t		pid;
+
+	/* Safety check... */
+	if (!sddb_attach_table())
+		return InvalidPid;
+
+	/* Set key */
+	key.dbid = dbid;
+	key.roleid = InvalidOid;
+
+	/* Look up the hash table entry with shared lock. */
+	lock = partition_lock(&key);
+	LWLockAcquire(lock, LW_SHARED);
+	entry = table_find(&key);
+
+	if (entry == NULL)
+	{
+		LWLockRelease(lock);
+		return InvalidPid;
+	}
+
+	/* Store data into the entry. */
+	e = (sddbEntry *) entry;
+
+	SpinLockAcquire(&e->mutex);
+	is_running = e->is_running;
+	pid = e->pid;
+	SpinLockRelease(&e->mutex);
+
+	LWLockRelease(lock);
+
+	if (!is_active)
+		return pid;
+
+	return (is_running == true) ? pid : InvalidPid;
+}
+
+/*
+ * Collect the dbids of the entries whose `is_running` is true, i.e. the
+ * databases which are being shut down in Transactional mode, into a
+ * palloc'd array *dbids sorted in ascending order, and return the number
+ * of them. The deadlines and the flags of them are set into the arrays
+ * *deadlines and *flags in the same order, if they are not NULL. `pid` is
+ * set into the collected entries as the pid of the supervisor process
+ * which serves them.
+ */
+int
+sddb_collect_running(Oid **dbids, TimestampTz **deadlines, int **flags,
+					 const pid_t pid)
+{
+	sddbTableScan scan;
+	sddbEntry  *entry;
+	sddbRunningItem *items;
+	int			max;
+	int			n = 0;
+	int			i;
+
+	*dbids = NULL;
+	if (deadlines)
+		*deadlines = NULL;
+	if (flags)
+		*flags = NULL;
+
+	/* Safety check... */
+	if (!sddb)
+		return 0;
+
+	/* quick check */
+	if ((max = pg_atomic_read_u32(&sddb->num_running)) == 0)
+		return 0;
+
+	if (!sddb_attach_table())
+		return 0;
+
+	lock_all_partitions(LW_SHARED);
+
+	/* num_running may have been changed, but it can't exceed num_ht */
+	max = Max(max, pg_atomic_read_u32(&sddb->num_ht));
+	items = (sddbRunningItem *) palloc(sizeof(sddbRunningItem) * max);
+
+	table_scan_begin(&scan);
+	while ((entry = table_scan_next(&scan)) != NULL)
+	{
+		/* The entries of roles are collected by sddb_collect_running_roles() */
+		if (OidIsValid(entry->key.roleid))
+			continue;
+
+		SpinLockAcquire(&entry->mutex);
+		if (entry->is_running && n < max)
+		{
+			items[n].dbid = entry->key.dbid;
+			items[n].deadline = entry->deadline;
+			items[n].flags = entry->flags;
+			n++;
+			entry->pid = pid;
+		}
+		SpinLockRelease(&entry->mutex);
+	}
+
+	table_scan_end(&scan);
+
+	unlock_all_partitions();
+
+	qsort(items, n, sizeof(sddbRunningItem), sddb_oid_cmp);
+
+	*dbids = (Oid *) palloc(sizeof(Oid) * Max(n, 1));
+	if (deadlines)
+		*deadlines = (TimestampTz *) palloc(sizeof(TimestampTz) * Max(n, 1));
+	if (flags)
+		*flags = (int *) palloc(sizeof(int) * Max(n, 1));
+	for (i = 0; i < n; i++)
+	{
+		(*dbids)[i] = items[i].dbid;
+		if (deadlines)
+			(*deadlines)[i] = items[i].deadline;
+		if (flags)
+			(*flags)[i] = items[i].flags;
+	}
+	pfree(items);
+
+	return n;
+}
+
+/*
+ * Collect the keys of the entries of roles whose `is_running` is true,
+ * i.e. the roles which are being shut down in Transactional or Immediate
+ * mode, into palloc'd arrays *dbids and *roleids, and return the number of
+ * them.
+ */
+int
+sddb_collect_running_roles(Oid **dbids, Oid **roleids)
+{
+	sddbTableScan scan;
+	sddbEntry  *entry;
+	int			max;
+	int			n = 0;
+
+	*dbids = NULL;
+	*roleids = NULL;
+
+	/* Safety check... */
+	if (!sddb)
+		return 0;
+
+	/* quick check */
+	if (pg_atomic_read_u32(&sddb->num_roles) == 0 ||
+		pg_atomic_read_u32(&sddb->num_running) == 0)
+		return 0;
+
+	if (!sddb_attach_table())
+		return 0;
+
+	lock_all_partitions(LW_SHARED);
+
+	/* num_roles can't be changed while we hold all the partition locks */
+	if ((max = pg_atomic_read_u32(&sddb->num_roles)) == 0)
+	{
+		unlock_all_partitions();
+		return 0;
+	}
+
+	*dbids = (Oid *) palloc(sizeof(Oid) * max);
+	*roleids = (Oid *) palloc(sizeof(Oid) * max);
+
+	table_scan_begin(&scan);
+	while ((entry = table_scan_next(&scan)) != NULL)
+	{
+		if (!OidIsValid(entry->key.roleid))
+			continue;
+
+		SpinLockAcquire(&entry->mutex);
+		if (entry->is_running && n < max)
+		{
+			(*dbids)[n] = entry->key.dbid;
+			(*roleids)[n] = entry->key.roleid;
+			n++;
+		}
+		SpinLockRelease(&entry->mutex);
+	}
+
+	table_scan_end(&scan);
+
+	unlock_all_partitions();
+
+	return n;
+}
+
+/*
+ * Set the `is_running` value into the entry whose key is dbid.
+ */
+bool
+sddb_set_entry(const Oid dbid, const bool is_running)
+{
+	sddbHashKey key;
+
+	/* Set key */
+	key.dbid = dbid;
+	key.roleid = InvalidOid;
+
+	return set_running(&key, is_running);
+}
+
+/*
+ * Same as sddb_set_entry(), but for the entry of the role roleid in the
+ * database dbid.
+ */
+bool
+sddb_set_role_entry(const Oid dbid, const Oid roleid, const bool is_running)
+{
+	sddbHashKey key;
+
+	key.dbid = dbid;
+	key.roleid = roleid;
+
+	return set_running(&key, is_running);
+}
+
+/*
+ * Workhorse of sddb_set_entry() and sddb_set_role_entry().
+ */
+static bool
+set_running(const sddbHashKey * key, const bool is_running)
+{
+	sddbEntry  *entry;
+	LWLock	   *lock;
+	sddbEntry  *e;
+	TimestampTz now;
+
+	/* Safety check... */
+	if (!sddb_attach_table())
+		return false;
+
+	/* Don't call GetCurrentTimestamp() while holding the spinlock */
+	now = GetCurrentTimestamp();
+
+	/*
+	 * Look up the hash table entry with shared lock; the entry is changed in
+	 * place under its mutex.
+	 */
+	lock = partition_lock(key);
+	LWLockAcquire(lock, LW_SHARED);
+	entry = table_find(key);
+
+	if (entry == NULL)
+	{
+		LWLockRelease(lock);
+		return false;
+	}
+
+	/* Store data into the entry. */
+	e = (sddbEntry *) entry;
+
+	SpinLockAcquire(&e->mutex);
+	if (e->is_running != is_running)
+	{
+		count_running(key->dbid, is_running);
+		e->state_change = now;
+	}
+	e->is_running = is_running;
+	SpinLockRelease(&e->mutex);
+
+	LWLockRelease(lock);
+
+	bump_generation();
+
+	/* The draining has finished; wake up sddb_wait_drained() */
+	if (!is_running)
+		ConditionVariableBroadcast(SDDB_WAIT_CV(key->dbid));
+
+	return true;
+}
+
+/*
+ * Change the mode of the entry whose key is dbid into `mode`. The entry is
+ * no longer served by the supervisor process unless `mode` is
+ * TRANSACTIONAL; this is used to escalate the draining database whose
+ * deadline has passed to IMMEDIATE mode, and to switch a database between
+ * THROTTLED and SUSPENDED modes, whose waiting backends check it again.
+ */
+bool
+sddb_set_mode(const Oid dbid, const int mode)
+{
+	sddbHashKey key;
+	sddbEntry  *entry;
+	LWLock	   *lock;
+	TimestampTz now;
+	bool		is_running = (mode == TRANSACTIONAL);
+
+	/* Safety check... */
+	if (!sddb_attach_table())
+		return false;
+
+	/* Set key */
+	key.dbid = dbid;
+	key.roleid = InvalidOid;
+
+	/* Don't call GetCurrentTimestamp() while holding the spinlock */
+	now = GetCurrentTimestamp();
+
+	/*
+	 * Look up the hash table entry with shared lock; the entry is changed in
+	 * place under its mutex.
+	 */
+	lock = partition_lock(&key);
+	LWLockAcquire(lock, LW_SHARED);
+
+	if ((entry = table_find(&key)) == NULL)
+	{
+		LWLockRelease(lock);
+		return false;
+	}
+
+	SpinLockAcquire(&entry->mutex);
+	entry->mode = mode;
+	if (entry->is_running != is_running)
+	{
+		count_running(dbid, is_running);
+		entry->state_change = now;
+	}
+	entry->is_running = is_running;
+	if (!is_running)
+		entry->deadline = 0;
+	SpinLockRelease(&entry->mutex);
+
+	LWLockRelease(lock);
+
+	bump_generation();
+
+	ConditionVariableBroadcast(SDDB_WAIT_CV(dbid));
+
+	return true;
+}
+
+/*
+ * Rename the database dbid, in its entry and the entries of its roles, or
+ * the role roleid, in the entries of the role, into newname; exactly one of
+ * dbid and roleid is valid. The name index is updated, so that the
+ * connections are rejected by the new name. Returns the number of the
+ * renamed entries.
+ */
+int
+sddb_rename_entries(const Oid dbid, const Oid roleid, const char *newname)
+{
+	sddbTableScan scan;
+	sddbEntry  *entry;
+	int			n = 0;
+
+	Assert(OidIsValid(dbid) != OidIsValid(roleid));
+
+	/* Safety check... */
+	if (!sddb)
+		return 0;
+
+	/* quick check */
+	if (pg_atomic_read_u32(&sddb->num_ht) == 0)
+		return 0;
+	if (OidIsValid(roleid) && pg_atomic_read_u32(&sddb->num_roles) == 0)
+		return 0;
+
+	if (!sddb_attach_table())
+		return 0;
+
+	lock_all_partitions(LW_EXCLUSIVE);
+
+	table_scan_begin(&scan);
+	while ((entry = table_scan_next(&scan)) != NULL)
+	{
+		bool		is_role = OidIsValid(entry->key.roleid);
+
+		if (OidIsValid(dbid) ? (entry->key.dbid != dbid) :
+			(entry->key.roleid != roleid))
+			continue;
+
+		unindex_entry(&entry->key, NameStr(entry->datname),
+					  is_role ? NameStr(entry->rolname) : NULL);
+
+		SpinLockAcquire(&entry->mutex);
+		if (OidIsValid(dbid))
+			namestrcpy(&entry->datname, newname);
+		else
+			namestrcpy(&entry->rolname, newname);
+		SpinLockRelease(&entry->mutex);
+
+		index_entry(&entry->key, NameStr(entry->datname),
+					is_role ? NameStr(entry->rolname) : NULL);
+		n++;
+	}
+
+	table_scan_end(&scan);
+
+	unlock_all_partitions();
+
+	if (n > 0)
+		bump_generation();
+
+	return n;
+}
+
+/*
+ * Mark the drain of the entry whose key is dbid as counted. Returns false
+ * if it has already been counted, or the entry has gone.
+ */
+bool
+sddb_set_drained(const Oid dbid)
+{
+	sddbHashKey key;
+	sddbEntry  *entry;
+	LWLock	   *lock;
+	bool		result = false;
+
+	/* Safety check... */
+	if (!sddb_attach_table())
+		return false;
+
+	/* Set key */
+	key.dbid = dbid;
+	key.roleid = InvalidOid;
+
+	/*
+	 * Look up the hash table entry with shared lock; the entry is changed in
+	 * place under its mutex.
+	 */
+	lock = partition_lock(&key);
+	LWLockAcquire(lock, LW_SHARED);
+
+	if ((entry = table_find(&key)) != NULL)
+	{
+		SpinLockAcquire(&entry->mutex);
+		if (entry->drain_pending)
+		{
+			entry->drain_pending = false;
+			pg_atomic_fetch_sub_u32(&sddb->num_undrained, 1);
+			result = true;
+		}
+		SpinLockRelease(&entry->mutex);
+	}
+
+	LWLockRelease(lock);
+
+	return result;
+}
+
+/*
+ * Mark the buffers of the entry whose key is dbid as done, i.e. released
+ * and/or dumped, and set the number of the released ones.
+ */
+bool
+sddb_set_released(const Oid dbid, const int released_buffers)
+{
+	sddbHashKey key;
+	sddbEntry  *entry;
+	LWLock	   *lock;
+	TimestampTz now = GetCurrentTimestamp();
+
+	/* Safety check... */
+	if (!sddb_attach_table())
+		return false;
+
+	/* Set key */
+	key.dbid = dbid;
+	key.roleid = InvalidOid;
 
 	/*
-	 * Find or create an entry with desired hash code. If hash table is full,
-	 * return NULL.
+	 * Look up the hash table entry with shared lock; the entry is changed in
+	 * place under its mutex.
 	 */
-	if ((entry = (sddbEntry *) hash_search(sddb_hash, key, HASH_ENTER_NULL, &found)) == NULL)
-		return entry;
+	lock = partition_lock(&key);
+	LWLockAcquire(lock, LW_SHARED);
 
-	if (!found)
+	if ((entry = table_find(&key)) == NULL)
 	{
-		/* New entry, initialize it */
-		SpinLockInit(&entry->mutex);
-		entry->dbid = InvalidOid;
-		entry->mode = INIT;
-		entry->is_running = false;
-		entry->pid = InvalidPid;
+		LWLockRelease(lock);
+		return false;
 	}
 
-	return entry;
-}
+	SpinLockAcquire(&entry->mutex);
+	if (SDDB_BUFFERS_PENDING(entry->flags))
+		pg_atomic_fetch_sub_u32(&sddb->num_releasing, 1);
+	entry->flags |= SDDB_FLAG_BUFFERS_DONE;
+	entry->released_buffers = released_buffers;
+	set_phase(entry, PHASE_DONE, now);
+	SpinLockRelease(&entry->mutex);
+
+	LWLockRelease(lock);
 
+	return true;
+}
 
 /*
- * Store the entry whose key is dbid to the hash table.
+ * Report the progress of the drain of dbid: set its phase to `phase`, and
+ * the number of the backend processes at the shutdown and the number of
+ * the buffers written out unless they are negative. The progress is not
+ * kept in the state file.
  */
 bool
-sddb_store_entry(const Oid dbid, const int mode, const bool is_running)
+sddb_set_progress(const Oid dbid, const int phase, const int backends_start,
+				  const int buffers_flushed)
 {
 	sddbHashKey key;
 	sddbEntry  *entry;
-	sddbEntry  *e;
+	LWLock	   *lock;
+	TimestampTz now = GetCurrentTimestamp();
 
 	/* Safety check... */
-	if (!sddb || !sddb_hash)
+	if (!sddb_attach_table())
 		return false;
 
 	/* Set key */
 	key.dbid = dbid;
+	key.roleid = InvalidOid;
 
-	/* Look up the hash table entry with shared lock. */
-	LWLockAcquire(sddb->lock, LW_SHARED);
-	entry = (sddbEntry *) hash_search(sddb_hash, &key, HASH_FIND, NULL);
-	LWLockRelease(sddb->lock);
-
-	if (entry != NULL)
-	{
-		elog(WARNING, "database %u is already stored.", dbid);
-		return false;
-	}
-
-	LWLockAcquire(sddb->lock, LW_EXCLUSIVE);
+	/*
+	 * Look up the hash table entry with shared lock; the entry is changed in
+	 * place under its mutex.
+	 */
+	lock = partition_lock(&key);
+	LWLockAcquire(lock, LW_SHARED);
 
-	/* Create new entry */
-	if ((entry = alloc_entry(&key)) == NULL)
+	if ((entry = table_find(&key)) == NULL)
 	{
-		/* New entry was not created since hash table is full. */
-		LWLockRelease(sddb->lock);
-		elog(WARNING, "New entry was not created since hash table is full.");
+		LWLockRelease(lock);
 		return false;
 	}
 
-	/* Store data into the entry. */
-	e = (sddbEntry *) entry;
-
-	SpinLockAcquire(&e->mutex);
-	e->dbid = dbid;
-	e->mode = mode;
-	e->is_running = is_running;
-	e->pid = InvalidPid;
-	SpinLockRelease(&e->mutex);
-
-	LWLockRelease(sddb->lock);
+	SpinLockAcquire(&entry->mutex);
+	set_phase(entry, phase, now);
+	if (backends_start >= 0)
+		entry->backends_start = backends_start;
+	if (buffers_flushed >= 0)
+		entry->buffers_flushed = buffers_flushed;
+	SpinLockRelease(&entry->mutex);
 
-	SpinLockAcquire(&sddb->elock);
-	sddb->num_ht++;
-	SpinLockRelease(&sddb->elock);
+	LWLockRelease(lock);
 
 	return true;
 }
 
-
 /*
- * Find the entry whose key is dbid in the hash table.
+ * Set the maximum number of the executing statements of the THROTTLED
+ * entry whose key is dbid. The backends waiting for a slot check it again.
  */
 bool
-sddb_find_entry(const Oid dbid, const bool is_running)
+sddb_set_throttle(const Oid dbid, const int max_active)
 {
 	sddbHashKey key;
 	sddbEntry  *entry;
-	sddbEntry  *e;
+	LWLock	   *lock;
+	bool		result = false;
 
 	/* Safety check... */
-	if (!sddb || !sddb_hash)
+	if (!sddb_attach_table())
 		return false;
 
-	/* quick check */
-	SpinLockAcquire(&sddb->elock);
-	if (sddb->num_ht == 0)
-	{
-		SpinLockRelease(&sddb->elock);
-		return false;
-	}
-	SpinLockRelease(&sddb->elock);
-
 	/* Set key */
 	key.dbid = dbid;
+	key.roleid = InvalidOid;
 
-	/* Look up the hash table entry with shared lock. */
-	LWLockAcquire(sddb->lock, LW_SHARED);
-	entry = (sddbEntry *) hash_search(sddb_hash, &key, HASH_FIND, NULL);
-	LWLockRelease(sddb->lock);
-
-	if (entry == NULL)
-		return false;
+	/*
+	 * Look up the hash table entry with shared lock; the entry is changed in
+	 * place under its mutex.
+	 */
+	lock = partition_lock(&key);
+	LWLockAcquire(lock, LW_SHARED);
 
-	if (is_running)
+	if ((entry = table_find(&key)) != NULL)
 	{
-		e = (sddbEntry *) entry;
-
-		SpinLockAcquire(&e->mutex);
-		if (e->is_running == true)
+		SpinLockAcquire(&entry->mutex);
+		if (entry->mode == THROTTLED)
 		{
-			SpinLockRelease(&e->mutex);
-			return true;
+			entry->max_active = max_active;
+			result = true;
 		}
-		SpinLockRelease(&e->mutex);
-
-		return false;
+		SpinLockRelease(&entry->mutex);
 	}
 
-	return true;
+	LWLockRelease(lock);
+
+	if (result)
+		ConditionVariableBroadcast(SDDB_WAIT_CV(dbid));
+
+	return result;
 }
 
-/* Return the pid of the killer process which is invoked for polling to the
- * transactions in the database whose id is dbid.
- *
- * If is_active is true, it only returns the pid when the killer process is
- * running; if `is_active` is true and the killer process is already halted,
- * returns InvalidPid. If `is_active` is false, it returns the pid even if
- * the killer process has been already halted.
+/*
+ * Try to acquire a slot to execute a statement in the database whose id is
+ * dbid. Returns SDDB_SLOT_NONE if the database is not THROTTLED,
+ * SDDB_SLOT_ACQUIRED if a slot has been acquired, which must be released
+ * by sddb_throttle_release(), or SDDB_SLOT_BUSY if all the slots are used.
  */
-pid_t
-sddb_get_pid(const Oid dbid, const bool is_active)
+int
+sddb_throttle_acquire(const Oid dbid)
 {
 	sddbHashKey key;
 	sddbEntry  *entry;
-	sddbEntry  *e;
-	bool		is_running;
-	pid_t		pid;
+	LWLock	   *lock;
+	int			result = SDDB_SLOT_NONE;
 
 	/* Safety check... */
-	if (!sddb || !sddb_hash)
-		return InvalidPid;
+	if (!sddb_attach_table())
+		return SDDB_SLOT_NONE;
 
 	/* Set key */
 	key.dbid = dbid;
+	key.roleid = InvalidOid;
 
-	/* Look up the hash table entry with exclusive lock. */
-	LWLockAcquire(sddb->lock, LW_EXCLUSIVE);
-	entry = (sddbEntry *) hash_search(sddb_hash, &key, HASH_FIND, NULL);
+	/*
+	 * Look up the hash table entry with shared lock; the entry is changed in
+	 * place under its mutex.
+	 */
+	lock = partition_lock(&key);
+	LWLockAcquire(lock, LW_SHARED);
 
-	if (entry == NULL)
+	if ((entry = table_find(&key)) != NULL)
 	{
-		LWLockRelease(sddb->lock);
-		return InvalidPid;
+		SpinLockAcquire(&entry->mutex);
+		if (entry->mode == THROTTLED)
+		{
+			if (entry->max_active <= 0 || entry->active < entry->max_active)
+			{
+				entry->active++;
+				result = SDDB_SLOT_ACQUIRED;
+			}
+			else
+				result = SDDB_SLOT_BUSY;
+		}
+		SpinLockRelease(&entry->mutex);
 	}
 
-	/* Store data into the entry. */
-	e = (sddbEntry *) entry;
-
-	SpinLockAcquire(&e->mutex);
-	is_running = e->is_running;
-	pid = e->pid;
-	SpinLockRelease(&e->mutex);
-
-	LWLockRelease(sddb->lock);
-
-	if (!is_active)
-		return pid;
+	LWLockRelease(lock);
 
-	return (is_running == true) ? pid : InvalidPid;
+	return result;
 }
 
 /*
- * Set the `is_running` value into the entry whose key is dbid.
+ * Release the slot acquired by sddb_throttle_acquire(), and wake up the
+ * backends waiting for one. If the entry has gone, there is nothing to
+ * release.
  */
-bool
-sddb_set_entry(const Oid dbid, const bool is_running)
+void
+sddb_throttle_release(const Oid dbid)
 {
 	sddbHashKey key;
 	sddbEntry  *entry;
-	sddbEntry  *e;
+	LWLock	   *lock;
 
 	/* Safety check... */
-	if (!sddb || !sddb_hash)
-		return false;
+	if (!sddb_attach_table())
+		return;
 
 	/* Set key */
 	key.dbid = dbid;
+	key.roleid = InvalidOid;
 
-	/* Look up the hash table entry with exclusive lock. */
-	LWLockAcquire(sddb->lock, LW_EXCLUSIVE);
-	entry = (sddbEntry *) hash_search(sddb_hash, &key, HASH_FIND, NULL);
+	lock = partition_lock(&key);
+	LWLockAcquire(lock, LW_SHARED);
 
-	if (entry == NULL)
+	if ((entry = table_find(&key)) != NULL)
 	{
-		LWLockRelease(sddb->lock);
-		return false;
+		SpinLockAcquire(&entry->mutex);
+		/* The mode may have been changed since the slot was acquired */
+		if (entry->active > 0)
+			entry->active--;
+		SpinLockRelease(&entry->mutex);
 	}
 
-	/* Store data into the entry. */
-	e = (sddbEntry *) entry;
-
-	SpinLockAcquire(&e->mutex);
-	e->is_running = is_running;
-	SpinLockRelease(&e->mutex);
-
-	LWLockRelease(sddb->lock);
+	LWLockRelease(lock);
 
-	return true;
+	/*
+	 * The condition variable may be shared with other databases, so wake up
+	 * all the waiters; the ones of other databases just sleep again.
+	 */
+	ConditionVariableBroadcast(SDDB_WAIT_CV(dbid));
 }
 
 /*
  * Set the `pid` value into the entry whose key is dbid, where `pid` is
- * the pid of the killer bgworker which runs to check the activity
+ * the pid of the supervisor bgworker which runs to check the activity
  * of the database, whose id is dbid.
  */
 bool
@@ -267,22 +1697,28 @@ sddb_set_pid2entry(const Oid dbid, const pid_t pid)
 {
 	sddbHashKey key;
 	sddbEntry  *entry;
+	LWLock	   *lock;
 	sddbEntry  *e;
 
 	/* Safety check... */
-	if (!sddb || !sddb_hash)
+	if (!sddb_attach_table())
 		return false;
 
 	/* Set key */
 	key.dbid = dbid;
+	key.roleid = InvalidOid;
 
-	/* Look up the hash table entry with exclusive lock. */
-	LWLockAcquire(sddb->lock, LW_EXCLUSIVE);
-	entry = (sddbEntry *) hash_search(sddb_hash, &key, HASH_FIND, NULL);
+	/*
+	 * Look up the hash table entry with shared lock; the entry is changed in
+	 * place under its mutex.
+	 */
+	lock = partition_lock(&key);
+	LWLockAcquire(lock, LW_SHARED);
+	entry = table_find(&key);
 
 	if (entry == NULL)
 	{
-		LWLockRelease(sddb->lock);
+		LWLockRelease(lock);
 		return false;
 	}
 
@@ -293,7 +1729,7 @@ sddb_set_pid2entry(const Oid dbid, const pid_t pid)
 	e->pid = pid;
 	SpinLockRelease(&e->mutex);
 
-	LWLockRelease(sddb->lock);
+	LWLockRelease(lock);
 
 	return true;
 }
@@ -304,21 +1740,358 @@ sddb_set_pid2entry(const Oid dbid, const pid_t pid)
  */
 void
 sddb_delete_entry(const Oid dbid)
+{
+	sddb_delete_entries(&dbid, 1);
+}
+
+/*
+ * Delete the stored entries whose keys are dbids[0 .. n-1]. Each entry is
+ * deleted under the exclusive lock of its own partition only.
+ */
+void
+sddb_delete_entries(const Oid *dbids, const int n)
 {
 	sddbHashKey key;
+	int			i;
+	int			num_deleted = 0;
 
 	/* Safety check... */
-	if (!sddb || !sddb_hash)
+	if (!sddb_attach_table())
 		return;
 
+	for (i = 0; i < n; i++)
+	{
+		key.dbid = dbids[i];
+		key.roleid = InvalidOid;
+
+		if (delete_entry(&key))
+			num_deleted++;
+	}
+
+	if (num_deleted > 0)
+		bump_generation();
+}
+
+/*
+ * Delete the entry of the role roleid in the database dbid. Returns false
+ * if not found.
+ */
+bool
+sddb_delete_role_entry(const Oid dbid, const Oid roleid)
+{
+	sddbHashKey key;
+
+	/* Safety check... */
+	if (!sddb_attach_table())
+		return false;
+
 	key.dbid = dbid;
+	key.roleid = roleid;
+
+	if (!delete_entry(&key))
+		return false;
+
+	bump_generation();
+	return true;
+}
+
+/*
+ * Workhorse of sddb_delete_entries() and sddb_delete_role_entry(). The
+ * caller must bump the generation if this returns true.
+ */
+static bool
+delete_entry(const sddbHashKey * key)
+{
+	sddbEntry  *entry;
+	LWLock	   *lock;
+
+	lock = partition_lock(key);
+	LWLockAcquire(lock, LW_EXCLUSIVE);
+
+	entry = table_find(key);
+	if (entry == NULL)
+	{
+		LWLockRelease(lock);
+		return false;
+	}
+
+	SpinLockAcquire(&entry->mutex);
+	if (entry->is_running)
+		count_running(key->dbid, false);
+	if (SDDB_BUFFERS_PENDING(entry->flags))
+		pg_atomic_fetch_sub_u32(&sddb->num_releasing, 1);
+	if (entry->flags & SDDB_FLAG_BLOCK_AUTOVAC)
+		pg_atomic_fetch_sub_u32(&sddb->num_blocking, 1);
+	if (entry->drain_pending)
+		pg_atomic_fetch_sub_u32(&sddb->num_undrained, 1);
+	SpinLockRelease(&entry->mutex);
+
+	/* The names are changed only under the exclusive partition lock */
+	unindex_entry(key, NameStr(entry->datname),
+				  OidIsValid(key->roleid) ? NameStr(entry->rolname) : NULL);
+
+	table_remove(key);
+
+	Assert(pg_atomic_read_u32(&sddb->num_ht) > 0);
+	pg_atomic_fetch_sub_u32(&sddb->num_ht, 1);
+	if (OidIsValid(key->roleid))
+		pg_atomic_fetch_sub_u32(&sddb->num_roles, 1);
+
+	LWLockRelease(lock);
+
+	/* Let the waiting backends go, and fail sddb_wait_drained() */
+	ConditionVariableBroadcast(SDDB_WAIT_CV(key->dbid));
+
+	return true;
+}
+
+/*
+ * Collect the dbids of the entries whose buffers are to be released or
+ * whose block list is to be dumped, i.e. SDDB_BUFFERS_PENDING(), and which
+ * aren't being drained, into a palloc'd array *dbids sorted in
+ * ascending order, and return the number of them.
+ */
+int
+sddb_collect_releasing(Oid **dbids)
+{
+	sddbTableScan scan;
+	sddbEntry  *entry;
+	int			max;
+	int			n = 0;
+
+	*dbids = NULL;
+
+	/* Safety check... */
+	if (!sddb)
+		return 0;
+
+	/* quick check */
+	if (pg_atomic_read_u32(&sddb->num_releasing) == 0)
+		return 0;
+
+	if (!sddb_attach_table())
+		return 0;
+
+	lock_all_partitions(LW_SHARED);
+
+	/* num_ht can't be changed while we hold all the partition locks */
+	if ((max = pg_atomic_read_u32(&sddb->num_ht)) == 0)
+	{
+		unlock_all_partitions();
+		return 0;
+	}
+
+	*dbids = (Oid *) palloc(sizeof(Oid) * max);
+
+	table_scan_begin(&scan);
+	while ((entry = table_scan_next(&scan)) != NULL)
+	{
+		SpinLockAcquire(&entry->mutex);
+		if (SDDB_BUFFERS_PENDING(entry->flags) && !entry->is_running && n < max)
+			(*dbids)[n++] = entry->key.dbid;
+		SpinLockRelease(&entry->mutex);
+	}
+
+	table_scan_end(&scan);
+
+	unlock_all_partitions();
+
+	qsort(*dbids, n, sizeof(Oid), sddb_oid_cmp);
+
+	return n;
+}
+
+/*
+ * Collect the dbids of the entries which have SDDB_FLAG_BLOCK_AUTOVAC into
+ * a palloc'd array *dbids sorted in ascending order, and their shutdown
+ * times into *since in the same order, and return the number of them.
+ */
+int
+sddb_collect_blocking(Oid **dbids, TimestampTz **since)
+{
+	sddbTableScan scan;
+	sddbEntry  *entry;
+	sddbRunningItem *items;
+	int			max;
+	int			n = 0;
+	int			i;
+
+	*dbids = NULL;
+	*since = NULL;
+
+	/* Safety check... */
+	if (!sddb)
+		return 0;
+
+	/* quick check */
+	if (pg_atomic_read_u32(&sddb->num_blocking) == 0)
+		return 0;
+
+	if (!sddb_attach_table())
+		return 0;
+
+	lock_all_partitions(LW_SHARED);
+
+	/* num_ht can't be changed while we hold all the partition locks */
+	if ((max = pg_atomic_read_u32(&sddb->num_ht)) == 0)
+	{
+		unlock_all_partitions();
+		return 0;
+	}
+
+	items = (sddbRunningItem *) palloc(sizeof(sddbRunningItem) * max);
+
+	table_scan_begin(&scan);
+	while ((entry = table_scan_next(&scan)) != NULL)
+	{
+		SpinLockAcquire(&entry->mutex);
+		if ((entry->flags & SDDB_FLAG_BLOCK_AUTOVAC) && n < max)
+		{
+			items[n].dbid = entry->key.dbid;
+			items[n].shutdown_time = entry->shutdown_time;
+			n++;
+		}
+		SpinLockRelease(&entry->mutex);
+	}
+
+	table_scan_end(&scan);
+
+	unlock_all_partitions();
+
+	qsort(items, n, sizeof(sddbRunningItem), sddb_oid_cmp);
+
+	*dbids = (Oid *) palloc(sizeof(Oid) * Max(n, 1));
+	*since = (TimestampTz *) palloc(sizeof(TimestampTz) * Max(n, 1));
+	for (i = 0; i < n; i++)
+	{
+		(*dbids)[i] = items[i].dbid;
+		(*since)[i] = items[i].shutdown_time;
+	}
+	pfree(items);
+
+	return n;
+}
+
+/*
+ * Collect the dbids of the entries whose drains are yet to be counted into
+ * a palloc'd array *dbids sorted in ascending order, and their shutdown
+ * times and flags into *shutdown_times and *flags in the same order, and
+ * return the number of them.
+ */
+int
+sddb_collect_undrained(Oid **dbids, TimestampTz **shutdown_times, int **flags)
+{
+	sddbTableScan scan;
+	sddbEntry  *entry;
+	sddbRunningItem *items;
+	int			max;
+	int			n = 0;
+	int			i;
+
+	*dbids = NULL;
+	*shutdown_times = NULL;
+	*flags = NULL;
+
+	/* Safety check... */
+	if (!sddb)
+		return 0;
+
+	/* quick check */
+	if (pg_atomic_read_u32(&sddb->num_undrained) == 0)
+		return 0;
+
+	if (!sddb_attach_table())
+		return 0;
+
+	lock_all_partitions(LW_SHARED);
+
+	/* num_ht can't be changed while we hold all the partition locks */
+	if ((max = pg_atomic_read_u32(&sddb->num_ht)) == 0)
+	{
+		unlock_all_partitions();
+		return 0;
+	}
+
+	items = (sddbRunningItem *) palloc(sizeof(sddbRunningItem) * max);
+
+	table_scan_begin(&scan);
+	while ((entry = table_scan_next(&scan)) != NULL)
+	{
+		SpinLockAcquire(&entry->mutex);
+		if (entry->drain_pending && n < max)
+		{
+			items[n].dbid = entry->key.dbid;
+			items[n].shutdown_time = entry->shutdown_time;
+			items[n].flags = entry->flags;
+			n++;
+		}
+		SpinLockRelease(&entry->mutex);
+	}
+
+	table_scan_end(&scan);
+
+	unlock_all_partitions();
+
+	qsort(items, n, sizeof(sddbRunningItem), sddb_oid_cmp);
+
+	*dbids = (Oid *) palloc(sizeof(Oid) * Max(n, 1));
+	*shutdown_times = (TimestampTz *) palloc(sizeof(TimestampTz) * Max(n, 1));
+	*flags = (int *) palloc(sizeof(int) * Max(n, 1));
+	for (i = 0; i < n; i++)
+	{
+		(*dbids)[i] = items[i].dbid;
+		(*shutdown_times)[i] = items[i].shutdown_time;
+		(*flags)[i] = items[i].flags;
+	}
+	pfree(items);
+
+	return n;
+}
+
+/*
+ * Copy all the entries into a palloc'd array *entries, and return the
+ * number of them.
+ */
+int
+sddb_copy_entries(sddbEntry * *entries)
+{
+	sddbTableScan scan;
+	sddbEntry  *entry;
+	int			max;
+	int			n = 0;
+
+	*entries = NULL;
+
+	/* Safety check... */
+	if (!sddb_attach_table())
+		return 0;
+
+	lock_all_partitions(LW_SHARED);
+
+	/* num_ht can't be changed while we hold all the partition locks */
+	if ((max = pg_atomic_read_u32(&sddb->num_ht)) == 0)
+	{
+		unlock_all_partitions();
+		return 0;
+	}
+
+	*entries = (sddbEntry *) palloc(sizeof(sddbEntry) * max);
+
+	table_scan_begin(&scan);
+	while ((entry = table_scan_next(&scan)) != NULL)
+	{
+		if (n >= max)
+			break;
+
+		SpinLockAcquire(&entry->mutex);
+		memcpy(&(*entries)[n], entry, sizeof(sddbEntry));
+		SpinLockRelease(&entry->mutex);
+		n++;
+	}
+
+	table_scan_end(&scan);
 
-	LWLockAcquire(sddb->lock, LW_EXCLUSIVE);
-	hash_search(sddb_hash, &key, HASH_REMOVE, NULL);
-	LWLockRelease(sddb->lock);
+	unlock_all_partitions();
 
-	SpinLockAcquire(&sddb->elock);
-	Assert(0 < sddb->num_ht);
-	sddb->num_ht--;
-	SpinLockRelease(&sddb->elock);
+	return n;
 }
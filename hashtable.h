@@ -8,14 +8,70 @@
 #ifndef __HASHTABLE_H__
 #define __HASHTABLE_H__
 
+/*
+ * Results of sddb_store_entries()
+ */
+#define SDDB_STORED		0			/* the entry has been stored */
+#define SDDB_EXISTS		1			/* the entry is already stored */
+#define SDDB_FULL		2			/* hash table is full */
+
+/*
+ * Results of sddb_throttle_acquire()
+ */
+#define SDDB_SLOT_NONE		0		/* the database is not throttled */
+#define SDDB_SLOT_ACQUIRED	1		/* a slot has been acquired */
+#define SDDB_SLOT_BUSY		2		/* no slot is free */
+
 /*
  * Function declarations
  */
-bool		sddb_store_entry(const Oid dbid, const int mode, const bool is_running);
+bool		sddb_attach_table(void);
+bool		sddb_store_entry(const Oid dbid, const char *datname, const int mode,
+							 const bool is_running, const int flags);
+int			sddb_store_entries(const Oid *dbids, const char *const *datnames,
+							   const int n, const int mode,
+							   const bool is_running, const int flags,
+							   const TimestampTz deadline, int *results);
+int			sddb_store_role_entry(const Oid dbid, const char *datname,
+								  const Oid roleid, const char *rolname,
+								  const int mode, const bool is_running);
+bool		sddb_restore_entry(const Oid dbid, const char *datname,
+							   const Oid roleid, const char *rolname,
+							   const int mode, const int flags,
+							   const TimestampTz shutdown_time);
 void		sddb_delete_entry(const Oid dbid);
+void		sddb_delete_entries(const Oid *dbids, const int n);
+bool		sddb_delete_role_entry(const Oid dbid, const Oid roleid);
 bool		sddb_find_entry(const Oid dbid, const bool is_running);
+bool		sddb_find_entry_by_name(const char *datname, const char *rolname,
+									Oid *dbid);
+bool		sddb_get_entry(const Oid dbid, sddbEntry * copy);
+bool		sddb_get_role_entry(const Oid dbid, const Oid roleid,
+								sddbEntry * copy);
+bool		sddb_is_running(const Oid dbid);
+bool		sddb_role_is_running(const Oid dbid, const Oid roleid);
 bool		sddb_set_entry(const Oid dbid, const bool is_running);
+bool		sddb_set_role_entry(const Oid dbid, const Oid roleid,
+								const bool is_running);
+bool		sddb_set_mode(const Oid dbid, const int mode);
+bool		sddb_set_released(const Oid dbid, const int released_buffers);
+bool		sddb_set_drained(const Oid dbid);
+int			sddb_rename_entries(const Oid dbid, const Oid roleid,
+								const char *newname);
+bool		sddb_set_progress(const Oid dbid, const int phase,
+							  const int backends_start, const int buffers_flushed);
+bool		sddb_set_throttle(const Oid dbid, const int max_active);
+int			sddb_throttle_acquire(const Oid dbid);
+void		sddb_throttle_release(const Oid dbid);
 bool		sddb_set_pid2entry(const Oid dbid, const pid_t pid);
 pid_t		sddb_get_pid(const Oid dbid, const bool is_active);
+int			sddb_collect_running(Oid **dbids, TimestampTz **deadlines,
+								 int **flags, const pid_t pid);
+int			sddb_collect_running_roles(Oid **dbids, Oid **roleids);
+int			sddb_collect_releasing(Oid **dbids);
+int			sddb_collect_blocking(Oid **dbids, TimestampTz **since);
+int			sddb_collect_undrained(Oid **dbids, TimestampTz **shutdown_times,
+								   int **flags);
+int			sddb_copy_entries(sddbEntry * *entries);
 
 #endif
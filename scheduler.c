@@ -0,0 +1,759 @@
+/*-------------------------------------------------------------------------
+ * scheduler.c
+ *
+ * Rolling shutdowns of many databases.
+ *
+ * shutdown_db.schedule() queues the shutdowns as jobs in the shared memory,
+ * and the supervisor process runs them in the order of the job id, within
+ * the budgets below, so that shutting down hundreds of databases at once
+ * doesn't cause a storm of the terminations and of the writes:
+ *
+ *	- shutdown_db.job_concurrency: the maximum number of the jobs being
+ *	  drained at once.
+ *	- shutdown_db.job_termination_rate: the maximum number of the backend
+ *	  processes terminated per second, as a token bucket which holds one
+ *	  second worth of the tokens. A job takes as many tokens as the backend
+ *	  processes of its database; a job larger than the bucket runs when the
+ *	  bucket is full, and the following jobs wait for the debt.
+ *	- shutdown_db.job_dirty_limit: no job is run while this percentage of
+ *	  the shared buffers or more is dirty, i.e. while the checkpointer and
+ *	  the bgwriter have much work to do.
+ *
+ * In ABORT mode, the buffers of the database only are written out, as
+ * shutdown_db.abort_flush = database does, by a flush worker launched for
+ * the job, so that the supervisor process goes on serving the others
+ * meanwhile. No ABORT job is run while shutdown_db.job_flush_concurrency
+ * jobs are flushing. If no worker can be launched, the supervisor process
+ * writes them out by itself; a worker which is registered but never runs
+ * is found by its handle, so that it doesn't hold up the following jobs.
+ *
+ * A job is running until the database is drained, i.e. until no backend
+ * process is accessing it and, in TRANSACTIONAL mode, the supervisor
+ * process has finished serving it, and until its buffers have been written
+ * out. A NORMAL job is done at once, since it terminates nobody.
+ *
+ * Copyright (c) 2008-2025, PostgreSQL Global Development Group
+ * Copyright (c) 2020-2025, Hironobu Suzuki @ interdb.jp
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "access/xact.h"
+#include "commands/dbcommands.h"
+#include "miscadmin.h"
+#include "postmaster/bgworker.h"
+#include "storage/procarray.h"
+#include "storage/shmem.h"
+#include "utils/memutils.h"
+#include "utils/resowner.h"
+#include "utils/snapmgr.h"
+#include "utils/timestamp.h"
+
+#include "shutdown_db.h"
+#include "backends.h"
+#include "bgworker.h"
+#include "buffers.h"
+#include "functions.h"
+#include "hashtable.h"
+#include "scheduler.h"
+
+/*
+ * The interval at which the supervisor process checks the running jobs,
+ * and the one at which it checks the dirty buffers again while they are
+ * over shutdown_db.job_dirty_limit, in milliseconds.
+ */
+#define SDDB_JOB_RECHECK_MS		200
+#define SDDB_JOB_BACKOFF_MS		1000
+
+/*
+ * The job queue, protected by sddb->job_lock
+ */
+typedef struct sddbJobQueue
+{
+	int64		next_job_id;
+	int			max_jobs;
+	sddbJob		jobs[FLEXIBLE_ARRAY_MEMBER];
+}			sddbJobQueue;
+
+/*
+ * A flush worker launched by this supervisor process
+ */
+typedef struct sddbFlushWorker
+{
+	int64		job_id;			/* 0 if the slot is unused */
+	BackgroundWorkerHandle *handle; /* allocated in TopMemoryContext */
+}			sddbFlushWorker;
+
+/*
+ * extern variables
+ */
+extern int	sddb_job_concurrency;
+extern int	sddb_job_termination_rate;
+extern int	sddb_job_dirty_limit;
+extern int	sddb_job_flush_concurrency;
+
+/*
+ * Links to shared memory state
+ */
+static sddbJobQueue * queue = NULL;
+
+/*
+ * The termination budget of the supervisor process; see the head comment
+ */
+static double tokens = -1;
+static TimestampTz last_refill = 0;
+
+/*
+ * The flush workers launched by this supervisor process, queue->max_jobs
+ * of them at most
+ */
+static sddbFlushWorker *flush_workers = NULL;
+
+/*
+ * Function declarations
+ */
+static int	job_id_cmp(const void *p1, const void *p2);
+static void check_flushing(void);
+static void check_running(void);
+static int	count_jobs(const int state);
+static int	count_flushing(void);
+static bool next_job(sddbJob * job);
+static bool claim_job(sddbJob * job);
+static void set_job(const sddbJob * job);
+static void run_job(sddbJob * job);
+static void flush_job(sddbJob * job);
+static void refill_tokens(void);
+
+
+Size
+sddb_scheduler_memsize(const int max_jobs)
+{
+	return add_size(offsetof(sddbJobQueue, jobs),
+					mul_size(sizeof(sddbJob), max_jobs));
+}
+
+/*
+ * Create or attach to the job queue. This is called from
+ * sddb_shmem_startup() while holding AddinShmemInitLock.
+ */
+void
+sddb_scheduler_shmem_startup(const int max_jobs, const bool found)
+{
+	bool		queue_found;
+
+	queue = ShmemInitStruct("shutdown_db jobs",
+							sddb_scheduler_memsize(max_jobs), &queue_found);
+	if (!queue_found)
+	{
+		memset(queue, 0, sddb_scheduler_memsize(max_jobs));
+		queue->next_job_id = 1;
+		queue->max_jobs = max_jobs;
+	}
+}
+
+/*
+ * Queue the shutdown of the database `datname` in the mode `mode`, and
+ * return its job id. If the queue is full, the slot of the job which has
+ * finished first is reused.
+ */
+int64
+sddb_job_enqueue(const char *datname, const int mode)
+{
+	sddbJob    *job = NULL;
+	TimestampTz now = GetCurrentTimestamp();
+	int64		job_id;
+	int			i;
+
+	LWLockAcquire(sddb->job_lock, LW_EXCLUSIVE);
+
+	for (i = 0; i < queue->max_jobs; i++)
+	{
+		sddbJob    *j = &queue->jobs[i];
+
+		if (j->state == JOB_FREE)
+		{
+			job = j;
+			break;
+		}
+		if (SDDB_JOB_IS_FINISHED(j->state) &&
+			(job == NULL || j->finished_at < job->finished_at))
+			job = j;
+	}
+
+	if (job == NULL)
+	{
+		LWLockRelease(sddb->job_lock);
+		ereport(ERROR,
+				(errcode(ERRCODE_CONFIGURATION_LIMIT_EXCEEDED),
+				 errmsg("shutdown_db job queue is full"),
+				 errhint("Consider increasing shutdown_db.max_jobs.")));
+	}
+
+	memset(job, 0, sizeof(sddbJob));
+	job->job_id = job_id = queue->next_job_id++;
+	namestrcpy(&job->datname, datname);
+	job->dbid = InvalidOid;
+	job->mode = mode;
+	job->state = JOB_QUEUED;
+	job->queued_at = now;
+
+	LWLockRelease(sddb->job_lock);
+
+	return job_id;
+}
+
+static int
+job_id_cmp(const void *p1, const void *p2)
+{
+	int64		j1 = ((const sddbJob *) p1)->job_id;
+	int64		j2 = ((const sddbJob *) p2)->job_id;
+
+	return (j1 > j2) - (j1 < j2);
+}
+
+/*
+ * Copy the jobs into *jobs, palloc'd, in the order of the job id, and
+ * return the number of them.
+ */
+int
+sddb_jobs_copy(sddbJob * *jobs)
+{
+	int			num = 0;
+	int			i;
+
+	*jobs = (sddbJob *) palloc(sizeof(sddbJob) * Max(queue->max_jobs, 1));
+
+	LWLockAcquire(sddb->job_lock, LW_SHARED);
+	for (i = 0; i < queue->max_jobs; i++)
+		if (queue->jobs[i].state != JOB_FREE)
+			(*jobs)[num++] = queue->jobs[i];
+	LWLockRelease(sddb->job_lock);
+
+	qsort(*jobs, num, sizeof(sddbJob), job_id_cmp);
+
+	return num;
+}
+
+/*
+ * Cancel all the queued jobs, and return the number of them.
+ */
+int
+sddb_jobs_cancel(void)
+{
+	TimestampTz now = GetCurrentTimestamp();
+	int			num = 0;
+	int			i;
+
+	LWLockAcquire(sddb->job_lock, LW_EXCLUSIVE);
+	for (i = 0; i < queue->max_jobs; i++)
+	{
+		sddbJob    *job = &queue->jobs[i];
+
+		if (job->state == JOB_QUEUED)
+		{
+			job->state = JOB_CANCELED;
+			job->finished_at = now;
+			num++;
+		}
+	}
+	LWLockRelease(sddb->job_lock);
+
+	return num;
+}
+
+/*
+ * Clear `flushing` of the jobs whose flush workers have gone without telling
+ * so, e.g. the ones which the postmaster has failed to start.
+ *
+ * The handles of the workers launched by this supervisor process tell
+ * whether they have stopped. The workers launched by a former supervisor
+ * process, whose handles have been lost, are checked by their pids.
+ */
+static void
+check_flushing(void)
+{
+	int			i;
+
+	if (flush_workers == NULL)
+		flush_workers = (sddbFlushWorker *)
+			MemoryContextAllocZero(TopMemoryContext,
+								   sizeof(sddbFlushWorker) * queue->max_jobs);
+
+	/* Forget the stopped workers */
+	for (i = 0; i < queue->max_jobs; i++)
+	{
+		BgwHandleStatus status;
+		pid_t		pid;
+
+		if (flush_workers[i].job_id == 0)
+			continue;
+		status = GetBackgroundWorkerPid(flush_workers[i].handle, &pid);
+		if (status == BGWH_STARTED || status == BGWH_NOT_YET_STARTED)
+			continue;
+		pfree(flush_workers[i].handle);
+		flush_workers[i].job_id = 0;
+		flush_workers[i].handle = NULL;
+	}
+
+	LWLockAcquire(sddb->job_lock, LW_EXCLUSIVE);
+	for (i = 0; i < queue->max_jobs; i++)
+	{
+		sddbJob    *j = &queue->jobs[i];
+		bool		alive = false;
+		int			k;
+
+		if (j->state != JOB_RUNNING || !j->flushing)
+			continue;
+
+		for (k = 0; k < queue->max_jobs && !alive; k++)
+			alive = (flush_workers[k].job_id == j->job_id);
+		if (!alive && j->flush_pid != 0)
+			alive = (BackendPidGetProc(j->flush_pid) != NULL);
+		if (alive)
+			continue;
+
+		j->flushing = false;
+		j->flush_pid = 0;
+		elog(LOG, "shutdown_db: the flush worker of job " INT64_FORMAT " has exited without finishing",
+			 j->job_id);
+	}
+	LWLockRelease(sddb->job_lock);
+}
+
+/*
+ * Finish the running jobs whose databases have been drained, or started up
+ * meanwhile, and whose buffers have been written out.
+ */
+static void
+check_running(void)
+{
+	sddbJob    *jobs;
+	Oid		   *dbids;
+	int		   *counts;
+	int			num = 0;
+	int			i;
+
+	check_flushing();
+
+	jobs = (sddbJob *) palloc(sizeof(sddbJob) * Max(queue->max_jobs, 1));
+
+	LWLockAcquire(sddb->job_lock, LW_SHARED);
+	for (i = 0; i < queue->max_jobs; i++)
+		if (queue->jobs[i].state == JOB_RUNNING && !queue->jobs[i].flushing)
+			jobs[num++] = queue->jobs[i];
+	LWLockRelease(sddb->job_lock);
+
+	if (num == 0)
+	{
+		pfree(jobs);
+		return;
+	}
+
+	dbids = (Oid *) palloc(sizeof(Oid) * num);
+	counts = (int *) palloc(sizeof(int) * num);
+	for (i = 0; i < num; i++)
+		dbids[i] = jobs[i].dbid;
+	qsort(dbids, num, sizeof(Oid), sddb_oid_cmp);
+	sddb_count_backends_multi(dbids, num, NULL, counts);
+
+	for (i = 0; i < num; i++)
+	{
+		sddbEntry	entry;
+		Oid		   *dbid;
+
+		if (sddb_get_entry(jobs[i].dbid, &entry))
+		{
+			if (entry.is_running)
+				continue;
+
+			dbid = (Oid *) bsearch(&jobs[i].dbid, dbids, num, sizeof(Oid),
+								   sddb_oid_cmp);
+			if (counts[dbid - dbids] > 0)
+				continue;
+		}
+
+		jobs[i].state = JOB_DONE;
+		jobs[i].finished_at = GetCurrentTimestamp();
+		set_job(&jobs[i]);
+	}
+
+	pfree(jobs);
+	pfree(dbids);
+	pfree(counts);
+}
+
+static int
+count_jobs(const int state)
+{
+	int			num = 0;
+	int			i;
+
+	LWLockAcquire(sddb->job_lock, LW_SHARED);
+	for (i = 0; i < queue->max_jobs; i++)
+		if (queue->jobs[i].state == state)
+			num++;
+	LWLockRelease(sddb->job_lock);
+
+	return num;
+}
+
+/*
+ * Return the number of the jobs whose flush workers are running.
+ */
+static int
+count_flushing(void)
+{
+	int			num = 0;
+	int			i;
+
+	LWLockAcquire(sddb->job_lock, LW_SHARED);
+	for (i = 0; i < queue->max_jobs; i++)
+		if (queue->jobs[i].state == JOB_RUNNING && queue->jobs[i].flushing)
+			num++;
+	LWLockRelease(sddb->job_lock);
+
+	return num;
+}
+
+/*
+ * Record the pid of the flush worker of the job whose job id is job_id.
+ * This is called by the worker when it starts.
+ */
+void
+sddb_job_flush_started(const int64 job_id)
+{
+	int			i;
+
+	if (queue == NULL)
+		return;
+
+	LWLockAcquire(sddb->job_lock, LW_EXCLUSIVE);
+	for (i = 0; i < queue->max_jobs; i++)
+	{
+		sddbJob    *j = &queue->jobs[i];
+
+		if (j->job_id == job_id)
+		{
+			if (j->flushing)
+				j->flush_pid = MyProcPid;
+			break;
+		}
+	}
+	LWLockRelease(sddb->job_lock);
+}
+
+/*
+ * Mark the job whose job id is job_id as flushed. This is called by the
+ * flush worker when it exits, whether it has succeeded or not; the ones
+ * which never start are found by check_flushing().
+ */
+void
+sddb_job_flush_done(const int64 job_id)
+{
+	int			i;
+
+	if (queue == NULL)
+		return;
+
+	LWLockAcquire(sddb->job_lock, LW_EXCLUSIVE);
+	for (i = 0; i < queue->max_jobs; i++)
+	{
+		sddbJob    *j = &queue->jobs[i];
+
+		if (j->job_id == job_id)
+		{
+			j->flushing = false;
+			j->flush_pid = 0;
+			break;
+		}
+	}
+	LWLockRelease(sddb->job_lock);
+}
+
+/*
+ * Copy the queued job whose job id is the smallest into *job. Returns false
+ * if there is none.
+ */
+static bool
+next_job(sddbJob * job)
+{
+	sddbJob    *next = NULL;
+	int			i;
+
+	LWLockAcquire(sddb->job_lock, LW_SHARED);
+	for (i = 0; i < queue->max_jobs; i++)
+	{
+		sddbJob    *j = &queue->jobs[i];
+
+		if (j->state == JOB_QUEUED && (next == NULL || j->job_id < next->job_id))
+			next = j;
+	}
+	if (next != NULL)
+		*job = *next;
+	LWLockRelease(sddb->job_lock);
+
+	return (next != NULL);
+}
+
+/*
+ * Mark the job running, unless it has been canceled meanwhile. Returns
+ * true if it's marked.
+ */
+static bool
+claim_job(sddbJob * job)
+{
+	bool		claimed = false;
+	int			i;
+
+	job->state = JOB_RUNNING;
+	job->started_at = GetCurrentTimestamp();
+
+	LWLockAcquire(sddb->job_lock, LW_EXCLUSIVE);
+	for (i = 0; i < queue->max_jobs; i++)
+	{
+		sddbJob    *j = &queue->jobs[i];
+
+		if (j->job_id == job->job_id)
+		{
+			if (j->state == JOB_QUEUED)
+			{
+				*j = *job;
+				claimed = true;
+			}
+			break;
+		}
+	}
+	LWLockRelease(sddb->job_lock);
+
+	return claimed;
+}
+
+/*
+ * Write back the job, unless its slot has been reused meanwhile.
+ */
+static void
+set_job(const sddbJob * job)
+{
+	int			i;
+
+	LWLockAcquire(sddb->job_lock, LW_EXCLUSIVE);
+	for (i = 0; i < queue->max_jobs; i++)
+	{
+		sddbJob    *j = &queue->jobs[i];
+
+		if (j->job_id == job->job_id)
+		{
+			*j = *job;
+			break;
+		}
+	}
+	LWLockRelease(sddb->job_lock);
+}
+
+/*
+ * Run the job in a subtransaction, so that an error only fails this job.
+ */
+static void
+run_job(sddbJob * job)
+{
+	MemoryContext oldcontext = CurrentMemoryContext;
+	ResourceOwner oldowner = CurrentResourceOwner;
+
+	BeginInternalSubTransaction(NULL);
+	MemoryContextSwitchTo(oldcontext);
+
+	PG_TRY();
+	{
+		const char *result;
+		Oid			dbid;
+
+		if (sddb_shutdown_job(NameStr(job->datname), job->mode, &dbid, &result))
+			job->state = (job->mode == NORMAL) ? JOB_DONE : JOB_RUNNING;
+		else
+			job->state = JOB_SKIPPED;
+		job->dbid = dbid;
+		strlcpy(job->result, result, SDDB_JOB_RESULT_LEN);
+
+		ReleaseCurrentSubTransaction();
+		MemoryContextSwitchTo(oldcontext);
+		CurrentResourceOwner = oldowner;
+	}
+	PG_CATCH();
+	{
+		ErrorData  *edata;
+
+		MemoryContextSwitchTo(oldcontext);
+		edata = CopyErrorData();
+		FlushErrorState();
+
+		RollbackAndReleaseCurrentSubTransaction();
+		MemoryContextSwitchTo(oldcontext);
+		CurrentResourceOwner = oldowner;
+
+		ereport(LOG,
+				(errmsg("shutdown_db: job " INT64_FORMAT " for database \"%s\" failed: %s",
+						job->job_id, NameStr(job->datname), edata->message)));
+
+		job->state = JOB_FAILED;
+		strlcpy(job->result, edata->message, SDDB_JOB_RESULT_LEN);
+		FreeErrorData(edata);
+	}
+	PG_END_TRY();
+
+	if (SDDB_JOB_IS_FINISHED(job->state))
+		job->finished_at = GetCurrentTimestamp();
+}
+
+/*
+ * Launch the flush worker of the ABORT job, which has been written back as
+ * flushing, so that the worker can clear it whenever it exits. If no worker
+ * can be launched, the buffers are written out here.
+ */
+static void
+flush_job(sddbJob * job)
+{
+	MemoryContext oldcontext;
+	BackgroundWorkerHandle *handle;
+	bool		launched;
+	int			i;
+
+	/* The handle is kept until check_flushing() finds the worker stopped */
+	oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+	launched = sddb_flush_launch(job->dbid, job->job_id, &handle);
+	MemoryContextSwitchTo(oldcontext);
+
+	if (launched)
+	{
+		for (i = 0; i < queue->max_jobs; i++)
+		{
+			if (flush_workers[i].job_id == 0)
+			{
+				flush_workers[i].job_id = job->job_id;
+				flush_workers[i].handle = handle;
+				break;
+			}
+		}
+		return;
+	}
+
+	sddb_flush_buffers(&job->dbid, 1);
+	sddb_set_progress(job->dbid, PHASE_TERMINATING, -1, -1);
+
+	job->flushing = false;
+	set_job(job);
+}
+
+/*
+ * Refill the termination budget by the time passed since the last refill.
+ */
+static void
+refill_tokens(void)
+{
+	TimestampTz now = GetCurrentTimestamp();
+	double		rate = sddb_job_termination_rate;
+
+	if (tokens < 0 && last_refill == 0)
+		tokens = rate;
+	else
+		tokens = Min(rate, tokens + rate * (now - last_refill) / USECS_PER_SEC);
+	last_refill = now;
+}
+
+/*
+ * Run the queued jobs as the budgets allow, and finish the running jobs
+ * which have been drained. This is called from the main loop of the
+ * supervisor process, outside a transaction.
+ *
+ * Returns the time in milliseconds after which this should be called
+ * again, or -1 if there is no job to wait for.
+ */
+long
+sddb_scheduler_run(void)
+{
+	long		timeout = -1;
+	int			nrunning;
+	int			nflushing;
+	sddbJob		job;
+
+	if (queue == NULL)
+		return -1;
+
+	/* Quick exit */
+	if (count_jobs(JOB_QUEUED) == 0 && count_jobs(JOB_RUNNING) == 0)
+		return -1;
+
+	StartTransactionCommand();
+	PushActiveSnapshot(GetTransactionSnapshot());
+
+	check_running();
+	nrunning = count_jobs(JOB_RUNNING);
+	nflushing = count_flushing();
+
+	if (count_jobs(JOB_QUEUED) > 0 && nrunning < sddb_job_concurrency)
+	{
+		if (sddb_job_dirty_limit > 0 &&
+			sddb_dirty_buffers_percent() >= sddb_job_dirty_limit)
+		{
+			elog(DEBUG1, "shutdown_db: the jobs wait for the dirty buffers to be written");
+			timeout = SDDB_JOB_BACKOFF_MS;
+		}
+		else
+		{
+			if (sddb_job_termination_rate > 0)
+				refill_tokens();
+
+			while (nrunning < sddb_job_concurrency && next_job(&job))
+			{
+				Oid			dbid = get_database_oid(NameStr(job.datname), true);
+				int			count = 0;
+
+				if (OidIsValid(dbid))
+					sddb_count_backends_multi(&dbid, 1, NULL, &count);
+
+				/* Wait until a flush worker exits; the jobs are run in order */
+				if (job.mode == ABORT && nflushing >= sddb_job_flush_concurrency)
+					break;
+
+				/* Wait until the bucket has enough tokens */
+				if (sddb_job_termination_rate > 0 && job.mode != NORMAL)
+				{
+					double		need = Min(count, sddb_job_termination_rate);
+
+					if (tokens < need)
+					{
+						timeout = (long) ((need - tokens) * 1000 / sddb_job_termination_rate) + 1;
+						break;
+					}
+				}
+
+				job.backends = count;
+				if (!claim_job(&job))
+					continue;
+				if (sddb_job_termination_rate > 0 && job.mode != NORMAL)
+					tokens -= count;
+				run_job(&job);
+				if (job.state == JOB_RUNNING && job.mode == ABORT)
+					job.flushing = true;
+				set_job(&job);
+
+				if (job.flushing)
+				{
+					flush_job(&job);
+					if (job.flushing)
+						nflushing++;
+				}
+
+				if (job.state == JOB_RUNNING)
+					nrunning++;
+			}
+		}
+	}
+
+	PopActiveSnapshot();
+	CommitTransactionCommand();
+
+	if (nrunning > 0)
+		timeout = (timeout < 0) ? SDDB_JOB_RECHECK_MS : Min(timeout, SDDB_JOB_RECHECK_MS);
+
+	return timeout;
+}
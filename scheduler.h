@@ -0,0 +1,64 @@
+/*-------------------------------------------------------------------------
+ * scheduler.h
+ *
+ * Copyright (c) 2008-2025, PostgreSQL Global Development Group
+ * Copyright (c) 2020-2025, hironobu suzuki@interdb.jp
+ *-------------------------------------------------------------------------
+ */
+#ifndef __SCHEDULER_H__
+#define __SCHEDULER_H__
+
+/*
+ * States of the jobs
+ */
+enum job_state
+{
+	JOB_FREE = 0,				/* the slot is unused */
+	JOB_QUEUED,					/* waiting for the budgets */
+	JOB_RUNNING,				/* shut down, and being drained */
+	JOB_DONE,					/* shut down and drained */
+	JOB_SKIPPED,				/* not shut down, e.g. not found */
+	JOB_FAILED,					/* the shutdown raised an error */
+	JOB_CANCELED				/* canceled before it was run */
+};
+
+#define SDDB_JOB_IS_FINISHED(state)	((state) >= JOB_DONE)
+
+#define SDDB_JOB_RESULT_LEN		128
+
+/*
+ * A shutdown job, queued by shutdown_db.schedule() and run by the
+ * supervisor process
+ */
+typedef struct sddbJob
+{
+	int64		job_id;			/* 0 if the slot is unused */
+	NameData	datname;
+	Oid			dbid;			/* InvalidOid until the job is run */
+	int			mode;
+	int			state;			/* enum job_state */
+	int			backends;		/* the backend processes when it was run */
+	bool		flushing;		/* ABORT: a flush worker is writing out the
+								 * buffers */
+	pid_t		flush_pid;		/* the pid of the flush worker once it has
+								 * started; otherwise 0 */
+	TimestampTz queued_at;
+	TimestampTz started_at;		/* 0 until the job is run */
+	TimestampTz finished_at;	/* 0 until the job is finished */
+	char		result[SDDB_JOB_RESULT_LEN];	/* the result of the shutdown,
+												 * or the error message */
+}			sddbJob;
+
+/*
+ * Function declarations
+ */
+Size		sddb_scheduler_memsize(const int max_jobs);
+void		sddb_scheduler_shmem_startup(const int max_jobs, const bool found);
+int64		sddb_job_enqueue(const char *datname, const int mode);
+int			sddb_jobs_copy(sddbJob * *jobs);
+int			sddb_jobs_cancel(void);
+long		sddb_scheduler_run(void);
+void		sddb_job_flush_started(const int64 job_id);
+void		sddb_job_flush_done(const int64 job_id);
+
+#endif
@@ -0,0 +1,283 @@
+/* shutdown_db--1.0.sql */
+
+-- complain if script is sourced in psql, rather than via CREATE EXTENSION
+\echo Use "CREATE EXTENSION shutdown_db" to load this file. \quit
+
+CREATE FUNCTION sddb_show_db(
+    OUT dbid oid,
+    OUT datname text,
+    OUT mode text,
+    OUT num_backends int,
+    OUT is_running bool,
+    OUT pid int,
+    OUT shutdown_time timestamptz,
+    OUT state_change timestamptz,
+    OUT released_bytes bigint)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
+CREATE VIEW show_db_list
+    AS
+    SELECT dbid, datname, mode,
+        num_backends AS num_users,
+        is_running AS killer_process_running,
+        pid AS killer_pid,
+        shutdown_time, state_change, released_bytes
+            FROM sddb_show_db() ORDER BY dbid;
+
+CREATE FUNCTION sddb_stats(
+    OUT dbid oid,
+    OUT datname text,
+    OUT shutdowns_normal bigint,
+    OUT shutdowns_abort bigint,
+    OUT shutdowns_immediate bigint,
+    OUT shutdowns_transactional bigint,
+    OUT throttles bigint,
+    OUT suspends bigint,
+    OUT startups bigint,
+    OUT drains bigint,
+    OUT total_drain_time float8,
+    OUT max_drain_time float8,
+    OUT cancels bigint,
+    OUT terminates bigint,
+    OUT rejections bigint,
+    OUT supervisor_loops bigint,
+    OUT executor_start_calls bigint,
+    OUT process_utility_calls bigint,
+    OUT client_authentication_calls bigint,
+    OUT xact_callback_calls bigint,
+    OUT stats_reset timestamptz)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
+CREATE FUNCTION sddb_stats_reset() RETURNS void
+AS 'MODULE_PATHNAME', 'sddb_stats_reset_all'
+LANGUAGE C;
+
+CREATE VIEW stats
+    AS
+    SELECT * FROM sddb_stats();
+
+CREATE FUNCTION shutdown_normal(TEXT) RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
+CREATE FUNCTION shutdown_abort(TEXT) RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
+CREATE FUNCTION shutdown_immediate(TEXT) RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
+CREATE FUNCTION shutdown_transactional(TEXT) RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
+CREATE FUNCTION shutdown_transactional(TEXT, timeout INTERVAL) RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
+CREATE FUNCTION startup(TEXT) RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
+CREATE FUNCTION throttle(TEXT, max_active INT) RETURNS void
+AS 'MODULE_PATHNAME', 'throttle_db'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION suspend(TEXT) RETURNS void
+AS 'MODULE_PATHNAME', 'suspend_db'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION shutdown_normal(TEXT, wait BOOL) RETURNS interval
+AS 'MODULE_PATHNAME', 'shutdown_normal_wait'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION shutdown_abort(TEXT, wait BOOL) RETURNS interval
+AS 'MODULE_PATHNAME', 'shutdown_abort_wait'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION shutdown_immediate(TEXT, wait BOOL) RETURNS interval
+AS 'MODULE_PATHNAME', 'shutdown_immediate_wait'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION shutdown_transactional(TEXT, wait BOOL) RETURNS interval
+AS 'MODULE_PATHNAME', 'shutdown_transactional_wait'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION shutdown_transactional(TEXT, timeout INTERVAL, wait BOOL) RETURNS interval
+AS 'MODULE_PATHNAME', 'shutdown_transactional_wait'
+LANGUAGE C;
+
+CREATE FUNCTION wait(TEXT, timeout INTERVAL DEFAULT NULL) RETURNS interval
+AS 'MODULE_PATHNAME', 'sddb_wait'
+LANGUAGE C;
+
+CREATE FUNCTION schedule(TEXT[], mode TEXT DEFAULT 'transactional',
+    OUT job_id bigint, OUT datname text)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'sddb_schedule'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION sddb_jobs(
+    OUT job_id bigint, OUT datname text, OUT dbid oid,
+    OUT mode text, OUT state text, OUT backends integer,
+    OUT queued_at timestamptz, OUT started_at timestamptz,
+    OUT finished_at timestamptz, OUT result text)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
+CREATE VIEW jobs
+    AS SELECT * FROM sddb_jobs();
+
+CREATE FUNCTION cancel_jobs() RETURNS integer
+AS 'MODULE_PATHNAME', 'sddb_cancel_jobs'
+LANGUAGE C;
+
+CREATE FUNCTION shutdown_role(TEXT, rolname TEXT,
+    mode TEXT DEFAULT 'transactional') RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION startup_role(TEXT, rolname TEXT) RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION sddb_show_roles(
+    OUT dbid oid, OUT datname text, OUT roleid oid,
+    OUT rolname text, OUT mode text, OUT is_running bool,
+    OUT shutdown_time timestamptz, OUT state_change timestamptz)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
+CREATE VIEW show_role_list
+    AS SELECT * FROM sddb_show_roles() ORDER BY dbid, roleid;
+
+CREATE FUNCTION plan(TEXT, mode TEXT DEFAULT 'transactional',
+    OUT pid integer, OUT backend_type text, OUT usename text,
+    OUT state text, OUT xact_start timestamptz,
+    OUT xact_age interval, OUT action text,
+    OUT backend_xid xid, OUT subxacts integer)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'sddb_plan'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION plan_summary(TEXT, mode TEXT DEFAULT 'transactional',
+    timeout INTERVAL DEFAULT NULL,
+    OUT datname text, OUT mode text, OUT backends integer,
+    OUT terminate integer, OUT cancel integer, OUT wait integer,
+    OUT ignore integer, OUT rolled_back_xids integer,
+    OUT oldest_xact_start timestamptz, OUT lost_xact_time interval,
+    OUT predicted_drain interval, OUT mean_drain interval,
+    OUT dirty_buffers bigint, OUT dirty_size bigint)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'sddb_plan_summary'
+LANGUAGE C;
+
+CREATE FUNCTION sddb_progress(
+    OUT dbid oid, OUT datname text, OUT mode text,
+    OUT phase text, OUT pid integer, OUT backends_total integer,
+    OUT backends_remaining integer, OUT elapsed interval,
+    OUT deadline timestamptz, OUT phase_change timestamptz,
+    OUT buffers_flushed bigint)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
+CREATE VIEW progress
+    AS SELECT * FROM sddb_progress();
+
+CREATE FUNCTION shutdown_normal(TEXT[],
+    OUT datname text, OUT dbid oid, OUT result text)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'shutdown_normal_array'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION shutdown_abort(TEXT[],
+    OUT datname text, OUT dbid oid, OUT result text)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'shutdown_abort_array'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION shutdown_immediate(TEXT[],
+    OUT datname text, OUT dbid oid, OUT result text)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'shutdown_immediate_array'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION shutdown_transactional(TEXT[],
+    OUT datname text, OUT dbid oid, OUT result text)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'shutdown_transactional_array'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION shutdown_transactional(TEXT[], timeout INTERVAL,
+    OUT datname text, OUT dbid oid, OUT result text)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'shutdown_transactional_array'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION startup(TEXT[],
+    OUT datname text, OUT dbid oid, OUT result text)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'startup_array'
+LANGUAGE C STRICT;
+
+-- This function kills the backend processes which is accessing the database
+-- whose id is dbid; see sddb_kill_backends() in backends.c.
+CREATE FUNCTION sddb_kill_processes(dbid OID, idle BOOL) RETURNS integer
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
+CREATE FUNCTION sddb_killer_launch(INTEGER) RETURNS pg_catalog.int4 STRICT
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
+-- Store the databases which have been shut down before the state file was
+-- introduced; see sddb_import_catalog() in functions.c.
+CREATE FUNCTION sddb_import_catalog() RETURNS integer
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
+SELECT sddb_import_catalog();
+
+REVOKE ALL ON FUNCTION sddb_killer_launch(INT) FROM PUBLIC;
+REVOKE ALL ON FUNCTION sddb_kill_processes(dbid OID, idle BOOL) FROM PUBLIC;
+REVOKE ALL ON FUNCTION shutdown_normal(TEXT) FROM PUBLIC;
+REVOKE ALL ON FUNCTION shutdown_abort(TEXT) FROM PUBLIC;
+REVOKE ALL ON FUNCTION shutdown_immediate(TEXT) FROM PUBLIC;
+REVOKE ALL ON FUNCTION shutdown_transactional(TEXT) FROM PUBLIC;
+REVOKE ALL ON FUNCTION shutdown_transactional(TEXT, INTERVAL) FROM PUBLIC;
+REVOKE ALL ON FUNCTION startup(TEXT) FROM PUBLIC;
+REVOKE ALL ON FUNCTION shutdown_normal(TEXT[]) FROM PUBLIC;
+REVOKE ALL ON FUNCTION shutdown_abort(TEXT[]) FROM PUBLIC;
+REVOKE ALL ON FUNCTION shutdown_immediate(TEXT[]) FROM PUBLIC;
+REVOKE ALL ON FUNCTION shutdown_transactional(TEXT[]) FROM PUBLIC;
+REVOKE ALL ON FUNCTION shutdown_transactional(TEXT[], INTERVAL) FROM PUBLIC;
+REVOKE ALL ON FUNCTION startup(TEXT[]) FROM PUBLIC;
+REVOKE ALL ON FUNCTION sddb_show_db() FROM PUBLIC;
+REVOKE ALL ON FUNCTION sddb_stats() FROM PUBLIC;
+REVOKE ALL ON FUNCTION sddb_stats_reset() FROM PUBLIC;
+REVOKE ALL ON FUNCTION throttle(TEXT, INT) FROM PUBLIC;
+REVOKE ALL ON FUNCTION suspend(TEXT) FROM PUBLIC;
+REVOKE ALL ON FUNCTION shutdown_normal(TEXT, BOOL) FROM PUBLIC;
+REVOKE ALL ON FUNCTION shutdown_abort(TEXT, BOOL) FROM PUBLIC;
+REVOKE ALL ON FUNCTION shutdown_immediate(TEXT, BOOL) FROM PUBLIC;
+REVOKE ALL ON FUNCTION shutdown_transactional(TEXT, BOOL) FROM PUBLIC;
+REVOKE ALL ON FUNCTION shutdown_transactional(TEXT, INTERVAL, BOOL) FROM PUBLIC;
+REVOKE ALL ON FUNCTION wait(TEXT, INTERVAL) FROM PUBLIC;
+REVOKE ALL ON FUNCTION schedule(TEXT[], TEXT) FROM PUBLIC;
+REVOKE ALL ON FUNCTION sddb_jobs() FROM PUBLIC;
+REVOKE ALL ON FUNCTION cancel_jobs() FROM PUBLIC;
+REVOKE ALL ON FUNCTION shutdown_role(TEXT, TEXT, TEXT) FROM PUBLIC;
+REVOKE ALL ON FUNCTION startup_role(TEXT, TEXT) FROM PUBLIC;
+REVOKE ALL ON FUNCTION sddb_show_roles() FROM PUBLIC;
+REVOKE ALL ON FUNCTION plan(TEXT, TEXT) FROM PUBLIC;
+REVOKE ALL ON FUNCTION plan_summary(TEXT, TEXT, INTERVAL) FROM PUBLIC;
+REVOKE ALL ON FUNCTION sddb_progress() FROM PUBLIC;
+REVOKE ALL ON FUNCTION sddb_import_catalog() FROM PUBLIC;
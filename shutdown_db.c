@@ -8,18 +8,33 @@
 #include "postgres.h"
 #include "postmaster/bgworker.h"
 
+#include "access/parallel.h"
 #include "access/xact.h"
+#include "commands/dbcommands.h"
 #include "funcapi.h"
+#include "libpq/auth.h"
+#include "libpq/libpq-be.h"
 #include "miscadmin.h"
+#include "replication/walsender.h"
 #include "storage/ipc.h"
 #if PG_VERSION_NUM >= 140000
 #include "storage/shmem.h"
 #endif
 #include "tcop/utility.h"
+#include "utils/acl.h"
+#include "utils/guc.h"
+#include "utils/memutils.h"
 #include "pgstat.h"
 
 #include "shutdown_db.h"
+#include "backends.h"
+#include "bgworker.h"
 #include "hashtable.h"
+#include "scheduler.h"
+#include "statefile.h"
+#include "stats.h"
+#include "throttle.h"
+#include "wal.h"
 
 PG_MODULE_MAGIC;
 
@@ -28,22 +43,108 @@ PG_MODULE_MAGIC;
  */
 static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
 static ExecutorStart_hook_type prev_ExecutorStart = NULL;
+static ExecutorEnd_hook_type prev_ExecutorEnd = NULL;
 static ProcessUtility_hook_type prev_ProcessUtility = NULL;
+static ClientAuthentication_hook_type prev_ClientAuthentication = NULL;
 
 /*
  * Links to shared memory state
  */
 sddbSharedState *sddb = NULL;
 HTAB	   *sddb_hash = NULL;
+HTAB	   *sddb_name_hash = NULL;
 
 /*
  * Static variables
  */
 static int	max_db_number;
+static int	max_jobs;
+int			sddb_killer_naptime;
+int			sddb_connection_gate;
+int			sddb_hash_storage;
+int			sddb_abort_flush;
+int			sddb_flush_rate_limit;
+bool		sddb_buffer_release;
+bool		sddb_prewarm;
+int			sddb_prewarm_rate_limit;
+bool		sddb_wal_propagation = false;
+int			sddb_job_concurrency;
+int			sddb_job_termination_rate;
+int			sddb_job_dirty_limit;
+int			sddb_job_flush_concurrency;
+int			sddb_autovacuum_policy;
+bool		sddb_block_autovacuum;
+bool		sddb_keep_walsenders;
+
+static const struct config_enum_entry gate_options[] = {
+	{"catalog", GATE_CATALOG, false},
+	{"hook", GATE_HOOK, false},
+	{NULL, 0, false}
+};
+
+static const struct config_enum_entry abort_flush_options[] = {
+	{"checkpoint", FLUSH_CHECKPOINT, false},
+	{"database", FLUSH_DATABASE, false},
+	{NULL, 0, false}
+};
+
+static const struct config_enum_entry autovacuum_options[] = {
+	{"terminate", AUTOVAC_TERMINATE, false},
+	{"finish", AUTOVAC_FINISH, false},
+	{"skip", AUTOVAC_SKIP, false},
+	{NULL, 0, false}
+};
+
+static const struct config_enum_entry session_state_options[] = {
+	{"open", SESSION_OPEN, false},
+	{"shutdown", SESSION_SHUTDOWN, false},
+	{"draining", SESSION_DRAINING, false},
+	{"throttled", SESSION_THROTTLED, false},
+	{"suspended", SESSION_SUSPENDED, false},
+	{NULL, 0, false}
+};
+
+static const struct config_enum_entry storage_options[] = {
+	{"fixed", STORAGE_FIXED, false},
+#if PG_VERSION_NUM >= 150000
+	{"dynamic", STORAGE_DYNAMIC, false},
+#endif
+	{NULL, 0, false}
+};
+
+/*
+ * The state of the accessing database cached by sddb_check_ht(), and the
+ * value of sddb->generation when it was cached.
+ */
+static uint64 cached_generation = 0;
+static bool cached_is_running = false;
+static int	cached_mode = -1;
+
+/*
+ * shutdown_db.state, which is reported to the client whenever it changes,
+ * and whether this session has been warned that it's being drained.
+ */
+static int	session_state = SESSION_OPEN;
+static bool session_warned = false;
 #if PG_VERSION_NUM >= 160000
 static shmem_request_hook_type prev_shmem_request_hook = NULL;
 #endif
 
+/*
+ * A rename of a database or a role done in the current transaction, which
+ * is applied to the entries when the transaction commits; see
+ * track_rename().
+ */
+typedef struct sddbRename
+{
+	Oid			dbid;			/* the renamed database, or InvalidOid */
+	Oid			roleid;			/* the renamed role, or InvalidOid */
+	NameData	newname;
+	SubTransactionId subid;		/* the subtransaction which has renamed it */
+}			sddbRename;
+
+static List *pending_renames = NIL;
+
 /*
  * Function declarations
  */
@@ -51,6 +152,7 @@ void		_PG_init(void);
 void		_PG_fini(void);
 
 static void sddb_ExecutorStart(QueryDesc *queryDesc, int eflags);
+static void sddb_ExecutorEnd(QueryDesc *queryDesc);
 static void sddb_ProcessUtility(PlannedStmt *pstmt, const char *queryString,
 #if PG_VERSION_NUM >= 140000
 								bool readOnlyTree,
@@ -65,7 +167,17 @@ static void sddb_ProcessUtility(PlannedStmt *pstmt, const char *queryString,
 static Size sddb_memsize(void);
 static void sddb_shmem_startup(void);
 static void sddb_shmem_shutdown(int code, Datum arg);
+static void refresh_cache(void);
 static bool sddb_check_ht(void);
+static int	sddb_check_mode(void);
+static void report_state(void);
+static void rename_target(PlannedStmt *pstmt, Oid *dbid, Oid *roleid);
+static void track_rename(PlannedStmt *pstmt, const Oid dbid, const Oid roleid);
+static void apply_renames(void);
+static void sddb_xact_callback(XactEvent event, void *arg);
+static void sddb_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+								  SubTransactionId parentSubid, void *arg);
+static void sddb_ClientAuthentication(Port *port, int status);
 #if PG_VERSION_NUM >= 160000
 static void shutdown_db_shmem_request(void);
 #endif
@@ -76,8 +188,6 @@ static void shutdown_db_shmem_request(void);
 void
 _PG_init(void)
 {
-	BackgroundWorker worker;
-
 	if (!process_shared_preload_libraries_in_progress)
 		return;
 
@@ -94,8 +204,239 @@ _PG_init(void)
 							NULL,
 							NULL);
 
+	DefineCustomEnumVariable("shutdown_db.abort_flush",
+							 "How shutdown_abort() writes out the dirty buffers.",
+							 "checkpoint performs a cluster-wide CHECKPOINT; "
+							 "database writes out only the buffers of the shutdown databases.",
+							 &sddb_abort_flush,
+							 FLUSH_CHECKPOINT,
+							 abort_flush_options,
+							 PGC_SIGHUP,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("shutdown_db.flush_rate_limit",
+							"Maximum number of buffers written per second when shutdown_db.abort_flush is database.",
+							"0 means no limit.",
+							&sddb_flush_rate_limit,
+							0,
+							0,
+							INT_MAX,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("shutdown_db.release_buffers",
+							 "Release the buffers of the databases shut down afterwards.",
+							 "When all the backends of a shutdown database have gone, its "
+							 "buffers are written out and invalidated by the supervisor process.",
+							 &sddb_buffer_release,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomBoolVariable("shutdown_db.prewarm",
+							 "Prewarm the buffers of the databases shut down afterwards when they start up again.",
+							 "When all the backends of a shutdown database have gone, the list of its "
+							 "blocks in the buffers is dumped by the supervisor process, and read back "
+							 "into the buffers when the database starts up.",
+							 &sddb_prewarm,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomEnumVariable("shutdown_db.autovacuum",
+							 "Selects how the autovacuum workers of the databases shut down afterwards are handled.",
+							 "terminate kills them as the other backends, finish lets them finish and waits for them, "
+							 "skip leaves them alone.",
+							 &sddb_autovacuum_policy,
+							 AUTOVAC_TERMINATE,
+							 autovacuum_options,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomBoolVariable("shutdown_db.block_autovacuum",
+							 "Terminates the autovacuum workers launched in the databases shut down afterwards.",
+							 "The ones vacuuming to prevent the wraparound are left alone.",
+							 &sddb_block_autovacuum,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomBoolVariable("shutdown_db.keep_walsenders",
+							 "Keeps the logical walsenders of the databases shut down afterwards.",
+							 "They are neither killed nor waited for, and their connections are accepted.",
+							 &sddb_keep_walsenders,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("shutdown_db.prewarm_rate_limit",
+							"Maximum number of blocks read per second when a database is prewarmed.",
+							"0 means no limit.",
+							&sddb_prewarm_rate_limit,
+							1024,
+							0,
+							INT_MAX,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomEnumVariable("shutdown_db.hash_storage",
+							 "Where the hash table of the shutdown databases is stored.",
+							 "fixed preallocates shutdown_db.max_db_number entries in the main shared memory; "
+							 "dynamic grows the table in dynamic shared memory on demand.",
+							 &sddb_hash_storage,
+							 STORAGE_FIXED,
+							 storage_options,
+							 PGC_POSTMASTER,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("shutdown_db.killer_naptime",
+							"Maximum time the supervisor process sleeps between checks of the transactions.",
+							"The supervisor process is also woken up whenever a transaction ends in the shutdown database.",
+							&sddb_killer_naptime,
+							15,
+							1,
+							INT_MAX / 1000,
+							PGC_SIGHUP,
+							GUC_UNIT_S,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomEnumVariable("shutdown_db.connection_gate",
+							 "How connections to the shutdown databases are rejected.",
+							 "catalog sets ALLOW_CONNECTIONS false by ALTER DATABASE; "
+							 "hook rejects them in ClientAuthentication_hook without touching pg_database.",
+							 &sddb_connection_gate,
+							 GATE_CATALOG,
+							 gate_options,
+							 PGC_SIGHUP,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("shutdown_db.max_jobs",
+							"Maximum number of the jobs kept in the queue of shutdown_db.schedule().",
+							"The slots of the finished jobs are reused.",
+							&max_jobs,
+							1024,
+							1,
+							1024 * 1024,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("shutdown_db.job_concurrency",
+							"Maximum number of the scheduled shutdowns being drained at once.",
+							NULL,
+							&sddb_job_concurrency,
+							4,
+							1,
+							INT_MAX,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("shutdown_db.job_termination_rate",
+							"Maximum number of the backend processes terminated per second by the scheduled shutdowns.",
+							"0 means no limit.",
+							&sddb_job_termination_rate,
+							100,
+							0,
+							INT_MAX,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("shutdown_db.job_flush_concurrency",
+							"Maximum number of the scheduled Abort shutdowns writing out their buffers at once.",
+							NULL,
+							&sddb_job_flush_concurrency,
+							1,
+							1,
+							INT_MAX,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("shutdown_db.job_dirty_limit",
+							"Percentage of the dirty shared buffers over which no scheduled shutdown is started.",
+							"0 means no limit.",
+							&sddb_job_dirty_limit,
+							0,
+							0,
+							100,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+#if PG_VERSION_NUM >= 150000
+	DefineCustomBoolVariable("shutdown_db.wal_propagation",
+							 "Propagates the shutdown state to the hot standbys through WAL.",
+							 "This must be set identically on the primary and on the standbys.",
+							 &sddb_wal_propagation,
+							 false,
+							 PGC_POSTMASTER,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+#endif
+
+	DefineCustomEnumVariable("shutdown_db.state",
+							 "Shows the state of the accessing database.",
+							 "This is reported to the client whenever it changes.",
+							 &session_state,
+							 SESSION_OPEN,
+							 session_state_options,
+							 PGC_INTERNAL,
+							 GUC_REPORT | GUC_NOT_IN_SAMPLE | GUC_DISALLOW_IN_FILE,
+							 NULL,
+							 NULL,
+							 NULL);
+
 	EmitWarningsOnPlaceholders("shutdown_db");
 
+	if (sddb_wal_propagation)
+		sddb_wal_register();
+
 #if PG_VERSION_NUM >= 160000
 	prev_shmem_request_hook = shmem_request_hook;
 	shmem_request_hook = shutdown_db_shmem_request;
@@ -104,9 +445,9 @@ _PG_init(void)
 #endif
 #if PG_VERSION_NUM < 160000
 #if PG_VERSION_NUM >= 90600
-	RequestNamedLWLockTranche("shutdown_db", 1);
+	RequestNamedLWLockTranche("shutdown_db", SDDB_NUM_LOCKS);
 #else
-	RequestAddinLWLocks(1);
+	RequestAddinLWLocks(SDDB_NUM_LOCKS);
 #endif
 #endif
 
@@ -117,24 +458,20 @@ _PG_init(void)
 	prev_ExecutorStart = ExecutorStart_hook;
 	ExecutorStart_hook = sddb_ExecutorStart;
 
+	prev_ExecutorEnd = ExecutorEnd_hook;
+	ExecutorEnd_hook = sddb_ExecutorEnd;
+
 	prev_ProcessUtility = ProcessUtility_hook;
 	ProcessUtility_hook = sddb_ProcessUtility;
 
-	/* Initialize background worker. */
-	memset(&worker, 0, sizeof(worker));
-	worker.bgw_flags = BGWORKER_SHMEM_ACCESS |
-		BGWORKER_BACKEND_DATABASE_CONNECTION;
-	worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
-
-	worker.bgw_restart_time = BGW_NEVER_RESTART;
-
-	sprintf(worker.bgw_library_name, "shutdown_db");
-	sprintf(worker.bgw_function_name, "shutdown_db_init");
-	worker.bgw_notify_pid = 0;
-	snprintf(worker.bgw_name, BGW_MAXLEN, "shutdown_db init");
-	snprintf(worker.bgw_type, BGW_MAXLEN, "shutdown_db");
-	worker.bgw_main_arg = Int32GetDatum(1);
-	RegisterBackgroundWorker(&worker);
+	prev_ClientAuthentication = ClientAuthentication_hook;
+	ClientAuthentication_hook = sddb_ClientAuthentication;
+
+	RegisterXactCallback(sddb_xact_callback, NULL);
+	RegisterSubXactCallback(sddb_subxact_callback, NULL);
+
+	/* Register the supervisor process. */
+	sddb_supervisor_register();
 }
 
 #if PG_VERSION_NUM >= 160000
@@ -145,7 +482,7 @@ shutdown_db_shmem_request(void)
 		prev_shmem_request_hook();
 
 	RequestAddinShmemSpace(sddb_memsize());
-	RequestNamedLWLockTranche("shutdown_db", 1);
+	RequestNamedLWLockTranche("shutdown_db", SDDB_NUM_LOCKS);
 }
 #endif
 
@@ -156,9 +493,12 @@ _PG_fini(void)
 	shmem_startup_hook = prev_shmem_startup_hook;
 	ProcessUtility_hook = prev_ProcessUtility;
 	ExecutorStart_hook = prev_ExecutorStart;
+	ExecutorEnd_hook = prev_ExecutorEnd;
+	ClientAuthentication_hook = prev_ClientAuthentication;
 #if PG_VERSION_NUM >= 160000
 	shmem_request_hook = prev_shmem_request_hook;
 #endif
+	UnregisterXactCallback(sddb_xact_callback, NULL);
 }
 
 /*
@@ -169,12 +509,14 @@ sddb_shmem_startup(void)
 {
 	bool		found;
 	HASHCTL		info;
+	int			i;
 
 	if (prev_shmem_startup_hook)
 		prev_shmem_startup_hook();
 
 	sddb = NULL;
 	sddb_hash = NULL;
+	sddb_name_hash = NULL;
 
 	/* Create or attach to the shared memory state, including hash table */
 	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
@@ -185,40 +527,125 @@ sddb_shmem_startup(void)
 	{
 		/* First time through ... */
 #if PG_VERSION_NUM >= 90600
-		sddb->lock = &(GetNamedLWLockTranche("shutdown_db"))->lock;
+		LWLockPadded *locks = GetNamedLWLockTranche("shutdown_db");
+
+		for (i = 0; i < SDDB_NUM_PARTITIONS; i++)
+			sddb->partition_locks[i] = &(locks[i].lock);
+		for (i = 0; i < SDDB_NUM_PARTITIONS; i++)
+			sddb->name_locks[i] = &(locks[SDDB_NUM_PARTITIONS + i].lock);
+		sddb->file_lock = &(locks[SDDB_NUM_PARTITIONS * 2].lock);
+		sddb->stats_lock = &(locks[SDDB_NUM_PARTITIONS * 2 + 1].lock);
+		sddb->job_lock = &(locks[SDDB_NUM_PARTITIONS * 2 + 2].lock);
 #else
-		sddb->lock = LWLockAssign();
+		for (i = 0; i < SDDB_NUM_PARTITIONS; i++)
+			sddb->partition_locks[i] = LWLockAssign();
+		for (i = 0; i < SDDB_NUM_PARTITIONS; i++)
+			sddb->name_locks[i] = LWLockAssign();
+		sddb->file_lock = LWLockAssign();
+		sddb->stats_lock = LWLockAssign();
+		sddb->job_lock = LWLockAssign();
+#endif
+		pg_atomic_init_u32(&sddb->num_ht, 0);
+		pg_atomic_init_u32(&sddb->num_roles, 0);
+		pg_atomic_init_u32(&sddb->num_unindexed, 0);
+		pg_atomic_init_u32(&sddb->num_bgw, 0);
+		pg_atomic_init_u32(&sddb->num_running, 0);
+		pg_atomic_init_u32(&sddb->num_releasing, 0);
+		pg_atomic_init_u32(&sddb->num_blocking, 0);
+		pg_atomic_init_u32(&sddb->num_undrained, 0);
+		for (i = 0; i < SDDB_FILTER_SIZE; i++)
+			pg_atomic_init_u32(&sddb->filter[i], 0);
+		for (i = 0; i < SDDB_NUM_PARTITIONS; i++)
+			ConditionVariableInit(&sddb->wait_cv[i]);
+		/* Start at 1 so that each backend's first check refreshes its cache */
+		pg_atomic_init_u64(&sddb->generation, 1);
+		SpinLockInit(&sddb->mutex);
+		sddb->supervisor_pid = InvalidPid;
+		sddb->supervisor_latch = NULL;
+		sddb->state_loaded = false;
+#if PG_VERSION_NUM >= 150000
+		sddb->dynamic_created = false;
 #endif
-		SpinLockInit(&sddb->elock);
 	}
 
-	/* Set the initial value to is_enable, num_ht and num_bgw */
-	SpinLockAcquire(&sddb->elock);
-	sddb->num_ht = 0;
-	sddb->num_bgw = 0;
-	SpinLockRelease(&sddb->elock);
+	/*
+	 * Under STORAGE_DYNAMIC, the table is created on demand by
+	 * sddb_attach_table().
+	 */
+	if (sddb_hash_storage == STORAGE_FIXED)
+	{
+		/* Be sure everyone agrees on the hash table entry size */
+		memset(&info, 0, sizeof(info));
+		info.keysize = sizeof(sddbHashKey);
+		info.entrysize = sizeof(sddbEntry);
+		info.num_partitions = SDDB_NUM_PARTITIONS;
+
+		sddb_hash = ShmemInitHash("shutdown_db hash",
+								  max_db_number, max_db_number,
+								  &info,
+								  HASH_ELEM | HASH_BLOBS | HASH_PARTITION);
+	}
 
-	/* Be sure everyone agrees on the hash table entry size */
+	/*
+	 * The name index is always in the main shared memory. Under
+	 * STORAGE_DYNAMIC, the entries beyond max_db_number are not indexed, and
+	 * are found by scanning the table.
+	 */
 	memset(&info, 0, sizeof(info));
-	info.keysize = sizeof(sddbHashKey);
-	info.entrysize = sizeof(sddbEntry);
+	info.keysize = sizeof(sddbNameKey);
+	info.entrysize = sizeof(sddbNameEntry);
+	info.num_partitions = SDDB_NUM_PARTITIONS;
+
+	sddb_name_hash = ShmemInitHash("shutdown_db name index",
+								   max_db_number, max_db_number,
+								   &info,
+								   HASH_ELEM | HASH_BLOBS | HASH_PARTITION);
 
-	sddb_hash = ShmemInitHash("shutdown_db hash",
-							  max_db_number, max_db_number,
-							  &info,
-							  HASH_ELEM);
+	sddb_stats_shmem_startup(max_db_number, found);
+	sddb_scheduler_shmem_startup(max_jobs, found);
 
 	LWLockRelease(AddinShmemInitLock);
 
+	/*
+	 * If we're in the postmaster (or a standalone backend...), set up a shmem
+	 * exit hook to save the state file.
+	 */
 	if (!IsUnderPostmaster)
 		on_shmem_exit(sddb_shmem_shutdown, (Datum) 0);
+
+	/*
+	 * Done if some other process already completed our initialization.
+	 */
+	if (found)
+		return;
+
+	/* Restore the shutdown databases from the state file. */
+	if (sddb_hash_storage == STORAGE_FIXED)
+		sddb_load_state();
 }
 
+/*
+ * shmem_shutdown hook: save the state file.
+ *
+ * The file is written whenever the hash table is changed, so this is just
+ * the last chance to write it if a previous write has failed.
+ */
 static void
 sddb_shmem_shutdown(int code, Datum arg)
 {
-	/* Do nothing */
-	return;
+	/* Don't try to save the state during a crash. */
+	if (code)
+		return;
+
+	/*
+	 * Safety check ... shouldn't get here unless shmem is set up. Under
+	 * STORAGE_DYNAMIC, sddb_hash is NULL since the postmaster never attaches
+	 * to the table; the state file is always up to date then.
+	 */
+	if (!sddb || !sddb_hash)
+		return;
+
+	sddb_save_state();
 }
 
 
@@ -231,11 +658,45 @@ sddb_memsize(void)
 	Size		size;
 
 	size = MAXALIGN(sizeof(sddbSharedState));
-	size = add_size(size, hash_estimate_size(max_db_number, sizeof(sddbEntry)));
+	if (sddb_hash_storage == STORAGE_FIXED)
+		size = add_size(size, hash_estimate_size(max_db_number, sizeof(sddbEntry)));
+	size = add_size(size, hash_estimate_size(max_db_number, sizeof(sddbNameEntry)));
+	size = add_size(size, sddb_stats_memsize(max_db_number));
+	size = add_size(size, sddb_scheduler_memsize(max_jobs));
 	return size;
 }
 
 
+/*
+ * Refresh what this backend knows about the accessing database.
+ *
+ * The answers only change when an entry is stored, changed or deleted, so
+ * they are cached in this backend and looked up again only when
+ * sddb->generation has advanced. Thus, usually, this only reads one atomic
+ * variable.
+ */
+static void
+refresh_cache(void)
+{
+	uint64		generation;
+	sddbEntry	entry;
+
+	generation = pg_atomic_read_u64(&sddb->generation);
+	if (generation != cached_generation)
+	{
+		/* Don't read the hash table before the generation */
+		pg_read_barrier();
+		cached_is_running = (sddb_is_running(MyDatabaseId) ||
+							 sddb_role_is_running(MyDatabaseId, GetSessionUserId()));
+		if (pg_atomic_read_u32(&sddb->num_ht) > 0 &&
+			sddb_get_entry(MyDatabaseId, &entry))
+			cached_mode = entry.mode;
+		else
+			cached_mode = -1;
+		cached_generation = generation;
+	}
+}
+
 /*
  * Check whether the accessing database is stored in the hash table and the killer process is running.
  * If yes, returns true; otherwise false.
@@ -243,18 +704,272 @@ sddb_memsize(void)
 static bool
 sddb_check_ht(void)
 {
-	SpinLockAcquire(&sddb->elock);
-	if (sddb->num_ht == 0)
-	{
-		SpinLockRelease(&sddb->elock);
+	if (!sddb)
 		return false;
+
+	refresh_cache();
+
+	return cached_is_running;
+}
+
+/*
+ * Return the mode of the accessing database, or -1 if it's not stored in
+ * the hash table.
+ */
+static int
+sddb_check_mode(void)
+{
+	if (!sddb || !OidIsValid(MyDatabaseId))
+		return -1;
+
+	refresh_cache();
+
+	return cached_mode;
+}
+
+/*
+ * Bring shutdown_db.state up to date with the accessing database, so that
+ * the client is told by a ParameterStatus message, rather than by a
+ * WARNING on every statement. The WARNING is sent once per drain, when
+ * the first statement outside a transaction block is executed.
+ *
+ * The variable is set as SET does, so the abort of the transaction
+ * reverts it; then, it's set again by the next statement.
+ */
+static void
+report_state(void)
+{
+	int			state;
+
+	if (!sddb || !OidIsValid(MyDatabaseId))
+		return;
+
+	/*
+	 * No parameter can be set in parallel mode, and the parallel workers
+	 * don't inherit the variable, which is PGC_INTERNAL; the leader reports
+	 * it at its next statement.
+	 */
+	if (IsParallelWorker() || IsInParallelMode())
+		return;
+
+	refresh_cache();
+
+	if (cached_is_running)
+		state = SESSION_DRAINING;
+	else if (cached_mode == -1)
+		state = SESSION_OPEN;
+	else if (cached_mode == THROTTLED)
+		state = SESSION_THROTTLED;
+	else if (cached_mode == SUSPENDED)
+		state = SESSION_SUSPENDED;
+	else
+		state = SESSION_SHUTDOWN;
+
+	if (state != session_state)
+		SetConfigOption("shutdown_db.state",
+						session_state_options[state].name,
+						PGC_INTERNAL, PGC_S_OVERRIDE);
+
+	if (state != SESSION_DRAINING)
+		session_warned = false;
+	else if (!session_warned && !IsTransactionBlock())
+	{
+		session_warned = true;
+		ereport(WARNING,
+				(errcode(ERRCODE_ADMIN_SHUTDOWN),
+				 errmsg("This database has already been shutdown and this process will be killed within seconds."),
+				 errdetail("This warning is sent once per session; shutdown_db.state shows the state.")));
+	}
+}
+
+/*
+ * Return the database or the role which pstmt renames, if any, into *dbid
+ * or *roleid. This is called before pstmt is executed, while the object
+ * can be looked up by its old name.
+ */
+static void
+rename_target(PlannedStmt *pstmt, Oid *dbid, Oid *roleid)
+{
+	RenameStmt *stmt;
+
+	*dbid = InvalidOid;
+	*roleid = InvalidOid;
+
+	if (!sddb || !IsA(pstmt->utilityStmt, RenameStmt))
+		return;
+
+	stmt = (RenameStmt *) pstmt->utilityStmt;
+	if (stmt->renameType == OBJECT_DATABASE)
+		*dbid = get_database_oid(stmt->subname, true);
+	else if (stmt->renameType == OBJECT_ROLE)
+		*roleid = get_role_oid(stmt->subname, true);
+}
+
+/*
+ * Remember the rename of the database dbid or the role roleid by pstmt,
+ * which has been executed, so that the entries are renamed at commit. The
+ * connection gate looks the entries up by the name, so they would be
+ * missed under the new name otherwise.
+ */
+static void
+track_rename(PlannedStmt *pstmt, const Oid dbid, const Oid roleid)
+{
+	RenameStmt *stmt = (RenameStmt *) pstmt->utilityStmt;
+	MemoryContext oldcontext;
+	sddbRename *rename;
+
+	oldcontext = MemoryContextSwitchTo(TopTransactionContext);
+	rename = (sddbRename *) palloc0(sizeof(sddbRename));
+	rename->dbid = dbid;
+	rename->roleid = roleid;
+	namestrcpy(&rename->newname, stmt->newname);
+	rename->subid = GetCurrentSubTransactionId();
+	pending_renames = lappend(pending_renames, rename);
+	MemoryContextSwitchTo(oldcontext);
+}
+
+/*
+ * Rename the entries as the transaction, which is about to commit, has
+ * renamed their databases and roles, and save the state file if any of
+ * them has been renamed.
+ */
+static void
+apply_renames(void)
+{
+	ListCell   *lc;
+	int			n = 0;
+
+	foreach(lc, pending_renames)
+	{
+		sddbRename *rename = (sddbRename *) lfirst(lc);
+
+		n += sddb_rename_entries(rename->dbid, rename->roleid,
+								 NameStr(rename->newname));
+	}
+	pending_renames = NIL;
+
+	if (n > 0)
+		sddb_save_state();
+}
+
+/*
+ * Transaction callback
+ *
+ * When a transaction ends in the database which the supervisor process is
+ * draining, wake up the supervisor process, so that it kills this backend as
+ * soon as the backend becomes idle instead of after sddb_killer_naptime.
+ *
+ * The renames of the databases and the roles are applied to the entries
+ * just before the commit, where an error still aborts the transaction.
+ */
+static void
+sddb_xact_callback(XactEvent event, void *arg)
+{
+	if (event == XACT_EVENT_PRE_COMMIT && pending_renames != NIL)
+		apply_renames();
+	else if (event == XACT_EVENT_ABORT || event == XACT_EVENT_PREPARE)
+		pending_renames = NIL;
+
+	/* Release the slot of the THROTTLED database, if still held */
+	if (event == XACT_EVENT_COMMIT || event == XACT_EVENT_ABORT ||
+		event == XACT_EVENT_PREPARE)
+		sddb_throttle_xact_end();
+
+	if (event != XACT_EVENT_COMMIT && event != XACT_EVENT_ABORT)
+		return;
+
+	sddb_stats_count_hook(HOOK_XACT_CALLBACK);
+
+	if (!OidIsValid(MyDatabaseId) || !sddb_check_ht())
+		return;
+
+	sddb_supervisor_wakeup();
+}
+
+/*
+ * Subtransaction callback
+ *
+ * Release the slot of the THROTTLED database held by the statement which
+ * has failed in the aborted subtransaction, since its ExecutorEnd is never
+ * called.
+ */
+static void
+sddb_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+					  SubTransactionId parentSubid, void *arg)
+{
+	if (event == SUBXACT_EVENT_ABORT_SUB)
+	{
+		sddb_throttle_subxact_abort(mySubid);
+
+		/* Forget the renames done in the aborted subtransaction */
+		if (pending_renames != NIL)
+		{
+			MemoryContext oldcontext = MemoryContextSwitchTo(TopTransactionContext);
+			List	   *kept = NIL;
+			ListCell   *lc;
+
+			foreach(lc, pending_renames)
+			{
+				sddbRename *rename = (sddbRename *) lfirst(lc);
+
+				if (rename->subid < mySubid)
+					kept = lappend(kept, rename);
+			}
+			pending_renames = kept;
+			MemoryContextSwitchTo(oldcontext);
+		}
 	}
-	SpinLockRelease(&sddb->elock);
+}
+
+/*
+ * ClientAuthentication hook
+ *
+ * Reject the connection to a shutdown database right after authentication,
+ * before the database is looked up. This is what rejects connections when
+ * shutdown_db.connection_gate is 'hook', since pg_database is not changed
+ * then.
+ */
+static void
+sddb_ClientAuthentication(Port *port, int status)
+{
+	Oid			dbid;
+
+	if (prev_ClientAuthentication)
+		prev_ClientAuthentication(port, status);
+
+	sddb_stats_count_hook(HOOK_CLIENT_AUTHENTICATION);
+
+	if (status != STATUS_OK || port->database_name == NULL)
+		return;
+
+	/* Wake up the waiters of the draining when this session exits */
+	on_shmem_exit(sddb_backend_exit, (Datum) 0);
 
-	if (sddb_find_entry(MyDatabaseId, true))
-		return true;
+	if (sddb_find_entry_by_name(port->database_name, NULL, &dbid))
+	{
+		sddbEntry	entry;
+
+		/* The logical walsenders may be kept */
+		if (am_db_walsender && sddb_get_entry(dbid, &entry) &&
+			(entry.flags & SDDB_FLAG_KEEP_WALSENDERS))
+			return;
+
+		sddb_stats_count_rejection(dbid);
+		ereport(FATAL,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("database \"%s\" is not currently accepting connections",
+						port->database_name)));
+	}
 
-	return false;
+	if (port->user_name != NULL &&
+		sddb_find_entry_by_name(port->database_name, port->user_name, &dbid))
+	{
+		sddb_stats_count_rejection(dbid);
+		ereport(FATAL,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("database \"%s\" is not currently accepting connections of role \"%s\"",
+						port->database_name, port->user_name)));
+	}
 }
 
 /*
@@ -263,19 +978,47 @@ sddb_check_ht(void)
 static void
 sddb_ExecutorStart(QueryDesc *queryDesc, int eflags)
 {
+	switch (sddb_check_mode())
+	{
+		case SUSPENDED:
+			/* Park until the database starts up again */
+			sddb_suspend_wait();
+			break;
+		case THROTTLED:
+			/* Wait for a slot */
+			sddb_throttle_start(queryDesc);
+			break;
+		default:
+			break;
+	}
+	sddb_statement_enter();
+
 	if (prev_ExecutorStart)
 		prev_ExecutorStart(queryDesc, eflags);
 	else
 		standard_ExecutorStart(queryDesc, eflags);
 
-	if (sddb_check_ht() && !IsTransactionBlock())
-	{
-		elog(WARNING, "This database has already been shutdown and this process will be killed within seconds.");
-		return;
-	}
+	sddb_stats_count_hook(HOOK_EXECUTOR_START);
+
+	report_state();
 }
 
 
+/*
+ * ExecutorEnd hook
+ */
+static void
+sddb_ExecutorEnd(QueryDesc *queryDesc)
+{
+	if (prev_ExecutorEnd)
+		prev_ExecutorEnd(queryDesc);
+	else
+		standard_ExecutorEnd(queryDesc);
+
+	sddb_statement_exit();
+	sddb_throttle_end(queryDesc);
+}
+
 /*
  * ProcessUtility hook
  */
@@ -292,6 +1035,16 @@ static void
 								char *completionTag)
 #endif
 {
+	Oid			rename_dbid;
+	Oid			rename_roleid;
+
+	/* Park until the database starts up again */
+	if (sddb_check_mode() == SUSPENDED)
+		sddb_suspend_wait();
+	sddb_statement_enter();
+
+	rename_target(pstmt, &rename_dbid, &rename_roleid);
+
 	if (prev_ProcessUtility)
 		prev_ProcessUtility(pstmt, queryString,
 #if PG_VERSION_NUM >= 140000
@@ -315,9 +1068,11 @@ static void
 								params, queryEnv, dest, completionTag);
 #endif
 
-	if (sddb_check_ht() && !IsTransactionBlock())
-	{
-		elog(WARNING, "This database has already been shutdown and this process will be killed within seconds.");
-		return;
-	}
+	if (OidIsValid(rename_dbid) || OidIsValid(rename_roleid))
+		track_rename(pstmt, rename_dbid, rename_roleid);
+
+	sddb_statement_exit();
+	sddb_stats_count_hook(HOOK_PROCESS_UTILITY);
+
+	report_state();
 }
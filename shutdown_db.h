@@ -8,30 +8,185 @@
 #ifndef __SHUTDOWN_DB_H__
 #define __SHUTDOWN_DB_H__
 
+#include "datatype/timestamp.h"
+#if PG_VERSION_NUM >= 150000
+#include "lib/dshash.h"
+#endif
+#include "port/atomics.h"
+#include "storage/condition_variable.h"
+#include "storage/latch.h"
 #include "storage/lwlock.h"
 
 /*
  * Define constants
  */
-#define SHUTDOWN_DB_COLS		 3
+#define SHUTDOWN_DB_COLS_V1_0	 3
+#define SHUTDOWN_DB_COLS		 9
 
 #define SCHEMA "shutdown_db"
 
+/*
+ * Number of the partitions of the hash table, each of which has its own
+ * LWLock. It must be a power of 2.
+ */
+#define SDDB_NUM_PARTITIONS		 16
+
+/*
+ * Number of the LWLocks in our tranche: the partition locks, the partition
+ * locks of the name index, the file lock, the stats lock and the job lock.
+ */
+#define SDDB_NUM_LOCKS			 (SDDB_NUM_PARTITIONS * 2 + 3)
+
+/*
+ * Size of the counting filter over the dbids whose killer process is
+ * running. It must be a power of 2.
+ */
+#define SDDB_FILTER_SIZE		 1024
+#define SDDB_FILTER_SLOT(dbid)	 ((dbid) & (SDDB_FILTER_SIZE - 1))
+
+/*
+ * The condition variable the backends of a THROTTLED or SUSPENDED database
+ * wait on
+ */
+#define SDDB_WAIT_CV(dbid) \
+	(&sddb->wait_cv[(dbid) & (SDDB_NUM_PARTITIONS - 1)])
+
+/*
+ * How connections to the shutdown databases are rejected
+ * (shutdown_db.connection_gate)
+ */
+enum gate
+{
+	GATE_CATALOG = 0,			/* ALTER DATABASE ALLOW_CONNECTIONS false */
+	GATE_HOOK					/* ClientAuthentication_hook */
+};
+
+/*
+ * How shutdown_abort() writes out the dirty buffers
+ * (shutdown_db.abort_flush)
+ */
+enum abort_flush
+{
+	FLUSH_CHECKPOINT = 0,		/* cluster-wide CHECKPOINT */
+	FLUSH_DATABASE,				/* only the buffers of the shutdown databases */
+	FLUSH_DEFERRED				/* only the buffers of the shutdown database,
+								 * by a flush worker; used by the jobs of the
+								 * scheduler, not a value of the parameter */
+};
+
+/*
+ * Where the hash table is stored (shutdown_db.hash_storage)
+ */
+enum storage
+{
+	STORAGE_FIXED = 0,			/* HTAB of max_db_number in main shared memory */
+	STORAGE_DYNAMIC				/* dshash table in a DSA area */
+};
+
+/*
+ * How the autovacuum workers are handled at shutdown
+ * (shutdown_db.autovacuum)
+ */
+enum autovacuum_policy
+{
+	AUTOVAC_TERMINATE = 0,		/* terminated as the other backends are */
+	AUTOVAC_FINISH,				/* SDDB_FLAG_AUTOVAC_FINISH */
+	AUTOVAC_SKIP				/* SDDB_FLAG_AUTOVAC_SKIP */
+};
+
+/*
+ * The state of the accessing database reported to the client
+ * (shutdown_db.state)
+ */
+enum session_state
+{
+	SESSION_OPEN = 0,			/* not stored in the hash table */
+	SESSION_SHUTDOWN,			/* shut down; new connections are rejected */
+	SESSION_DRAINING,			/* being drained; this session is terminated
+								 * once idle */
+	SESSION_THROTTLED,			/* THROTTLED */
+	SESSION_SUSPENDED			/* SUSPENDED */
+};
+
+/*
+ * What is being done to drain a shutdown database, shown in
+ * shutdown_db.progress
+ */
+enum drain_phase
+{
+	PHASE_DONE = 0,				/* drained, or not being drained */
+	PHASE_GATING,				/* rejecting the new connections */
+	PHASE_CANCELLING,			/* cancelling the transactions, past the
+								 * deadline */
+	PHASE_WAITING,				/* waiting for the transactions to end */
+	PHASE_WAITING_SESSIONS,		/* waiting for the sessions to disconnect,
+								 * in NORMAL mode */
+	PHASE_TERMINATING,			/* waiting for the terminated backends to
+								 * exit */
+	PHASE_FLUSHING,				/* writing out the dirty buffers */
+	PHASE_RELEASING				/* releasing the buffers */
+};
+
+/*
+ * Flags of sddbEntry
+ */
+#define SDDB_FLAG_CATALOG_GATE	0x0001	/* ALLOW_CONNECTIONS has been set to
+										 * false by ALTER DATABASE */
+#define SDDB_FLAG_RELEASE_BUFFERS	0x0002	/* release the buffers after all
+											 * the backends have gone */
+#define SDDB_FLAG_BUFFERS_DONE	0x0004	/* the buffers have been released
+										 * and/or dumped */
+#define SDDB_FLAG_DUMP_BLOCKS	0x0008	/* dump the block list of the buffers
+										 * after all the backends have gone,
+										 * to prewarm them at startup */
+
+#define SDDB_FLAG_AUTOVAC_FINISH	0x0010	/* let the running autovacuum
+											 * workers finish, and wait for
+											 * them */
+#define SDDB_FLAG_AUTOVAC_SKIP	0x0020	/* leave the autovacuum workers
+										 * alone, and don't wait for them */
+#define SDDB_FLAG_BLOCK_AUTOVAC 0x0040	/* terminate the autovacuum workers
+										 * launched after the shutdown */
+#define SDDB_FLAG_KEEP_WALSENDERS	0x0080	/* leave the logical walsenders
+											 * alone, and accept their
+											 * connections */
+#define SDDB_FLAG_TERMINATE_ALL 0x0100	/* the supervisor process terminates
+										 * all the sessions, not only the
+										 * idle ones; the Abort and Immediate
+										 * modes replayed on a standby */
+
+/* Whether the supervisor process has the buffers of the entry to handle */
+#define SDDB_BUFFERS_PENDING(flags) \
+	(((flags) & (SDDB_FLAG_RELEASE_BUFFERS | SDDB_FLAG_DUMP_BLOCKS)) != 0 && \
+	 ((flags) & SDDB_FLAG_BUFFERS_DONE) == 0)
+
 enum mode
 {
 	INIT = 0,
 	NORMAL,
 	ABORT,
 	IMMEDIATE,
-	TRANSACTIONAL
+	TRANSACTIONAL,
+	THROTTLED,					/* not shut down; the concurrently executing
+								 * statements are limited */
+	SUSPENDED					/* not shut down; new statements wait until
+								 * startup() */
 };
 
+#define SDDB_NUM_MODES			 (SUSPENDED + 1)
+
+/* Whether the mode rejects connections, i.e. the database is shut down */
+#define SDDB_IS_SHUTDOWN(mode)	 ((mode) != THROTTLED && (mode) != SUSPENDED)
+
 /*
  * Define data types
  */
 typedef struct sddbHashKey
 {
 	Oid			dbid;			/* the id of the shutdown database */
+	Oid			roleid;			/* the id of the shutdown role in the
+								 * database; InvalidOid if the whole
+								 * database is shut down */
 }			sddbHashKey;
 
 typedef struct sddbEntry
@@ -39,22 +194,111 @@ typedef struct sddbEntry
 	sddbHashKey key;			/* hash key of entry - MUST BE FIRST */
 	slock_t		mutex;			/* protects the entry */
 	Oid			dbid;			/* the id of the shutdown database */
+	NameData	datname;		/* the name of the shutdown database */
+	NameData	rolname;		/* the name of the shutdown role, if
+								 * key.roleid is valid */
 	int			mode;			/* shutdown mode */
+	int			flags;			/* SDDB_FLAG_* */
+	TimestampTz shutdown_time;	/* when the database has been shut down */
+	TimestampTz state_change;	/* when `is_running` was last changed */
+	TimestampTz deadline;		/* when the draining is given up and the
+								 * mode is escalated to IMMEDIATE; 0 if none */
+	int			released_buffers;	/* number of the buffers released, if
+									 * SDDB_FLAG_BUFFERS_DONE is set; -1
+									 * if unknown */
+	int			max_active;		/* THROTTLED: the maximum number of the
+								 * executing statements; 0 if no limit */
+	int			active;			/* THROTTLED: the number of the executing
+								 * statements */
 	bool		is_running;		/* whether users are using this database */
-	pid_t		pid;			/* the pid of killer bgworker process if it's
-								 * running; otherwise InvalidPid */
+	pid_t		pid;			/* the pid of the supervisor process which
+								 * serves this entry if it's running;
+								 * otherwise InvalidPid */
+	int			phase;			/* enum drain_phase */
+	TimestampTz phase_change;	/* when `phase` was last changed */
+	pid_t		progress_pid;	/* the pid of the process which has reported
+								 * the progress last */
+	int			backends_start; /* number of the backend processes at the
+								 * shutdown; -1 if unknown */
+	int			buffers_flushed;	/* number of the buffers written out by
+									 * the shutdown; -1 if none */
+	bool		drain_pending;	/* whether the drain is yet to be counted
+								 * when the backends are gone */
 }			sddbEntry;
 
+/*
+ * The index of the entries by name, which the ClientAuthentication hook
+ * looks up before the database is known by its id.
+ */
+typedef struct sddbNameKey
+{
+	NameData	datname;		/* the name of the database */
+	NameData	rolname;		/* the name of the role; empty for the entry
+								 * of the whole database */
+}			sddbNameKey;
+
+typedef struct sddbNameEntry
+{
+	sddbNameKey key;			/* hash key of entry - MUST BE FIRST */
+	sddbHashKey entry_key;		/* the key of the entry in the hash table */
+}			sddbNameEntry;
+
 /*
  * Global shared state
  */
 typedef struct sddbSharedState
 {
-	LWLock	   *lock;			/* protects hashtable search/modification */
-	int			num_ht;			/* number of hashtable elements */
-	int			num_bgw;		/* number of running bgworkers */
-	slock_t		elock;			/* protects the variable `num_ht` and
-								 * `num_bgw` */
+	LWLock	   *partition_locks[SDDB_NUM_PARTITIONS];	/* protect hashtable
+														 * search/modification,
+														 * per partition */
+	LWLock	   *name_locks[SDDB_NUM_PARTITIONS];	/* protect the name index,
+													 * per partition; taken
+													 * after partition_locks,
+													 * never before */
+	LWLock	   *file_lock;		/* serializes writers of the state file */
+	LWLock	   *stats_lock;		/* protects the statistics; see stats.c */
+	LWLock	   *job_lock;		/* protects the job queue; see scheduler.c */
+	pg_atomic_uint32 num_ht;	/* number of hashtable elements */
+	pg_atomic_uint32 num_roles; /* number of hashtable elements of roles */
+	pg_atomic_uint32 num_unindexed; /* number of hashtable elements missing
+									 * from the name index */
+	pg_atomic_uint32 num_bgw;	/* number of running bgworkers */
+	pg_atomic_uint32 num_running;	/* number of entries whose `is_running`
+									 * is true */
+	pg_atomic_uint32 num_releasing; /* number of entries whose buffers are
+									 * SDDB_BUFFERS_PENDING() */
+	pg_atomic_uint32 num_blocking;	/* number of entries which have
+									 * SDDB_FLAG_BLOCK_AUTOVAC */
+	pg_atomic_uint32 num_undrained; /* number of entries whose
+									 * `drain_pending` is true */
+	pg_atomic_uint32 filter[SDDB_FILTER_SIZE];	/* number of entries whose
+												 * `is_running` is true, per
+												 * SDDB_FILTER_SLOT(dbid) */
+	pg_atomic_uint64 generation;	/* incremented whenever an entry is
+									 * stored, changed or deleted */
+	pid_t		supervisor_pid; /* the pid of the supervisor process if it's
+								 * running; otherwise InvalidPid */
+	Latch	   *supervisor_latch;	/* the latch of the supervisor process if
+									 * it's running; otherwise NULL */
+	slock_t		mutex;			/* protects `supervisor_pid` and
+								 * `supervisor_latch` */
+	bool		state_loaded;	/* whether the hash table has been restored
+								 * from the state file, or imported from
+								 * pg_database */
+	ConditionVariable wait_cv[SDDB_NUM_PARTITIONS]; /* the backends of
+													 * THROTTLED and
+													 * SUSPENDED databases
+													 * sleep on
+													 * SDDB_WAIT_CV() */
+#if PG_VERSION_NUM >= 150000
+	/* The followings are protected by `file_lock` */
+	bool		dynamic_created;	/* whether the dshash table has been
+									 * created under STORAGE_DYNAMIC */
+	int			tranche_id;		/* tranche of the DSA area and the dshash
+								 * table */
+	dsa_handle	dsa_handle;		/* the DSA area of the dshash table */
+	dshash_table_handle dshash_handle;	/* the dshash table */
+#endif
 }			sddbSharedState;
 
 #endif
@@ -0,0 +1,302 @@
+/*-------------------------------------------------------------------------
+ * statefile.c
+ *
+ * Copyright (c) 2008-2025, PostgreSQL Global Development Group
+ * Copyright (c) 2020-2025, Hironobu Suzuki @ interdb.jp
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "storage/fd.h"
+
+#include "shutdown_db.h"
+#include "hashtable.h"
+#include "statefile.h"
+
+/*
+ * The state file consists of the header, the version, the number of
+ * records, and the records. The files of version 1, which have no
+ * max_active, and of version 2, which have no roles, are still read.
+ */
+static const uint32 SDDB_STATE_FILE_HEADER = 0x53444442;
+static const uint32 SDDB_STATE_FILE_VERSION = 3;
+
+typedef struct sddbStateRecordV1
+{
+	TimestampTz shutdown_time;
+	Oid			dbid;
+	int32		mode;
+	int32		flags;
+	NameData	datname;
+}			sddbStateRecordV1;
+
+typedef struct sddbStateRecordV2
+{
+	TimestampTz shutdown_time;
+	Oid			dbid;
+	int32		mode;
+	int32		flags;
+	int32		max_active;
+	NameData	datname;
+}			sddbStateRecordV2;
+
+typedef struct sddbStateRecord
+{
+	TimestampTz shutdown_time;	/* when the database has been shut down */
+	Oid			dbid;			/* the id of the shutdown database */
+	Oid			roleid;			/* the id of the shutdown role; InvalidOid
+								 * if the whole database is shut down */
+	int32		mode;			/* shutdown mode */
+	int32		flags;			/* SDDB_FLAG_* */
+	int32		max_active;		/* the limit of a THROTTLED database */
+	NameData	datname;		/* the name of the shutdown database */
+	NameData	rolname;		/* the name of the shutdown role */
+}			sddbStateRecord;
+
+/*
+ * extern variables
+ */
+extern sddbSharedState * sddb;
+
+
+/*
+ * Write all the entries into the state file.
+ *
+ * This is called whenever an entry is stored or deleted, and at the
+ * shutdown of the server. The file is written to a temporary file and then
+ * renamed, so that a crash can't leave a half-written state file.
+ *
+ * A failure is reported as a WARNING: the hash table itself has been
+ * changed anyway, and only the next restart will lose the change.
+ */
+void
+sddb_save_state(void)
+{
+	FILE	   *file;
+	sddbEntry  *entries;
+	sddbStateRecord rec;
+	int32		num;
+	int			i;
+
+	/*
+	 * Safety check... This also attaches to the table before taking
+	 * file_lock, which attaching to it may need.
+	 */
+	if (!sddb_attach_table())
+		return;
+
+	/*
+	 * Hold file_lock while copying the entries, so that the newest copy is
+	 * always the last one written.
+	 */
+	LWLockAcquire(sddb->file_lock, LW_EXCLUSIVE);
+
+	num = sddb_copy_entries(&entries);
+
+	file = AllocateFile(SDDB_STATE_FILE ".tmp", PG_BINARY_W);
+	if (file == NULL)
+		goto error;
+
+	if (fwrite(&SDDB_STATE_FILE_HEADER, sizeof(uint32), 1, file) != 1)
+		goto error;
+	if (fwrite(&SDDB_STATE_FILE_VERSION, sizeof(uint32), 1, file) != 1)
+		goto error;
+	if (fwrite(&num, sizeof(int32), 1, file) != 1)
+		goto error;
+
+	for (i = 0; i < num; i++)
+	{
+		memset(&rec, 0, sizeof(rec));
+		rec.shutdown_time = entries[i].shutdown_time;
+		rec.dbid = entries[i].dbid;
+		rec.roleid = entries[i].key.roleid;
+		rec.mode = entries[i].mode;
+		rec.flags = entries[i].flags;
+		rec.max_active = entries[i].max_active;
+		namestrcpy(&rec.datname, NameStr(entries[i].datname));
+		namestrcpy(&rec.rolname, NameStr(entries[i].rolname));
+
+		if (fwrite(&rec, sizeof(sddbStateRecord), 1, file) != 1)
+			goto error;
+	}
+
+	if (FreeFile(file))
+	{
+		file = NULL;
+		goto error;
+	}
+
+	(void) durable_rename(SDDB_STATE_FILE ".tmp", SDDB_STATE_FILE, WARNING);
+
+	LWLockRelease(sddb->file_lock);
+
+	if (entries)
+		pfree(entries);
+	return;
+
+error:
+	ereport(WARNING,
+			(errcode_for_file_access(),
+			 errmsg("could not write file \"%s\": %m",
+					SDDB_STATE_FILE ".tmp")));
+	if (file)
+		FreeFile(file);
+	unlink(SDDB_STATE_FILE ".tmp");
+
+	LWLockRelease(sddb->file_lock);
+
+	if (entries)
+		pfree(entries);
+}
+
+/*
+ * Load the entries from the state file into the hash table.
+ *
+ * This is called by the postmaster when the shared memory is created. The
+ * killer processes are gone by then, so every entry is restored as not
+ * running. A broken file is ignored with a LOG message; the entries
+ * restored before the error is found are deleted again, so that a file is
+ * either restored as a whole or not at all, as sddb->state_loaded tells.
+ */
+void
+sddb_load_state(void)
+{
+	FILE	   *file;
+	sddbStateRecord rec;
+	uint32		header;
+	uint32		version;
+	int32		num;
+	sddbHashKey *restored = NULL;
+	int			nrestored = 0;
+	int			maxrestored = 0;
+	int			i;
+
+	file = AllocateFile(SDDB_STATE_FILE, PG_BINARY_R);
+	if (file == NULL)
+	{
+		if (errno != ENOENT)
+			goto read_error;
+		/* No existing persisted state file, so we're done */
+		return;
+	}
+
+	if (fread(&header, sizeof(uint32), 1, file) != 1 ||
+		fread(&version, sizeof(uint32), 1, file) != 1 ||
+		fread(&num, sizeof(int32), 1, file) != 1)
+		goto read_error;
+
+	if (header != SDDB_STATE_FILE_HEADER ||
+		version < 1 || version > SDDB_STATE_FILE_VERSION ||
+		num < 0)
+		goto data_error;
+
+	for (i = 0; i < num; i++)
+	{
+		if (version == 1)
+		{
+			sddbStateRecordV1 rec_v1;
+
+			if (fread(&rec_v1, sizeof(sddbStateRecordV1), 1, file) != 1)
+				goto read_error;
+
+			memset(&rec, 0, sizeof(rec));
+			rec.shutdown_time = rec_v1.shutdown_time;
+			rec.dbid = rec_v1.dbid;
+			rec.roleid = InvalidOid;
+			rec.mode = rec_v1.mode;
+			rec.flags = rec_v1.flags;
+			rec.max_active = 0;
+			memcpy(&rec.datname, &rec_v1.datname, sizeof(NameData));
+		}
+		else if (version == 2)
+		{
+			sddbStateRecordV2 rec_v2;
+
+			if (fread(&rec_v2, sizeof(sddbStateRecordV2), 1, file) != 1)
+				goto read_error;
+
+			memset(&rec, 0, sizeof(rec));
+			rec.shutdown_time = rec_v2.shutdown_time;
+			rec.dbid = rec_v2.dbid;
+			rec.roleid = InvalidOid;
+			rec.mode = rec_v2.mode;
+			rec.flags = rec_v2.flags;
+			rec.max_active = rec_v2.max_active;
+			memcpy(&rec.datname, &rec_v2.datname, sizeof(NameData));
+		}
+		else if (fread(&rec, sizeof(sddbStateRecord), 1, file) != 1)
+			goto read_error;
+
+		if (!OidIsValid(rec.dbid) || rec.mode < INIT || rec.mode >= SDDB_NUM_MODES)
+			goto data_error;
+
+		/* make sure the names are terminated */
+		rec.datname.data[NAMEDATALEN - 1] = '\0';
+		rec.rolname.data[NAMEDATALEN - 1] = '\0';
+
+		if (!sddb_restore_entry(rec.dbid, NameStr(rec.datname), rec.roleid,
+								NameStr(rec.rolname), rec.mode, rec.flags,
+								rec.shutdown_time))
+			ereport(LOG,
+					(errmsg("shutdown_db: could not restore database %u from file \"%s\"",
+							rec.dbid, SDDB_STATE_FILE),
+					 errhint("Consider increasing shutdown_db.max_db_number.")));
+		else
+		{
+			/* num is not trusted until the whole file has been read */
+			if (nrestored >= maxrestored)
+			{
+				maxrestored = Max(maxrestored * 2, 64);
+				if (restored)
+					restored = (sddbHashKey *) repalloc(restored,
+														sizeof(sddbHashKey) * maxrestored);
+				else
+					restored = (sddbHashKey *) palloc(sizeof(sddbHashKey) * maxrestored);
+			}
+			restored[nrestored].dbid = rec.dbid;
+			restored[nrestored].roleid = rec.roleid;
+			nrestored++;
+
+			if (rec.mode == THROTTLED)
+				sddb_set_throttle(rec.dbid, rec.max_active);
+		}
+	}
+
+	FreeFile(file);
+	if (restored)
+		pfree(restored);
+
+	sddb->state_loaded = true;
+	return;
+
+read_error:
+	ereport(LOG,
+			(errcode_for_file_access(),
+			 errmsg("could not read file \"%s\": %m",
+					SDDB_STATE_FILE)));
+	goto fail;
+data_error:
+	ereport(LOG,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("ignoring invalid data in file \"%s\"",
+					SDDB_STATE_FILE)));
+fail:
+	if (file)
+		FreeFile(file);
+
+	/* Undo the partial restore */
+	for (i = 0; i < nrestored; i++)
+	{
+		if (OidIsValid(restored[i].roleid))
+			sddb_delete_role_entry(restored[i].dbid, restored[i].roleid);
+		else
+			sddb_delete_entry(restored[i].dbid);
+	}
+	if (restored)
+		pfree(restored);
+}
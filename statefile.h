@@ -0,0 +1,22 @@
+/*-------------------------------------------------------------------------
+ * statefile.h
+ *
+ * Copyright (c) 2008-2025, PostgreSQL Global Development Group
+ * Copyright (c) 2020-2025, hironobu suzuki@interdb.jp
+ *-------------------------------------------------------------------------
+ */
+#ifndef __STATEFILE_H__
+#define __STATEFILE_H__
+
+/*
+ * Location of the state file, which keeps the hash table across restarts
+ */
+#define SDDB_STATE_FILE		PGSTAT_STAT_PERMANENT_DIRECTORY "/shutdown_db.state"
+
+/*
+ * Function declarations
+ */
+void		sddb_save_state(void);
+void		sddb_load_state(void);
+
+#endif
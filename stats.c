@@ -0,0 +1,430 @@
+/*-------------------------------------------------------------------------
+ * stats.c
+ *
+ * Copyright (c) 2008-2025, PostgreSQL Global Development Group
+ * Copyright (c) 2020-2025, Hironobu Suzuki @ interdb.jp
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "storage/ipc.h"
+#include "storage/shmem.h"
+#include "utils/hsearch.h"
+#include "utils/timestamp.h"
+
+#include "shutdown_db.h"
+#include "stats.h"
+
+/*
+ * Each backend counts the hook invocations locally, and adds them to the
+ * shared counters every SDDB_STATS_HOOK_FLUSH invocations and at exit, so
+ * that the hooks don't contend on the shared counters.
+ */
+#define SDDB_STATS_HOOK_FLUSH	1024
+
+/*
+ * Shared statistics. The per-database counters are in stats_hash.
+ */
+typedef struct sddbStatsShared
+{
+	sddbStatsCounters total;	/* protected by sddb->stats_lock */
+	TimestampTz stats_reset;	/* protected by sddb->stats_lock */
+	pg_atomic_uint64 supervisor_loops;
+	pg_atomic_uint64 hook_calls[SDDB_NUM_HOOKS];
+}			sddbStatsShared;
+
+/*
+ * extern variables
+ */
+extern sddbSharedState * sddb;
+
+/*
+ * Links to shared memory state
+ */
+static sddbStatsShared * stats = NULL;
+static HTAB *stats_hash = NULL;
+
+/*
+ * Hook invocations not added to the shared counters yet
+ */
+static uint64 local_hook_calls[SDDB_NUM_HOOKS];
+static int	local_pending = 0;
+static bool local_exit_registered = false;
+
+/*
+ * Function declarations
+ */
+static sddbStatsEntry * get_stats_entry(const Oid dbid, const char *datname);
+static void flush_hook_calls(int code, Datum arg);
+
+
+/*
+ * Estimate shared memory space needed.
+ */
+Size
+sddb_stats_memsize(const int max_entries)
+{
+	Size		size;
+
+	size = MAXALIGN(sizeof(sddbStatsShared));
+	size = add_size(size, hash_estimate_size(max_entries, sizeof(sddbStatsEntry)));
+	return size;
+}
+
+/*
+ * Allocate or attach to the shared statistics. This is called from the
+ * shmem_startup hook while holding AddinShmemInitLock.
+ */
+void
+sddb_stats_shmem_startup(const int max_entries, const bool found)
+{
+	HASHCTL		info;
+	bool		stats_found;
+	int			i;
+
+	stats = ShmemInitStruct("shutdown_db stats", sizeof(sddbStatsShared),
+							&stats_found);
+	if (!stats_found)
+	{
+		memset(&stats->total, 0, sizeof(sddbStatsCounters));
+		stats->stats_reset = GetCurrentTimestamp();
+		pg_atomic_init_u64(&stats->supervisor_loops, 0);
+		for (i = 0; i < SDDB_NUM_HOOKS; i++)
+			pg_atomic_init_u64(&stats->hook_calls[i], 0);
+	}
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(Oid);
+	info.entrysize = sizeof(sddbStatsEntry);
+
+	stats_hash = ShmemInitHash("shutdown_db stats hash",
+							   max_entries, max_entries,
+							   &info,
+							   HASH_ELEM | HASH_BLOBS);
+}
+
+/*
+ * Find or create the stats entry of dbid, and set its datname if given.
+ * Returns NULL if the table is full; the counters are kept only in total
+ * then. The caller must hold sddb->stats_lock exclusively.
+ */
+static sddbStatsEntry *
+get_stats_entry(const Oid dbid, const char *datname)
+{
+	sddbStatsEntry *entry;
+	bool		found;
+
+	entry = (sddbStatsEntry *) hash_search(stats_hash, &dbid, HASH_ENTER_NULL, &found);
+	if (entry == NULL)
+		return NULL;
+
+	if (!found)
+	{
+		memset(&entry->datname, 0, sizeof(NameData));
+		memset(&entry->counters, 0, sizeof(sddbStatsCounters));
+	}
+
+	if (datname != NULL)
+		namestrcpy(&entry->datname, datname);
+
+	return entry;
+}
+
+/*
+ * Count the shutdowns of dbids[0 .. n-1] in `mode`.
+ */
+void
+sddb_stats_count_shutdowns(const Oid *dbids, const char *const *datnames,
+						   const int n, const int mode)
+{
+	sddbStatsEntry *entry;
+	int			i;
+
+	if (!stats || n == 0)
+		return;
+
+	LWLockAcquire(sddb->stats_lock, LW_EXCLUSIVE);
+	for (i = 0; i < n; i++)
+	{
+		if ((entry = get_stats_entry(dbids[i], datnames[i])) != NULL)
+			entry->counters.shutdowns[mode]++;
+		stats->total.shutdowns[mode]++;
+	}
+	LWLockRelease(sddb->stats_lock);
+}
+
+/*
+ * Count the startups of dbids[0 .. n-1].
+ */
+void
+sddb_stats_count_startups(const Oid *dbids, const char *const *datnames,
+						  const int n)
+{
+	sddbStatsEntry *entry;
+	int			i;
+
+	if (!stats || n == 0)
+		return;
+
+	LWLockAcquire(sddb->stats_lock, LW_EXCLUSIVE);
+	for (i = 0; i < n; i++)
+	{
+		if ((entry = get_stats_entry(dbids[i], datnames[i])) != NULL)
+			entry->counters.startups++;
+		stats->total.startups++;
+	}
+	LWLockRelease(sddb->stats_lock);
+}
+
+/*
+ * Count the drain of dbid, which has been shut down at shutdown_time and
+ * whose backends have just gone.
+ */
+void
+sddb_stats_count_drain(const Oid dbid, const TimestampTz shutdown_time)
+{
+	sddbStatsEntry *entry;
+	double		msecs;
+
+	if (!stats || shutdown_time == 0)
+		return;
+
+	msecs = (double) (GetCurrentTimestamp() - shutdown_time) / 1000.0;
+	if (msecs < 0)
+		msecs = 0;
+
+	LWLockAcquire(sddb->stats_lock, LW_EXCLUSIVE);
+	if ((entry = get_stats_entry(dbid, NULL)) != NULL)
+	{
+		entry->counters.drains++;
+		entry->counters.drain_time += msecs;
+		entry->counters.max_drain_time = Max(entry->counters.max_drain_time, msecs);
+	}
+	stats->total.drains++;
+	stats->total.drain_time += msecs;
+	stats->total.max_drain_time = Max(stats->total.max_drain_time, msecs);
+	LWLockRelease(sddb->stats_lock);
+}
+
+/*
+ * Count the signals sent to the backends of dbids[0 .. n-1].
+ */
+void
+sddb_stats_count_signals(const Oid *dbids, const int n,
+						 const int *cancels, const int *terminates)
+{
+	sddbStatsEntry *entry;
+	int			i;
+
+	if (!stats || n == 0)
+		return;
+
+	LWLockAcquire(sddb->stats_lock, LW_EXCLUSIVE);
+	for (i = 0; i < n; i++)
+	{
+		if (cancels[i] == 0 && terminates[i] == 0)
+			continue;
+
+		if ((entry = get_stats_entry(dbids[i], NULL)) != NULL)
+		{
+			entry->counters.cancels += cancels[i];
+			entry->counters.terminates += terminates[i];
+		}
+		stats->total.cancels += cancels[i];
+		stats->total.terminates += terminates[i];
+	}
+	LWLockRelease(sddb->stats_lock);
+}
+
+/*
+ * Count a connection to dbid rejected by the ClientAuthentication hook.
+ */
+void
+sddb_stats_count_rejection(const Oid dbid)
+{
+	sddbStatsEntry *entry;
+
+	if (!stats)
+		return;
+
+	LWLockAcquire(sddb->stats_lock, LW_EXCLUSIVE);
+	if ((entry = get_stats_entry(dbid, NULL)) != NULL)
+		entry->counters.rejections++;
+	stats->total.rejections++;
+	LWLockRelease(sddb->stats_lock);
+}
+
+/*
+ * Count an iteration of the main loop of the supervisor process.
+ */
+void
+sddb_stats_count_loop(void)
+{
+	if (stats)
+		pg_atomic_fetch_add_u64(&stats->supervisor_loops, 1);
+}
+
+/*
+ * Count an invocation of `hook` in this backend.
+ */
+void
+sddb_stats_count_hook(const int hook)
+{
+	local_hook_calls[hook]++;
+
+	if (!local_exit_registered)
+	{
+		before_shmem_exit(flush_hook_calls, (Datum) 0);
+		local_exit_registered = true;
+	}
+
+	if (++local_pending >= SDDB_STATS_HOOK_FLUSH)
+		flush_hook_calls(0, (Datum) 0);
+}
+
+/*
+ * Add the hook invocations counted in this backend to the shared counters.
+ */
+static void
+flush_hook_calls(int code, Datum arg)
+{
+	int			i;
+
+	if (!stats)
+		return;
+
+	for (i = 0; i < SDDB_NUM_HOOKS; i++)
+	{
+		if (local_hook_calls[i] > 0)
+			pg_atomic_fetch_add_u64(&stats->hook_calls[i], local_hook_calls[i]);
+		local_hook_calls[i] = 0;
+	}
+	local_pending = 0;
+}
+
+/*
+ * Copy the per-database counters into *entries, and the total ones into
+ * *total and *global. Returns the number of the entries.
+ */
+int
+sddb_stats_copy(sddbStatsEntry * *entries, sddbStatsCounters * total,
+				sddbStatsGlobal * global)
+{
+	HASH_SEQ_STATUS hash_seq;
+	sddbStatsEntry *entry;
+	int			num = 0;
+	int			i;
+
+	if (!stats)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("shutdown_db must be loaded via shared_preload_libraries")));
+
+	/* Include this backend's own invocations */
+	flush_hook_calls(0, (Datum) 0);
+
+	LWLockAcquire(sddb->stats_lock, LW_SHARED);
+
+	*entries = (sddbStatsEntry *) palloc(sizeof(sddbStatsEntry) *
+										 Max(hash_get_num_entries(stats_hash), 1));
+
+	hash_seq_init(&hash_seq, stats_hash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+		memcpy(&(*entries)[num++], entry, sizeof(sddbStatsEntry));
+
+	memcpy(total, &stats->total, sizeof(sddbStatsCounters));
+	global->stats_reset = stats->stats_reset;
+
+	LWLockRelease(sddb->stats_lock);
+
+	global->supervisor_loops = (int64) pg_atomic_read_u64(&stats->supervisor_loops);
+	for (i = 0; i < SDDB_NUM_HOOKS; i++)
+		global->hook_calls[i] = (int64) pg_atomic_read_u64(&stats->hook_calls[i]);
+
+	return num;
+}
+
+/*
+ * Copy the counters of the database dbid into *counters. Returns false if
+ * nothing has been counted for it.
+ */
+bool
+sddb_stats_get(const Oid dbid, sddbStatsCounters * counters)
+{
+	sddbStatsEntry *entry;
+	bool		found = false;
+
+	if (!stats)
+		return false;
+
+	LWLockAcquire(sddb->stats_lock, LW_SHARED);
+	entry = (sddbStatsEntry *) hash_search(stats_hash, &dbid, HASH_FIND, NULL);
+	if (entry != NULL)
+	{
+		memcpy(counters, &entry->counters, sizeof(sddbStatsCounters));
+		found = true;
+	}
+	LWLockRelease(sddb->stats_lock);
+
+	return found;
+}
+
+/*
+ * Reset all the counters.
+ */
+void
+sddb_stats_reset(void)
+{
+	HASH_SEQ_STATUS hash_seq;
+	sddbStatsEntry *entry;
+	int			i;
+
+	if (!stats)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("shutdown_db must be loaded via shared_preload_libraries")));
+
+	LWLockAcquire(sddb->stats_lock, LW_EXCLUSIVE);
+
+	hash_seq_init(&hash_seq, stats_hash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+		hash_search(stats_hash, &entry->dbid, HASH_REMOVE, NULL);
+
+	memset(&stats->total, 0, sizeof(sddbStatsCounters));
+	stats->stats_reset = GetCurrentTimestamp();
+
+	pg_atomic_write_u64(&stats->supervisor_loops, 0);
+	for (i = 0; i < SDDB_NUM_HOOKS; i++)
+		pg_atomic_write_u64(&stats->hook_calls[i], 0);
+
+	LWLockRelease(sddb->stats_lock);
+}
+
+/*
+ * Return the wait event to report while waiting at `event`. They are
+ * registered as custom wait events on PostgreSQL 17 or later, so that they
+ * are distinguished in pg_stat_activity; otherwise, they're all Extension.
+ */
+uint32
+sddb_wait_event(const int event)
+{
+#if PG_VERSION_NUM >= 170000
+	static uint32 wait_events[SDDB_NUM_WAIT_EVENTS];
+	static const char *const wait_event_names[SDDB_NUM_WAIT_EVENTS] = {
+		"ShutdownDbSupervisorMain",
+		"ShutdownDbThrottle",
+		"ShutdownDbThrottledSlot",
+		"ShutdownDbSuspended",
+		"ShutdownDbDrain",
+	};
+
+	if (wait_events[event] == 0)
+		wait_events[event] = WaitEventExtensionNew(wait_event_names[event]);
+
+	return wait_events[event];
+#else
+	return PG_WAIT_EXTENSION;
+#endif
+}
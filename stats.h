@@ -0,0 +1,94 @@
+/*-------------------------------------------------------------------------
+ * stats.h
+ *
+ * Copyright (c) 2008-2025, PostgreSQL Global Development Group
+ * Copyright (c) 2020-2025, hironobu suzuki@interdb.jp
+ *-------------------------------------------------------------------------
+ */
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include "datatype/timestamp.h"
+
+/*
+ * Hooks whose invocations are counted
+ */
+enum stats_hook
+{
+	HOOK_EXECUTOR_START = 0,
+	HOOK_PROCESS_UTILITY,
+	HOOK_CLIENT_AUTHENTICATION,
+	HOOK_XACT_CALLBACK,
+	SDDB_NUM_HOOKS
+};
+
+/*
+ * Custom wait events, see sddb_wait_event()
+ */
+enum wait_event
+{
+	WAIT_SUPERVISOR_MAIN = 0,	/* the main loop of the supervisor process */
+	WAIT_THROTTLE,				/* rate limit of writing and reading buffers */
+	WAIT_THROTTLED_SLOT,		/* a slot of a THROTTLED database */
+	WAIT_SUSPENDED,				/* startup() of a SUSPENDED database */
+	WAIT_DRAIN,					/* the draining of a shutdown database */
+	SDDB_NUM_WAIT_EVENTS
+};
+
+/*
+ * Counters kept per database, and in total
+ */
+typedef struct sddbStatsCounters
+{
+	int64		shutdowns[SDDB_NUM_MODES];	/* by mode, except INIT; THROTTLED
+											 * and SUSPENDED count the
+											 * throttles and suspends */
+	int64		startups;
+	int64		drains;			/* number of the drains measured */
+	double		drain_time;		/* total time from a shutdown to zero
+								 * backends, in milliseconds */
+	double		max_drain_time; /* the longest one, in milliseconds */
+	int64		cancels;		/* SIGINTs sent to the backends */
+	int64		terminates;		/* SIGTERMs sent to the backends */
+	int64		rejections;		/* connections rejected by the hook gate */
+}			sddbStatsCounters;
+
+typedef struct sddbStatsEntry
+{
+	Oid			dbid;			/* hash key - MUST BE FIRST */
+	NameData	datname;		/* empty if not known */
+	sddbStatsCounters counters;
+}			sddbStatsEntry;
+
+/*
+ * Counters which are only kept in total
+ */
+typedef struct sddbStatsGlobal
+{
+	int64		supervisor_loops;
+	int64		hook_calls[SDDB_NUM_HOOKS];
+	TimestampTz stats_reset;
+}			sddbStatsGlobal;
+
+/*
+ * Function declarations
+ */
+Size		sddb_stats_memsize(const int max_entries);
+void		sddb_stats_shmem_startup(const int max_entries, const bool found);
+void		sddb_stats_count_shutdowns(const Oid *dbids, const char *const *datnames,
+									   const int n, const int mode);
+void		sddb_stats_count_startups(const Oid *dbids, const char *const *datnames,
+									  const int n);
+void		sddb_stats_count_drain(const Oid dbid, const TimestampTz shutdown_time);
+void		sddb_stats_count_signals(const Oid *dbids, const int n,
+									 const int *cancels, const int *terminates);
+void		sddb_stats_count_rejection(const Oid dbid);
+void		sddb_stats_count_loop(void);
+void		sddb_stats_count_hook(const int hook);
+int			sddb_stats_copy(sddbStatsEntry * *entries, sddbStatsCounters * total,
+							sddbStatsGlobal * global);
+bool		sddb_stats_get(const Oid dbid, sddbStatsCounters * counters);
+void		sddb_stats_reset(void);
+uint32		sddb_wait_event(const int event);
+
+#endif
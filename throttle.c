@@ -0,0 +1,213 @@
+/*-------------------------------------------------------------------------
+ * throttle.c
+ *
+ * Admission control of the THROTTLED and SUSPENDED databases.
+ *
+ * In a THROTTLED database, at most `max_active` statements are executed at
+ * once, and the backends over the limit wait in sddb_ExecutorStart() until
+ * a slot frees up. A backend holds at most one slot, taken by its outermost
+ * statement, so that the statements executed inside it, e.g. by functions,
+ * never wait for the slot their own backend holds. The slot is released at
+ * ExecutorEnd, or at the end of the (sub)transaction if the statement has
+ * failed.
+ *
+ * Only the top-level statements outside a transaction block wait, as in
+ * sddb_suspend_wait(): a backend executing a statement, in a transaction
+ * block, or with a transaction id, may hold the locks of the earlier
+ * statements, which the statements holding the slots may wait for; that
+ * would be a deadlock nobody detects. Such a statement takes a slot if one
+ * is free, and is admitted over the limit otherwise.
+ *
+ * Note that the waiting statement itself has already been parsed and
+ * planned at ExecutorStart, so it holds its snapshot and the
+ * AccessShareLocks on the relations it reads. These only conflict with
+ * ACCESS EXCLUSIVE locks, e.g. DDL on those relations, which waits until
+ * the statement is admitted and has finished.
+ *
+ * In a SUSPENDED database, the backends are parked at the next statement
+ * boundary, i.e. at ExecutorStart or ProcessUtility of a top-level
+ * statement outside a transaction block, until the database starts up
+ * again. The sessions stay connected, so nobody has to reconnect
+ * afterwards. As above, a parked statement holds the locks taken by its
+ * parsing and planning, and its snapshot.
+ *
+ * Copyright (c) 2008-2025, PostgreSQL Global Development Group
+ * Copyright (c) 2020-2025, Hironobu Suzuki @ interdb.jp
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "access/parallel.h"
+#include "access/xact.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "storage/condition_variable.h"
+
+#include "shutdown_db.h"
+#include "hashtable.h"
+#include "stats.h"
+#include "throttle.h"
+
+/*
+ * How long a waiting backend sleeps before checking its slot again, in
+ * milliseconds. The backends are woken up whenever a slot is released, so
+ * this only bounds the wait when a wakeup is missed.
+ */
+#define SDDB_THROTTLE_RECHECK_MS	1000
+
+/*
+ * extern variables
+ */
+extern sddbSharedState * sddb;
+
+/*
+ * The statement holding the slot in this backend, and its subtransaction
+ */
+static QueryDesc *throttle_query = NULL;
+static SubTransactionId throttle_subid = InvalidSubTransactionId;
+
+/*
+ * Nesting level of the statements being executed in this backend
+ */
+static int	statement_depth = 0;
+
+/*
+ * Function declarations
+ */
+static void release_slot(void);
+
+
+/*
+ * Wait for a slot of this database before executing queryDesc, unless the
+ * backend may hold the locks of other statements; see above.
+ */
+void
+sddb_throttle_start(QueryDesc *queryDesc)
+{
+	ConditionVariable *cv = SDDB_WAIT_CV(MyDatabaseId);
+	bool		may_wait;
+	int			result;
+
+	/* The outermost statement already holds the slot */
+	if (throttle_query != NULL)
+		return;
+
+	/* The leader holds the slot for its parallel workers */
+	if (IsParallelWorker())
+		return;
+
+	may_wait = (statement_depth == 0 && !IsTransactionBlock() &&
+				!TransactionIdIsValid(GetTopTransactionIdIfAny()));
+
+	while ((result = sddb_throttle_acquire(MyDatabaseId)) == SDDB_SLOT_BUSY)
+	{
+		if (!may_wait)
+			break;
+#if PG_VERSION_NUM >= 130000
+		(void) ConditionVariableTimedSleep(cv, SDDB_THROTTLE_RECHECK_MS,
+										   sddb_wait_event(WAIT_THROTTLED_SLOT));
+#else
+		ConditionVariableSleep(cv, sddb_wait_event(WAIT_THROTTLED_SLOT));
+#endif
+	}
+	ConditionVariableCancelSleep();
+
+	if (result == SDDB_SLOT_ACQUIRED)
+	{
+		throttle_query = queryDesc;
+		throttle_subid = GetCurrentSubTransactionId();
+	}
+}
+
+/*
+ * Release the slot if queryDesc holds it.
+ */
+void
+sddb_throttle_end(QueryDesc *queryDesc)
+{
+	if (throttle_query != NULL && throttle_query == queryDesc)
+		release_slot();
+}
+
+/*
+ * Park this backend while the database is SUSPENDED. This is only done at a
+ * statement boundary: nested statements and the statements in a transaction
+ * block go on, so that the parked backends hold no lock but the ones the
+ * parked statement has taken while it was parsed and planned, i.e. the
+ * AccessShareLocks on the relations it reads. Superusers are not parked, so
+ * that they can do the maintenance; their DDL on those relations waits
+ * until the database starts up again.
+ */
+void
+sddb_suspend_wait(void)
+{
+	ConditionVariable *cv = SDDB_WAIT_CV(MyDatabaseId);
+	sddbEntry	entry;
+	bool		parked = false;
+
+	if (statement_depth > 0 || IsTransactionBlock() || IsParallelWorker() ||
+		superuser())
+		return;
+
+	while (sddb_get_entry(MyDatabaseId, &entry) && entry.mode == SUSPENDED)
+	{
+		parked = true;
+#if PG_VERSION_NUM >= 130000
+		(void) ConditionVariableTimedSleep(cv, SDDB_THROTTLE_RECHECK_MS,
+										   sddb_wait_event(WAIT_SUSPENDED));
+#else
+		ConditionVariableSleep(cv, sddb_wait_event(WAIT_SUSPENDED));
+#endif
+	}
+	if (parked)
+		ConditionVariableCancelSleep();
+}
+
+/*
+ * Track the nesting level of the statements, see sddb_suspend_wait().
+ */
+void
+sddb_statement_enter(void)
+{
+	statement_depth++;
+}
+
+void
+sddb_statement_exit(void)
+{
+	if (statement_depth > 0)
+		statement_depth--;
+}
+
+/*
+ * Release the slot held by the statement which has not reached
+ * ExecutorEnd at the end of the transaction. The statements which have
+ * failed never exit, so the nesting level is reset as well.
+ */
+void
+sddb_throttle_xact_end(void)
+{
+	statement_depth = 0;
+
+	if (throttle_query != NULL)
+		release_slot();
+}
+
+/*
+ * Release the slot held by the statement which has failed in the
+ * subtransaction being aborted.
+ */
+void
+sddb_throttle_subxact_abort(const SubTransactionId subid)
+{
+	if (throttle_query != NULL && throttle_subid == subid)
+		release_slot();
+}
+
+static void
+release_slot(void)
+{
+	throttle_query = NULL;
+	throttle_subid = InvalidSubTransactionId;
+	sddb_throttle_release(MyDatabaseId);
+}
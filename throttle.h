@@ -0,0 +1,24 @@
+/*-------------------------------------------------------------------------
+ * throttle.h
+ *
+ * Copyright (c) 2008-2025, PostgreSQL Global Development Group
+ * Copyright (c) 2020-2025, hironobu suzuki@interdb.jp
+ *-------------------------------------------------------------------------
+ */
+#ifndef __THROTTLE_H__
+#define __THROTTLE_H__
+
+#include "executor/execdesc.h"
+
+/*
+ * Function declarations
+ */
+void		sddb_throttle_start(QueryDesc *queryDesc);
+void		sddb_throttle_end(QueryDesc *queryDesc);
+void		sddb_suspend_wait(void);
+void		sddb_statement_enter(void);
+void		sddb_statement_exit(void);
+void		sddb_throttle_xact_end(void);
+void		sddb_throttle_subxact_abort(const SubTransactionId subid);
+
+#endif
@@ -0,0 +1,448 @@
+/*-------------------------------------------------------------------------
+ * wal.c
+ *
+ * Propagate the shutdown state to the hot standbys through WAL.
+ *
+ * If shutdown_db.wal_propagation is on, every change of the hash table on
+ * the primary, i.e. a shutdown, a startup, an escalation and a switch
+ * between THROTTLED and SUSPENDED modes, is written into WAL by a custom
+ * resource manager, and the standbys replay it into their own hash tables.
+ * The shutdowns of roles by shutdown_role() are propagated as well.
+ * Thus, the standbys reject the connections to the shutdown databases and
+ * terminate their sessions as the primary does; the supervisor process of
+ * each standby drains them.
+ *
+ * This requires PostgreSQL 15 or later, and the module must be loaded with
+ * shutdown_db.wal_propagation on, on the primary and on all the standbys,
+ * as long as the WAL containing the records is replayed.
+ *
+ * Copyright (c) 2008-2025, PostgreSQL Global Development Group
+ * Copyright (c) 2020-2025, Hironobu Suzuki @ interdb.jp
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#if PG_VERSION_NUM >= 150000
+#include "access/rmgr.h"
+#include "access/xlog.h"
+#include "access/xlog_internal.h"
+#include "access/xloginsert.h"
+#include "access/xlogreader.h"
+#include "lib/stringinfo.h"
+#endif
+#include "miscadmin.h"
+
+#include "shutdown_db.h"
+#include "bgworker.h"
+#include "hashtable.h"
+#include "statefile.h"
+#include "wal.h"
+
+#if PG_VERSION_NUM >= 150000
+
+/*
+ * The id of our resource manager. RM_EXPERIMENTAL_ID is reserved for the
+ * extensions under development; change it to the one registered in
+ * https://wiki.postgresql.org/wiki/CustomWALResourceManagers if another
+ * extension uses it.
+ */
+#define SDDB_RMGR_ID			RM_EXPERIMENTAL_ID
+#define SDDB_RMGR_NAME			"shutdown_db"
+
+/*
+ * WAL record types
+ */
+#define XLOG_SDDB_ENTRY			0x00	/* entries are stored or changed */
+#define XLOG_SDDB_DELETE		0x10	/* entries are deleted */
+#define XLOG_SDDB_ROLE_ENTRY	0x20	/* an entry of a role is stored */
+#define XLOG_SDDB_ROLE_DELETE	0x30	/* an entry of a role is deleted */
+
+typedef struct xl_sddb_entry
+{
+	TimestampTz deadline;		/* 0 if none */
+	Oid			dbid;
+	int32		mode;
+	int32		flags;
+	int32		max_active;
+	NameData	datname;
+}			xl_sddb_entry;
+
+typedef struct xl_sddb_delete
+{
+	Oid			dbid;
+}			xl_sddb_delete;
+
+typedef struct xl_sddb_role_entry
+{
+	Oid			dbid;
+	Oid			roleid;
+	int32		mode;
+	NameData	datname;
+	NameData	rolname;
+}			xl_sddb_role_entry;
+
+typedef struct xl_sddb_role_delete
+{
+	Oid			dbid;
+	Oid			roleid;
+}			xl_sddb_role_delete;
+
+/*
+ * extern variables
+ */
+extern bool sddb_wal_propagation;
+
+/*
+ * Function declarations
+ */
+static void sddb_rmgr_redo(XLogReaderState *record);
+static void sddb_rmgr_desc(StringInfo buf, XLogReaderState *record);
+static const char *sddb_rmgr_identify(uint8 info);
+static void redo_entry(const xl_sddb_entry * xlrec);
+static void redo_role_entry(const xl_sddb_role_entry * xlrec);
+
+static const RmgrData sddb_rmgr = {
+	.rm_name = SDDB_RMGR_NAME,
+	.rm_redo = sddb_rmgr_redo,
+	.rm_desc = sddb_rmgr_desc,
+	.rm_identify = sddb_rmgr_identify
+};
+
+#endif							/* PG_VERSION_NUM >= 150000 */
+
+
+/*
+ * Register our resource manager. This is called from _PG_init() if
+ * shutdown_db.wal_propagation is on.
+ */
+void
+sddb_wal_register(void)
+{
+#if PG_VERSION_NUM >= 150000
+	RegisterCustomRmgr(SDDB_RMGR_ID, &sddb_rmgr);
+#endif
+}
+
+/*
+ * Write the current state of the entries of dbids[0 .. n-1] into WAL, and
+ * flush it so that the standbys receive it at once. Nothing is done unless
+ * shutdown_db.wal_propagation is on, nor on a standby.
+ *
+ * The entries are written into one record, an array of xl_sddb_entry, so
+ * that a standby replays them at once and saves its state file once for
+ * them; see sddb_rmgr_redo().
+ */
+void
+sddb_wal_log_entries(const Oid *dbids, const int n)
+{
+#if PG_VERSION_NUM >= 150000
+	xl_sddb_entry *xlrecs;
+	int			nrecs = 0;
+	int			i;
+
+	if (!sddb_wal_propagation || n == 0 || RecoveryInProgress())
+		return;
+
+	xlrecs = (xl_sddb_entry *) palloc0(sizeof(xl_sddb_entry) * n);
+
+	for (i = 0; i < n; i++)
+	{
+		sddbEntry	entry;
+		xl_sddb_entry *xlrec = &xlrecs[nrecs];
+
+		if (!sddb_get_entry(dbids[i], &entry))
+			continue;
+
+		xlrec->deadline = entry.deadline;
+		xlrec->dbid = entry.dbid;
+		xlrec->mode = entry.mode;
+		xlrec->flags = entry.flags & ~SDDB_FLAG_TERMINATE_ALL;
+		xlrec->max_active = entry.max_active;
+		namestrcpy(&xlrec->datname, NameStr(entry.datname));
+		nrecs++;
+	}
+
+	if (nrecs > 0)
+	{
+		XLogBeginInsert();
+		XLogRegisterData((char *) xlrecs, sizeof(xl_sddb_entry) * nrecs);
+		XLogFlush(XLogInsert(SDDB_RMGR_ID, XLOG_SDDB_ENTRY));
+	}
+
+	pfree(xlrecs);
+#endif
+}
+
+/*
+ * Write the deletion of the entries of dbids[0 .. n-1] into WAL, in the
+ * same way as sddb_wal_log_entries().
+ */
+void
+sddb_wal_log_deletes(const Oid *dbids, const int n)
+{
+#if PG_VERSION_NUM >= 150000
+	xl_sddb_delete *xlrecs;
+	int			i;
+
+	if (!sddb_wal_propagation || n == 0 || RecoveryInProgress())
+		return;
+
+	xlrecs = (xl_sddb_delete *) palloc(sizeof(xl_sddb_delete) * n);
+	for (i = 0; i < n; i++)
+		xlrecs[i].dbid = dbids[i];
+
+	XLogBeginInsert();
+	XLogRegisterData((char *) xlrecs, sizeof(xl_sddb_delete) * n);
+	XLogFlush(XLogInsert(SDDB_RMGR_ID, XLOG_SDDB_DELETE));
+
+	pfree(xlrecs);
+#endif
+}
+
+/*
+ * Write the entry of the role roleid in the database dbid into WAL, in the
+ * same way as sddb_wal_log_entries().
+ */
+void
+sddb_wal_log_role_entry(const Oid dbid, const Oid roleid)
+{
+#if PG_VERSION_NUM >= 150000
+	sddbEntry	entry;
+	xl_sddb_role_entry xlrec;
+
+	if (!sddb_wal_propagation || RecoveryInProgress())
+		return;
+
+	if (!sddb_get_role_entry(dbid, roleid, &entry))
+		return;
+
+	memset(&xlrec, 0, sizeof(xlrec));
+	xlrec.dbid = dbid;
+	xlrec.roleid = roleid;
+	xlrec.mode = entry.mode;
+	namestrcpy(&xlrec.datname, NameStr(entry.datname));
+	namestrcpy(&xlrec.rolname, NameStr(entry.rolname));
+
+	XLogBeginInsert();
+	XLogRegisterData((char *) &xlrec, sizeof(xlrec));
+	XLogFlush(XLogInsert(SDDB_RMGR_ID, XLOG_SDDB_ROLE_ENTRY));
+#endif
+}
+
+/*
+ * Write the deletion of the entry of the role roleid in the database dbid
+ * into WAL, in the same way as sddb_wal_log_entries().
+ */
+void
+sddb_wal_log_role_delete(const Oid dbid, const Oid roleid)
+{
+#if PG_VERSION_NUM >= 150000
+	xl_sddb_role_delete xlrec;
+
+	if (!sddb_wal_propagation || RecoveryInProgress())
+		return;
+
+	xlrec.dbid = dbid;
+	xlrec.roleid = roleid;
+
+	XLogBeginInsert();
+	XLogRegisterData((char *) &xlrec, sizeof(xlrec));
+	XLogFlush(XLogInsert(SDDB_RMGR_ID, XLOG_SDDB_ROLE_DELETE));
+#endif
+}
+
+#if PG_VERSION_NUM >= 150000
+
+/*
+ * Redo routine, executed by the startup process.
+ *
+ * The records are idempotent, so replaying the ones already reflected in
+ * the state file after a restart of the standby is harmless. The state file
+ * is written after each record, so that the standby keeps the state across
+ * its restarts. A record holds all the entries changed by one call on the
+ * primary, so the file is written as often as on the primary, not once per
+ * entry.
+ */
+static void
+sddb_rmgr_redo(XLogReaderState *record)
+{
+	uint8		info = XLogRecGetInfo(record) & ~XLR_INFO_MASK;
+	char	   *rec = XLogRecGetData(record);
+	int			i;
+
+	switch (info)
+	{
+		case XLOG_SDDB_ENTRY:
+			for (i = 0; i < XLogRecGetDataLen(record) / sizeof(xl_sddb_entry); i++)
+				redo_entry(&((xl_sddb_entry *) rec)[i]);
+			break;
+		case XLOG_SDDB_DELETE:
+			for (i = 0; i < XLogRecGetDataLen(record) / sizeof(xl_sddb_delete); i++)
+				sddb_delete_entry(((xl_sddb_delete *) rec)[i].dbid);
+			break;
+		case XLOG_SDDB_ROLE_ENTRY:
+			redo_role_entry((xl_sddb_role_entry *) XLogRecGetData(record));
+			break;
+		case XLOG_SDDB_ROLE_DELETE:
+			{
+				xl_sddb_role_delete *xlrec = (xl_sddb_role_delete *) XLogRecGetData(record);
+
+				sddb_delete_role_entry(xlrec->dbid, xlrec->roleid);
+				break;
+			}
+		default:
+			elog(PANIC, "sddb_rmgr_redo: unknown op code %u", info);
+	}
+
+	sddb_save_state();
+}
+
+/*
+ * Store or change the entry as the primary has done, and apply it to the
+ * sessions of this standby.
+ */
+static void
+redo_entry(const xl_sddb_entry * xlrec)
+{
+	sddbEntry	entry;
+	const char *datname = NameStr(xlrec->datname);
+	int			flags = xlrec->flags;
+	int			result;
+
+	if (sddb_get_entry(xlrec->dbid, &entry))
+	{
+		if (entry.mode == xlrec->mode)
+		{
+			if (xlrec->mode == THROTTLED)
+				sddb_set_throttle(xlrec->dbid, xlrec->max_active);
+			return;
+		}
+
+		sddb_delete_entry(xlrec->dbid);
+	}
+
+	/*
+	 * The sessions of Abort and Immediate modes are terminated by the
+	 * supervisor process of this standby, rather than by raising a recovery
+	 * conflict as the replay of DROP DATABASE does, so that the clients are
+	 * told the database is shut down, not dropped, and the termination
+	 * policies are applied as on the primary.
+	 */
+	if (xlrec->mode == ABORT || xlrec->mode == IMMEDIATE)
+		flags |= SDDB_FLAG_TERMINATE_ALL;
+
+	sddb_store_entries(&xlrec->dbid, &datname, 1, xlrec->mode,
+					   (xlrec->mode == TRANSACTIONAL ||
+						(flags & SDDB_FLAG_TERMINATE_ALL) != 0),
+					   flags, xlrec->deadline, &result);
+	if (result != SDDB_STORED)
+	{
+		ereport(WARNING,
+				(errmsg("shutdown_db: could not replay the shutdown of database %u",
+						xlrec->dbid),
+				 errhint("Consider increasing shutdown_db.max_db_number.")));
+		return;
+	}
+
+	switch (xlrec->mode)
+	{
+		case ABORT:
+		case IMMEDIATE:
+		case TRANSACTIONAL:
+			/* The supervisor process of this standby drains it */
+			sddb_supervisor_wakeup();
+			break;
+		case THROTTLED:
+			sddb_set_throttle(xlrec->dbid, xlrec->max_active);
+			break;
+		default:
+			break;
+	}
+}
+
+/*
+ * Store the entry of the role as the primary has done. The supervisor
+ * process of this standby terminates the sessions of the role; see
+ * drain_roles().
+ */
+static void
+redo_role_entry(const xl_sddb_role_entry * xlrec)
+{
+	sddb_delete_role_entry(xlrec->dbid, xlrec->roleid);
+
+	if (sddb_store_role_entry(xlrec->dbid, NameStr(xlrec->datname),
+							  xlrec->roleid, NameStr(xlrec->rolname),
+							  xlrec->mode, (xlrec->mode != NORMAL)) != SDDB_STORED)
+	{
+		ereport(WARNING,
+				(errmsg("shutdown_db: could not replay the shutdown of role %u in database %u",
+						xlrec->roleid, xlrec->dbid),
+				 errhint("Consider increasing shutdown_db.max_db_number.")));
+		return;
+	}
+
+	if (xlrec->mode != NORMAL)
+		sddb_supervisor_wakeup();
+}
+
+static void
+sddb_rmgr_desc(StringInfo buf, XLogReaderState *record)
+{
+	uint8		info = XLogRecGetInfo(record) & ~XLR_INFO_MASK;
+	char	   *rec = XLogRecGetData(record);
+
+	int			i;
+
+	if (info == XLOG_SDDB_ENTRY)
+	{
+		for (i = 0; i < XLogRecGetDataLen(record) / sizeof(xl_sddb_entry); i++)
+		{
+			xl_sddb_entry *xlrec = &((xl_sddb_entry *) rec)[i];
+
+			appendStringInfo(buf, "%sdbid %u; datname %s; mode %d; flags 0x%x; max_active %d",
+							 (i > 0) ? ", " : "",
+							 xlrec->dbid, NameStr(xlrec->datname), xlrec->mode,
+							 xlrec->flags, xlrec->max_active);
+		}
+	}
+	else if (info == XLOG_SDDB_DELETE)
+	{
+		for (i = 0; i < XLogRecGetDataLen(record) / sizeof(xl_sddb_delete); i++)
+			appendStringInfo(buf, "%sdbid %u", (i > 0) ? ", " : "",
+							 ((xl_sddb_delete *) rec)[i].dbid);
+	}
+	else if (info == XLOG_SDDB_ROLE_ENTRY)
+	{
+		xl_sddb_role_entry *xlrec = (xl_sddb_role_entry *) rec;
+
+		appendStringInfo(buf, "dbid %u; datname %s; roleid %u; rolname %s; mode %d",
+						 xlrec->dbid, NameStr(xlrec->datname), xlrec->roleid,
+						 NameStr(xlrec->rolname), xlrec->mode);
+	}
+	else if (info == XLOG_SDDB_ROLE_DELETE)
+	{
+		xl_sddb_role_delete *xlrec = (xl_sddb_role_delete *) rec;
+
+		appendStringInfo(buf, "dbid %u; roleid %u", xlrec->dbid, xlrec->roleid);
+	}
+}
+
+static const char *
+sddb_rmgr_identify(uint8 info)
+{
+	switch (info & ~XLR_INFO_MASK)
+	{
+		case XLOG_SDDB_ENTRY:
+			return "ENTRY";
+		case XLOG_SDDB_DELETE:
+			return "DELETE";
+		case XLOG_SDDB_ROLE_ENTRY:
+			return "ROLE_ENTRY";
+		case XLOG_SDDB_ROLE_DELETE:
+			return "ROLE_DELETE";
+		default:
+			return NULL;
+	}
+}
+
+#endif							/* PG_VERSION_NUM >= 150000 */
@@ -0,0 +1,20 @@
+/*-------------------------------------------------------------------------
+ * wal.h
+ *
+ * Copyright (c) 2008-2025, PostgreSQL Global Development Group
+ * Copyright (c) 2020-2025, hironobu suzuki@interdb.jp
+ *-------------------------------------------------------------------------
+ */
+#ifndef __SDDB_WAL_H__
+#define __SDDB_WAL_H__
+
+/*
+ * Function declarations
+ */
+void		sddb_wal_register(void);
+void		sddb_wal_log_entries(const Oid *dbids, const int n);
+void		sddb_wal_log_deletes(const Oid *dbids, const int n);
+void		sddb_wal_log_role_entry(const Oid dbid, const Oid roleid);
+void		sddb_wal_log_role_delete(const Oid dbid, const Oid roleid);
+
+#endif